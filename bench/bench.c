@@ -0,0 +1,338 @@
+// Benchmark of the I/O backends on metadata-heavy paths of the FAT32 emulator xkubpise
+#include "utils.h"
+#include "fat32.h"
+#include "format.h"
+#include "fatcache.h"
+#include "allocator.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "dirscan.h"
+#include "blockdev.h"
+#include "volume.h"
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BENCH_IMAGE "xkubpise_bench.img"
+#define BENCH_DIRECTORIES 1000
+#define BENCH_ITERATIONS 200
+#define BENCH_FORMATS 20
+#define BENCH_MAX_DEPTH 64
+#define BENCH_FULL_DIRECTORY (MAX_DIR_ENTRIES - 2) // every slot but "." and ".."
+#define BENCH_MAX_SAMPLES 65536
+#define LARGE_TOTAL_N_SECTORS (8u * 1024 * 1024) // 4 GiB, created sparse
+
+static Volume * vol = NULL; // the volume every benchmark runs on
+static int savedStdout = -1;
+
+// The engine reports progress on stdout, which would pollute the results
+static void silence(boolean on) {
+    fflush(stdout);
+    if (on) {
+        savedStdout = dup(STDOUT_FILENO);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    } else if (savedStdout >= 0) {
+        dup2(savedStdout, STDOUT_FILENO);
+        close(savedStdout);
+        savedStdout = -1;
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Every operation of a run is timed on its own, so that the report can give percentiles; the total
+// time of the run also covers what is not an operation (e.g. the final commit of a batch)
+static double samples[BENCH_MAX_SAMPLES];
+static uint32_t nSamples = 0;
+static double runStart, opStart;
+
+static void beginRun(void) {
+    nSamples = 0;
+    runStart = now();
+}
+
+static void beginOp(void) {
+    opStart = now();
+}
+
+static void endOp(void) {
+    if (nSamples < BENCH_MAX_SAMPLES) samples[nSamples++] = now() - opStart;
+}
+
+static int compareSamples(const void * a, const void * b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double fraction) {
+    if (nSamples == 0) return 0.0;
+    return samples[(uint32_t)(fraction * (nSamples - 1) + 0.5)];
+}
+
+static void endRun(const char * name, BackendKind kind) {
+    double seconds = now() - runStart;
+    qsort(samples, nSamples, sizeof(double), compareSamples);
+    printf("{\"benchmark\": \"%s\", \"backend\": \"%s\", \"ops\": %u, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f}\n",
+        name, backendName(kind), nSamples, seconds, seconds > 0 ? nSamples / seconds : 0.0, percentile(0.5) * 1e6, percentile(0.99) * 1e6);
+}
+
+static success createImage(const char * path) {
+    FILE * image = fopen(path, "wb");
+    if (!image) return Failure;
+    if (fseeko(image, (off_t)TOTAL_SIZE(vol) - 1, SEEK_SET) != 0 || fwrite("", 1, 1, image) != 1) {
+        fclose(image);
+        return Failure;
+    }
+    fclose(image);
+    return Success;
+}
+
+static success mountFresh(BackendKind kind, uint32_t totalSectors) {
+    remove(BENCH_IMAGE);
+    if (setGeometry(vol, totalSectors, DEFAULT_SECTORS_PER_CLUSTER) == Failure) return Failure;
+    if (createImage(BENCH_IMAGE) == Failure) return Failure;
+    vol->device = openBlockDevice(BENCH_IMAGE, kind, vol->stats);
+    if (!vol->device) return Failure;
+    silence(True);
+    success ret = preformat(vol, totalSectors, DEFAULT_SECTORS_PER_CLUSTER);
+    if (ret == Success) ret = format(vol, 0);
+    silence(False);
+    return ret;
+}
+
+static void unmount(void) {
+    unmountVolume(vol);
+    remove(BENCH_IMAGE);
+}
+
+static void benchFormat(BackendKind kind) {
+    beginRun();
+    silence(True);
+    for (uint32_t i = 0; i < BENCH_FORMATS; ++i) {
+        beginOp();
+        format(vol, 0);
+        endOp();
+    }
+    silence(False);
+    endRun("format", kind);
+}
+
+static uint32_t benchMkdir(BackendKind kind, uint32_t parentCluster) {
+    char name[FULL_FILE_STRING_SIZE];
+    uint32_t last = 0;
+    beginRun();
+    silence(True);
+    for (uint32_t i = 0; i < BENCH_DIRECTORIES; ++i) {
+        snprintf(name, sizeof(name), "D%u", i);
+        beginOp();
+        uint32_t cluster = allocateCluster(vol);
+        if (cluster == 0 || createNewObject(vol, name, cluster, parentCluster, itsFolder) == Failure) break;
+        endOp();
+        last = cluster;
+    }
+    commitMetadata(vol);
+    silence(False);
+    endRun("mkdir", kind);
+    return last;
+}
+
+// A directory with every one of its 65536 slots used, created with the touch path
+static uint32_t benchTouch(BackendKind kind) {
+    char name[FULL_FILE_STRING_SIZE];
+    uint32_t dirCluster = allocateCluster(vol);
+    if (dirCluster == 0 || createNewObject(vol, "FULL", dirCluster, ROOT_CLUSTER, itsFolder) == Failure) return 0;
+    beginRun();
+    silence(True);
+    for (uint32_t i = 0; i < BENCH_FULL_DIRECTORY; ++i) {
+        snprintf(name, sizeof(name), "F%05u", i);
+        beginOp();
+        if (createNewObject(vol, name, 0, dirCluster, itsFile) == Failure) break;
+        endOp();
+    }
+    commitMetadata(vol);
+    silence(False);
+    endRun("touch", kind);
+    return dirCluster;
+}
+
+static void benchList(BackendKind kind, const char * name, uint32_t dirCluster) {
+    beginRun();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+        char (* names)[FULL_FILE_STRING_SIZE];
+        beginOp();
+        collectNamesInCluster(vol, dirCluster, &names);
+        endOp();
+        free(names);
+    }
+    endRun(name, kind);
+}
+
+// Cold lookups rebuild the index of a full root directory from the volume every time
+static void benchLookupCold(BackendKind kind) {
+    char name[FULL_FILE_STRING_SIZE];
+    snprintf(name, sizeof(name), "D%u", BENCH_DIRECTORIES - 1);
+    beginRun();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+        invalidateAllDirIndexes(vol);
+        dcacheInvalidateAll(vol);
+        beginOp();
+        if (findSubdirectoryCluster(vol, name, ROOT_CLUSTER) == 0) printf("Lookup of %s failed\n", name);
+        endOp();
+    }
+    endRun("lookup_cold", kind);
+}
+
+// A chain of nested directories /L1/L2/.../L64, resolved at depths 1, 2, 4, ... 64 and walked back up
+static void benchPaths(BackendKind kind) {
+    char path[MAX_PATH] = "", upPath[MAX_PATH], benchName[32];
+    uint32_t depthCluster[BENCH_MAX_DEPTH + 1] = { ROOT_CLUSTER };
+    silence(True);
+    for (uint32_t depth = 1; depth <= BENCH_MAX_DEPTH; ++depth) {
+        snprintf(benchName, sizeof(benchName), "L%u", depth);
+        uint32_t cluster = allocateCluster(vol);
+        if (cluster == 0 || createNewObject(vol, benchName, cluster, depthCluster[depth - 1], itsFolder) == Failure) break;
+        depthCluster[depth] = cluster;
+    }
+    commitMetadata(vol);
+    silence(False);
+    for (uint32_t depth = 1; depth <= BENCH_MAX_DEPTH; depth *= 2) {
+        path[0] = '\0';
+        for (uint32_t d = 1; d <= depth; ++d) snprintf(path + strlen(path), sizeof(path) - strlen(path), "/L%u", d);
+        snprintf(benchName, sizeof(benchName), "resolve_depth_%u", depth);
+        beginRun();
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+            beginOp();
+            if (findClusterByFullPath(vol, path, ROOT_CLUSTER) != depthCluster[depth]) printf("Lookup of %s failed\n", path);
+            endOp();
+        }
+        endRun(benchName, kind);
+    }
+    beginRun();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+        invalidateAllDirIndexes(vol);
+        dcacheInvalidateAll(vol);
+        beginOp();
+        findClusterByFullPath(vol, path, ROOT_CLUSTER);
+        endOp();
+    }
+    endRun("resolve_depth_64_cold", kind);
+    beginRun();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+        beginOp();
+        buildPathToRoot(vol, depthCluster[BENCH_MAX_DEPTH], upPath);
+        endOp();
+    }
+    endRun("build_path_depth_64", kind);
+}
+
+static void benchMountFAT(BackendKind kind) {
+    beginRun();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+        beginOp();
+        loadFATCache(vol);
+        initAllocator(vol);
+        endOp();
+    }
+    endRun("mount_fat", kind);
+}
+
+// "percent" of every hundred clusters are taken, so that the free ones are spread over the volume
+static void benchFindFree(BackendKind kind, uint32_t percent) {
+    char benchName[32];
+    if (mountFresh(kind, DEFAULT_TOTAL_N_SECTORS) == Failure) {
+        printf("Failed to prepare a volume for the %s backend\n", backendName(kind));
+        return;
+    }
+    for (uint32_t cluster = ROOT_CLUSTER + 1; cluster < N_CLUSTERS(vol); ++cluster)
+        if (cluster % 100 < percent) setFATEntry(vol, cluster, FAT_EOC);
+    commitMetadata(vol);
+    snprintf(benchName, sizeof(benchName), "find_free_%u", percent);
+    beginRun();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+        beginOp();
+        uint32_t cluster = findFreeCluster(vol);
+        endOp();
+        if (cluster == 0) break;
+        setFATEntry(vol, cluster, FAT_EOC);
+    }
+    endRun(benchName, kind);
+    unmount();
+}
+
+static void benchBackend(BackendKind kind) {
+    if (mountFresh(kind, DEFAULT_TOTAL_N_SECTORS) == Failure) {
+        printf("Failed to prepare a volume for the %s backend\n", backendName(kind));
+        return;
+    }
+    benchFormat(kind);
+    benchMkdir(kind, ROOT_CLUSTER);
+    benchLookupCold(kind);
+    benchList(kind, "list", ROOT_CLUSTER);
+    uint32_t fullDirectory = benchTouch(kind);
+    if (fullDirectory) benchList(kind, "list_full", fullDirectory);
+    benchPaths(kind);
+    benchMountFAT(kind);
+    unmount();
+
+    benchFindFree(kind, 0);
+    benchFindFree(kind, 50);
+    benchFindFree(kind, 99);
+}
+
+// Mounting only reads the first FAT page and the FSInfo hints, so a 4 GiB volume mounts as fast as
+// a 20 MB one; the first allocations then read the pages they need
+static void benchLargeMount(BackendKind kind) {
+    if (mountFresh(kind, LARGE_TOTAL_N_SECTORS) == Failure) {
+        printf("Failed to prepare a 4 GiB volume for the %s backend\n", backendName(kind));
+        unmount();
+        return;
+    }
+    syncVolume(vol);
+    beginRun();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+        beginOp();
+        loadFATCache(vol);
+        initAllocator(vol);
+        endOp();
+    }
+    endRun("mount_4gib", kind);
+
+    beginRun();
+    for (uint32_t i = 0; i < BENCH_DIRECTORIES; ++i) {
+        beginOp();
+        allocateCluster(vol);
+        endOp();
+    }
+    commitMetadata(vol);
+    endRun("allocate_4gib", kind);
+    uint32_t residentPages;
+    uint64_t pageLoads;
+    getFATCacheStats(vol, &residentPages, &pageLoads);
+    printf("{\"benchmark\": \"fat_pages_4gib\", \"backend\": \"%s\", \"pages\": %u, \"resident\": %u, \"max_resident\": %d}\n",
+        backendName(kind), getFATPageCount(vol), residentPages, MAX_RESIDENT_FAT_PAGES);
+    unmount();
+}
+
+// Without arguments every backend is measured; "xkubpise_bench pread" measures only one
+int main(int argc, char * argv[]) {
+    BackendKind only;
+    vol = createVolume();
+    if (!vol) return 1;
+    vol->isFormatted = formatted; // every volume of the benchmark is formatted by it
+    if (argc > 1 && !parseBackendName(argv[1], &only)) {
+        printf("Unknown I/O backend %s (expected stdio, pread or mmap)\n", argv[1]);
+        return 1;
+    }
+    printf("{\"benchmark\": \"scan_kernel\", \"kernel\": \"%s\"}\n", scanKernelName());
+    for (int kind = backendStdio; kind <= backendMmap; ++kind)
+        if (argc == 1 || (BackendKind)kind == only) benchBackend((BackendKind)kind);
+    if (argc == 1 || only == backendPositional) benchLargeMount(backendPositional);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef ALLOCATOR_H_xkubpise
+#define ALLOCATOR_H_xkubpise
+
+#include "utils.h"
+
+#define FSINFO_SECTOR 1
+#define FSINFO_FREE_COUNT_OFFSET 0x1E8
+#define FSINFO_NEXT_FREE_OFFSET 0x1EC
+#define FSINFO_UNKNOWN 0xFFFFFFFF
+
+typedef struct Allocator Allocator;
+
+Allocator * createAllocator(void);
+success initAllocator(Volume * vol);
+void releaseAllocator(Volume * vol);
+uint32_t allocateCluster(Volume * vol);
+void freeCluster(Volume * vol, uint32_t cluster);
+uint32_t allocateClusterRun(Volume * vol, uint32_t wanted, uint32_t * firstCluster);
+success allocateClusters(Volume * vol, uint32_t wanted, uint32_t * clusters);
+uint32_t freeClusterChain(Volume * vol, uint32_t firstCluster);
+void freeClusters(Volume * vol, uint32_t * clusters, uint32_t count);
+uint32_t peekFreeCluster(Volume * vol);
+uint32_t getFreeClusterCount(Volume * vol);
+void setFreeClusterCount(Volume * vol, uint32_t count);
+void noteClusterState(Volume * vol, uint32_t cluster, boolean isFree);
+success flushFSInfo(Volume * vol);
+
+#endif
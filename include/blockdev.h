@@ -0,0 +1,42 @@
+#ifndef BLOCKDEV_H_xkubpise
+#define BLOCKDEV_H_xkubpise
+
+#include "utils.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+typedef enum { backendStdio, backendPositional, backendMmap } BackendKind;
+
+typedef struct BlockDevice BlockDevice;
+
+// Every access to the volume image goes through one of these backends
+struct BlockDevice {
+    BackendKind kind;
+    success (* read)(BlockDevice * device, uint32_t lba, void * buffer, uint32_t count);
+    success (* write)(BlockDevice * device, uint32_t lba, const void * data, uint32_t count);
+    // Consecutive sectors gathered from several buffers; every part is a whole number of sectors
+    success (* writeVector)(BlockDevice * device, uint32_t lba, const struct iovec * parts, int nParts);
+    success (* flush)(BlockDevice * device);
+    void (* close)(BlockDevice * device);
+    FILE * file;        // stdio backend
+    int fd;             // positional and mmap backends
+    uint8_t * map;      // mmap backend
+    uint64_t size;      // size of the image in bytes
+    uint64_t dirtyStart; // byte range modified in the mapping since the last flush
+    uint64_t dirtyEnd;
+    VolumeStats * stats; // where the requests that reach the image are counted
+    pthread_mutex_t lock; // the file offset of the stdio backend and the dirty range of the mapping
+};
+
+BlockDevice * openBlockDevice(const char * filename, BackendKind kind, VolumeStats * stats);
+void closeBlockDevice(BlockDevice * device);
+boolean parseBackendName(const char * name, BackendKind * kind);
+const char * backendName(BackendKind kind);
+success flushVolume(BlockDevice * device);
+success persistVolume(BlockDevice * device);
+const uint8_t * mappedSectors(BlockDevice * device, uint32_t lba, uint32_t count);
+uint8_t * mappedSectorsForWrite(BlockDevice * device, uint32_t lba, uint32_t count);
+
+#endif
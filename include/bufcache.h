@@ -0,0 +1,27 @@
+#ifndef BUFCACHE_H_xkubpise
+#define BUFCACHE_H_xkubpise
+
+#include "utils.h"
+
+#include <sys/uio.h>
+
+#define DEFAULT_CACHE_SECTORS 1024
+#define CACHE_BYPASS_SECTORS 64 // larger transfers are not kept in the cache
+
+typedef struct BufferCache BufferCache;
+
+BufferCache * createBufferCache(void);
+void setBufferCacheCapacity(Volume * vol, uint32_t sectors);
+uint32_t getBufferCacheCapacity(Volume * vol);
+success cachedRead(Volume * vol, uint32_t lba, void * buffer, uint32_t count);
+success cachedWrite(Volume * vol, uint32_t lba, const void * data, uint32_t count);
+success uncachedWriteVector(Volume * vol, uint32_t lba, const struct iovec * parts, int nParts);
+void discardCachedRange(Volume * vol, uint32_t lba, uint32_t count);
+success syncBufferCache(Volume * vol, uint32_t * written);
+void dropBufferCache(Volume * vol);
+uint32_t gatherUnloggedSectors(Volume * vol, uint32_t * lbas, uint8_t * data, uint32_t max);
+void markSectorsLogged(Volume * vol);
+void markLoggedSectorsClean(Volume * vol);
+void getBufferCacheStats(Volume * vol, uint64_t * hits, uint64_t * misses, uint32_t * dirty);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef DCACHE_H_xkubpise
+#define DCACHE_H_xkubpise
+
+#include "utils.h"
+#include "fat32.h"
+
+#define DCACHE_SLOTS 4096 // per direction, direct-mapped
+
+typedef struct DentryCache DentryCache;
+
+DentryCache * createDentryCache(void);
+void destroyDentryCache(DentryCache * cache);
+boolean dcacheLookupParent(Volume * vol, uint32_t cluster, uint32_t * parentCluster, char * name);
+boolean dcacheLookupChild(Volume * vol, uint32_t parentCluster, const uint8_t * rawName, uint32_t * cluster);
+void dcacheInsert(Volume * vol, uint32_t parentCluster, const uint8_t * rawName, uint32_t cluster);
+void dcacheInvalidate(Volume * vol, uint32_t parentCluster, const uint8_t * rawName, uint32_t cluster);
+void dcacheInvalidateAll(Volume * vol);
+void dcacheGetStats(Volume * vol, uint64_t * hits, uint64_t * misses);
+void dcacheResetStats(Volume * vol);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef DIRINDEX_H_xkubpise
+#define DIRINDEX_H_xkubpise
+
+#include "utils.h"
+#include "fat32.h"
+
+#define MAX_RESIDENT_DIR_INDEXES 1024
+
+typedef struct {
+    uint8_t name[FILE_AND_EXT_RAW_LENGTH];
+    uint8_t attributes;
+    boolean used;
+    uint32_t slot;
+    uint32_t firstCluster;
+} DirIndexEntry;
+
+typedef struct DirIndex {
+    uint32_t cluster;            // first cluster of the indexed directory
+    uint32_t nClusters;          // length of its cluster chain
+    uint32_t lastCluster;        // tail of the chain, where it grows
+    uint32_t endSlot;            // first never-used (0x00) slot
+    uint32_t * deletedSlots;     // stack of reusable (0xE5) slots
+    uint32_t nDeleted;
+    uint32_t deletedCapacity;
+    uint32_t capacity;           // size of the open-addressing table (power of two)
+    uint32_t count;
+    DirIndexEntry * entries;
+    struct DirIndex * bucketNext;
+    struct DirIndex * lruPrev;
+    struct DirIndex * lruNext;
+} DirIndex;
+
+typedef struct DirIndexTable DirIndexTable;
+
+DirIndexTable * createDirIndexTable(void);
+void destroyDirIndexTable(DirIndexTable * table);
+DirIndex * getDirIndex(Volume * vol, uint32_t dirCluster);
+const DirIndexEntry * lookupDirIndex(DirIndex * index, const uint8_t * rawName);
+int peekFreeSlot(Volume * vol, DirIndex * index);
+success insertIntoDirIndex(Volume * vol, uint32_t dirCluster, const uint8_t * rawName, uint8_t attributes, uint32_t slot, uint32_t firstCluster);
+void updateDirIndexCluster(Volume * vol, uint32_t dirCluster, const uint8_t * rawName, uint32_t firstCluster);
+void removeFromDirIndex(Volume * vol, uint32_t dirCluster, const uint8_t * rawName);
+void noteDirectoryExtended(Volume * vol, uint32_t dirCluster, uint32_t newCluster);
+void invalidateDirIndex(Volume * vol, uint32_t dirCluster);
+void invalidateAllDirIndexes(Volume * vol);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef DIRSCAN_H_xkubpise
+#define DIRSCAN_H_xkubpise
+
+#include "utils.h"
+#include "fat32.h"
+
+#define SCAN_BLOCK_ENTRIES 64 // entries described by one set of masks
+#define SCAN_KERNEL_ENV "XKUBPISE_SCAN" // "scalar", "sse2" or "avx2" overrides the choice made from cpuid
+
+// One bit per entry of a block; the never-used entry that ends the directory and those after it
+// are in none of the masks
+typedef struct {
+    uint32_t count;     // entries in the block
+    uint32_t end;       // of the first never-used (0x00) entry, count when there is none
+    uint64_t used;      // neither never-used nor deleted
+    uint64_t deleted;   // 0xE5
+    uint64_t longName;  // used, with the long-name attribute
+    uint64_t directory; // used, with the directory attribute and not a long-name part
+} EntryMasks;
+
+boolean scanDirectoryBlock(const DirectoryView * view, uint32_t firstSlot, EntryMasks * masks);
+const char * scanKernelName(void);
+boolean useScanKernel(const char * name);
+
+static inline uint32_t lowestBit(uint64_t bits) {
+#if defined(__GNUC__)
+    return (uint32_t)__builtin_ctzll(bits);
+#else
+    uint32_t n = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+#endif
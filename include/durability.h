@@ -0,0 +1,28 @@
+#ifndef DURABILITY_H_xkubpise
+#define DURABILITY_H_xkubpise
+
+#include "utils.h"
+
+// When committed changes are forced to the disk with fdatasync():
+// never (they reach it whenever the kernel writes them back), after every command, or every few milliseconds
+typedef enum { syncNone, syncCommand, syncInterval } SyncMode;
+
+#define MAX_SYNC_INTERVAL_MS (60 * 60 * 1000)
+
+typedef struct Durability Durability;
+
+Durability * createDurability(void);
+void destroyDurability(Durability * dur);
+boolean parseSyncPolicy(Volume * vol, const char * text);
+SyncMode getSyncMode(Volume * vol);
+success durableBarrier(Volume * vol);
+void noteCommit(Volume * vol);
+success persistChanges(Volume * vol);
+success persistAfterCommand(Volume * vol);
+success startFlusher(Volume * vol);
+void stopFlusher(Volume * vol);
+void lockEngine(Volume * vol);
+void lockEngineShared(Volume * vol);
+void unlockEngine(Volume * vol);
+
+#endif
@@ -8,6 +8,9 @@
 #define LOCATION_MAX_LENGTH (1024 * 4)
 #define INPUT_MAX_LENGTH 512
 
-void emulate(void);
+typedef enum { commandSucceeded, commandFailed, commandExit } CommandResult;
+
+success emulate(Volume * vol, FILE * script, boolean batch, boolean keepGoing);
+CommandResult runClientCommand(Volume * vol, char * input, uint32_t * cluster, FILE * output);
 
 #endif
\ No newline at end of file
@@ -9,6 +9,10 @@
 #define FULL_FILE_STRING_SIZE (FILE_AND_EXT_RAW_LENGTH + 2)
 #define ENTRY_SIZE 32
 #define MAX_PATH 1024
+#define ENTRIES_PER_SECTOR (SECTOR_SIZE / ENTRY_SIZE)
+#define ENTRIES_PER_CLUSTER(vol) (CLUSTER_SIZE(vol) / ENTRY_SIZE)
+#define MAX_DIR_ENTRIES 65536 // FAT32 limit for entries in one directory
+#define MAX_DIR_CLUSTERS(vol) (MAX_DIR_ENTRIES / ENTRIES_PER_CLUSTER(vol))
 
 typedef struct {
     char name[FILE_AND_EXT_RAW_LENGTH];
@@ -17,24 +21,60 @@ typedef struct {
     int parent;
 } FAT32Node;
 
+// A directory chain as an array of per-cluster pointers (in place when the volume is mapped)
+typedef struct {
+    uint32_t nClusters;
+    uint32_t entriesPerCluster;
+    uint32_t * chain;
+    const uint8_t ** clusters;
+    uint8_t * copy;
+} DirectoryView;
+
+static inline const uint8_t * directoryEntry(const DirectoryView * view, uint32_t slot) {
+    return view->clusters[slot / view->entriesPerCluster] + (slot % view->entriesPerCluster) * ENTRY_SIZE;
+}
+
+static inline uint32_t entryFirstCluster(const uint8_t * entry) {
+    return ((uint32_t)(entry[21] << 8 | entry[20]) << 16) | (uint32_t)(entry[27] << 8 | entry[26]);
+}
+
+static inline uint32_t entryFileSize(const uint8_t * entry) {
+    return (uint32_t)entry[28] | (uint32_t)entry[29] << 8 | (uint32_t)entry[30] << 16 | (uint32_t)entry[31] << 24;
+}
+
 typedef enum {
     badSize = -1,
     notFormatted = 0,
     formatted = 1,
 } IsFormatted;
 
-success readSector(uint32_t sector, uint8_t * buffer);
-success readSectors(uint32_t sector, void * buffer, uint32_t count);
-void readCluster(uint32_t clusterNumber, uint8_t * buffer);
-void buildPathToRoot(uint32_t currentCluster, char * outPath);
-uint32_t findClusterByFullPath(const char * inputPath, uint32_t currentCluster);
-uint32_t findSubdirectoryCluster(const char * name, uint32_t cluster);
-uint32_t findFreeCluster();
-success createNewObject(const char * objectName, int firstCluster, int parentCluster, IsFolder isFolder);
-int collectNamesInCluster(int cluster);
-void initializeDotEntries(uint32_t cluster, uint32_t parentCluster);
-int findFirstFreeEntry(int cluster);
-void commentOnExtFlags(uint16_t bpb_ExtFlags);
-IsFormatted isValidFAT32xkubpise(const char * filename);
+success readSector(Volume * vol, uint32_t sector, uint8_t * buffer);
+success readSectors(Volume * vol, uint32_t sector, void * buffer, uint32_t count);
+void readCluster(Volume * vol, uint32_t clusterNumber, uint8_t * buffer);
+uint32_t collectClusterChain(Volume * vol, uint32_t firstCluster, uint32_t ** chain);
+success openDirectoryView(Volume * vol, uint32_t firstCluster, DirectoryView * view);
+void closeDirectoryView(DirectoryView * view);
+void buildPathToRoot(Volume * vol, uint32_t currentCluster, char * outPath);
+uint32_t findClusterByFullPath(Volume * vol, const char * inputPath, uint32_t currentCluster);
+uint32_t findSubdirectoryCluster(Volume * vol, const char * name, uint32_t cluster);
+boolean nameExistsInDirectory(Volume * vol, const char * name, uint32_t cluster);
+uint32_t findFreeCluster(Volume * vol);
+success commitMetadata(Volume * vol);
+success syncVolume(Volume * vol);
+void unmountVolume(Volume * vol);
+success readDirectoryEntry(Volume * vol, uint32_t dirCluster, uint32_t slot, uint8_t * entry);
+success updateDirectoryEntry(Volume * vol, uint32_t dirCluster, uint32_t slot, uint32_t firstCluster, uint32_t size);
+success deleteDirectoryEntry(Volume * vol, uint32_t dirCluster, uint32_t slot);
+success placeDirectoryEntry(Volume * vol, uint32_t dirCluster, const uint8_t * entry);
+success createNewObject(Volume * vol, const char * objectName, int firstCluster, int parentCluster, IsFolder isFolder);
+success createFileIn(Volume * vol, uint32_t dirCluster, char * name);
+success createFolderIn(Volume * vol, uint32_t dirCluster, char * name);
+int collectNamesInCluster(Volume * vol, int cluster, char (** names)[FULL_FILE_STRING_SIZE]);
+void initializeDotEntries(Volume * vol, uint32_t cluster, uint32_t parentCluster);
+uint32_t getDotDotCluster(Volume * vol, uint32_t cluster);
+success setDotDotCluster(Volume * vol, uint32_t cluster, uint32_t parentCluster);
+int findFirstFreeEntry(Volume * vol, int cluster);
+void commentOnExtFlags(Volume * vol, uint16_t bpb_ExtFlags);
+IsFormatted isValidFAT32xkubpise(Volume * vol, const char * filename);
 
 #endif
\ No newline at end of file
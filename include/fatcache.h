@@ -0,0 +1,33 @@
+#ifndef FATCACHE_H_xkubpise
+#define FATCACHE_H_xkubpise
+
+#include "utils.h"
+
+#define FAT_ENTRIES_PER_SECTOR (SECTOR_SIZE / FAT_ENTRY_SIZE)
+#define FAT_PAGE_SECTORS 8 // 4 KiB pages of 1024 entries
+#define FAT_ENTRIES_PER_PAGE (FAT_PAGE_SECTORS * FAT_ENTRIES_PER_SECTOR)
+#define MAX_RESIDENT_FAT_PAGES 256 // at most 1 MiB of FAT in memory, the whole FAT of the default profile
+#define FAT_FREE_WORDS_PER_PAGE (FAT_ENTRIES_PER_PAGE / 64) // free-entry bits of a page, 64 to a word
+#define FAT_PAGE_FREE_UNKNOWN 0xFFFF
+#define FAT_COMPARE_CHUNK_SECTORS 256 // the FAT copies are compared 128 KiB at a time
+
+typedef struct FATCache FATCache;
+
+FATCache * createFATCache(void);
+success loadFATCache(Volume * vol);
+void releaseFATCache(Volume * vol);
+boolean isFATCacheLoaded(Volume * vol);
+uint32_t getFATEntry(Volume * vol, uint32_t cluster);
+void setFATEntry(Volume * vol, uint32_t cluster, uint32_t value);
+success flushFATCache(Volume * vol);
+uint32_t gatherUnloggedFATSectors(Volume * vol, uint32_t * lbas, uint8_t * data, uint32_t max);
+void markFATSectorsLogged(Volume * vol);
+void markLoggedFATSectorsClean(Volume * vol);
+uint32_t getFATPageCount(Volume * vol);
+uint32_t getFATPageFreeCount(Volume * vol, uint32_t page);
+uint32_t findFreeClusterInFATPage(Volume * vol, uint32_t page, uint32_t fromCluster);
+void getFATCacheStats(Volume * vol, uint32_t * residentPages, uint64_t * pageLoads);
+uint32_t compareFATCopies(Volume * vol);
+success copyActiveFAT(Volume * vol);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef FILE_H_xkubpise
+#define FILE_H_xkubpise
+
+#include "utils.h"
+
+success writeFile(Volume * vol, uint32_t dirCluster, const char * name, const void * data, uint32_t length, boolean append);
+uint8_t * readFile(Volume * vol, uint32_t dirCluster, const char * name, uint32_t * length);
+success importFile(Volume * vol, uint32_t dirCluster, const char * name, int hostFd, uint64_t length);
+success exportFile(Volume * vol, uint32_t dirCluster, const char * name, int hostFd, uint64_t * length);
+
+#endif
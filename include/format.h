@@ -3,10 +3,13 @@
 
 #include "utils.h"
 
-#define FAT_ENTRY_MASK 0x0FFFFFFF
-
-boolean checkFormatting(void);
-success format(void);
-success preformat(void);
+#define FORMAT_CHUNK_SECTORS 2048 // the FATs are written 1 MiB at a time
+#define EXT_FLAGS_MIRRORED 0x00 // every FAT copy is active
+#define EXT_FLAGS_SINGLE_FAT 0x80 // mirroring disabled, FAT #1 is the active one
+
+boolean checkFormatting(Volume * vol);
+success format(Volume * vol, uint32_t sectorsPerCluster);
+success preformat(Volume * vol, uint32_t totalSectors, uint32_t sectorsPerCluster);
+success setFATMirroring(Volume * vol, boolean mirrored);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef FSCK_H_xkubpise
+#define FSCK_H_xkubpise
+
+#include "utils.h"
+
+#define FSCK_MAX_THREADS 8
+#define FSCK_MAX_REPORTED_RANGES 16 // orphan ranges printed before the rest is only counted
+
+typedef struct {
+    uint32_t directories;
+    uint32_t files;
+    uint32_t usedClusters;
+    uint32_t orphanClusters;
+    uint32_t crossLinks;
+    uint32_t brokenChains;
+    uint32_t badDotEntries;
+    uint32_t badSizes;
+    boolean freeCountDrift;
+    uint32_t repaired;
+    uint32_t unrepaired;
+    uint32_t threads;
+    double seconds;
+} FsckReport;
+
+success checkVolume(Volume * vol, boolean repair, FsckReport * report);
+uint32_t fsckProblemCount(const FsckReport * report);
+void printFsckReport(const FsckReport * report, boolean repair);
+
+#endif
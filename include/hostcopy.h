@@ -0,0 +1,16 @@
+#ifndef HOSTCOPY_H_xkubpise
+#define HOSTCOPY_H_xkubpise
+
+#include "utils.h"
+
+#define HOST_COPY_BUFFER_SIZE (1024 * 1024)
+#define HOST_COPY_ALIGNMENT 4096
+
+typedef enum { copyKernel, copySendfile, copyBuffered, copyMapped } HostCopyMethod;
+
+success copyFromHostFile(Volume * vol, int hostFd, uint64_t hostOffset, uint32_t lba, uint64_t bytes);
+success copyToHostFile(Volume * vol, uint32_t lba, uint64_t bytes, int hostFd, uint64_t hostOffset);
+HostCopyMethod lastHostCopyMethod(void);
+const char * hostCopyMethodName(HostCopyMethod method);
+
+#endif
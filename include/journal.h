@@ -0,0 +1,29 @@
+#ifndef JOURNAL_H_xkubpise
+#define JOURNAL_H_xkubpise
+
+#include "utils.h"
+
+// The reserved sectors after the backup boot sector hold a write-ahead journal of metadata sectors
+#define JOURNAL_FIRST_SECTOR 8 // 0, 1 and 6 are the boot sector, FSInfo and the backup boot sector
+#define JOURNAL_SECTORS (N_RESERVED_SECTORS - JOURNAL_FIRST_SECTOR)
+#define JOURNAL_MAX_RECORD_SECTORS (JOURNAL_SECTORS - 1) // a descriptor sector precedes the logged ones
+#define JOURNAL_GROUP_SECTORS (JOURNAL_MAX_RECORD_SECTORS / 2) // a batch commits once this many sectors are pending
+#define JOURNAL_MAGIC 0x4C4A4B58 // "XKJL"
+
+typedef struct Journal Journal;
+
+Journal * createJournal(void);
+void setJournalEnabled(Volume * vol, boolean enabled);
+boolean isJournalEnabled(Volume * vol);
+boolean isJournalActive(Volume * vol);
+success replayJournal(Volume * vol);
+success clearJournal(Volume * vol);
+success commitTransaction(Volume * vol);
+success checkpointJournal(Volume * vol, uint32_t * written);
+success journalBeforeWriteBack(Volume * vol);
+success journalForget(Volume * vol, uint32_t lba, uint32_t count);
+uint32_t pendingJournalSectors(Volume * vol);
+void resetJournal(Volume * vol);
+void getJournalStats(Volume * vol, uint64_t * records, uint64_t * sectors, uint64_t * checkpoints, uint64_t * inPlaceCommits);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef MKTREE_H_xkubpise
+#define MKTREE_H_xkubpise
+
+#include "utils.h"
+
+#define MKTREE_CHUNK_BYTES (1024 * 1024) // new directory clusters are built and written this much at a time
+
+success makeDirectories(Volume * vol, char * const * paths, uint32_t nPaths, uint32_t startCluster, uint32_t * nCreated);
+success makeTreeFromManifest(Volume * vol, const char * manifestPath, uint32_t startCluster, uint32_t * nCreated);
+
+#endif
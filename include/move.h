@@ -0,0 +1,9 @@
+#ifndef MOVE_H_xkubpise
+#define MOVE_H_xkubpise
+
+#include "utils.h"
+
+// Both paths are relative to startCluster unless absolute; a bare name is always in that folder
+success moveEntry(Volume * vol, char * sourcePath, char * destinationPath, uint32_t startCluster);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef RMTREE_H_xkubpise
+#define RMTREE_H_xkubpise
+
+#include "utils.h"
+
+// rm takes files only, rmdir empty folders only, rm -r either with everything below
+typedef enum { removeFileOnly, removeEmptyFolder, removeRecursively } RemoveMode;
+
+success removeEntry(Volume * vol, uint32_t dirCluster, const char * name, RemoveMode mode, uint32_t * nRemoved);
+
+#endif
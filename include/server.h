@@ -0,0 +1,16 @@
+#ifndef SERVER_H_xkubpise
+#define SERVER_H_xkubpise
+
+#include "utils.h"
+
+#define SERVER_MAX_WORKERS 16
+#define SERVER_MAX_CLIENTS 256
+#define SERVER_BACKLOG 64
+
+// Every reply ends with one of these lines, after whatever the command printed
+#define SERVER_REPLY_OK "\004ok\n"
+#define SERVER_REPLY_FAILED "\004failed\n"
+
+success serve(Volume * vol, const char * socketPath, uint32_t nWorkers);
+
+#endif
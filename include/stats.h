@@ -0,0 +1,31 @@
+#ifndef STATS_H_xkubpise
+#define STATS_H_xkubpise
+
+#include "utils.h"
+
+#define STATS_MAX_VERBS 32
+#define STATS_VERB_LENGTH 16
+#define STATS_LATENCY_BUCKETS 32 // bucket i holds latencies below 2^i microseconds
+#define STATS_ENV "XKUBPISE_STATS" // path of the JSON dump written at exit ("-" for stderr)
+
+// Traffic the engine asks for, before the caches: the region of an LBA tells reserved sectors and
+// FAT apart, and inside the data region the caller says whether it moves file data
+typedef enum { ioReserved, ioFAT, ioDirectory, ioData, IO_CLASS_COUNT } IOClass;
+
+typedef struct VolumeStats VolumeStats;
+
+VolumeStats * createVolumeStats(const VolumeGeometry * geometry);
+void destroyVolumeStats(VolumeStats * stats);
+IOClass setIOClass(IOClass ioClass);
+void countRequest(VolumeStats * stats, uint32_t lba, uint64_t sectors, boolean write);
+void countDataTransfer(VolumeStats * stats, uint64_t sectors, boolean write);
+void countDeviceIO(VolumeStats * stats, uint32_t lba, uint64_t sectors, boolean write);
+void countSeekCall(VolumeStats * stats);
+void countFlush(VolumeStats * stats);
+void countDataSync(VolumeStats * stats);
+void recordCommandLatency(Volume * vol, const char * verb, double seconds);
+void printStats(Volume * vol);
+void resetStats(Volume * vol);
+success dumpStats(Volume * vol, const char * path);
+
+#endif
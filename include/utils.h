@@ -13,28 +13,65 @@
 #define FAT32ERRORS_SIZE (4 * 1024)
 
 #define SECTOR_SIZE 512
-#define SECTORS_PER_CLUSTER 1
-#define CLUSTER_SIZE (SECTOR_SIZE * SECTORS_PER_CLUSTER)
-#define TOTAL_N_SECTORS (2 * 1024 * 20) // 20 MB
-#define TOTAL_SIZE (SECTOR_SIZE * TOTAL_N_SECTORS) // 20 MB
 #define N_RESERVED_SECTORS 32
 #define N_FATS 2
 #define FAT_ENTRY_SIZE 4
-#define FAT_SIZE (TOTAL_N_SECTORS * 4 / SECTOR_SIZE) // 320
-#define FIRST_DATA_SECTOR (N_FATS * FAT_SIZE + N_RESERVED_SECTORS)
-#define N_DATA_SECTORS (TOTAL_N_SECTORS - FIRST_DATA_SECTOR)
-#define N_CLUSTERS (N_DATA_SECTORS / SECTORS_PER_CLUSTER)
+#define DEFAULT_TOTAL_N_SECTORS (2 * 1024 * 20) // 20 MB, the strict xkubpise profile
+#define DEFAULT_SECTORS_PER_CLUSTER 1
+#define MAX_SECTORS_PER_CLUSTER 64
+#define MIN_TOTAL_N_SECTORS 2048 // 1 MB
+#define MAX_CLUSTER_NUMBER 0x0FFFFFF6 // larger values are reserved or mark bad clusters and chain ends
+
+// The layout of a volume is only known at runtime: it is parsed from the BPB at mount
+// or chosen when a new volume is created. The macros below read it from the volume.
+#define SECTORS_PER_CLUSTER(vol) ((vol)->geometry.sectorsPerCluster)
+#define CLUSTER_SIZE(vol) (SECTOR_SIZE * SECTORS_PER_CLUSTER(vol))
+#define TOTAL_N_SECTORS(vol) ((vol)->geometry.totalSectors)
+#define TOTAL_SIZE(vol) ((uint64_t)SECTOR_SIZE * TOTAL_N_SECTORS(vol))
+#define FAT_SIZE(vol) ((vol)->geometry.fatSize) // sectors per FAT
+#define FIRST_DATA_SECTOR(vol) ((vol)->geometry.firstDataSector)
+#define N_DATA_SECTORS(vol) (TOTAL_N_SECTORS(vol) - FIRST_DATA_SECTOR(vol))
+#define N_CLUSTERS(vol) ((vol)->geometry.nClusters)
 #define ROOT_CLUSTER 2
-#define ROOT_DIR_SECTOR (FIRST_DATA_SECTOR + (ROOT_CLUSTER - 2) * SECTORS_PER_CLUSTER)
-#define FAT_ENTRIES_COUNT (FAT_SIZE * SECTOR_SIZE / FAT_ENTRY_SIZE)
+#define ROOT_DIR_SECTOR(vol) (FIRST_DATA_SECTOR(vol) + (ROOT_CLUSTER - 2) * SECTORS_PER_CLUSTER(vol))
+#define CLUSTER_FIRST_SECTOR(vol, cluster) (FIRST_DATA_SECTOR(vol) + ((cluster) - 2) * SECTORS_PER_CLUSTER(vol))
+#define FAT_ENTRIES_COUNT(vol) (FAT_SIZE(vol) * SECTOR_SIZE / FAT_ENTRY_SIZE)
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_EOC 0x0FFFFFFF // end-of-chain marker
+#define FAT_EOC_MIN 0x0FFFFFF8 // any entry at or above this value terminates a chain
+#define FAT_COPIES_WRITTEN(vol) ((vol)->geometry.mirroredFATs ? N_FATS : 1) // without mirroring only the first FAT is active
 
 typedef enum { False, True } boolean;
 typedef enum { Failure, Success } success;
 typedef enum { FAT32_OK, FAT32_ERROR, FAT32_NOT_FOUND } fat32_status_t;
 typedef enum { itsFile, itsFolder } IsFolder;
 
-extern FILE * volume;
+typedef struct {
+    uint32_t totalSectors;
+    uint32_t sectorsPerCluster;
+    uint32_t fatSize;
+    uint32_t firstDataSector;
+    uint32_t nClusters;
+    boolean mirroredFATs; // Extended Flags bit 7 clear: every FAT copy is kept up to date
+} VolumeGeometry;
+
+// Everything the engine keeps about one volume, see volume.h
+typedef struct Volume Volume;
+
+// Where the messages of the calling thread go, see setMessageSink()
+typedef struct MessageTarget MessageTarget;
+
+uint32_t fatSizeFor(uint32_t totalSectors, uint32_t sectorsPerCluster);
+success setGeometry(Volume * vol, uint32_t totalSectors, uint32_t sectorsPerCluster);
+void setDefaultGeometry(Volume * vol);
 
+void setMessageSink(char * buffer, size_t size);
+void setMessageStream(FILE * output);
+MessageTarget * currentMessageTarget(void);
+void useMessageTarget(MessageTarget * target);
+void reportMessage(const char * format, ...);
+void reportLine(const char * text);
+void reportBytes(const void * data, size_t length);
 void skipRest();
 int cmpLocalNames(const void * a, const void * b);
 void extractNameToBuffer(const unsigned char * entry, char * dest);
@@ -44,9 +81,9 @@ void toLowerRegister(const char * name, char * nameLower);
 boolean isValidShortChar(char c, boolean fullPath, boolean withLowercase);
 boolean isValidShortNameAndUppercaseFile(char * name, IsFolder isFolder);
 boolean isValidShortNameAndUppercaseFolder(char * name);
-success writeSector(uint32_t sector, const void * data);
-success writeSectors(uint32_t startSector, const void * data, size_t count);
+success writeSector(Volume * vol, uint32_t sector, const void * data);
+success writeSectors(Volume * vol, uint32_t startSector, const void * data, size_t count);
 char safeChar(unsigned char c);
-fat32_status_t checkFileStatus(const char * filename);
+fat32_status_t checkFileStatus(Volume * vol, const char * filename);
 
 #endif
\ No newline at end of file
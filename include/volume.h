@@ -0,0 +1,57 @@
+#ifndef VOLUME_H_xkubpise
+#define VOLUME_H_xkubpise
+
+#include "utils.h"
+#include "fat32.h"
+#include "blockdev.h"
+
+#include <pthread.h>
+
+#define DIRECTORY_LOCK_STRIPES 64 // directories share reader/writer locks by first cluster
+
+// Everything the engine keeps about one volume: every engine function takes the volume it works
+// on, so that a process can keep any number of them open. The caches, the journal and the other
+// modules keep their state behind the pointers below, created with the volume and freed with it.
+// Calls on different volumes run in parallel. On one volume, a call holds its lock exclusively
+// (lockEngine()), or shared (lockEngineShared()) when it reads or changes the entries of single
+// directories: those it works in are then locked one at a time (lockDirectory()), readers shared
+// and writers exclusively, and the storage layer below (sector cache, FAT cache, allocator and
+// journal, which call one another) is entered under storageLock.
+struct Volume {
+    BlockDevice * device;  // NULL when nothing is mounted
+    BackendKind backend;   // used by the next mount
+    VolumeGeometry geometry;
+    IsFormatted isFormatted;
+    boolean enforceAbsolutePath;
+    char readingErrors[FAT32ERRORS_SIZE]; // what the last mount found wrong with the BPB
+    size_t readingErrorsEnd;
+    struct FATCache * fatCache;
+    struct Allocator * allocator;
+    struct BufferCache * bufferCache;
+    struct Journal * journal;
+    struct DirIndexTable * dirIndexes;
+    struct DentryCache * dcache;
+    struct Durability * durability;
+    struct VolumeStats * stats;
+    pthread_rwlock_t lock;
+    pthread_mutex_t storageLock; // recursive
+    pthread_rwlock_t directoryLocks[DIRECTORY_LOCK_STRIPES];
+    pthread_mutex_t foldersLock;
+    uint32_t ** currentFolders; // where the clients and sessions keep the cluster of their current folder
+    uint32_t nCurrentFolders;
+    uint32_t currentFoldersCapacity;
+};
+
+Volume * createVolume(void);
+void destroyVolume(Volume * vol);
+void lockDirectory(Volume * vol, uint32_t cluster, boolean exclusive);
+boolean tryLockDirectory(Volume * vol, uint32_t cluster);
+void unlockDirectory(Volume * vol, uint32_t cluster);
+void lockStorage(Volume * vol);
+void unlockStorage(Volume * vol);
+success trackCurrentFolder(Volume * vol, uint32_t * cluster);
+void untrackCurrentFolder(Volume * vol, uint32_t * cluster);
+void leaveRemovedFolder(Volume * vol, uint32_t cluster);
+void leaveAllFolders(Volume * vol);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef XKUBPISE_H_xkubpise
+#define XKUBPISE_H_xkubpise
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Library interface of the FAT32 emulator xkubpise (libxkubpise.a, libxkubpise.so).
+// Any number of volumes can be open at once and used from any thread. A session is a cursor
+// (current folder and last error) on one volume; a thread keeps its own. Calls on one volume are
+// serialized inside the library, calls on different volumes run in parallel. Functions returning
+// int give 0 on success and -1 on failure, with the reason in xkLastError() of the session.
+typedef struct XkVolume XkVolume;
+typedef struct XkSession XkSession;
+
+typedef enum { xkBackendStdio, xkBackendPread, xkBackendMmap } XkBackend;
+
+typedef struct {
+    XkBackend backend;
+    uint32_t cacheSectors;      // sector cache of the volume, 0 disables it (and the journal)
+    int journal;                // metadata write-ahead journal
+    int durable;                // a call that changes the volume returns once the changes are on the disk
+    int create;                 // a missing image is created and formatted
+    uint32_t sizeMB;            // of a created image
+    uint32_t sectorsPerCluster; // of a created image
+} XkOptions;
+
+#define XK_ERROR_SIZE 1024
+
+void xkDefaultOptions(XkOptions * options);
+// error, when not NULL, receives the reason of a failure
+XkVolume * xkOpen(const char * path, const XkOptions * options, char * error, size_t errorSize);
+// Fails while sessions of the volume are open
+int xkClose(XkVolume * volume);
+
+XkSession * xkOpenSession(XkVolume * volume);
+void xkCloseSession(XkSession * session);
+// Messages of the last call of the session, empty when it had nothing to say
+const char * xkLastError(const XkSession * session);
+
+// Paths are absolute or relative to the current folder of the session
+int xkChangeDirectory(XkSession * session, const char * path);
+int xkCurrentDirectory(XkSession * session, char * path, size_t size);
+// Calls visit for every name of the folder (NULL for the current one), sorted; visit must not call the library
+int xkList(XkSession * session, const char * path, void (* visit)(const char * name, void * data), void * data);
+// Without parents, path is the name of a new folder in the current one
+int xkMakeDirectory(XkSession * session, const char * path, int parents);
+// Creates every folder listed in a host file, one path per line
+int xkMakeTree(XkSession * session, const char * manifestPath);
+int xkCreateFile(XkSession * session, const char * name);
+// Removes a file of the current folder, or with recursive, a file or folder with everything in it
+int xkRemove(XkSession * session, const char * name, int recursive);
+// Moves or renames a file or folder, into destination when it is an existing folder
+int xkMove(XkSession * session, const char * source, const char * destination);
+// A file that does not exist yet is created, unless the data is appended
+int xkWriteFile(XkSession * session, const char * name, const void * data, uint32_t length, int append);
+// The content in a buffer the caller frees, or NULL
+void * xkReadFile(XkSession * session, const char * name, uint32_t * length);
+int xkSync(XkSession * session);
+// problems receives what the check found, or with repair, what it could not repair
+int xkCheck(XkSession * session, int repair, uint32_t * problems);
+
+#endif
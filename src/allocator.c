@@ -0,0 +1,188 @@
+#include "allocator.h"
+#include "fatcache.h"
+#include "fat32.h"
+#include "volume.h"
+
+// Free clusters are found through the per-page summaries of the FAT cache: full pages are skipped
+// without being read, and the free-entry bits of the page holding the cursor are scanned a word at a time.
+// Commands that share the volume allocate under its storage lock, so a cluster found free is
+// marked taken before anybody else looks.
+struct Allocator {
+    uint32_t freeCount;
+    uint32_t nextFree;
+    uint8_t fsinfoSector[SECTOR_SIZE];
+    boolean fsinfoDirty;
+    boolean initialized;
+};
+
+Allocator * createAllocator(void) {
+    Allocator * alloc = calloc(1, sizeof(Allocator));
+    if (alloc) alloc->nextFree = ROOT_CLUSTER;
+    return alloc;
+}
+
+static void markFSInfoDirty(Volume * vol) {
+    Allocator * alloc = vol->allocator;
+    *(uint32_t *)(alloc->fsinfoSector + FSINFO_FREE_COUNT_OFFSET) = alloc->freeCount;
+    *(uint32_t *)(alloc->fsinfoSector + FSINFO_NEXT_FREE_OFFSET) = alloc->nextFree;
+    alloc->fsinfoDirty = True;
+}
+
+success initAllocator(Volume * vol) {
+    Allocator * alloc = vol->allocator;
+    if (!isFATCacheLoaded(vol)) {
+        reportMessage("FAT cache must be loaded before the allocator\n");
+        return Failure;
+    }
+    if (readSector(vol, FSINFO_SECTOR, alloc->fsinfoSector) == Failure) {
+        reportMessage("Failed to read FSInfo sector\n");
+        return Failure;
+    }
+    uint32_t storedCount = *(uint32_t *)(alloc->fsinfoSector + FSINFO_FREE_COUNT_OFFSET);
+    uint32_t storedNext = *(uint32_t *)(alloc->fsinfoSector + FSINFO_NEXT_FREE_OFFSET);
+    alloc->nextFree = (storedNext >= ROOT_CLUSTER && storedNext < N_CLUSTERS(vol)) ? storedNext : ROOT_CLUSTER;
+    alloc->fsinfoDirty = False;
+    alloc->initialized = True;
+
+    // A FAT that fits in the cache is counted exactly; on a large volume the FSInfo count is
+    // trusted, as other FAT32 implementations do, unless it is unknown or impossible
+    if (getFATPageCount(vol) <= MAX_RESIDENT_FAT_PAGES || storedCount == FSINFO_UNKNOWN || storedCount > N_CLUSTERS(vol) - ROOT_CLUSTER) {
+        alloc->freeCount = 0;
+        for (uint32_t page = 0; page < getFATPageCount(vol); ++page) alloc->freeCount += getFATPageFreeCount(vol, page);
+    } else alloc->freeCount = storedCount;
+    // The hints are only advisory, so I correct them if they have drifted
+    if (storedCount != alloc->freeCount || storedNext != alloc->nextFree) markFSInfoDirty(vol);
+    return Success;
+}
+
+void releaseAllocator(Volume * vol) {
+    Allocator * alloc = vol->allocator;
+    alloc->freeCount = 0;
+    alloc->fsinfoDirty = False;
+    alloc->initialized = False;
+}
+
+// I look from the rolling cursor to the end of the FAT and wrap around once
+uint32_t peekFreeCluster(Volume * vol) {
+    Allocator * alloc = vol->allocator;
+    uint32_t cluster = 0;
+    lockStorage(vol);
+    uint32_t nPages = getFATPageCount(vol);
+    uint32_t startPage = alloc->nextFree / FAT_ENTRIES_PER_PAGE;
+    for (uint32_t i = 0; alloc->initialized && alloc->freeCount && !cluster && i <= nPages; ++i)
+        cluster = findFreeClusterInFATPage(vol, (startPage + i) % nPages, i == 0 ? alloc->nextFree : 0);
+    unlockStorage(vol);
+    return cluster;
+}
+
+uint32_t allocateCluster(Volume * vol) {
+    lockStorage(vol);
+    uint32_t cluster = peekFreeCluster(vol);
+    if (cluster) setFATEntry(vol, cluster, FAT_EOC); // the FAT cache reports the transition back via noteClusterState()
+    unlockStorage(vol);
+    return cluster;
+}
+
+void freeCluster(Volume * vol, uint32_t cluster) {
+    if (cluster < ROOT_CLUSTER || cluster >= N_CLUSTERS(vol)) return;
+    setFATEntry(vol, cluster, 0x00000000);
+}
+
+// I hand out up to "wanted" adjacent clusters starting at the first free one after the cursor,
+// already linked into a chain that ends with an end-of-chain marker
+uint32_t allocateClusterRun(Volume * vol, uint32_t wanted, uint32_t * firstCluster) {
+    lockStorage(vol);
+    uint32_t start = wanted ? peekFreeCluster(vol) : 0, length = start ? 1 : 0;
+    while (length && length < wanted && start + length < N_CLUSTERS(vol) && getFATEntry(vol, start + length) == 0) ++length;
+    for (uint32_t i = 0; i < length; ++i) setFATEntry(vol, start + i, i + 1 < length ? start + i + 1 : FAT_EOC);
+    unlockStorage(vol);
+    if (length) *firstCluster = start;
+    return length;
+}
+
+// I reserve "wanted" clusters at once, each marked end-of-chain for the caller to link: they are
+// taken in ascending order from the cursor, so they are adjacent wherever the free space is.
+// Nothing is reserved when fewer clusters are free.
+success allocateClusters(Volume * vol, uint32_t wanted, uint32_t * clusters) {
+    Allocator * alloc = vol->allocator;
+    success ret = Success;
+    lockStorage(vol);
+    if (!alloc->initialized || wanted > alloc->freeCount) ret = Failure;
+    for (uint32_t i = 0; ret == Success && i < wanted; ++i) {
+        clusters[i] = allocateCluster(vol);
+        if (clusters[i] == 0) {
+            while (i-- > 0) freeCluster(vol, clusters[i]);
+            ret = Failure;
+        }
+    }
+    unlockStorage(vol);
+    return ret;
+}
+
+// I release every cluster of a chain and return how many were freed
+uint32_t freeClusterChain(Volume * vol, uint32_t firstCluster) {
+    uint32_t cluster = firstCluster, nFreed = 0;
+    lockStorage(vol);
+    while (cluster >= ROOT_CLUSTER && cluster < N_CLUSTERS(vol) && nFreed < N_CLUSTERS(vol)) {
+        uint32_t next = getFATEntry(vol, cluster);
+        if (next == 0) break; // already free, the chain is broken here
+        freeCluster(vol, cluster);
+        ++nFreed;
+        if (next >= FAT_EOC_MIN) break;
+        cluster = next;
+    }
+    unlockStorage(vol);
+    return nFreed;
+}
+
+static int compareClusters(const void * a, const void * b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// I release a batch of clusters in ascending order, so that every FAT page and sector is visited
+// once however the chains were laid out; the cached FAT and FSInfo reach the volume at the commit
+void freeClusters(Volume * vol, uint32_t * clusters, uint32_t count) {
+    qsort(clusters, count, sizeof(uint32_t), compareClusters);
+    lockStorage(vol);
+    for (uint32_t i = 0; i < count; ++i) freeCluster(vol, clusters[i]);
+    unlockStorage(vol);
+}
+
+uint32_t getFreeClusterCount(Volume * vol) {
+    Allocator * alloc = vol->allocator;
+    lockStorage(vol);
+    uint32_t count = alloc->freeCount;
+    unlockStorage(vol);
+    return count;
+}
+
+// fsck knows the exact count after a full scan of the FAT
+void setFreeClusterCount(Volume * vol, uint32_t count) {
+    Allocator * alloc = vol->allocator;
+    if (!alloc->initialized) return;
+    alloc->freeCount = count;
+    markFSInfoDirty(vol);
+}
+
+void noteClusterState(Volume * vol, uint32_t cluster, boolean isFree) {
+    Allocator * alloc = vol->allocator;
+    if (!alloc->initialized || cluster < ROOT_CLUSTER || cluster >= N_CLUSTERS(vol)) return;
+    if (isFree) ++alloc->freeCount;
+    else {
+        if (alloc->freeCount) --alloc->freeCount;
+        alloc->nextFree = (cluster + 1 < N_CLUSTERS(vol)) ? cluster + 1 : ROOT_CLUSTER;
+    }
+    markFSInfoDirty(vol);
+}
+
+success flushFSInfo(Volume * vol) {
+    Allocator * alloc = vol->allocator;
+    if (!alloc->fsinfoDirty) return Success;
+    if (writeSector(vol, FSINFO_SECTOR, alloc->fsinfoSector) == Failure) {
+        reportMessage("Failed to write FSInfo sector\n");
+        return Failure;
+    }
+    alloc->fsinfoDirty = False;
+    return Success;
+}
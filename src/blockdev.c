@@ -0,0 +1,337 @@
+#include "blockdev.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // the Linux limit, only exposed by <limits.h> in X/Open mode
+#endif
+
+static const char * backendNames[] = { "stdio", "pread", "mmap" };
+
+static boolean isInside(const BlockDevice * device, uint32_t lba, uint32_t count) {
+    return (uint64_t)(lba + (uint64_t)count) * SECTOR_SIZE <= device->size;
+}
+
+static void markMappedDirty(BlockDevice * device, uint32_t lba, uint32_t count) {
+    uint64_t start = (uint64_t)lba * SECTOR_SIZE, end = start + (uint64_t)count * SECTOR_SIZE;
+    pthread_mutex_lock(&device->lock);
+    if (device->dirtyStart >= device->dirtyEnd) {
+        device->dirtyStart = start;
+        device->dirtyEnd = end;
+    } else {
+        if (start < device->dirtyStart) device->dirtyStart = start;
+        if (end > device->dirtyEnd) device->dirtyEnd = end;
+    }
+    pthread_mutex_unlock(&device->lock);
+}
+
+static uint64_t vectorSectors(const struct iovec * parts, int nParts) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < nParts; ++i) bytes += parts[i].iov_len;
+    return bytes / SECTOR_SIZE;
+}
+
+// stdio backend: the original fseek + fread/fwrite path with a shared file offset, which a request
+// holds under the lock of the device
+
+static success stdioRead(BlockDevice * device, uint32_t lba, void * buffer, uint32_t count) {
+    countDeviceIO(device->stats, lba, count, False);
+    countSeekCall(device->stats);
+    success ret = Success;
+    pthread_mutex_lock(&device->lock);
+    if (fseeko(device->file, (off_t)lba * SECTOR_SIZE, SEEK_SET) != 0) {
+        perror("fseek");
+        ret = Failure;
+    } else if (fread(buffer, SECTOR_SIZE, count, device->file) != count) {
+        reportMessage("Error reading %u sector(s) at %u\n", count, lba);
+        ret = Failure;
+    }
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+static success stdioWrite(BlockDevice * device, uint32_t lba, const void * data, uint32_t count) {
+    countDeviceIO(device->stats, lba, count, True);
+    countSeekCall(device->stats);
+    success ret = Success;
+    pthread_mutex_lock(&device->lock);
+    if (fseeko(device->file, (off_t)lba * SECTOR_SIZE, SEEK_SET) != 0) {
+        perror("fseek");
+        ret = Failure;
+    } else if (fwrite(data, SECTOR_SIZE, count, device->file) != count) {
+        reportMessage("Error writing %u sector(s) at %u\n", count, lba);
+        ret = Failure;
+    }
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+static success stdioWriteVector(BlockDevice * device, uint32_t lba, const struct iovec * parts, int nParts) {
+    countDeviceIO(device->stats, lba, vectorSectors(parts, nParts), True);
+    countSeekCall(device->stats);
+    success ret = Success;
+    pthread_mutex_lock(&device->lock);
+    if (fseeko(device->file, (off_t)lba * SECTOR_SIZE, SEEK_SET) != 0) {
+        perror("fseek");
+        ret = Failure;
+    }
+    for (int i = 0; ret == Success && i < nParts; ++i) {
+        if (fwrite(parts[i].iov_base, 1, parts[i].iov_len, device->file) != parts[i].iov_len) {
+            reportMessage("Error writing %zu byte(s) at sector %u\n", parts[i].iov_len, lba);
+            ret = Failure;
+        }
+    }
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+static success stdioFlush(BlockDevice * device) {
+    pthread_mutex_lock(&device->lock);
+    success ret = fflush(device->file) == 0 ? Success : Failure;
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+static void stdioClose(BlockDevice * device) {
+    fclose(device->file);
+}
+
+// pread backend: positional I/O, no shared file offset and no user-space buffering
+
+static success positionalRead(BlockDevice * device, uint32_t lba, void * buffer, uint32_t count) {
+    countDeviceIO(device->stats, lba, count, False);
+    size_t total = (size_t)count * SECTOR_SIZE, done = 0;
+    while (done < total) {
+        ssize_t n = pread(device->fd, (uint8_t *)buffer + done, total - done, (off_t)lba * SECTOR_SIZE + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            reportMessage("Error reading %u sector(s) at %u\n", count, lba);
+            return Failure;
+        }
+        done += (size_t)n;
+    }
+    return Success;
+}
+
+static success positionalWrite(BlockDevice * device, uint32_t lba, const void * data, uint32_t count) {
+    countDeviceIO(device->stats, lba, count, True);
+    size_t total = (size_t)count * SECTOR_SIZE, done = 0;
+    while (done < total) {
+        ssize_t n = pwrite(device->fd, (const uint8_t *)data + done, total - done, (off_t)lba * SECTOR_SIZE + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            reportMessage("Error writing %u sector(s) at %u\n", count, lba);
+            return Failure;
+        }
+        done += (size_t)n;
+    }
+    return Success;
+}
+
+// One pwritev() per IOV_MAX parts; a short write is finished part by part with pwrite()
+static success positionalWriteVector(BlockDevice * device, uint32_t lba, const struct iovec * parts, int nParts) {
+    countDeviceIO(device->stats, lba, vectorSectors(parts, nParts), True);
+    off_t offset = (off_t)lba * SECTOR_SIZE;
+    while (nParts > 0) {
+        int batch = nParts < IOV_MAX ? nParts : IOV_MAX;
+        ssize_t n = pwritev(device->fd, parts, batch, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            reportMessage("Error writing %d buffer(s) at sector %u\n", batch, lba);
+            return Failure;
+        }
+        for (int i = 0; i < batch; ++i) {
+            size_t done = (size_t)n < parts[i].iov_len ? (size_t)n : parts[i].iov_len;
+            n -= (ssize_t)done;
+            while (done < parts[i].iov_len) {
+                ssize_t m = pwrite(device->fd, (const uint8_t *)parts[i].iov_base + done, parts[i].iov_len - done, offset + done);
+                if (m < 0 && errno == EINTR) continue;
+                if (m <= 0) {
+                    reportMessage("Error writing %zu byte(s) at sector %u\n", parts[i].iov_len, lba);
+                    return Failure;
+                }
+                done += (size_t)m;
+            }
+            offset += (off_t)parts[i].iov_len;
+        }
+        parts += batch;
+        nParts -= batch;
+    }
+    return Success;
+}
+
+static success positionalFlush(BlockDevice * device) {
+    (void)device; // pwrite() already hands the data to the kernel
+    return Success;
+}
+
+static void descriptorClose(BlockDevice * device) {
+    close(device->fd);
+}
+
+// mmap backend: the whole image is mapped shared, reads and writes are plain memory copies
+
+static success mappedRead(BlockDevice * device, uint32_t lba, void * buffer, uint32_t count) {
+    countDeviceIO(device->stats, lba, count, False);
+    if (!isInside(device, lba, count)) {
+        reportMessage("Error reading %u sector(s) at %u: beyond the end of the volume\n", count, lba);
+        return Failure;
+    }
+    memcpy(buffer, device->map + (size_t)lba * SECTOR_SIZE, (size_t)count * SECTOR_SIZE);
+    return Success;
+}
+
+static success mappedWrite(BlockDevice * device, uint32_t lba, const void * data, uint32_t count) {
+    countDeviceIO(device->stats, lba, count, True);
+    if (!isInside(device, lba, count)) {
+        reportMessage("Error writing %u sector(s) at %u: beyond the end of the volume\n", count, lba);
+        return Failure;
+    }
+    memcpy(device->map + (size_t)lba * SECTOR_SIZE, data, (size_t)count * SECTOR_SIZE);
+    markMappedDirty(device, lba, count);
+    return Success;
+}
+
+static success mappedWriteVector(BlockDevice * device, uint32_t lba, const struct iovec * parts, int nParts) {
+    for (int i = 0; i < nParts; ++i) {
+        uint32_t count = (uint32_t)(parts[i].iov_len / SECTOR_SIZE);
+        if (mappedWrite(device, lba, parts[i].iov_base, count) == Failure) return Failure;
+        lba += count;
+    }
+    return Success;
+}
+
+// Only the page-aligned range touched since the previous commit is scheduled for write-back
+static success mappedFlush(BlockDevice * device) {
+    pthread_mutex_lock(&device->lock);
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = device->dirtyStart / pageSize * pageSize, end = device->dirtyEnd;
+    device->dirtyStart = device->dirtyEnd = 0;
+    pthread_mutex_unlock(&device->lock);
+    if (start >= end) return Success;
+    return msync(device->map + start, end - start, MS_ASYNC) == 0 ? Success : Failure;
+}
+
+static void mappedClose(BlockDevice * device) {
+    msync(device->map, device->size, MS_SYNC);
+    munmap(device->map, device->size);
+    close(device->fd);
+}
+
+BlockDevice * openBlockDevice(const char * filename, BackendKind kind, VolumeStats * stats) {
+    BlockDevice * device = calloc(1, sizeof(BlockDevice));
+    if (!device) return NULL;
+    if (pthread_mutex_init(&device->lock, NULL) != 0) {
+        free(device);
+        return NULL;
+    }
+    device->kind = kind;
+    device->stats = stats;
+    device->fd = -1;
+
+    struct stat info;
+    if (stat(filename, &info) != 0) {
+        pthread_mutex_destroy(&device->lock);
+        free(device);
+        return NULL;
+    }
+    device->size = (uint64_t)info.st_size;
+
+    switch (kind) {
+    case backendStdio:
+        device->file = fopen(filename, "r+b");
+        if (!device->file) break;
+        device->read = stdioRead;
+        device->write = stdioWrite;
+        device->writeVector = stdioWriteVector;
+        device->flush = stdioFlush;
+        device->close = stdioClose;
+        return device;
+    case backendPositional:
+        device->fd = open(filename, O_RDWR);
+        if (device->fd < 0) break;
+        device->read = positionalRead;
+        device->write = positionalWrite;
+        device->writeVector = positionalWriteVector;
+        device->flush = positionalFlush;
+        device->close = descriptorClose;
+        return device;
+    case backendMmap:
+        device->fd = open(filename, O_RDWR);
+        if (device->fd < 0 || device->size == 0) break;
+        device->map = mmap(NULL, device->size, PROT_READ | PROT_WRITE, MAP_SHARED, device->fd, 0);
+        if (device->map == MAP_FAILED) {
+            perror("mmap");
+            close(device->fd);
+            device->fd = -1;
+            break;
+        }
+        device->read = mappedRead;
+        device->write = mappedWrite;
+        device->writeVector = mappedWriteVector;
+        device->flush = mappedFlush;
+        device->close = mappedClose;
+        return device;
+    }
+    if (device->fd >= 0) close(device->fd);
+    pthread_mutex_destroy(&device->lock);
+    free(device);
+    return NULL;
+}
+
+void closeBlockDevice(BlockDevice * device) {
+    if (!device) return;
+    device->close(device);
+    pthread_mutex_destroy(&device->lock);
+    free(device);
+}
+
+boolean parseBackendName(const char * name, BackendKind * kind) {
+    for (int i = 0; i < (int)(sizeof(backendNames) / sizeof(backendNames[0])); ++i) {
+        if (strcmp(name, backendNames[i]) == 0) {
+            *kind = (BackendKind)i;
+            return True;
+        }
+    }
+    return False;
+}
+
+const char * backendName(BackendKind kind) {
+    return backendNames[kind];
+}
+
+success flushVolume(BlockDevice * device) {
+    if (!device) return Failure;
+    countFlush(device->stats);
+    return device->flush(device);
+}
+
+// A flush only hands the writes to the kernel; this waits until they are on the disk.
+// The dirty pages of a shared mapping belong to the file, so fdatasync() covers the mmap backend too.
+success persistVolume(BlockDevice * device) {
+    if (flushVolume(device) == Failure) return Failure;
+    countDataSync(device->stats);
+    int fd = device->kind == backendStdio ? fileno(device->file) : device->fd;
+    if (fdatasync(fd) != 0) {
+        reportMessage("fdatasync failed: %s\n", strerror(errno));
+        return Failure;
+    }
+    return Success;
+}
+
+// Zero-copy access for the mmap backend; NULL means the caller has to go through read/write
+const uint8_t * mappedSectors(BlockDevice * device, uint32_t lba, uint32_t count) {
+    if (!device || device->kind != backendMmap || !isInside(device, lba, count)) return NULL;
+    return device->map + (size_t)lba * SECTOR_SIZE;
+}
+
+// The returned memory is the volume itself: changes are written through and picked up by the next flush
+uint8_t * mappedSectorsForWrite(BlockDevice * device, uint32_t lba, uint32_t count) {
+    if (!device || device->kind != backendMmap || !isInside(device, lba, count)) return NULL;
+    markMappedDirty(device, lba, count);
+    return device->map + (size_t)lba * SECTOR_SIZE;
+}
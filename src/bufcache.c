@@ -0,0 +1,355 @@
+#include "bufcache.h"
+#include "blockdev.h"
+#include "stats.h"
+#include "journal.h"
+#include "volume.h"
+
+// Write-back cache of individual sectors with LRU eviction. The FAT has its own cache,
+// so in practice this holds directory sectors, FSInfo and the sectors commits write back.
+// With the journal, a dirty sector is "logged" once its content is in a journal record; the others
+// belong to a command that is not committed yet and are kept out of the way of eviction.
+// Reads and writes may come from commands that share the volume: they hold its storage lock, and so
+// does whatever they start in the FAT cache and the journal. Sync, logging and checkpoints run
+// with the volume held alone.
+typedef struct CacheBuffer {
+    uint32_t lba;
+    boolean dirty;
+    boolean logged;
+    struct CacheBuffer * hashNext;
+    struct CacheBuffer * lruPrev;
+    struct CacheBuffer * lruNext;
+    uint8_t data[SECTOR_SIZE];
+} CacheBuffer;
+
+struct BufferCache {
+    uint32_t capacity;
+    CacheBuffer * buffers;
+    CacheBuffer ** buckets;
+    uint32_t nBuckets;
+    CacheBuffer * freeList;
+    CacheBuffer * lruHead; // most recently used
+    CacheBuffer * lruTail;
+    uint32_t dirtyCount;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+BufferCache * createBufferCache(void) {
+    BufferCache * cache = calloc(1, sizeof(BufferCache));
+    if (cache) cache->capacity = DEFAULT_CACHE_SECTORS;
+    return cache;
+}
+
+static boolean cacheEnabled(Volume * vol) {
+    BufferCache * cache = vol->bufferCache;
+    // A mapped volume is its own cache
+    return cache->capacity > 0 && vol->device && vol->device->kind != backendMmap;
+}
+
+static boolean ensureAllocated(Volume * vol) {
+    BufferCache * cache = vol->bufferCache;
+    if (cache->buffers) return True;
+    cache->nBuckets = 1;
+    while (cache->nBuckets < cache->capacity * 2) cache->nBuckets <<= 1;
+    cache->buffers = calloc(cache->capacity, sizeof(CacheBuffer));
+    cache->buckets = calloc(cache->nBuckets, sizeof(CacheBuffer *));
+    if (!cache->buffers || !cache->buckets) {
+        free(cache->buffers);
+        free(cache->buckets);
+        cache->buffers = NULL;
+        cache->buckets = NULL;
+        return False;
+    }
+    cache->freeList = NULL;
+    for (uint32_t i = cache->capacity; i-- > 0;) {
+        cache->buffers[i].lruNext = cache->freeList;
+        cache->freeList = &cache->buffers[i];
+    }
+    return True;
+}
+
+static CacheBuffer * lookup(Volume * vol, uint32_t lba) {
+    BufferCache * cache = vol->bufferCache;
+    for (CacheBuffer * b = cache->buckets[lba & (cache->nBuckets - 1)]; b; b = b->hashNext)
+        if (b->lba == lba) return b;
+    return NULL;
+}
+
+static void unlinkFromLRU(Volume * vol, CacheBuffer * b) {
+    BufferCache * cache = vol->bufferCache;
+    if (b->lruPrev) b->lruPrev->lruNext = b->lruNext;
+    else cache->lruHead = b->lruNext;
+    if (b->lruNext) b->lruNext->lruPrev = b->lruPrev;
+    else cache->lruTail = b->lruPrev;
+    b->lruPrev = b->lruNext = NULL;
+}
+
+static void pushToLRUHead(Volume * vol, CacheBuffer * b) {
+    BufferCache * cache = vol->bufferCache;
+    b->lruPrev = NULL;
+    b->lruNext = cache->lruHead;
+    if (cache->lruHead) cache->lruHead->lruPrev = b;
+    cache->lruHead = b;
+    if (!cache->lruTail) cache->lruTail = b;
+}
+
+static void unhash(Volume * vol, CacheBuffer * b) {
+    BufferCache * cache = vol->bufferCache;
+    CacheBuffer ** link = &cache->buckets[b->lba & (cache->nBuckets - 1)];
+    while (*link && *link != b) link = &(*link)->hashNext;
+    if (*link) *link = b->hashNext;
+    b->hashNext = NULL;
+}
+
+static void release(Volume * vol, CacheBuffer * b) {
+    BufferCache * cache = vol->bufferCache;
+    unhash(vol, b);
+    unlinkFromLRU(vol, b);
+    if (b->dirty) --cache->dirtyCount;
+    b->dirty = False;
+    b->logged = False;
+    b->lruNext = cache->freeList;
+    cache->freeList = b;
+}
+
+// I take a free buffer or evict the least recently used one, writing it back if it is dirty
+static CacheBuffer * obtainBuffer(Volume * vol, uint32_t lba) {
+    BufferCache * cache = vol->bufferCache;
+    CacheBuffer * b = cache->freeList;
+    if (b) cache->freeList = b->lruNext;
+    else {
+        b = cache->lruTail;
+        if (!b) return NULL;
+        // A sector that is not logged yet only goes when every other one is in the same situation
+        if (isJournalActive(vol)) {
+            CacheBuffer * candidate = b;
+            while (candidate && candidate->dirty && !candidate->logged) candidate = candidate->lruPrev;
+            if (candidate) b = candidate;
+            else if (journalForget(vol, b->lba, 1) == Failure) return NULL;
+        }
+        if (b->dirty && (journalBeforeWriteBack(vol) == Failure || vol->device->write(vol->device, b->lba, b->data, 1) == Failure)) {
+            reportMessage("Failed to write back cached sector %u\n", b->lba);
+            return NULL;
+        }
+        if (b->dirty) --cache->dirtyCount;
+        unhash(vol, b);
+        unlinkFromLRU(vol, b);
+    }
+    b->lba = lba;
+    b->dirty = False;
+    b->logged = False;
+    b->hashNext = cache->buckets[lba & (cache->nBuckets - 1)];
+    cache->buckets[lba & (cache->nBuckets - 1)] = b;
+    pushToLRUHead(vol, b);
+    return b;
+}
+
+void setBufferCacheCapacity(Volume * vol, uint32_t sectors) {
+    BufferCache * cache = vol->bufferCache;
+    dropBufferCache(vol);
+    cache->capacity = sectors;
+}
+
+uint32_t getBufferCacheCapacity(Volume * vol) {
+    BufferCache * cache = vol->bufferCache;
+    return cache->capacity;
+}
+
+static success readThroughCache(Volume * vol, uint32_t lba, void * buffer, uint32_t count) {
+    BufferCache * cache = vol->bufferCache;
+    countRequest(vol->stats, lba, count, False);
+    if (!cacheEnabled(vol) || !ensureAllocated(vol)) return vol->device->read(vol->device, lba, buffer, count);
+    uint8_t * out = buffer;
+    boolean populate = count <= CACHE_BYPASS_SECTORS;
+    uint32_t i = 0;
+    while (i < count) {
+        CacheBuffer * b = lookup(vol, lba + i);
+        if (b) {
+            memcpy(out + (size_t)i * SECTOR_SIZE, b->data, SECTOR_SIZE);
+            unlinkFromLRU(vol, b);
+            pushToLRUHead(vol, b);
+            ++cache->hits;
+            ++i;
+            continue;
+        }
+        // I read the whole run of missing sectors with a single request
+        uint32_t runEnd = i + 1;
+        while (runEnd < count && !lookup(vol, lba + runEnd)) ++runEnd;
+        if (vol->device->read(vol->device, lba + i, out + (size_t)i * SECTOR_SIZE, runEnd - i) == Failure) return Failure;
+        cache->misses += runEnd - i;
+        for (; populate && i < runEnd; ++i) {
+            CacheBuffer * fresh = obtainBuffer(vol, lba + i);
+            if (fresh) memcpy(fresh->data, out + (size_t)i * SECTOR_SIZE, SECTOR_SIZE);
+        }
+        i = runEnd;
+    }
+    return Success;
+}
+
+success cachedRead(Volume * vol, uint32_t lba, void * buffer, uint32_t count) {
+    lockStorage(vol);
+    success ret = readThroughCache(vol, lba, buffer, count);
+    unlockStorage(vol);
+    return ret;
+}
+
+static success writeIntoCache(Volume * vol, uint32_t lba, const void * data, uint32_t count) {
+    BufferCache * cache = vol->bufferCache;
+    countRequest(vol->stats, lba, count, True);
+    if (!cacheEnabled(vol) || !ensureAllocated(vol)) return vol->device->write(vol->device, lba, data, count);
+    const uint8_t * in = data;
+    if (count > CACHE_BYPASS_SECTORS) {
+        // Bulk writes go straight to the volume; cached copies of those sectors would be stale
+        if (journalForget(vol, lba, count) == Failure) return Failure;
+        discardCachedRange(vol, lba, count);
+        return vol->device->write(vol->device, lba, data, count);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        CacheBuffer * b = lookup(vol, lba + i);
+        if (b) {
+            unlinkFromLRU(vol, b);
+            pushToLRUHead(vol, b);
+        } else {
+            b = obtainBuffer(vol, lba + i);
+            if (!b) {
+                if (journalForget(vol, lba + i, count - i) == Failure) return Failure;
+                return vol->device->write(vol->device, lba + i, in + (size_t)i * SECTOR_SIZE, count - i);
+            }
+        }
+        memcpy(b->data, in + (size_t)i * SECTOR_SIZE, SECTOR_SIZE);
+        if (!b->dirty) ++cache->dirtyCount;
+        b->dirty = True;
+        b->logged = False;
+    }
+    return Success;
+}
+
+success cachedWrite(Volume * vol, uint32_t lba, const void * data, uint32_t count) {
+    lockStorage(vol);
+    success ret = writeIntoCache(vol, lba, data, count);
+    unlockStorage(vol);
+    return ret;
+}
+
+// Gathered writes (the FAT copies) go straight to the volume, like bulk writes
+success uncachedWriteVector(Volume * vol, uint32_t lba, const struct iovec * parts, int nParts) {
+    uint32_t count = 0;
+    for (int i = 0; i < nParts; ++i) count += (uint32_t)(parts[i].iov_len / SECTOR_SIZE);
+    countRequest(vol->stats, lba, count, True);
+    lockStorage(vol);
+    discardCachedRange(vol, lba, count);
+    success ret = vol->device->writeVector(vol->device, lba, parts, nParts);
+    unlockStorage(vol);
+    return ret;
+}
+
+// Cached copies of sectors that are about to be overwritten behind the cache's back are dropped, dirty or not
+void discardCachedRange(Volume * vol, uint32_t lba, uint32_t count) {
+    BufferCache * cache = vol->bufferCache;
+    lockStorage(vol);
+    for (uint32_t i = 0; cache->buffers && i < count; ++i) {
+        CacheBuffer * b = lookup(vol, lba + i);
+        if (b) release(vol, b);
+    }
+    unlockStorage(vol);
+}
+
+static int compareByLBA(const void * a, const void * b) {
+    uint32_t lbaA = (*(CacheBuffer * const *)a)->lba, lbaB = (*(CacheBuffer * const *)b)->lba;
+    return (lbaA > lbaB) - (lbaA < lbaB);
+}
+
+// I write every dirty sector in LBA order, coalescing neighbours into one request
+success syncBufferCache(Volume * vol, uint32_t * written) {
+    BufferCache * cache = vol->bufferCache;
+    if (written) *written = 0;
+    if (!cache->buffers || cache->dirtyCount == 0) return Success;
+    // Sectors that are not logged go to their place directly: no older logged version may follow them there
+    for (CacheBuffer * b = cache->lruHead; b; b = b->lruNext)
+        if (b->dirty && !b->logged && journalForget(vol, b->lba, 1) == Failure) return Failure;
+    if (journalBeforeWriteBack(vol) == Failure) return Failure;
+    if (cache->dirtyCount == 0) return Success;
+    CacheBuffer ** dirty = malloc(cache->dirtyCount * sizeof(CacheBuffer *));
+    uint8_t * run = malloc((size_t)CACHE_BYPASS_SECTORS * SECTOR_SIZE);
+    if (!dirty || !run) {
+        free(dirty);
+        free(run);
+        return Failure;
+    }
+    uint32_t n = 0;
+    for (CacheBuffer * b = cache->lruHead; b; b = b->lruNext)
+        if (b->dirty) dirty[n++] = b;
+    qsort(dirty, n, sizeof(CacheBuffer *), compareByLBA);
+
+    success ret = Success;
+    uint32_t i = 0;
+    while (i < n && ret == Success) {
+        uint32_t runLength = 0;
+        while (i + runLength < n && runLength < CACHE_BYPASS_SECTORS && dirty[i + runLength]->lba == dirty[i]->lba + runLength) {
+            memcpy(run + (size_t)runLength * SECTOR_SIZE, dirty[i + runLength]->data, SECTOR_SIZE);
+            ++runLength;
+        }
+        ret = vol->device->write(vol->device, dirty[i]->lba, run, runLength);
+        for (uint32_t k = 0; ret == Success && k < runLength; ++k) dirty[i + k]->dirty = dirty[i + k]->logged = False;
+        if (ret == Success) {
+            cache->dirtyCount -= runLength;
+            if (written) *written += runLength;
+        }
+        i += runLength;
+    }
+    free(dirty);
+    free(run);
+    return ret;
+}
+
+// Dirty sectors whose content is not in the journal yet; they are copied out only if they all fit
+uint32_t gatherUnloggedSectors(Volume * vol, uint32_t * lbas, uint8_t * data, uint32_t max) {
+    BufferCache * cache = vol->bufferCache;
+    uint32_t n = 0;
+    if (!cache->buffers) return 0;
+    for (CacheBuffer * b = cache->lruHead; b; b = b->lruNext)
+        if (b->dirty && !b->logged) ++n;
+    if (!data || n > max) return n;
+    uint32_t i = 0;
+    for (CacheBuffer * b = cache->lruHead; b; b = b->lruNext) {
+        if (!b->dirty || b->logged) continue;
+        lbas[i] = b->lba;
+        memcpy(data + (size_t)i * SECTOR_SIZE, b->data, SECTOR_SIZE);
+        ++i;
+    }
+    return n;
+}
+
+void markSectorsLogged(Volume * vol) {
+    BufferCache * cache = vol->bufferCache;
+    for (CacheBuffer * b = cache->lruHead; b; b = b->lruNext)
+        if (b->dirty) b->logged = True;
+}
+
+// After a checkpoint the logged sectors are in their place; those changed again stay dirty
+void markLoggedSectorsClean(Volume * vol) {
+    BufferCache * cache = vol->bufferCache;
+    for (CacheBuffer * b = cache->lruHead; b; b = b->lruNext) {
+        if (!b->dirty || !b->logged) continue;
+        b->dirty = b->logged = False;
+        --cache->dirtyCount;
+    }
+}
+
+// Dirty sectors must be synced before; whatever is still dirty is lost
+void dropBufferCache(Volume * vol) {
+    BufferCache * cache = vol->bufferCache;
+    free(cache->buffers);
+    free(cache->buckets);
+    cache->buffers = NULL;
+    cache->buckets = NULL;
+    cache->freeList = cache->lruHead = cache->lruTail = NULL;
+    cache->dirtyCount = 0;
+}
+
+void getBufferCacheStats(Volume * vol, uint64_t * hitCount, uint64_t * missCount, uint32_t * dirty) {
+    BufferCache * cache = vol->bufferCache;
+    *hitCount = cache->hits;
+    *missCount = cache->misses;
+    *dirty = cache->dirtyCount;
+}
@@ -0,0 +1,147 @@
+#include "dcache.h"
+#include "volume.h"
+
+// Two direct-mapped tables of directory entries: one answers "who is the parent of this
+// cluster and what is it called" for the prompt, the other resolves path components
+typedef struct {
+    boolean valid;
+    uint32_t cluster;
+    uint32_t parentCluster;
+    char name[FULL_FILE_STRING_SIZE];
+} ParentSlot;
+
+typedef struct {
+    boolean valid;
+    uint32_t parentCluster;
+    uint8_t rawName[FILE_AND_EXT_RAW_LENGTH];
+    uint32_t cluster;
+} ChildSlot;
+
+// The tables are allocated by the first insertion, so that a volume that is not in use costs nothing.
+// Commands that share the volume look up and fill them at the same time, under the lock of the cache.
+struct DentryCache {
+    pthread_mutex_t lock;
+    ParentSlot * byCluster;
+    ChildSlot * byName;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+DentryCache * createDentryCache(void) {
+    DentryCache * cache = calloc(1, sizeof(DentryCache));
+    if (cache && pthread_mutex_init(&cache->lock, NULL) != 0) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static void dropTables(DentryCache * cache) {
+    free(cache->byCluster);
+    free(cache->byName);
+    cache->byCluster = NULL;
+    cache->byName = NULL;
+}
+
+void destroyDentryCache(DentryCache * cache) {
+    if (!cache) return;
+    dropTables(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static uint32_t childHash(uint32_t parentCluster, const uint8_t * rawName) {
+    uint32_t hash = 2166136261u ^ parentCluster; // FNV-1a seeded with the parent
+    for (int i = 0; i < FILE_AND_EXT_RAW_LENGTH; ++i) {
+        hash ^= rawName[i];
+        hash *= 16777619u;
+    }
+    return hash % DCACHE_SLOTS;
+}
+
+boolean dcacheLookupParent(Volume * vol, uint32_t cluster, uint32_t * parentCluster, char * name) {
+    DentryCache * cache = vol->dcache;
+    pthread_mutex_lock(&cache->lock);
+    ParentSlot * slot = cache->byCluster ? &cache->byCluster[cluster % DCACHE_SLOTS] : NULL;
+    boolean hit = slot && slot->valid && slot->cluster == cluster;
+    if (hit) {
+        ++cache->hits;
+        *parentCluster = slot->parentCluster;
+        strcpy(name, slot->name);
+    } else ++cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+boolean dcacheLookupChild(Volume * vol, uint32_t parentCluster, const uint8_t * rawName, uint32_t * cluster) {
+    DentryCache * cache = vol->dcache;
+    pthread_mutex_lock(&cache->lock);
+    ChildSlot * slot = cache->byName ? &cache->byName[childHash(parentCluster, rawName)] : NULL;
+    boolean hit = slot && slot->valid && slot->parentCluster == parentCluster && memcmp(slot->rawName, rawName, FILE_AND_EXT_RAW_LENGTH) == 0;
+    if (hit) {
+        ++cache->hits;
+        *cluster = slot->cluster;
+    } else ++cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+void dcacheInsert(Volume * vol, uint32_t parentCluster, const uint8_t * rawName, uint32_t cluster) {
+    DentryCache * cache = vol->dcache;
+    pthread_mutex_lock(&cache->lock);
+    if (!cache->byCluster) {
+        cache->byCluster = calloc(DCACHE_SLOTS, sizeof(ParentSlot));
+        cache->byName = calloc(DCACHE_SLOTS, sizeof(ChildSlot));
+        if (!cache->byCluster || !cache->byName) {
+            dropTables(cache);
+            pthread_mutex_unlock(&cache->lock);
+            return; // a cache that could not be allocated only misses
+        }
+    }
+    ParentSlot * parentSlot = &cache->byCluster[cluster % DCACHE_SLOTS];
+    parentSlot->valid = True;
+    parentSlot->cluster = cluster;
+    parentSlot->parentCluster = parentCluster;
+    extractNameToBuffer(rawName, parentSlot->name);
+
+    ChildSlot * childSlot = &cache->byName[childHash(parentCluster, rawName)];
+    childSlot->valid = True;
+    childSlot->parentCluster = parentCluster;
+    memcpy(childSlot->rawName, rawName, FILE_AND_EXT_RAW_LENGTH);
+    childSlot->cluster = cluster;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void dcacheInvalidate(Volume * vol, uint32_t parentCluster, const uint8_t * rawName, uint32_t cluster) {
+    DentryCache * cache = vol->dcache;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->byCluster) {
+        ParentSlot * parentSlot = &cache->byCluster[cluster % DCACHE_SLOTS];
+        if (parentSlot->cluster == cluster) parentSlot->valid = False;
+        ChildSlot * childSlot = &cache->byName[childHash(parentCluster, rawName)];
+        if (childSlot->parentCluster == parentCluster && memcmp(childSlot->rawName, rawName, FILE_AND_EXT_RAW_LENGTH) == 0) childSlot->valid = False;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void dcacheInvalidateAll(Volume * vol) {
+    DentryCache * cache = vol->dcache;
+    pthread_mutex_lock(&cache->lock);
+    dropTables(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void dcacheGetStats(Volume * vol, uint64_t * hitCount, uint64_t * missCount) {
+    DentryCache * cache = vol->dcache;
+    pthread_mutex_lock(&cache->lock);
+    *hitCount = cache->hits;
+    *missCount = cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void dcacheResetStats(Volume * vol) {
+    DentryCache * cache = vol->dcache;
+    pthread_mutex_lock(&cache->lock);
+    cache->hits = cache->misses = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,298 @@
+#include "dirindex.h"
+#include "fatcache.h"
+#include "volume.h"
+#include "dirscan.h"
+
+// Indexes of recently used directories, found by their first cluster and evicted in LRU order.
+// The table is shared by the commands that run at the same time and kept under its lock; the
+// content of an index belongs to whoever holds the lock of its directory, so an index is only
+// evicted when that lock is free.
+#define INDEX_BUCKETS 256
+
+struct DirIndexTable {
+    pthread_mutex_t lock;
+    DirIndex * buckets[INDEX_BUCKETS];
+    DirIndex * lruHead; // most recently used
+    DirIndex * lruTail;
+    uint32_t residentIndexes;
+};
+
+DirIndexTable * createDirIndexTable(void) {
+    DirIndexTable * table = calloc(1, sizeof(DirIndexTable));
+    if (table && pthread_mutex_init(&table->lock, NULL) != 0) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+// The indexes are dropped when the volume is unmounted
+void destroyDirIndexTable(DirIndexTable * table) {
+    if (!table) return;
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+static uint32_t hashRawName(const uint8_t * rawName) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < FILE_AND_EXT_RAW_LENGTH; ++i) {
+        hash ^= rawName[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void unlinkFromLRU(Volume * vol, DirIndex * index) {
+    DirIndexTable * table = vol->dirIndexes;
+    if (index->lruPrev) index->lruPrev->lruNext = index->lruNext;
+    else table->lruHead = index->lruNext;
+    if (index->lruNext) index->lruNext->lruPrev = index->lruPrev;
+    else table->lruTail = index->lruPrev;
+    index->lruPrev = index->lruNext = NULL;
+}
+
+static void pushToLRUHead(Volume * vol, DirIndex * index) {
+    DirIndexTable * table = vol->dirIndexes;
+    index->lruNext = table->lruHead;
+    index->lruPrev = NULL;
+    if (table->lruHead) table->lruHead->lruPrev = index;
+    table->lruHead = index;
+    if (!table->lruTail) table->lruTail = index;
+}
+
+static void destroyDirIndex(Volume * vol, DirIndex * index) {
+    DirIndexTable * table = vol->dirIndexes;
+    DirIndex ** link = &table->buckets[index->cluster % INDEX_BUCKETS];
+    while (*link && *link != index) link = &(*link)->bucketNext;
+    if (*link) *link = index->bucketNext;
+    unlinkFromLRU(vol, index);
+    free(index->entries);
+    free(index->deletedSlots);
+    free(index);
+    --table->residentIndexes;
+}
+
+static boolean growTable(DirIndex * index) {
+    uint32_t newCapacity = index->capacity ? index->capacity * 2 : 64;
+    DirIndexEntry * table = calloc(newCapacity, sizeof(DirIndexEntry));
+    if (!table) return False;
+    for (uint32_t i = 0; i < index->capacity; ++i) {
+        if (!index->entries[i].used) continue;
+        uint32_t pos = hashRawName(index->entries[i].name) & (newCapacity - 1);
+        while (table[pos].used) pos = (pos + 1) & (newCapacity - 1);
+        table[pos] = index->entries[i];
+    }
+    free(index->entries);
+    index->entries = table;
+    index->capacity = newCapacity;
+    return True;
+}
+
+static boolean addEntry(DirIndex * index, const uint8_t * rawName, uint8_t attributes, uint32_t slot, uint32_t firstCluster) {
+    // I keep the load factor under 1/2 so that probe sequences stay short
+    if ((index->count + 1) * 2 > index->capacity && !growTable(index)) return False;
+    uint32_t pos = hashRawName(rawName) & (index->capacity - 1);
+    while (index->entries[pos].used) {
+        if (memcmp(index->entries[pos].name, rawName, FILE_AND_EXT_RAW_LENGTH) == 0) break;
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+    if (!index->entries[pos].used) ++index->count;
+    DirIndexEntry * entry = &index->entries[pos];
+    memcpy(entry->name, rawName, FILE_AND_EXT_RAW_LENGTH);
+    entry->attributes = attributes;
+    entry->used = True;
+    entry->slot = slot;
+    entry->firstCluster = firstCluster;
+    return True;
+}
+
+static boolean pushDeletedSlot(DirIndex * index, uint32_t slot) {
+    if (index->nDeleted == index->deletedCapacity) {
+        uint32_t newCapacity = index->deletedCapacity ? index->deletedCapacity * 2 : 16;
+        uint32_t * grown = realloc(index->deletedSlots, newCapacity * sizeof(uint32_t));
+        if (!grown) return False;
+        index->deletedSlots = grown;
+        index->deletedCapacity = newCapacity;
+    }
+    index->deletedSlots[index->nDeleted++] = slot;
+    return True;
+}
+
+static DirIndex * buildDirIndex(Volume * vol, uint32_t dirCluster) {
+    DirIndexTable * table = vol->dirIndexes;
+    DirectoryView view;
+    if (openDirectoryView(vol, dirCluster, &view) == Failure) return NULL;
+
+    DirIndex * index = calloc(1, sizeof(DirIndex));
+    if (!index) {
+        closeDirectoryView(&view);
+        return NULL;
+    }
+    index->cluster = dirCluster;
+    index->nClusters = view.nClusters;
+    index->lastCluster = view.chain[view.nClusters - 1];
+    index->endSlot = view.nClusters * ENTRIES_PER_CLUSTER(vol);
+
+    boolean ok = True;
+    EntryMasks masks;
+    for (uint32_t base = 0; ok && scanDirectoryBlock(&view, base, &masks); base += SCAN_BLOCK_ENTRIES) {
+        for (uint64_t bits = masks.used; ok && bits; bits &= bits - 1) {
+            uint32_t slot = base + lowestBit(bits);
+            const uint8_t * entry = directoryEntry(&view, slot);
+            ok = addEntry(index, entry, entry[11], slot, entryFirstCluster(entry));
+        }
+        for (uint64_t bits = masks.deleted; ok && bits; bits &= bits - 1) ok = pushDeletedSlot(index, base + lowestBit(bits));
+        if (masks.end < masks.count) {
+            index->endSlot = base + masks.end;
+            break;
+        }
+    }
+    // The deleted slots were pushed in ascending order; reversed, the lowest one is reused first
+    for (uint32_t i = 0; ok && i < index->nDeleted / 2; ++i) {
+        uint32_t slot = index->deletedSlots[i];
+        index->deletedSlots[i] = index->deletedSlots[index->nDeleted - 1 - i];
+        index->deletedSlots[index->nDeleted - 1 - i] = slot;
+    }
+    closeDirectoryView(&view);
+    if (!ok) {
+        reportMessage("Failed to allocate memory for the index of directory %u\n", dirCluster);
+        free(index->entries);
+        free(index->deletedSlots);
+        free(index);
+        return NULL;
+    }
+
+    if (table->residentIndexes >= MAX_RESIDENT_DIR_INDEXES) {
+        DirIndex * victim = table->lruTail;
+        while (victim && !tryLockDirectory(vol, victim->cluster)) victim = victim->lruPrev;
+        if (victim) {
+            uint32_t victimCluster = victim->cluster;
+            destroyDirIndex(vol, victim);
+            unlockDirectory(vol, victimCluster);
+        }
+    }
+    index->bucketNext = table->buckets[dirCluster % INDEX_BUCKETS];
+    table->buckets[dirCluster % INDEX_BUCKETS] = index;
+    pushToLRUHead(vol, index);
+    ++table->residentIndexes;
+    return index;
+}
+
+static DirIndex * findResidentIndex(Volume * vol, uint32_t dirCluster) {
+    DirIndexTable * table = vol->dirIndexes;
+    for (DirIndex * index = table->buckets[dirCluster % INDEX_BUCKETS]; index; index = index->bucketNext)
+        if (index->cluster == dirCluster) return index;
+    return NULL;
+}
+
+// The caller holds the lock of the directory for as long as it uses the index
+DirIndex * getDirIndex(Volume * vol, uint32_t dirCluster) {
+    DirIndexTable * table = vol->dirIndexes;
+    pthread_mutex_lock(&table->lock);
+    DirIndex * index = findResidentIndex(vol, dirCluster);
+    if (index) {
+        unlinkFromLRU(vol, index);
+        pushToLRUHead(vol, index);
+    } else index = buildDirIndex(vol, dirCluster);
+    pthread_mutex_unlock(&table->lock);
+    return index;
+}
+
+const DirIndexEntry * lookupDirIndex(DirIndex * index, const uint8_t * rawName) {
+    if (!index || index->count == 0) return NULL;
+    uint32_t pos = hashRawName(rawName) & (index->capacity - 1);
+    while (index->entries[pos].used) {
+        if (memcmp(index->entries[pos].name, rawName, FILE_AND_EXT_RAW_LENGTH) == 0) return &index->entries[pos];
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+    return NULL;
+}
+
+int peekFreeSlot(Volume * vol, DirIndex * index) {
+    if (!index) return -1;
+    if (index->nDeleted) return (int)index->deletedSlots[index->nDeleted - 1];
+    if (index->endSlot < index->nClusters * ENTRIES_PER_CLUSTER(vol)) return (int)index->endSlot;
+    return -1; // the chain has to grow first
+}
+
+success insertIntoDirIndex(Volume * vol, uint32_t dirCluster, const uint8_t * rawName, uint8_t attributes, uint32_t slot, uint32_t firstCluster) {
+    DirIndexTable * table = vol->dirIndexes;
+    success ret = Success;
+    pthread_mutex_lock(&table->lock);
+    DirIndex * index = findResidentIndex(vol, dirCluster); // if it is not, it will be built from disk on next access
+    if (index && index->nDeleted && index->deletedSlots[index->nDeleted - 1] == slot) --index->nDeleted;
+    else if (index && slot == index->endSlot) ++index->endSlot;
+    else if (index) {
+        destroyDirIndex(vol, index); // unexpected slot, I rebuild from disk next time
+        index = NULL;
+    }
+    if (index && !addEntry(index, rawName, attributes, slot, firstCluster)) {
+        destroyDirIndex(vol, index);
+        ret = Failure;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return ret;
+}
+
+void updateDirIndexCluster(Volume * vol, uint32_t dirCluster, const uint8_t * rawName, uint32_t firstCluster) {
+    DirIndexTable * table = vol->dirIndexes;
+    pthread_mutex_lock(&table->lock);
+    DirIndexEntry * entry = (DirIndexEntry *)lookupDirIndex(findResidentIndex(vol, dirCluster), rawName);
+    if (entry) entry->firstCluster = firstCluster;
+    pthread_mutex_unlock(&table->lock);
+}
+
+// Backward-shift deletion: the entries after the hole that may live there move up, so that
+// every probe sequence stays unbroken without tombstones
+static void deleteIndexEntry(Volume * vol, DirIndex * index, const uint8_t * rawName) {
+    uint32_t mask = index->capacity - 1;
+    uint32_t pos = hashRawName(rawName) & mask;
+    while (index->entries[pos].used && memcmp(index->entries[pos].name, rawName, FILE_AND_EXT_RAW_LENGTH) != 0) pos = (pos + 1) & mask;
+    if (!index->entries[pos].used) return;
+    uint32_t slot = index->entries[pos].slot;
+    uint32_t hole = pos;
+    for (uint32_t next = (hole + 1) & mask; index->entries[next].used; next = (next + 1) & mask) {
+        uint32_t home = hashRawName(index->entries[next].name) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            index->entries[hole] = index->entries[next];
+            hole = next;
+        }
+    }
+    index->entries[hole].used = False;
+    --index->count;
+    if (!pushDeletedSlot(index, slot)) destroyDirIndex(vol, index);
+}
+
+void removeFromDirIndex(Volume * vol, uint32_t dirCluster, const uint8_t * rawName) {
+    DirIndexTable * table = vol->dirIndexes;
+    pthread_mutex_lock(&table->lock);
+    DirIndex * index = findResidentIndex(vol, dirCluster);
+    if (index && index->count) deleteIndexEntry(vol, index, rawName);
+    pthread_mutex_unlock(&table->lock);
+}
+
+void noteDirectoryExtended(Volume * vol, uint32_t dirCluster, uint32_t newCluster) {
+    DirIndexTable * table = vol->dirIndexes;
+    pthread_mutex_lock(&table->lock);
+    DirIndex * index = findResidentIndex(vol, dirCluster);
+    if (index) {
+        ++index->nClusters;
+        index->lastCluster = newCluster;
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+void invalidateDirIndex(Volume * vol, uint32_t dirCluster) {
+    DirIndexTable * table = vol->dirIndexes;
+    pthread_mutex_lock(&table->lock);
+    DirIndex * index = findResidentIndex(vol, dirCluster);
+    if (index) destroyDirIndex(vol, index);
+    pthread_mutex_unlock(&table->lock);
+}
+
+void invalidateAllDirIndexes(Volume * vol) {
+    DirIndexTable * table = vol->dirIndexes;
+    pthread_mutex_lock(&table->lock);
+    while (table->lruHead) destroyDirIndex(vol, table->lruHead);
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,189 @@
+#include "dirscan.h"
+
+#include <pthread.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Only the first byte and the attribute byte of an entry tell what it is. The vector kernels
+// gather those two bytes of 16 entries (32 with AVX2) into one register each and classify them
+// all with a handful of compares, so that a block of a directory costs no branch per entry.
+// A cluster always holds a multiple of 16 entries, which the kernels rely on. The kernel is
+// chosen once, from what cpuid reports.
+
+// Per-entry predicates of a contiguous run of entries, before the end of the directory is applied
+typedef struct {
+    uint64_t zero;
+    uint64_t deleted;
+    uint64_t longName;
+    uint64_t directory;
+} RawMasks;
+
+typedef void (* ScanKernel)(const uint8_t * entries, uint32_t count, RawMasks * raw);
+
+static void scanScalar(const uint8_t * entries, uint32_t count, RawMasks * raw) {
+    memset(raw, 0, sizeof(RawMasks));
+    for (uint32_t i = 0; i < count; ++i, entries += ENTRY_SIZE) {
+        uint64_t bit = (uint64_t)1 << i;
+        if (entries[0] == 0x00) raw->zero |= bit;
+        if (entries[0] == 0xE5) raw->deleted |= bit;
+        if ((entries[11] & 0x0F) == 0x0F) raw->longName |= bit;
+        if (entries[11] & 0x10) raw->directory |= bit;
+    }
+}
+
+#ifdef SCAN_X86
+// The dwords holding bytes 0-3 and 8-11 of four entries are interleaved into one register each,
+// and bytes 0 and 11 of the 16 entries are then packed down in order
+static inline void gatherSSE2(const uint8_t * entries, __m128i * first, __m128i * attributes) {
+    __m128i low[4], high[4];
+    for (int g = 0; g < 4; ++g) {
+        const uint8_t * e = entries + g * 4 * ENTRY_SIZE;
+        __m128i e0 = _mm_loadu_si128((const __m128i *)e);
+        __m128i e1 = _mm_loadu_si128((const __m128i *)(e + ENTRY_SIZE));
+        __m128i e2 = _mm_loadu_si128((const __m128i *)(e + 2 * ENTRY_SIZE));
+        __m128i e3 = _mm_loadu_si128((const __m128i *)(e + 3 * ENTRY_SIZE));
+        low[g] = _mm_unpacklo_epi64(_mm_unpacklo_epi32(e0, e1), _mm_unpacklo_epi32(e2, e3));
+        high[g] = _mm_unpacklo_epi64(_mm_unpackhi_epi32(e0, e1), _mm_unpackhi_epi32(e2, e3));
+    }
+    const __m128i lowByte = _mm_set1_epi32(0xFF);
+    for (int g = 0; g < 4; ++g) {
+        low[g] = _mm_and_si128(low[g], lowByte);
+        high[g] = _mm_srli_epi32(high[g], 24);
+    }
+    *first = _mm_packus_epi16(_mm_packs_epi32(low[0], low[1]), _mm_packs_epi32(low[2], low[3]));
+    *attributes = _mm_packus_epi16(_mm_packs_epi32(high[0], high[1]), _mm_packs_epi32(high[2], high[3]));
+}
+
+static void scanSSE2(const uint8_t * entries, uint32_t count, RawMasks * raw) {
+    memset(raw, 0, sizeof(RawMasks));
+    const __m128i zero = _mm_setzero_si128(), deleted = _mm_set1_epi8((char)0xE5);
+    const __m128i longName = _mm_set1_epi8(0x0F), directory = _mm_set1_epi8(0x10);
+    for (uint32_t i = 0; i < count; i += 16) {
+        __m128i first, attributes;
+        gatherSSE2(entries + i * ENTRY_SIZE, &first, &attributes);
+        raw->zero |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(first, zero)) << i;
+        raw->deleted |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(first, deleted)) << i;
+        raw->longName |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(attributes, longName), longName)) << i;
+        raw->directory |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(attributes, directory), directory)) << i;
+    }
+}
+
+// AVX2 shuffles and packs within 128-bit lanes, so the low lane works on 16 entries as SSE2 does
+// and the high lane on the 16 after them
+__attribute__((target("avx2")))
+static inline __m256i loadPair(const uint8_t * low, const uint8_t * high) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)low)),
+        _mm_loadu_si128((const __m128i *)high), 1);
+}
+
+__attribute__((target("avx2")))
+static void scanAVX2(const uint8_t * entries, uint32_t count, RawMasks * raw) {
+    memset(raw, 0, sizeof(RawMasks));
+    const __m256i zero = _mm256_setzero_si256(), deleted = _mm256_set1_epi8((char)0xE5);
+    const __m256i longName = _mm256_set1_epi8(0x0F), directory = _mm256_set1_epi8(0x10);
+    const __m256i lowByte = _mm256_set1_epi32(0xFF);
+    uint32_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i low[4], high[4];
+        for (int g = 0; g < 4; ++g) {
+            const uint8_t * e = entries + (i + g * 4) * ENTRY_SIZE;
+            const uint32_t half = 16 * ENTRY_SIZE;
+            __m256i e0 = loadPair(e, e + half);
+            __m256i e1 = loadPair(e + ENTRY_SIZE, e + ENTRY_SIZE + half);
+            __m256i e2 = loadPair(e + 2 * ENTRY_SIZE, e + 2 * ENTRY_SIZE + half);
+            __m256i e3 = loadPair(e + 3 * ENTRY_SIZE, e + 3 * ENTRY_SIZE + half);
+            low[g] = _mm256_and_si256(_mm256_unpacklo_epi64(_mm256_unpacklo_epi32(e0, e1), _mm256_unpacklo_epi32(e2, e3)), lowByte);
+            high[g] = _mm256_srli_epi32(_mm256_unpacklo_epi64(_mm256_unpackhi_epi32(e0, e1), _mm256_unpackhi_epi32(e2, e3)), 24);
+        }
+        __m256i first = _mm256_packus_epi16(_mm256_packs_epi32(low[0], low[1]), _mm256_packs_epi32(low[2], low[3]));
+        __m256i attributes = _mm256_packus_epi16(_mm256_packs_epi32(high[0], high[1]), _mm256_packs_epi32(high[2], high[3]));
+        raw->zero |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(first, zero)) << i;
+        raw->deleted |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(first, deleted)) << i;
+        raw->longName |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(attributes, longName), longName)) << i;
+        raw->directory |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(attributes, directory), directory)) << i;
+    }
+    if (i < count) {
+        RawMasks rest;
+        scanSSE2(entries + i * ENTRY_SIZE, count - i, &rest);
+        raw->zero |= rest.zero << i;
+        raw->deleted |= rest.deleted << i;
+        raw->longName |= rest.longName << i;
+        raw->directory |= rest.directory << i;
+    }
+}
+#endif
+
+static ScanKernel kernel = scanScalar;
+static const char * kernelName = "scalar";
+static pthread_once_t kernelChosen = PTHREAD_ONCE_INIT;
+
+static boolean selectKernel(const char * name) {
+    if (strcmp(name, "scalar") == 0) {
+        kernel = scanScalar;
+        kernelName = "scalar";
+        return True;
+    }
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        kernel = scanAVX2;
+        kernelName = "avx2";
+        return True;
+    }
+    if (strcmp(name, "sse2") == 0) {
+        kernel = scanSSE2; // part of x86-64
+        kernelName = "sse2";
+        return True;
+    }
+#endif
+    return False;
+}
+
+static void chooseKernel(void) {
+    const char * forced = getenv(SCAN_KERNEL_ENV);
+    if (forced && selectKernel(forced)) return;
+    if (!selectKernel("avx2")) selectKernel("sse2");
+}
+
+// For the tests, before any other thread scans: False when the CPU has no kernel of that name
+boolean useScanKernel(const char * name) {
+    pthread_once(&kernelChosen, chooseKernel);
+    return selectKernel(name);
+}
+
+const char * scanKernelName(void) {
+    pthread_once(&kernelChosen, chooseKernel);
+    return kernelName;
+}
+
+// A block runs over several clusters when they hold fewer than SCAN_BLOCK_ENTRIES entries each
+boolean scanDirectoryBlock(const DirectoryView * view, uint32_t firstSlot, EntryMasks * masks) {
+    uint32_t nSlots = view->nClusters * view->entriesPerCluster;
+    if (firstSlot >= nSlots) return False;
+    pthread_once(&kernelChosen, chooseKernel);
+    uint32_t count = nSlots - firstSlot < SCAN_BLOCK_ENTRIES ? nSlots - firstSlot : SCAN_BLOCK_ENTRIES;
+    RawMasks raw = { 0, 0, 0, 0 };
+    for (uint32_t done = 0; done < count;) {
+        uint32_t slot = firstSlot + done;
+        uint32_t piece = view->entriesPerCluster - slot % view->entriesPerCluster;
+        if (piece > count - done) piece = count - done;
+        RawMasks part;
+        kernel(directoryEntry(view, slot), piece, &part);
+        raw.zero |= part.zero << done;
+        raw.deleted |= part.deleted << done;
+        raw.longName |= part.longName << done;
+        raw.directory |= part.directory << done;
+        done += piece;
+    }
+    masks->count = count;
+    masks->end = raw.zero ? lowestBit(raw.zero) : count;
+    uint64_t valid = masks->end == 64 ? ~(uint64_t)0 : ((uint64_t)1 << masks->end) - 1;
+    masks->deleted = raw.deleted & valid;
+    masks->used = ~raw.deleted & valid;
+    masks->longName = raw.longName & masks->used;
+    masks->directory = raw.directory & ~raw.longName & masks->used;
+    return True;
+}
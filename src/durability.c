@@ -0,0 +1,206 @@
+#include "durability.h"
+#include "fat32.h"
+#include "journal.h"
+#include "blockdev.h"
+#include "volume.h"
+
+#include <pthread.h>
+#include <time.h>
+
+// In interval mode the flusher thread of the volume takes the lock of the volume exclusively, as
+// the commands that cannot share it do, so a periodic flush happens between commands and commits
+// what the commands before it changed, as a batch does when its group is full.
+// Only the flusher flushes. It sleeps on a timer lock of its own, and once the interval is over it
+// raises flushWanted before it asks for the lock of the volume: lockEngine() and lockEngineShared()
+// then wait for the flush instead of starting another command, so busy clients cannot keep the
+// flusher waiting.
+// With the journal, making a commit durable costs one fdatasync() of the appended records; the
+// sectors themselves reach their place at the next checkpoint, behind barriers of their own.
+struct Durability {
+    SyncMode mode;
+    uint32_t intervalMs;
+    boolean unpersisted;          // something was committed since the last fdatasync()
+    struct timespec lastPersist;  // CLOCK_MONOTONIC
+    pthread_mutex_t timerLock;    // the flusher sleeps on it, not on the lock of the volume
+    pthread_cond_t wakeFlusher;   // waited on with timerLock
+    pthread_cond_t flushDone;     // waited on with timerLock while flushWanted is set
+    boolean flushWanted;          // the flusher is waiting for the lock of the volume, set under timerLock
+    pthread_t flusher;
+    boolean flusherRunning;
+    boolean stopRequested;        // under timerLock
+};
+
+Durability * createDurability(void) {
+    Durability * dur = calloc(1, sizeof(Durability));
+    if (!dur) return NULL;
+    if (pthread_mutex_init(&dur->timerLock, NULL) != 0) {
+        free(dur);
+        return NULL;
+    }
+    if (pthread_cond_init(&dur->wakeFlusher, NULL) != 0) {
+        pthread_mutex_destroy(&dur->timerLock);
+        free(dur);
+        return NULL;
+    }
+    if (pthread_cond_init(&dur->flushDone, NULL) != 0) {
+        pthread_cond_destroy(&dur->wakeFlusher);
+        pthread_mutex_destroy(&dur->timerLock);
+        free(dur);
+        return NULL;
+    }
+    dur->mode = syncNone;
+    return dur;
+}
+
+void destroyDurability(Durability * dur) {
+    if (!dur) return;
+    pthread_cond_destroy(&dur->flushDone);
+    pthread_cond_destroy(&dur->wakeFlusher);
+    pthread_mutex_destroy(&dur->timerLock);
+    free(dur);
+}
+
+boolean parseSyncPolicy(Volume * vol, const char * text) {
+    Durability * dur = vol->durability;
+    if (strcmp(text, "none") == 0) {
+        dur->mode = syncNone;
+        return True;
+    }
+    if (strcmp(text, "command") == 0) {
+        dur->mode = syncCommand;
+        return True;
+    }
+    if (strncmp(text, "interval:", 9) != 0) return False;
+    char * end;
+    unsigned long ms = strtoul(text + 9, &end, 10);
+    if (text[9] == '\0' || *end != '\0' || ms == 0 || ms > MAX_SYNC_INTERVAL_MS) return False;
+    dur->mode = syncInterval;
+    dur->intervalMs = (uint32_t)ms;
+    return True;
+}
+
+SyncMode getSyncMode(Volume * vol) {
+    return vol->durability->mode;
+}
+
+// Whatever was written before must be on the disk before whatever is written after:
+// the journal relies on this between its records, their checkpoint and the empty mark
+success durableBarrier(Volume * vol) {
+    return vol->durability->mode == syncNone ? flushVolume(vol->device) : persistVolume(vol->device);
+}
+
+void noteCommit(Volume * vol) {
+    vol->durability->unpersisted = True;
+}
+
+// Changes are still in the caches when nothing has been committed since they were made
+static boolean hasUnpersistedChanges(Volume * vol) {
+    return vol->durability->unpersisted || (vol->isFormatted == formatted && pendingJournalSectors(vol) > 0);
+}
+
+// Pending changes are committed first; without the journal the committed directory sectors
+// are still in the sector cache, so they are written in place before the device is synced
+success persistChanges(Volume * vol) {
+    Durability * dur = vol->durability;
+    if (!vol->device) return Failure;
+    if (isJournalActive(vol)) {
+        if (vol->isFormatted == formatted && commitMetadata(vol) == Failure) return Failure;
+    } else if (syncVolume(vol) == Failure) {
+        return Failure;
+    }
+    if (persistVolume(vol->device) == Failure) return Failure;
+    dur->unpersisted = False;
+    clock_gettime(CLOCK_MONOTONIC, &dur->lastPersist);
+    return Success;
+}
+
+static boolean isFlushDue(Volume * vol) {
+    Durability * dur = vol->durability;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsedMs = (uint64_t)(now.tv_sec - dur->lastPersist.tv_sec) * 1000 + (now.tv_nsec - dur->lastPersist.tv_nsec) / 1000000;
+    return elapsedMs >= dur->intervalMs && hasUnpersistedChanges(vol);
+}
+
+success persistAfterCommand(Volume * vol) {
+    Durability * dur = vol->durability;
+    if (dur->mode != syncCommand || !hasUnpersistedChanges(vol)) return Success;
+    return persistChanges(vol);
+}
+
+static void * flushPeriodically(void * argument) {
+    Volume * vol = argument;
+    Durability * dur = vol->durability;
+    pthread_mutex_lock(&dur->timerLock);
+    while (!dur->stopRequested) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += dur->intervalMs / 1000;
+        deadline.tv_nsec += (long)(dur->intervalMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!dur->stopRequested && pthread_cond_timedwait(&dur->wakeFlusher, &dur->timerLock, &deadline) == 0) {}
+        if (dur->stopRequested) break;
+        // The commands in progress delay the flush until they are done, the next ones wait for it
+        __atomic_store_n(&dur->flushWanted, True, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&dur->timerLock);
+        pthread_rwlock_wrlock(&vol->lock);
+        if (isFlushDue(vol) && persistChanges(vol) == Failure) reportMessage("Background flush of the volume failed\n");
+        pthread_rwlock_unlock(&vol->lock);
+        pthread_mutex_lock(&dur->timerLock);
+        __atomic_store_n(&dur->flushWanted, False, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&dur->flushDone);
+    }
+    pthread_mutex_unlock(&dur->timerLock);
+    return NULL;
+}
+
+success startFlusher(Volume * vol) {
+    Durability * dur = vol->durability;
+    if (dur->mode != syncInterval || dur->flusherRunning) return Success;
+    dur->stopRequested = False;
+    clock_gettime(CLOCK_MONOTONIC, &dur->lastPersist);
+    if (pthread_create(&dur->flusher, NULL, flushPeriodically, vol) != 0) {
+        reportMessage("Failed to start the background flusher\n");
+        return Failure;
+    }
+    dur->flusherRunning = True;
+    return Success;
+}
+
+void stopFlusher(Volume * vol) {
+    Durability * dur = vol->durability;
+    if (!dur->flusherRunning) return;
+    pthread_mutex_lock(&dur->timerLock);
+    dur->stopRequested = True;
+    pthread_cond_signal(&dur->wakeFlusher);
+    pthread_mutex_unlock(&dur->timerLock);
+    pthread_join(dur->flusher, NULL);
+    dur->flusherRunning = False;
+}
+
+// A busy emulator takes the lock back right away: when the flusher is waiting for it, the command
+// lets it go first
+static void waitForFlusher(Volume * vol) {
+    Durability * dur = vol->durability;
+    if (!__atomic_load_n(&dur->flushWanted, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&dur->timerLock);
+    while (__atomic_load_n(&dur->flushWanted, __ATOMIC_ACQUIRE)) pthread_cond_wait(&dur->flushDone, &dur->timerLock);
+    pthread_mutex_unlock(&dur->timerLock);
+}
+
+void lockEngine(Volume * vol) {
+    waitForFlusher(vol);
+    pthread_rwlock_wrlock(&vol->lock);
+}
+
+void lockEngineShared(Volume * vol) {
+    waitForFlusher(vol);
+    pthread_rwlock_rdlock(&vol->lock);
+}
+
+void unlockEngine(Volume * vol) {
+    pthread_rwlock_unlock(&vol->lock);
+}
@@ -1,159 +1,522 @@
 #include "emulator.h"
 #include "fat32.h"
 #include "format.h"
+#include "allocator.h"
+#include "fatcache.h"
+#include "dcache.h"
+#include "bufcache.h"
+#include "blockdev.h"
+#include "file.h"
+#include "hostcopy.h"
+#include "fsck.h"
+#include "stats.h"
+#include "journal.h"
+#include "durability.h"
+#include "mktree.h"
+#include "rmtree.h"
+#include "move.h"
+#include "volume.h"
+
+#include <fcntl.h>
+#include <time.h>
 
 static char * username;
-static char location[LOCATION_MAX_LENGTH] = "/";
-FAT32Node currentNode;
-int currentCluster = ROOT_CLUSTER;
-extern char localFilesAndFolders[SECTOR_SIZE / FAT_ENTRY_SIZE][FULL_FILE_STRING_SIZE];
-extern IsFormatted isFormatted;
-
-static void printPrompt(void) {
-    buildPathToRoot(currentCluster, location);
+static boolean batchMode = False;
+
+// How a command holds the volume: alone, or shared with the commands of other clients of the
+// server while it reads or changes the entries of a single folder
+typedef enum { holdsVolume, readsDirectory, changesDirectory } CommandScope;
+
+static void printPrompt(Volume * vol, uint32_t cluster) {
+    char location[LOCATION_MAX_LENGTH];
+    buildPathToRoot(vol, cluster, location);
     printf("%s@xkubpise %s> ", username, location);
 }
 
 static void notFormattedMessage(void) {
-    puts("The volume is pre-initialized but not fully formatted.\nYou can use the emulator to format it now (command \"format\")");
+    reportLine("The volume is pre-initialized but not fully formatted.\nYou can use the emulator to format it now (command \"format\")");
 }
 
-void emulate(void) {
-    username = getenv("USER");
+static double secondsSince(const struct timespec * start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void reportTransfer(const char * verb, const char * name, uint64_t bytes, double seconds) {
+    reportMessage("%s %s: %llu byte(s) in %.3f s (%.1f MB/s, %s)\n", verb, name, (unsigned long long)bytes, seconds,
+        seconds > 0 ? bytes / seconds / 1e6 : 0.0, hostCopyMethodName(lastHostCopyMethod()));
+}
+
+// I run one command from the folder at "cluster", which cd moves; "toTerminal" lays a listing out
+// in columns. Every folder a shared command works in is locked while it is read or changed.
+static CommandResult runCommand(Volume * vol, char * input, uint32_t * cluster, boolean toTerminal) {
     struct winsize w;
     uint32_t newCluster;
-    char input[INPUT_MAX_LENGTH];
-    boolean inDir = False;
-    int nInDir = 0;
     char lowerCaseName[FULL_FILE_STRING_SIZE];
     char * argument;
     char * pathArg;
-    while(True) {
-        argument = NULL;
-        printPrompt();
-        fgets(input, sizeof(input), stdin);
-        argument = strtok(input, " \n");
-        if (argument) {
-            if (strcmp(argument, "exit") == 0) {
-                puts("Emulation shuts down...");
-                return;
-            } else if (strcmp(argument, "quit") == 0) {
-                puts("Emulation shuts down...");
-                return;
-            } else if (strcmp(argument, "q") == 0) {
-                puts("Emulation shuts down...");
-                return;
-            } else if (strcmp(argument, "format") == 0) {
-                if (format() == Failure) {
-                    puts("\nFAT32 volume formatting failed\n");
-                    continue;
-                } else {
-                    puts("\nPre-initialized FAT32 volume successfully formatted\n");
-                    isFormatted = formatted;
-                    currentCluster = ROOT_CLUSTER;
-                    strcpy(location, "/");
-                    puts("You can now use the emulator with the following commands:\n"
-                        "pwd - print current working directory\n"
-                        "ls (<directory>) or dir (<directory>) - list files and folders in the current or indicated directory\n"
-                        "cd <directory> - change directory to <directory>\n"
-                        "mkdir <folder_name> - create a new folder named <folder_name>\n"
-                        "touch <file_name> - create a new file named <file_name>\n"
-                        "exit, quit, q - exit the emulator");
-                }
-            } else if (strcmp(argument, "pwd") == 0) {
-                if (!isFormatted) { notFormattedMessage(); continue; }
-                buildPathToRoot(currentCluster, location);
-                printf(" %s\n", location);
-            } else if (strcmp(argument, "ls") == 0 || strcmp(argument, "dir") == 0) {
-                if (!isFormatted) { notFormattedMessage(); continue; }
-                pathArg = strtok(NULL, " \n");
-                if (pathArg != NULL) {
-                    newCluster = findClusterByFullPath(pathArg, currentCluster);
-                    if (newCluster == 0) continue;
-                } else newCluster = currentCluster;
-
-                int nInDir = collectNamesInCluster(newCluster);
-                if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) {
-                    for (int i = 0; i < nInDir; ++i) {
-                        toLowerRegister(localFilesAndFolders[i], lowerCaseName);
-                        if(i % (w.ws_col / 16) == 0 && i) puts("");
-                        printf("%16s", lowerCaseName);
-                    }
-                } else {
-                    for (int i = 0; i < nInDir; ++i) {
-                        toLowerRegister(localFilesAndFolders[i], lowerCaseName);
-                        printf("%16s", lowerCaseName);
-                    }   
-                }
-                puts("");
-            } else if (strcmp(argument, "cd") == 0) {
-                if (!isFormatted) { notFormattedMessage(); continue; }
-                pathArg = strtok(NULL, " \n");
-                uint32_t newCluster = findClusterByFullPath(pathArg, currentCluster);
-                if (newCluster == 0) continue;
-                currentCluster = newCluster;
-            } else if (strcmp(argument, "mkdir") == 0) {
-                if (!isFormatted) { notFormattedMessage(); continue; }
-                inDir = False;
-                char * newObj = strtok(NULL, " \n");
-                if (newObj == NULL) {
-                    printf("Usage: mkdir <folder_name>\n");
-                    continue;
-                }
-                newObj[FILE_NAME_MAX_LENGTH] = '\0'; // Ensure null-termination
-                if (!isValidShortNameAndUppercaseFile(newObj, itsFolder)) {
-                    printf("Invalid folder name: %s\n", newObj);
-                    continue;
-                }
-                nInDir = collectNamesInCluster(currentCluster);
-                for (int i = 0; i < nInDir; ++i) {
-                    if (strcmp(localFilesAndFolders[i], newObj) == 0) {
-                        printf("Name %s already exists in the folder\n", newObj);
-                        inDir = True;
-                        break;
-                    }
-                }
-                if (inDir) continue;
-                uint32_t newCluster = findFreeCluster();
-                if (newCluster == 0) {
-                    printf("No free clusters available to create a new folder\n");
-                    continue;
-                }
-                if (createNewObject(newObj, newCluster, currentCluster, itsFolder) == Failure) {
-                    printf("Failed to create folder %s\n", newObj);
-                    continue;
-                }
-                printf("Folder %s created successfully\n", newObj);
-            } else if (strcmp(argument, "touch") == 0) {
-                if (!isFormatted) { notFormattedMessage(); continue; }
-                inDir = False;
-                char * newObj = strtok(NULL, " \n");
-                if (newObj == NULL) {
-                    printf("Usage: touch <file_name>\n");
-                    continue;
-                }
-                newObj[FILE_AND_EXT_RAW_LENGTH + 1] = '\0';
-                if (!isValidShortNameAndUppercaseFile(newObj, itsFile)) {
-                    printf("Invalid file name: %s\n", newObj);
-                    continue;
-                }
-                nInDir = collectNamesInCluster(currentCluster);
-                for (int i = 0; i < nInDir; ++i) {
-                    if (strcmp(localFilesAndFolders[i], newObj) == 0) {
-                        printf("Name %s already exists in the folder\n", newObj);
-                        inDir = True;
-                        break;
-                    }
-                }
-                if (inDir) continue;
-                if (createNewObject(newObj, 0, currentCluster, itsFile) == Failure) {
-                    printf("Failed to create file %s\n", newObj);
-                    continue;
-                }
-                printf("File %s created successfully\n", newObj);
-            } else {
-                printf("Unknown command: %s\n", argument);
+    char * rest;
+    argument = strtok_r(input, " \t\r\n", &rest);
+    if (!argument) return commandSucceeded;
+    if (strcmp(argument, "exit") == 0 || strcmp(argument, "quit") == 0 || strcmp(argument, "q") == 0) {
+        reportLine("Emulation shuts down...");
+        return commandExit;
+    } else if (strcmp(argument, "format") == 0) {
+        // An optional argument chooses a new cluster size: format <sectors_per_cluster>
+        pathArg = strtok_r(NULL, " \t\r\n", &rest);
+        uint32_t sectorsPerCluster = pathArg ? (uint32_t)strtoul(pathArg, NULL, 10) : 0;
+        if (pathArg && sectorsPerCluster == 0) {
+            reportMessage("Usage: format (<sectors_per_cluster>)\n");
+            return commandFailed;
+        }
+        if (format(vol, sectorsPerCluster) == Failure) {
+            reportLine("\nFAT32 volume formatting failed\n");
+            return commandFailed;
+        } else {
+            reportLine("\nPre-initialized FAT32 volume successfully formatted\n");
+            vol->isFormatted = formatted;
+            *cluster = ROOT_CLUSTER;
+            leaveAllFolders(vol);
+            reportLine("You can now use the emulator with the following commands:\n"
+                "format (<sectors_per_cluster>) - format the volume again, optionally with another cluster size (1-64 sectors)\n"
+                "pwd - print current working directory\n"
+                "ls (<directory>) or dir (<directory>) - list files and folders in the current or indicated directory\n"
+                "cd <directory> - change directory to <directory>\n"
+                "mkdir <folder_name> - create a new folder named <folder_name>\n"
+                "mkdir -p <path> - create every missing folder along <path>\n"
+                "mktree <host_manifest> - create the folders listed in a host file, one path per line\n"
+                "touch <file_name> - create a new file named <file_name>\n"
+                "rm <file_name> - remove the file <file_name>\n"
+                "rm -r <name> - remove the file or folder <name> with everything in it\n"
+                "rmdir <folder_name> - remove the empty folder <folder_name>\n"
+                "mv <source> <destination> - move or rename a file or folder, into <destination> if it is a folder\n"
+                "write <file_name> <text> - replace the content of <file_name> with <text> (the file is created if needed)\n"
+                "append <file_name> <text> - add <text> at the end of <file_name>\n"
+                "cat <file_name> - print the content of <file_name>\n"
+                "import <host_path> <file_name> - copy a file of the host into <file_name>\n"
+                "export <file_name> <host_path> - copy <file_name> to a file of the host\n"
+                "sync - write all cached changes to the volume\n"
+                "dcache (reset) - show (and reset) the hit rate of the path-resolution cache\n"
+                "stats (reset) - show (and reset) I/O counters and per-command latencies\n"
+                "fsck (repair) - check that the FAT agrees with the directory tree (and repair what does not)\n"
+                "mirror (on|off|check) - show or change whether every FAT copy is kept up to date, or compare the copies\n"
+                "exit, quit, q - exit the emulator");
+        }
+    } else if (strcmp(argument, "pwd") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        char location[LOCATION_MAX_LENGTH];
+        buildPathToRoot(vol, *cluster, location);
+        reportMessage(" %s\n", location);
+    } else if (strcmp(argument, "ls") == 0 || strcmp(argument, "dir") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        pathArg = strtok_r(NULL, " \t\r\n", &rest);
+        if (pathArg != NULL) {
+            newCluster = findClusterByFullPath(vol, pathArg, *cluster);
+            if (newCluster == 0) return commandFailed;
+        } else newCluster = *cluster;
+
+        char (* names)[FULL_FILE_STRING_SIZE];
+        lockDirectory(vol, newCluster, False);
+        int nInDir = collectNamesInCluster(vol, newCluster, &names);
+        unlockDirectory(vol, newCluster);
+        if (toTerminal && ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) {
+            for (int i = 0; i < nInDir; ++i) {
+                toLowerRegister(names[i], lowerCaseName);
+                if(i % (w.ws_col / 16) == 0 && i) reportLine("");
+                reportMessage("%16s", lowerCaseName);
+            }
+        } else {
+            for (int i = 0; i < nInDir; ++i) {
+                toLowerRegister(names[i], lowerCaseName);
+                reportMessage("%16s", lowerCaseName);
+            }   
+        }
+        free(names);
+        reportLine("");
+    } else if (strcmp(argument, "cd") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        pathArg = strtok_r(NULL, " \t\r\n", &rest);
+        uint32_t newCluster = findClusterByFullPath(vol, pathArg, *cluster);
+        if (newCluster == 0) return commandFailed;
+        *cluster = newCluster;
+    } else if (strcmp(argument, "mkdir") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        char * newObj = strtok_r(NULL, " \t\r\n", &rest);
+        if (newObj == NULL) {
+            reportMessage("Usage: mkdir <folder_name> or mkdir -p <path>\n");
+            return commandFailed;
+        }
+        if (strcmp(newObj, "-p") == 0) {
+            // Every missing folder along the path is created in one pass
+            pathArg = strtok_r(NULL, " \t\r\n", &rest);
+            if (pathArg == NULL) {
+                reportMessage("Usage: mkdir -p <path>\n");
+                return commandFailed;
+            }
+            uint32_t nCreated;
+            if (makeDirectories(vol, &pathArg, 1, *cluster, &nCreated) == Failure) return commandFailed;
+            reportMessage("%u folder(s) created\n", nCreated);
+            return commandSucceeded;
+        }
+        lockDirectory(vol, *cluster, True);
+        success created = createFolderIn(vol, *cluster, newObj);
+        unlockDirectory(vol, *cluster);
+        if (created == Failure) return commandFailed;
+        reportMessage("Folder %s created successfully\n", newObj);
+    } else if (strcmp(argument, "mktree") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        char * manifestPath = strtok_r(NULL, " \t\r\n", &rest);
+        if (manifestPath == NULL) {
+            reportMessage("Usage: mktree <host_manifest>\n");
+            return commandFailed;
+        }
+        uint32_t nCreated;
+        if (makeTreeFromManifest(vol, manifestPath, *cluster, &nCreated) == Failure) return commandFailed;
+        reportMessage("%u folder(s) created from %s\n", nCreated, manifestPath);
+    } else if (strcmp(argument, "touch") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        char * newObj = strtok_r(NULL, " \t\r\n", &rest);
+        if (newObj == NULL) {
+            reportMessage("Usage: touch <file_name>\n");
+            return commandFailed;
+        }
+        lockDirectory(vol, *cluster, True);
+        success created = createFileIn(vol, *cluster, newObj);
+        unlockDirectory(vol, *cluster);
+        if (created == Failure) return commandFailed;
+        reportMessage("File %s created successfully\n", newObj);
+    } else if (strcmp(argument, "rm") == 0 || strcmp(argument, "rmdir") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        RemoveMode mode = strcmp(argument, "rmdir") == 0 ? removeEmptyFolder : removeFileOnly;
+        char * name = strtok_r(NULL, " \t\r\n", &rest);
+        if (name && mode == removeFileOnly && strcmp(name, "-r") == 0) {
+            mode = removeRecursively;
+            name = strtok_r(NULL, " \t\r\n", &rest);
+        }
+        if (name == NULL) {
+            if (mode == removeEmptyFolder) reportMessage("Usage: rmdir <folder_name>\n");
+            else reportMessage("Usage: rm <file_name> or rm -r <name>\n");
+            return commandFailed;
+        }
+        uint32_t nRemoved;
+        lockDirectory(vol, *cluster, True);
+        success removed = removeEntry(vol, *cluster, name, mode, &nRemoved);
+        unlockDirectory(vol, *cluster);
+        if (removed == Failure) return commandFailed;
+        if (mode == removeRecursively) reportMessage("%u file(s) and folder(s) removed\n", nRemoved);
+        else reportMessage("%s %s removed\n", mode == removeEmptyFolder ? "Folder" : "File", name);
+    } else if (strcmp(argument, "mv") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        char * source = strtok_r(NULL, " \t\r\n", &rest);
+        char * destination = strtok_r(NULL, " \t\r\n", &rest);
+        if (source == NULL || destination == NULL) {
+            reportMessage("Usage: mv <source> <destination>\n");
+            return commandFailed;
+        }
+        if (moveEntry(vol, source, destination, *cluster) == Failure) return commandFailed;
+    } else if (strcmp(argument, "write") == 0 || strcmp(argument, "append") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        boolean append = strcmp(argument, "append") == 0;
+        char * fileName = strtok_r(NULL, " \t\r\n", &rest);
+        if (fileName == NULL) {
+            reportMessage("Usage: %s <file_name> <text>\n", argument);
+            return commandFailed;
+        }
+        // The rest of the line is the text, written with a trailing newline like echo does
+        char * text = strtok_r(NULL, "\r\n", &rest);
+        if (!text) text = "";
+        while (*text == ' ' || *text == '\t') ++text;
+        size_t textLength = strlen(text);
+        char line[INPUT_MAX_LENGTH + 1];
+        memcpy(line, text, textLength);
+        line[textLength++] = '\n';
+        // write creates the file when it does not exist yet
+        lockDirectory(vol, *cluster, True);
+        success written = Success;
+        if (!append && !nameExistsInDirectory(vol, fileName, *cluster)) written = createFileIn(vol, *cluster, fileName);
+        if (written == Success) written = writeFile(vol, *cluster, fileName, line, (uint32_t)textLength, append);
+        unlockDirectory(vol, *cluster);
+        if (written == Failure) return commandFailed;
+    } else if (strcmp(argument, "cat") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        char * fileName = strtok_r(NULL, " \t\r\n", &rest);
+        if (fileName == NULL) {
+            reportMessage("Usage: cat <file_name>\n");
+            return commandFailed;
+        }
+        uint32_t length;
+        lockDirectory(vol, *cluster, False);
+        uint8_t * content = readFile(vol, *cluster, fileName, &length);
+        unlockDirectory(vol, *cluster);
+        if (!content) return commandFailed;
+        reportBytes(content, length);
+        if (length && content[length - 1] != '\n') reportLine("");
+        free(content);
+    } else if (strcmp(argument, "import") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        char * hostPath = strtok_r(NULL, " \t\r\n", &rest);
+        char * fileName = strtok_r(NULL, " \t\r\n", &rest);
+        if (hostPath == NULL || fileName == NULL) {
+            reportMessage("Usage: import <host_path> <file_name>\n");
+            return commandFailed;
+        }
+        int hostFd = open(hostPath, O_RDONLY);
+        struct stat info;
+        if (hostFd < 0 || fstat(hostFd, &info) != 0) {
+            reportMessage("Cannot open host file %s: %s\n", hostPath, strerror(errno));
+            if (hostFd >= 0) close(hostFd);
+            return commandFailed;
+        }
+        if ((uint64_t)info.st_size > 0xFFFFFFFF) {
+            reportMessage("Host file %s is larger than the FAT32 limit of 4 GiB\n", hostPath);
+            close(hostFd);
+            return commandFailed;
+        }
+        if (!nameExistsInDirectory(vol, fileName, *cluster) && createFileIn(vol, *cluster, fileName) == Failure) {
+            close(hostFd);
+            return commandFailed;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        success ret = importFile(vol, *cluster, fileName, hostFd, (uint64_t)info.st_size);
+        close(hostFd);
+        if (ret == Failure) return commandFailed;
+        reportTransfer("Imported", fileName, (uint64_t)info.st_size, secondsSince(&start));
+    } else if (strcmp(argument, "export") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        char * fileName = strtok_r(NULL, " \t\r\n", &rest);
+        char * hostPath = strtok_r(NULL, " \t\r\n", &rest);
+        if (fileName == NULL || hostPath == NULL) {
+            reportMessage("Usage: export <file_name> <host_path>\n");
+            return commandFailed;
+        }
+        int hostFd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (hostFd < 0) {
+            reportMessage("Cannot create host file %s: %s\n", hostPath, strerror(errno));
+            return commandFailed;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t length = 0;
+        success ret = exportFile(vol, *cluster, fileName, hostFd, &length);
+        close(hostFd);
+        if (ret == Failure) return commandFailed;
+        reportTransfer("Exported", fileName, length, secondsSince(&start));
+    } else if (strcmp(argument, "sync") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        uint32_t written = 0, checkpointed = 0;
+        if (commitMetadata(vol) == Failure || (isJournalActive(vol) && checkpointJournal(vol, &checkpointed) == Failure) ||
+            syncBufferCache(vol, &written) == Failure || flushVolume(vol->device) == Failure) {
+            reportLine("Failed to write cached changes to the volume");
+            return commandFailed;
+        }
+        reportMessage("%u cached sector(s) written to the volume\n", written + checkpointed);
+    } else if (strcmp(argument, "dcache") == 0) {
+        uint64_t hits, misses;
+        dcacheGetStats(vol, &hits, &misses);
+        reportMessage("Dentry cache: %llu hits, %llu misses (%.1f%% hit rate)\n", (unsigned long long)hits, (unsigned long long)misses,
+            hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+        pathArg = strtok_r(NULL, " \t\r\n", &rest);
+        if (pathArg && strcmp(pathArg, "reset") == 0) dcacheResetStats(vol);
+    } else if (strcmp(argument, "stats") == 0) {
+        printStats(vol);
+        pathArg = strtok_r(NULL, " \t\r\n", &rest);
+        if (pathArg && strcmp(pathArg, "reset") == 0) resetStats(vol);
+    } else if (strcmp(argument, "fsck") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        pathArg = strtok_r(NULL, " \t\r\n", &rest);
+        if (pathArg && strcmp(pathArg, "repair") != 0) {
+            reportMessage("Usage: fsck (repair)\n");
+            return commandFailed;
+        }
+        boolean repair = pathArg ? True : False;
+        FsckReport report;
+        // In a batch the commands before this one may not be committed yet, and the check looks at what is
+        if (commitMetadata(vol) == Failure || checkVolume(vol, repair, &report) == Failure) {
+            reportLine("The check could not be completed");
+            return commandFailed;
+        }
+        printFsckReport(&report, repair);
+        if (repair ? report.unrepaired : fsckProblemCount(&report)) return commandFailed;
+    } else if (strcmp(argument, "mirror") == 0) {
+        if (!vol->isFormatted) { notFormattedMessage(); return commandFailed; }
+        pathArg = strtok_r(NULL, " \t\r\n", &rest);
+        if (pathArg && (strcmp(pathArg, "on") == 0 || strcmp(pathArg, "off") == 0)) {
+            if (setFATMirroring(vol, strcmp(pathArg, "on") == 0 ? True : False) == Failure) {
+                reportLine("Failed to change FAT mirroring");
+                return commandFailed;
             }
+        } else if (pathArg && strcmp(pathArg, "check") == 0) {
+            uint32_t divergent = compareFATCopies(vol);
+            if (divergent) {
+                reportMessage("%u FAT sector(s) differ between the copies\n", divergent);
+                return vol->geometry.mirroredFATs ? commandFailed : commandSucceeded;
+            }
+            reportLine("All FAT copies are identical");
+            return commandSucceeded;
+        } else if (pathArg) {
+            reportMessage("Usage: mirror (on|off|check)\n");
+            return commandFailed;
         }
+        if (vol->geometry.mirroredFATs) reportMessage("FAT mirroring is on: every commit writes all %d copies\n", N_FATS);
+        else reportLine("FAT mirroring is off: only FAT #1 is kept up to date");
+    } else {
+        reportMessage("Unknown command: %s\n", argument);
+        return commandFailed;
+    }
+    return commandSucceeded;
+}
+
+// Words that are not made of letters and digits all share one histogram
+static void commandVerb(const char * input, char verb[STATS_VERB_LENGTH]) {
+    size_t start = strspn(input, " \t\r\n"), length = strcspn(input + start, " \t\r\n");
+    verb[0] = '\0';
+    if (!length) return;
+    boolean plain = length < STATS_VERB_LENGTH ? True : False;
+    for (size_t i = 0; i < length && plain; ++i)
+        if (!isalnum((unsigned char)input[start + i])) plain = False;
+    if (!plain) {
+        strcpy(verb, "other");
+        return;
+    }
+    memcpy(verb, input + start, length);
+    verb[length] = '\0';
+}
+
+// Interactively every command is committed on its own; a batch is committed once at the end,
+// or with the journal, in groups of commands whose changes fill about half a record.
+// With --sync=command every command is committed and on the disk before the next one starts.
+static void commitCommand(Volume * vol) {
+    if (vol->isFormatted == formatted && (!batchMode || getSyncMode(vol) == syncCommand ||
+        (isJournalActive(vol) && pendingJournalSectors(vol) >= JOURNAL_GROUP_SECTORS))) {
+        if (commitMetadata(vol) == Failure || persistAfterCommand(vol) == Failure) reportLine("Failed to commit the changes of the command");
+    }
+}
+
+// Commands that look up, list or read in one folder share the volume, and so do those that add or
+// remove a file or an empty folder's entry in it; the others hold the volume alone
+static CommandScope commandScope(const char * input) {
+    static const char * const readers[] = { "pwd", "ls", "dir", "cd", "cat", "exit", "quit", "q" };
+    static const char * const writers[] = { "mkdir", "touch", "rm", "write", "append" };
+    char words[INPUT_MAX_LENGTH];
+    char * rest;
+    snprintf(words, sizeof(words), "%s", input);
+    const char * verb = strtok_r(words, " \t\r\n", &rest);
+    if (!verb) return readsDirectory;
+    const char * option = strtok_r(NULL, " \t\r\n", &rest);
+    if (option && ((strcmp(verb, "mkdir") == 0 && strcmp(option, "-p") == 0) || (strcmp(verb, "rm") == 0 && strcmp(option, "-r") == 0)))
+        return holdsVolume;
+    for (size_t i = 0; i < sizeof(readers) / sizeof(readers[0]); ++i)
+        if (strcmp(verb, readers[i]) == 0) return readsDirectory;
+    for (size_t i = 0; i < sizeof(writers) / sizeof(writers[0]); ++i)
+        if (strcmp(verb, writers[i]) == 0) return changesDirectory;
+    return holdsVolume;
+}
+
+// A command of a client of the server runs from the client's own folder, with its output sent to
+// the client, and is committed on its own as interactively. A command that changed a folder under
+// the shared lock takes the volume alone to commit, and its commit takes along the changes other
+// clients made meanwhile.
+CommandResult runClientCommand(Volume * vol, char * input, uint32_t * cluster, FILE * output) {
+    char verb[STATS_VERB_LENGTH];
+    commandVerb(input, verb);
+    CommandScope scope = commandScope(input);
+    struct timespec start, end;
+    if (scope == holdsVolume) lockEngine(vol);
+    else lockEngineShared(vol);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    setMessageStream(output);
+    CommandResult result = runCommand(vol, input, cluster, False);
+    if (result != commandExit && scope == changesDirectory) {
+        unlockEngine(vol);
+        lockEngine(vol);
     }
-}
\ No newline at end of file
+    if (result != commandExit && scope != readsDirectory) commitCommand(vol);
+    setMessageStream(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unlockEngine(vol);
+    if (verb[0]) recordCommandLatency(vol, verb, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return result;
+}
+
+// A failed command ends a batch unless it keeps going
+static boolean stopsBatch(boolean keepGoing) {
+    if (!batchMode || keepGoing) return False;
+    printf("Batch stopped at the first failing command (use -k to keep going)\n");
+    return True;
+}
+
+// A line longer than the buffer is read up to its end and dropped: its tail must never run as a
+// command of its own
+static boolean readLine(FILE * script, char input[INPUT_MAX_LENGTH], boolean * tooLong) {
+    *tooLong = False;
+    if (!fgets(input, INPUT_MAX_LENGTH, script)) return False;
+    if (strchr(input, '\n')) return True;
+    int c = getc(script);
+    if (c != EOF && c != '\n') *tooLong = True;
+    while (c != EOF && c != '\n') c = getc(script);
+    return True;
+}
+
+success emulate(Volume * vol, FILE * script, boolean batch, boolean keepGoing) {
+    username = getenv("USER");
+    batchMode = batch;
+    char input[INPUT_MAX_LENGTH];
+    uint32_t nCommands = 0, nFailed = 0, cluster = ROOT_CLUSTER;
+    if (trackCurrentFolder(vol, &cluster) == Failure) {
+        puts("Failed to allocate memory for the current folder");
+        return Failure;
+    }
+    while (True) {
+        if (!batchMode) {
+            lockEngineShared(vol);
+            printPrompt(vol, cluster);
+            unlockEngine(vol);
+        }
+        boolean tooLong;
+        if (!readLine(script, input, &tooLong)) break;
+        if (batchMode && input[0] == '#') continue; // comment line in a script
+        if (tooLong) {
+            puts("Command too long");
+            ++nCommands;
+            ++nFailed;
+            if (stopsBatch(keepGoing)) break;
+            continue;
+        }
+        // runCommand() tokenizes the line in place, so I keep the verb for the latency histograms
+        char verb[STATS_VERB_LENGTH];
+        commandVerb(input, verb);
+        struct timespec start, end;
+        lockEngine(vol);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        CommandResult result = runCommand(vol, input, &cluster, !batchMode);
+        if (result == commandExit) {
+            unlockEngine(vol);
+            break;
+        }
+        ++nCommands;
+        if (result == commandFailed) {
+            ++nFailed;
+            if (stopsBatch(keepGoing)) {
+                unlockEngine(vol);
+                break;
+            }
+        }
+        commitCommand(vol);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        unlockEngine(vol);
+        if (verb[0]) recordCommandLatency(vol, verb, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    untrackCurrentFolder(vol, &cluster);
+    if (!batchMode) return Success;
+    lockEngine(vol);
+    success synced = vol->isFormatted == formatted ? syncVolume(vol) : Success;
+    unlockEngine(vol);
+    if (synced == Failure) {
+        puts("Failed to write the batch to the volume");
+        return Failure;
+    }
+    printf("Batch finished: %u command(s), %u failed\n", nCommands, nFailed);
+    return nFailed ? Failure : Success;
+}
@@ -1,97 +1,229 @@
 #include "fat32.h"
 #include "utils.h"
-
-extern boolean enforceAbsolutePath;
-extern char fat32ReadingErrors[FAT32ERRORS_SIZE];
-extern FILE * volume;
-extern char localFilesAndFolders[SECTOR_SIZE / FAT_ENTRY_SIZE][FULL_FILE_STRING_SIZE];
-
-success readSector(uint32_t sector, uint8_t * buffer) {
-    if (fseek(volume, sector * SECTOR_SIZE, SEEK_SET) != 0) {
-        perror("fseek");
+#include "fatcache.h"
+#include "blockdev.h"
+#include "allocator.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "dirscan.h"
+#include "bufcache.h"
+#include "format.h"
+#include "journal.h"
+#include "durability.h"
+#include "volume.h"
+
+success readSector(Volume * vol, uint32_t sector, uint8_t * buffer) {
+    if (cachedRead(vol, sector, buffer, 1) == Failure) {
+        reportMessage("Error reading sector %u\n", sector);
         return Failure;
     }
-    if (fread(buffer, 1, SECTOR_SIZE, volume) != SECTOR_SIZE) {
-        printf("Error reading sector %u\n", sector);
-        perror("fread");
+    return Success;
+}
+
+success readSectors(Volume * vol, uint32_t sector, void * buffer, uint32_t count) {
+    if (cachedRead(vol, sector, buffer, count) == Failure) {
+        reportMessage("Error reading %u sectors starting at %u\n", count, sector);
         return Failure;
     }
     return Success;
 }
 
-success readSectors(uint32_t sector, void * buffer, uint32_t count) {
-    if (fseek(volume, sector * SECTOR_SIZE, SEEK_SET) != 0) {
-        perror("fseek (readSectors)");
+void readCluster(Volume * vol, uint32_t clusterNumber, uint8_t * buffer) {
+    uint32_t firstSector = FIRST_DATA_SECTOR(vol) + (clusterNumber - 2) * SECTORS_PER_CLUSTER(vol);
+    for (uint32_t sector = 0; sector < SECTORS_PER_CLUSTER(vol); ++sector) {
+        readSector(vol, firstSector + sector, buffer + sector * SECTOR_SIZE);
+    }
+}
+
+// I follow the FAT from the first cluster of a chain; the caller owns the returned array
+uint32_t collectClusterChain(Volume * vol, uint32_t firstCluster, uint32_t ** chain) {
+    uint32_t capacity = 8, count = 0;
+    *chain = malloc(capacity * sizeof(uint32_t));
+    if (!*chain) return 0;
+    uint32_t cluster = firstCluster;
+    while (cluster >= ROOT_CLUSTER && cluster < N_CLUSTERS(vol) && count < MAX_DIR_CLUSTERS(vol)) {
+        if (count == capacity) {
+            capacity *= 2;
+            uint32_t * grown = realloc(*chain, capacity * sizeof(uint32_t));
+            if (!grown) break;
+            *chain = grown;
+        }
+        (*chain)[count++] = cluster;
+        uint32_t next = getFATEntry(vol, cluster);
+        if (next >= FAT_EOC_MIN || next == 0) break;
+        cluster = next;
+    }
+    return count;
+}
+
+// I give access to every cluster of a directory chain. With the mmap backend the entries are
+// read in place; otherwise the chain is copied with one read per run of contiguous clusters.
+success openDirectoryView(Volume * vol, uint32_t firstCluster, DirectoryView * view) {
+    memset(view, 0, sizeof(DirectoryView));
+    view->entriesPerCluster = ENTRIES_PER_CLUSTER(vol);
+    view->nClusters = collectClusterChain(vol, firstCluster, &view->chain);
+    if (view->nClusters == 0) {
+        reportMessage("Invalid directory cluster: %u\n", firstCluster);
+        closeDirectoryView(view);
         return Failure;
     }
-    if (fread(buffer, 1, SECTOR_SIZE * count, volume) != SECTOR_SIZE * count) {
-        perror("fread (readSectors)");
+    view->clusters = malloc(view->nClusters * sizeof(uint8_t *));
+    if (!view->clusters) {
+        reportMessage("Failed to allocate memory for directory at cluster %u\n", firstCluster);
+        closeDirectoryView(view);
         return Failure;
     }
-    return Success;
-}
+    boolean inPlace = True;
+    for (uint32_t i = 0; inPlace && i < view->nClusters; ++i) {
+        view->clusters[i] = mappedSectors(vol->device, CLUSTER_FIRST_SECTOR(vol, view->chain[i]), SECTORS_PER_CLUSTER(vol));
+        inPlace = view->clusters[i] != NULL;
+    }
+    if (inPlace) return Success;
 
-void readCluster(uint32_t clusterNumber, uint8_t * buffer) {
-    uint32_t firstSector = FIRST_DATA_SECTOR + (clusterNumber - 2) * SECTORS_PER_CLUSTER;
-    for (uint32_t sector = 0; sector < SECTORS_PER_CLUSTER; ++sector) {
-        readSector(firstSector + sector, buffer + sector * SECTOR_SIZE);
+    view->copy = malloc((size_t)view->nClusters * CLUSTER_SIZE(vol));
+    if (!view->copy) {
+        reportMessage("Failed to allocate memory for directory at cluster %u\n", firstCluster);
+        closeDirectoryView(view);
+        return Failure;
     }
+    uint32_t i = 0;
+    while (i < view->nClusters) {
+        uint32_t runStart = i;
+        while (i + 1 < view->nClusters && view->chain[i + 1] == view->chain[i] + 1) ++i;
+        ++i;
+        if (readSectors(vol, CLUSTER_FIRST_SECTOR(vol, view->chain[runStart]), view->copy + (size_t)runStart * CLUSTER_SIZE(vol), (i - runStart) * SECTORS_PER_CLUSTER(vol)) == Failure) {
+            reportMessage("Failed to read directory clusters %u-%u\n", view->chain[runStart], view->chain[i - 1]);
+            closeDirectoryView(view);
+            return Failure;
+        }
+    }
+    for (i = 0; i < view->nClusters; ++i) view->clusters[i] = view->copy + (size_t)i * CLUSTER_SIZE(vol);
+    return Success;
 }
 
-uint32_t getDotDotCluster(uint32_t cluster) {
-    uint8_t buffer[CLUSTER_SIZE];
-    readCluster(cluster, buffer);
+void closeDirectoryView(DirectoryView * view) {
+    free(view->chain);
+    free(view->clusters);
+    free(view->copy);
+    memset(view, 0, sizeof(DirectoryView));
+}
 
-    for (int i = 0; i < CLUSTER_SIZE; i += ENTRY_SIZE) {
-        if (buffer[i] == '.' && buffer[i + 1] == '.') {
-            uint16_t high = *(uint16_t *)&buffer[i + 20];
-            uint16_t low  = *(uint16_t *)&buffer[i + 26];
-            return ((uint32_t)high << 16) | low;
-        }
+// I link a fresh zeroed cluster to the end of a directory chain
+static uint32_t extendDirectory(Volume * vol, uint32_t lastCluster) {
+    uint32_t newCluster = allocateCluster(vol);
+    if (newCluster == 0) {
+        reportMessage("No free clusters available to extend the directory\n");
+        return 0;
     }
-    return 0;  // Not found
+    uint8_t * emptyCluster = calloc(SECTORS_PER_CLUSTER(vol), SECTOR_SIZE);
+    if (!emptyCluster || writeSectors(vol, CLUSTER_FIRST_SECTOR(vol, newCluster), emptyCluster, SECTORS_PER_CLUSTER(vol)) == Failure) {
+        reportMessage("Failed to initialize directory cluster %u\n", newCluster);
+        free(emptyCluster);
+        freeCluster(vol, newCluster);
+        return 0;
+    }
+    free(emptyCluster);
+    setFATEntry(vol, lastCluster, newCluster);
+    return newCluster;
 }
 
-const char * findNameByCluster(uint32_t parentCluster, uint32_t targetCluster) {
-    static char name[12];
-    uint8_t buffer[CLUSTER_SIZE];
-    readCluster(parentCluster, buffer);
+// I translate a directory slot index into the sector holding it and the byte offset inside that sector
+static success locateDirectorySlot(Volume * vol, uint32_t dirCluster, int slot, uint32_t * sector, int * offset) {
+    uint32_t cluster = dirCluster;
+    for (int hop = slot / ENTRIES_PER_CLUSTER(vol); hop > 0; --hop) {
+        cluster = getFATEntry(vol, cluster);
+        if (cluster < ROOT_CLUSTER || cluster >= N_CLUSTERS(vol)) return Failure;
+    }
+    int slotInCluster = slot % ENTRIES_PER_CLUSTER(vol);
+    *sector = CLUSTER_FIRST_SECTOR(vol, cluster) + slotInCluster / ENTRIES_PER_SECTOR;
+    *offset = (slotInCluster % ENTRIES_PER_SECTOR) * ENTRY_SIZE;
+    return Success;
+}
 
-    for (int i = 0; i < CLUSTER_SIZE; i += ENTRY_SIZE) {
-        if (buffer[i] == 0x00 || buffer[i] == 0xE5) continue;
-        if ((buffer[i + 11] & 0x10) == 0) continue;  // Not a directory
+uint32_t getDotDotCluster(Volume * vol, uint32_t cluster) {
+    uint8_t copy[CLUSTER_SIZE(vol)];
+    const uint8_t * buffer = mappedSectors(vol->device, CLUSTER_FIRST_SECTOR(vol, cluster), SECTORS_PER_CLUSTER(vol));
+    if (!buffer) {
+        readCluster(vol, cluster, copy);
+        buffer = copy;
+    }
 
-        uint16_t high = *(uint16_t *)&buffer[i + 20];
-        uint16_t low  = *(uint16_t *)&buffer[i + 26];
-        uint32_t cluster = ((uint32_t)high << 16) | low;
+    for (uint32_t i = 0; i < CLUSTER_SIZE(vol); i += ENTRY_SIZE) {
+        if (buffer[i] == '.' && buffer[i + 1] == '.') return entryFirstCluster(buffer + i);
+    }
+    return 0;  // Not found
+}
 
-        if (cluster == targetCluster) {
-            memcpy(name, &buffer[i], 11);
-            name[11] = '\0';
+// I point the ".." entry of a directory at a new parent, on the volume and in its index
+success setDotDotCluster(Volume * vol, uint32_t cluster, uint32_t parentCluster) {
+    uint8_t entry[ENTRY_SIZE];
+    for (uint32_t slot = 0; slot < ENTRIES_PER_CLUSTER(vol); ++slot) {
+        if (readDirectoryEntry(vol, cluster, slot, entry) == Failure) return Failure;
+        if (entry[0] == 0x00) break;
+        if (entry[0] != '.' || entry[1] != '.') continue;
+        if (updateDirectoryEntry(vol, cluster, slot, parentCluster, entryFileSize(entry)) == Failure) return Failure;
+        updateDirIndexCluster(vol, cluster, entry, parentCluster);
+        return Success;
+    }
+    reportMessage("The directory at cluster %u has no \"..\" entry\n", cluster);
+    return Failure;
+}
 
-            for (int j = 10; j >= 0; --j) {
+// The name goes to the caller's buffer, which holds at least FILE_AND_EXT_RAW_LENGTH + 1 bytes
+static success findNameByCluster(Volume * vol, uint32_t parentCluster, uint32_t targetCluster, char * name) {
+    DirectoryView view;
+    if (openDirectoryView(vol, parentCluster, &view) == Failure) return Failure;
+
+    success found = Failure;
+    EntryMasks masks;
+    for (uint32_t base = 0; found == Failure && scanDirectoryBlock(&view, base, &masks); base += SCAN_BLOCK_ENTRIES) {
+        for (uint64_t bits = masks.directory; bits; bits &= bits - 1) {
+            const uint8_t * entry = directoryEntry(&view, base + lowestBit(bits));
+            if (entryFirstCluster(entry) != targetCluster) continue;
+            memcpy(name, entry, FILE_AND_EXT_RAW_LENGTH);
+            name[FILE_AND_EXT_RAW_LENGTH] = '\0';
+
+            for (int j = FILE_AND_EXT_RAW_LENGTH - 1; j >= 0; --j) {
                 if (name[j] == ' ') name[j] = '\0';
                 else break;
             }
-            return name;
+            found = Success;
+            break;
         }
+        if (masks.end < masks.count) break;  // End of directory
     }
-    return NULL;
+    closeDirectoryView(&view);
+    return found;
 }
 
-void buildPathToRoot(uint32_t currentCluster, char * upPath) {
+// Each folder on the way up is locked while it is read; the caller holds no directory lock
+void buildPathToRoot(Volume * vol, uint32_t currentCluster, char * upPath) {
     char temp[MAX_PATH] = "";
     upPath[0] = '\0';
 
     while (currentCluster != ROOT_CLUSTER) { 
-        uint32_t parentCluster = getDotDotCluster(currentCluster);
-        const char * name = findNameByCluster(parentCluster, currentCluster);
-        if (!name) break;
+        uint32_t parentCluster;
+        char cachedName[FULL_FILE_STRING_SIZE];
+        const char * name = cachedName;
+        if (!dcacheLookupParent(vol, currentCluster, &parentCluster, cachedName)) {
+            lockDirectory(vol, currentCluster, False);
+            parentCluster = getDotDotCluster(vol, currentCluster);
+            unlockDirectory(vol, currentCluster);
+            lockDirectory(vol, parentCluster, False);
+            success named = findNameByCluster(vol, parentCluster, currentCluster, cachedName);
+            unlockDirectory(vol, parentCluster);
+            if (named == Failure) break;
+            unsigned char rawName[FILE_AND_EXT_RAW_LENGTH];
+            formatShortName(name, rawName);
+            dcacheInsert(vol, parentCluster, rawName, currentCluster);
+        }
 
-        char segment[64];
-        snprintf(segment, sizeof(segment), "/%s", name);
-        strcat(segment, temp);
-        strcpy(temp, segment);
+        // I prepend "/name" in place; the whole path is bounded by MAX_PATH
+        size_t nameLen = strlen(name), tempLen = strlen(temp);
+        if (tempLen + nameLen + 2 > MAX_PATH) break;
+        memmove(temp + nameLen + 1, temp, tempLen + 1);
+        temp[0] = '/';
+        memcpy(temp + 1, name, nameLen);
 
         currentCluster = parentCluster;
     }
@@ -101,48 +233,53 @@ void buildPathToRoot(uint32_t currentCluster, char * upPath) {
     else toLowerRegister(temp, upPath);
 }
 
-uint32_t findClusterByFullPath(const char * inputPath, uint32_t currentCluster) {
+// Every folder along the path is locked for reading while its entry is looked up, one at a time:
+// the caller holds no directory lock
+uint32_t findClusterByFullPath(Volume * vol, const char * inputPath, uint32_t currentCluster) {
     if (!inputPath || strlen(inputPath) == 0) {
-        puts("No path provided");
+        reportLine("No path provided");
         return 0;
     }
     boolean absPath = False;
     if (inputPath[0] == '/') absPath = True;
-    if (enforceAbsolutePath && !absPath) {
-        puts("\tAbsolute path is required in this configuration of FAT32 emulator \x1b[34mxkubpise\x1b[0m\n\tUse -p option to allow relative paths when launching emulator");
+    if (vol->enforceAbsolutePath && !absPath) {
+        reportLine("\tAbsolute path is required in this configuration of FAT32 emulator \x1b[34mxkubpise\x1b[0m\n\tUse -p option to allow relative paths when launching emulator");
         return 0;
     }
     for (size_t c = 0; c < strlen(inputPath); ++c) {
         if (!isValidShortChar(inputPath[c], True, True)) {
-            puts("Invalid character(s) in path");
+            reportLine("Invalid character(s) in path");
             return 0;
         }
     }
     char path[MAX_PATH] = {0};
     strcpy(path, inputPath);
-    char * token = strtok(path, "/");
+    char * rest;
+    char * token = strtok_r(path, "/", &rest);
     uint32_t iCluster = currentCluster;
     if (absPath) iCluster = ROOT_CLUSTER;
 
     while (token) {
-        uint32_t nextCluster = findSubdirectoryCluster(token, iCluster);
+        lockDirectory(vol, iCluster, False);
+        uint32_t nextCluster = findSubdirectoryCluster(vol, token, iCluster);
+        unlockDirectory(vol, iCluster);
         if (nextCluster == 0) {
-            printf("Directory \033[31m%s\033[0m from the path %s not found\n", token, inputPath);
+            reportMessage("Directory \033[31m%s\033[0m from the path %s not found\n", token, inputPath);
             return 0;
         }
         iCluster = nextCluster;
-        token = strtok(NULL, "/");
+        token = strtok_r(NULL, "/", &rest);
     }
     return iCluster;
 }
 
-uint32_t findSubdirectoryCluster(const char * inputName, uint32_t cluster) {
+uint32_t findSubdirectoryCluster(Volume * vol, const char * inputName, uint32_t cluster) {
     char formattedName[FILE_AND_EXT_RAW_LENGTH];
     memset(formattedName, ' ', FILE_AND_EXT_RAW_LENGTH);
     if (strcmp(inputName, ".") == 0) return cluster;
-    if (strcmp(inputName, "..") == 0) return getDotDotCluster(cluster);
+    if (strcmp(inputName, "..") == 0) return getDotDotCluster(vol, cluster);
     if (strlen(inputName) > FILE_NAME_MAX_LENGTH) {
-        printf("Invalid length for folder name: %s\n", inputName);
+        reportMessage("Invalid length for folder name: %s\n", inputName);
         return 0;
     }
     for (size_t c = 0; c < FILE_NAME_MAX_LENGTH; ++c) {
@@ -151,64 +288,52 @@ uint32_t findSubdirectoryCluster(const char * inputName, uint32_t cluster) {
         formattedName[c] = toupper(inputName[c]);
     }
 
-    uint8_t buffer[SECTOR_SIZE];
-
-    for (uint32_t sector = 0; sector < SECTORS_PER_CLUSTER; ++sector) {
-        uint32_t baseSector = ROOT_DIR_SECTOR + (cluster - 2) * SECTORS_PER_CLUSTER + sector;
-        fseek(volume, (baseSector + sector) * SECTOR_SIZE, SEEK_SET);
-        int ret = fread(buffer, 1, SECTOR_SIZE, volume);
-        if (!ret) continue;
-
-        for (int offset = 0; offset < SECTOR_SIZE; offset += ENTRY_SIZE) {
-            uint8_t * entry = buffer + offset;
-
-            if (entry[0] == 0x00) return 0;         // End of directory
-            if (entry[0] == 0xE5) continue;         // Deleted entry
-            if (!(entry[11] & 0x10)) continue;      // Not a directory
-
-            if (memcmp(entry, formattedName, 11) == 0) {
-                uint16_t high = *(uint16_t *)(entry + 20);
-                uint16_t low  = *(uint16_t *)(entry + 26);
-                return (high << 16) | low; 
-            }
-        }
-    }
-    return 0; // Not found
+    uint32_t found;
+    if (dcacheLookupChild(vol, cluster, (const uint8_t *)formattedName, &found)) return found;
+    const DirIndexEntry * entry = lookupDirIndex(getDirIndex(vol, cluster), (const uint8_t *)formattedName);
+    if (!entry || !(entry->attributes & 0x10)) return 0; // Not found or not a directory
+    dcacheInsert(vol, cluster, entry->name, entry->firstCluster);
+    return entry->firstCluster;
 }
 
+boolean nameExistsInDirectory(Volume * vol, const char * name, uint32_t cluster) {
+    unsigned char rawName[FILE_AND_EXT_RAW_LENGTH];
+    formatShortName(name, rawName);
+    return lookupDirIndex(getDirIndex(vol, cluster), rawName) != NULL;
+}
 
-int collectNamesInCluster(int cluster) {
-    if (cluster < 2 || cluster >= N_CLUSTERS) {
-        printf("Invalid cluster number: %d\n", cluster);
+// The sorted names go to an array the caller frees, sized for every slot of the directory
+int collectNamesInCluster(Volume * vol, int cluster, char (** names)[FULL_FILE_STRING_SIZE]) {
+    *names = NULL;
+    if (cluster < 2 || (uint32_t)cluster >= N_CLUSTERS(vol)) {
+        reportMessage("Invalid cluster number: %d\n", cluster);
         return 0;
     }
     int count = 0;
 
-    uint32_t baseSector = ROOT_DIR_SECTOR + (cluster - 2) * SECTORS_PER_CLUSTER;
-    unsigned char buffer[SECTOR_SIZE];
-
-    for (int sector = 0; sector < SECTORS_PER_CLUSTER; ++sector) {
-        fseek(volume, (baseSector + sector) * SECTOR_SIZE, SEEK_SET);
-        int ret = fread(buffer, 1, SECTOR_SIZE, volume);
-        if (ret != SECTOR_SIZE) {
-            printf("Failed to read sector %u\nRead only %d bytes\n", baseSector + sector, ret);
-            continue;
-        }
-
-        for (int i = 0; i < SECTOR_SIZE; i += ENTRY_SIZE) {
-            unsigned char * entry = &buffer[i];
+    DirectoryView view;
+    if (openDirectoryView(vol, cluster, &view) == Failure) return 0;
+    char (* listing)[FULL_FILE_STRING_SIZE] = malloc((size_t)view.nClusters * ENTRIES_PER_CLUSTER(vol) * FULL_FILE_STRING_SIZE);
+    if (!listing) {
+        reportMessage("Failed to allocate memory for the listing of cluster %d\n", cluster);
+        closeDirectoryView(&view);
+        return 0;
+    }
 
-            if (entry[0] == 0x00) break; // No more entries
-            if (entry[0] == 0xE5) continue; // Deleted entry
-            if ((entry[11] & 0x0F) == 0x0F) continue; // Long File Name entry, skip for now
-            extractNameToBuffer(entry, localFilesAndFolders[count++]);
-        }
+    EntryMasks masks;
+    for (uint32_t base = 0; scanDirectoryBlock(&view, base, &masks); base += SCAN_BLOCK_ENTRIES) {
+        // Deleted entries are not in the mask; Long File Name entries are skipped for now
+        for (uint64_t bits = masks.used & ~masks.longName; bits; bits &= bits - 1)
+            extractNameToBuffer(directoryEntry(&view, base + lowestBit(bits)), listing[count++]);
+        if (masks.end < masks.count) break; // No more entries
     }
-    qsort(localFilesAndFolders, count, FULL_FILE_STRING_SIZE, cmpLocalNames);
+    closeDirectoryView(&view);
+    qsort(listing, count, FULL_FILE_STRING_SIZE, cmpLocalNames);
+    *names = listing;
     return count;
 }
 
-void initializeDotEntries(uint32_t cluster, uint32_t parentCluster) {
+void initializeDotEntries(Volume * vol, uint32_t cluster, uint32_t parentCluster) {
     unsigned char buffer[SECTOR_SIZE];
     memset(buffer, 0, SECTOR_SIZE);
 
@@ -230,228 +355,352 @@ void initializeDotEntries(uint32_t cluster, uint32_t parentCluster) {
     buffer[32 + 20] = (parentCluster >> 16) & 0xFF;
     buffer[32 + 21] = (parentCluster >> 24) & 0xFF;
 
-    // Write to first sector of the new cluster
-    uint32_t sector = ROOT_DIR_SECTOR + (cluster - 2) * SECTORS_PER_CLUSTER;
-    fseek(volume, sector * SECTOR_SIZE, SEEK_SET);
-    fwrite(buffer, 1, SECTOR_SIZE, volume);
-    if (ferror(volume)) {
-        printf("Error writing dot entries to sector %u for cluster %u\n", sector, cluster);
+    // Write to first sector of the new cluster; with larger clusters the other sectors must not
+    // keep stale data that would look like entries
+    uint32_t sector = ROOT_DIR_SECTOR(vol) + (cluster - 2) * SECTORS_PER_CLUSTER(vol);
+    if (writeSector(vol, sector, buffer) == Failure) {
+        reportMessage("Error writing dot entries to sector %u for cluster %u\n", sector, cluster);
+        return;
+    }
+    if (SECTORS_PER_CLUSTER(vol) > 1) {
+        uint8_t * empty = calloc(SECTORS_PER_CLUSTER(vol) - 1, SECTOR_SIZE);
+        if (!empty || writeSectors(vol, sector + 1, empty, SECTORS_PER_CLUSTER(vol) - 1) == Failure)
+            reportMessage("Error clearing the rest of cluster %u\n", cluster);
+        free(empty);
     }
-    fflush(volume);
 }
 
-uint32_t findFreeCluster() {
-    uint8_t fatSector[SECTOR_SIZE];
-    for (uint32_t cluster = ROOT_CLUSTER; cluster < N_CLUSTERS; ++cluster) { 
-        uint32_t fatSectorIndex = cluster / (SECTOR_SIZE / FAT_ENTRY_SIZE);
-        uint32_t offsetInSector = (cluster % (SECTOR_SIZE / FAT_ENTRY_SIZE)) * FAT_ENTRY_SIZE;
-
-        // I read sector only once per sector group
-        fseek(volume, (N_RESERVED_SECTORS + fatSectorIndex) * SECTOR_SIZE, SEEK_SET);
-        fread(fatSector, 1, SECTOR_SIZE, volume);
-        if (ferror(volume)) {
-            printf("Error reading FAT sector for cluster %u\n", cluster);
-            perror("fread");
-            return 0;
-        }
+uint32_t findFreeCluster(Volume * vol) {
+    return peekFreeCluster(vol); // 0 if no free cluster is left
+}
+
+// I hand everything the current command has modified (dirty FAT sectors and FSInfo hints)
+// to the sector cache; it reaches the volume on the next syncVolume() or eviction.
+// With the journal, the command becomes a record instead and nothing is written in place yet.
+success commitMetadata(Volume * vol) {
+    success committed = Success;
+    if (isJournalActive(vol)) committed = commitTransaction(vol);
+    else if (flushFATCache(vol) == Failure || flushFSInfo(vol) == Failure) committed = Failure;
+    if (committed == Success) noteCommit(vol);
+    return committed;
+}
 
-        uint32_t value = *(uint32_t *)(fatSector + offsetInSector) & 0x0FFFFFFF; // mask to 28-bit
-        if (value == 0x00000000) return cluster;
+success syncVolume(Volume * vol) {
+    if (commitMetadata(vol) == Failure) return Failure;
+    if (isJournalActive(vol) && checkpointJournal(vol, NULL) == Failure) return Failure;
+    if (syncBufferCache(vol, NULL) == Failure) {
+        reportMessage("Failed to write back cached sectors\n");
+        return Failure;
     }
-    return 0; // No free cluster found
+    return flushVolume(vol->device);
 }
 
-success createNewObject(const char * objectName, int firstCluster, int parentCluster, IsFolder isFolder) {
+void unmountVolume(Volume * vol) {
+    if (!vol->device) return;
+    // With a durability policy, what the run wrote is on the disk once the program ends
+    if (syncVolume(vol) == Success && getSyncMode(vol) != syncNone) persistVolume(vol->device);
+    resetJournal(vol);
+    dropBufferCache(vol);
+    invalidateAllDirIndexes(vol);
+    dcacheInvalidateAll(vol);
+    releaseAllocator(vol);
+    releaseFATCache(vol);
+    closeBlockDevice(vol->device);
+    vol->device = NULL;
+}
+
+// I store a complete entry in the first free slot of a directory, growing its chain if needed,
+// in place on a mapped volume and with a read-modify-write of its sector otherwise
+success placeDirectoryEntry(Volume * vol, uint32_t dirCluster, const uint8_t * entry) {
+    int freeEntryIndex = findFirstFreeEntry(vol, (int)dirCluster);
+    if (freeEntryIndex < 0) {
+        reportMessage("No free entries available in cluster %u\n", dirCluster);
+        return Failure;
+    }
+
+    uint32_t sector;
+    int entryOffset;
+    if (locateDirectorySlot(vol, dirCluster, freeEntryIndex, &sector, &entryOffset) == Failure) {
+        reportMessage("Failed to locate entry %d in the chain of cluster %u\n", freeEntryIndex, dirCluster);
+        return Failure;
+    }
+    unsigned char copy[SECTOR_SIZE];
+    unsigned char * buffer = mappedSectorsForWrite(vol->device, sector, 1);
+    if (!buffer) {
+        buffer = copy;
+        if (readSector(vol, sector, buffer) == Failure) {
+            reportMessage("Failed to read sector %u for cluster %u\n", sector, dirCluster);
+            return Failure;
+        }
+    }
+    memcpy(buffer + entryOffset, entry, ENTRY_SIZE);
+    if (buffer == copy && writeSector(vol, sector, buffer) == Failure) {
+        reportMessage("Failed to write to sector %u for cluster %u\n", sector, dirCluster);
+        return Failure;
+    }
+    uint32_t firstCluster = entryFirstCluster(entry);
+    insertIntoDirIndex(vol, dirCluster, entry, entry[FILE_AND_EXT_RAW_LENGTH], (uint32_t)freeEntryIndex, firstCluster);
+    dcacheInvalidate(vol, dirCluster, entry, firstCluster);
+    return Success;
+}
+
+success createNewObject(Volume * vol, const char * objectName, int firstCluster, int parentCluster, IsFolder isFolder) {
     size_t nameLen = strlen(objectName);
     if (isFolder) {
         if (!objectName || nameLen == 0 || nameLen > FILE_NAME_MAX_LENGTH) {
-            printf("Invalid folder name: %s\n", objectName);
+            reportMessage("Invalid folder name: %s\n", objectName);
             return Failure;
         }
-        if (firstCluster < 2 || firstCluster >= N_CLUSTERS) {
-            printf("Invalid cluster number: %d\n", firstCluster);
+        if (firstCluster < 2 || (uint32_t)firstCluster >= N_CLUSTERS(vol)) {
+            reportMessage("Invalid cluster number: %d\n", firstCluster);
             return Failure;
         }
     } else {
         if (!objectName || nameLen == 0 || nameLen > FILE_AND_EXT_RAW_LENGTH + 1) {
-            printf("Invalid file name: %s\n", objectName);
+            reportMessage("Invalid file name: %s\n", objectName);
             return Failure;
         }
         firstCluster = 0;
     }
 
-    if (parentCluster < 2 || parentCluster >= N_CLUSTERS) {
-        printf("Invalid parent cluster number: %d\n", parentCluster);
+    if (parentCluster < 2 || (uint32_t)parentCluster >= N_CLUSTERS(vol)) {
+        reportMessage("Invalid parent cluster number: %d\n", parentCluster);
         return Failure;
     }
 
-    int freeEntryIndex = findFirstFreeEntry(parentCluster);
-    if (freeEntryIndex < 0) {
-        printf("No free entries available in cluster %d\n", parentCluster);
-        return Failure;
-    }
-
-    uint32_t sector = ROOT_DIR_SECTOR + (parentCluster - 2) * SECTORS_PER_CLUSTER;
-    unsigned char buffer[SECTOR_SIZE];
-    fseek(volume, sector * SECTOR_SIZE, SEEK_SET);
-    size_t readBytes = fread(buffer, 1, SECTOR_SIZE, volume);
-    if (readBytes != SECTOR_SIZE) {
-        printf("Failed to read sector %u for cluster %d\n", sector, parentCluster);
-        return Failure;
-    }
-    unsigned char * entryName = buffer + freeEntryIndex * ENTRY_SIZE;
-    memset(entryName, 0, ENTRY_SIZE); // Clear the entry
+    unsigned char entry[ENTRY_SIZE];
+    memset(entry, 0, ENTRY_SIZE);
     if (isFolder) {
-        buffer[freeEntryIndex * ENTRY_SIZE + FILE_AND_EXT_RAW_LENGTH] = 0x10; // Directory attribute
-        memset(entryName, 0x20, FILE_AND_EXT_RAW_LENGTH);
+        entry[FILE_AND_EXT_RAW_LENGTH] = 0x10; // Directory attribute
+        memset(entry, 0x20, FILE_AND_EXT_RAW_LENGTH);
         for (size_t i = 0; i < nameLen; ++i) {
             char c = objectName[i];
             if (c >= 'a' && c <= 'z') c -= 32;  // Uppercase
-            entryName[i] = c;
+            entry[i] = c;
         }
     } else {
-        formatShortName(objectName, buffer + freeEntryIndex * ENTRY_SIZE);
-        buffer[freeEntryIndex * ENTRY_SIZE + FILE_AND_EXT_RAW_LENGTH] = 0x20; // Regular file attribute
-    }
-    buffer[freeEntryIndex * ENTRY_SIZE + 26] = firstCluster & 0xFF;
-    buffer[freeEntryIndex * ENTRY_SIZE + 27] = (firstCluster >> 8) & 0xFF;
-    buffer[freeEntryIndex * ENTRY_SIZE + 20] = (firstCluster >> 16) & 0xFF;
-    buffer[freeEntryIndex * ENTRY_SIZE + 21] = (firstCluster >> 24) & 0xFF;
-
-    fseek(volume, sector * SECTOR_SIZE, SEEK_SET);
-    size_t writtenBytes = fwrite(buffer, 1, SECTOR_SIZE, volume);
-    if (writtenBytes != SECTOR_SIZE) {
-        printf("Failed to write to sector %u for cluster %d, number of bytes written %zu\n", sector, parentCluster, writtenBytes);
-        perror("fwrite");
-        return Failure;
+        formatShortName(objectName, entry);
+        entry[FILE_AND_EXT_RAW_LENGTH] = 0x20; // Regular file attribute
     }
-    
+    entry[26] = firstCluster & 0xFF;
+    entry[27] = (firstCluster >> 8) & 0xFF;
+    entry[20] = (firstCluster >> 16) & 0xFF;
+    entry[21] = (firstCluster >> 24) & 0xFF;
+    if (placeDirectoryEntry(vol, parentCluster, entry) == Failure) return Failure;
+
     if (isFolder) {
-        uint32_t fatOffset = firstCluster * FAT_ENTRY_SIZE;
-        uint32_t fatSector = N_RESERVED_SECTORS + (fatOffset / SECTOR_SIZE);
-        uint32_t fatSectorOffset = fatOffset % SECTOR_SIZE;
-
-        // I read the sector containing the FAT entry
-        unsigned char fatBuffer[SECTOR_SIZE];
-        fseek(volume, fatSector * SECTOR_SIZE, SEEK_SET);
-        if (fread(fatBuffer, 1, SECTOR_SIZE, volume) != SECTOR_SIZE) {
-            printf("Failed to read FAT sector %u\n", fatSector);
-            return Failure;
-        }
+        // I mark the cluster as end-of-chain in the cached FAT
+        setFATEntry(vol, firstCluster, FAT_EOC);
+        initializeDotEntries(vol, firstCluster, parentCluster);
+    }
+    return Success;
+}
 
-        // I update the FAT entry to mark the cluster as end-of-chain
-        fatBuffer[fatSectorOffset + 0] = 0xFF;
-        fatBuffer[fatSectorOffset + 1] = 0xFF;
-        fatBuffer[fatSectorOffset + 2] = 0xFF;
-        fatBuffer[fatSectorOffset + 3] = 0x0F;
+// The name is checked and uppercased in place
+success createFileIn(Volume * vol, uint32_t dirCluster, char * name) {
+    name[FILE_AND_EXT_RAW_LENGTH + 1] = '\0';
+    if (!isValidShortNameAndUppercaseFile(name, itsFile)) {
+        reportMessage("Invalid file name: %s\n", name);
+        return Failure;
+    }
+    if (nameExistsInDirectory(vol, name, dirCluster)) {
+        reportMessage("Name %s already exists in the folder\n", name);
+        return Failure;
+    }
+    if (createNewObject(vol, name, 0, dirCluster, itsFile) == Failure) {
+        reportMessage("Failed to create file %s\n", name);
+        return Failure;
+    }
+    return Success;
+}
 
-        // I write the modified FAT sector back
-        fseek(volume, fatSector * SECTOR_SIZE, SEEK_SET);
-        if (fwrite(fatBuffer, 1, SECTOR_SIZE, volume) != SECTOR_SIZE) {
-            printf("Failed to write updated FAT sector %u\n", fatSector);
-            return Failure;
-        }
-        initializeDotEntries(firstCluster, parentCluster);
+success createFolderIn(Volume * vol, uint32_t dirCluster, char * name) {
+    name[FILE_NAME_MAX_LENGTH] = '\0';
+    if (!isValidShortNameAndUppercaseFile(name, itsFolder)) {
+        reportMessage("Invalid folder name: %s\n", name);
+        return Failure;
+    }
+    if (nameExistsInDirectory(vol, name, dirCluster)) {
+        reportMessage("Name %s already exists in the folder\n", name);
+        return Failure;
+    }
+    // I reserve the cluster first, so that growing the parent chain can't hand it out again
+    uint32_t newCluster = allocateCluster(vol);
+    if (newCluster == 0) {
+        reportMessage("No free clusters available to create a new folder\n");
+        return Failure;
+    }
+    if (createNewObject(vol, name, newCluster, dirCluster, itsFolder) == Failure) {
+        reportMessage("Failed to create folder %s\n", name);
+        freeCluster(vol, newCluster);
+        return Failure;
     }
-    fflush(volume);
     return Success;
 }
 
-int findFirstFreeEntry(int cluster) {
-    if (cluster < 2 || cluster >= N_CLUSTERS) {
-        printf("Invalid cluster number: %d\n", cluster);
-        return -1;
+success readDirectoryEntry(Volume * vol, uint32_t dirCluster, uint32_t slot, uint8_t * entry) {
+    uint32_t sector;
+    int offset;
+    uint8_t buffer[SECTOR_SIZE];
+    if (locateDirectorySlot(vol, dirCluster, (int)slot, &sector, &offset) == Failure || readSector(vol, sector, buffer) == Failure) {
+        reportMessage("Failed to read entry %u of the directory at cluster %u\n", slot, dirCluster);
+        return Failure;
     }
+    memcpy(entry, buffer + offset, ENTRY_SIZE);
+    return Success;
+}
 
-    uint32_t sector = ROOT_DIR_SECTOR + (cluster - 2) * SECTORS_PER_CLUSTER;
-    unsigned char buffer[SECTOR_SIZE];
-    fseek(volume, sector * SECTOR_SIZE, SEEK_SET);
-    size_t readBytes = fread(buffer, 1, SECTOR_SIZE, volume);
-    if (readBytes != SECTOR_SIZE) {
-        printf("Failed to read sector %u for cluster %d\n", sector, cluster);
+// I rewrite the first-cluster and size fields of an existing entry, in place on a mapped volume
+success updateDirectoryEntry(Volume * vol, uint32_t dirCluster, uint32_t slot, uint32_t firstCluster, uint32_t size) {
+    uint32_t sector;
+    int offset;
+    if (locateDirectorySlot(vol, dirCluster, (int)slot, &sector, &offset) == Failure) {
+        reportMessage("Failed to locate entry %u in the chain of cluster %u\n", slot, dirCluster);
+        return Failure;
+    }
+    unsigned char copy[SECTOR_SIZE];
+    unsigned char * buffer = mappedSectorsForWrite(vol->device, sector, 1);
+    if (!buffer) {
+        buffer = copy;
+        if (readSector(vol, sector, buffer) == Failure) return Failure;
+    }
+    unsigned char * entry = buffer + offset;
+    entry[26] = firstCluster & 0xFF;
+    entry[27] = (firstCluster >> 8) & 0xFF;
+    entry[20] = (firstCluster >> 16) & 0xFF;
+    entry[21] = (firstCluster >> 24) & 0xFF;
+    entry[28] = size & 0xFF;
+    entry[29] = (size >> 8) & 0xFF;
+    entry[30] = (size >> 16) & 0xFF;
+    entry[31] = (size >> 24) & 0xFF;
+    if (buffer == copy && writeSector(vol, sector, buffer) == Failure) {
+        reportMessage("Failed to write to sector %u for cluster %u\n", sector, dirCluster);
+        return Failure;
+    }
+    return Success;
+}
+
+// I mark an entry deleted (0xE5), in place on a mapped volume
+success deleteDirectoryEntry(Volume * vol, uint32_t dirCluster, uint32_t slot) {
+    uint32_t sector;
+    int offset;
+    if (locateDirectorySlot(vol, dirCluster, (int)slot, &sector, &offset) == Failure) {
+        reportMessage("Failed to locate entry %u in the chain of cluster %u\n", slot, dirCluster);
+        return Failure;
+    }
+    unsigned char copy[SECTOR_SIZE];
+    unsigned char * buffer = mappedSectorsForWrite(vol->device, sector, 1);
+    if (!buffer) {
+        buffer = copy;
+        if (readSector(vol, sector, buffer) == Failure) return Failure;
+    }
+    buffer[offset] = 0xE5;
+    if (buffer == copy && writeSector(vol, sector, buffer) == Failure) {
+        reportMessage("Failed to write to sector %u for cluster %u\n", sector, dirCluster);
+        return Failure;
+    }
+    return Success;
+}
+
+int findFirstFreeEntry(Volume * vol, int cluster) {
+    if (cluster < 2 || (uint32_t)cluster >= N_CLUSTERS(vol)) {
+        reportMessage("Invalid cluster number: %d\n", cluster);
         return -1;
     }
 
-    for (int i = 0; i < SECTOR_SIZE; i += 32)
-        if (buffer[i] == 0x00 || buffer[i] == 0xE5) // Free entry or deleted entry
-            return i / 32; // Return the index of the first free entry
-    
-    printf("No free entries found in cluster %d\n", cluster);
-    return -1; // No free entries found
+    DirIndex * index = getDirIndex(vol, cluster);
+    if (!index) return -1;
+    int slot = peekFreeSlot(vol, index);
+    if (slot >= 0) return slot;
+
+    // The directory is full, so I grow its chain by one cluster
+    if (index->nClusters >= MAX_DIR_CLUSTERS(vol)) {
+        reportMessage("Directory at cluster %d reached the maximum of %d entries\n", cluster, MAX_DIR_ENTRIES);
+        return -1;
+    }
+    uint32_t newCluster = extendDirectory(vol, index->lastCluster);
+    if (newCluster == 0) return -1;
+    noteDirectoryExtended(vol, cluster, newCluster);
+    return peekFreeSlot(vol, index);
 }
 
-static void appendToFAT32ReadingErrors(const char * newError, ...) {
-    static size_t end = 0;
+static void appendToFAT32ReadingErrors(Volume * vol, const char * newError, ...) {
+    size_t end = vol->readingErrorsEnd;
     size_t spaceLeft = FAT32ERRORS_SIZE - end - 1;
     if (spaceLeft == 0) return;
 
     if (spaceLeft > 0) {
-        fat32ReadingErrors[end++] = '\t';
+        vol->readingErrors[end++] = '\t';
+        vol->readingErrorsEnd = end;
         --spaceLeft;
     }
     if (spaceLeft == 0) return;
 
     va_list args;
     va_start(args, newError);
-    size_t written = vsnprintf(fat32ReadingErrors + end, spaceLeft + 1, newError, args);
+    size_t written = vsnprintf(vol->readingErrors + end, spaceLeft + 1, newError, args);
     va_end(args);
 
     if (written <= 0) return;
-    end += (written < spaceLeft) ? written : spaceLeft;
+    vol->readingErrorsEnd = end + ((written < spaceLeft) ? written : spaceLeft);
 }
 
-void commentOnExtFlags(uint16_t bpb_ExtFlags) {
+void commentOnExtFlags(Volume * vol, uint16_t bpb_ExtFlags) {
     uint8_t activeFAT = bpb_ExtFlags & 0x000F;         // bits 0–3
     uint8_t mirrorDisabled = (bpb_ExtFlags >> 7) & 1;  // bit 7
 
-    appendToFAT32ReadingErrors("BIOS Parameter Block has unexpected Extended Flags: 0x%04X\n", bpb_ExtFlags);
+    appendToFAT32ReadingErrors(vol, "BIOS Parameter Block has unexpected Extended Flags: 0x%04X\n", bpb_ExtFlags);
 
     if (mirrorDisabled)
-        appendToFAT32ReadingErrors("Mirroring is DISABLED which is expected by FAT32 emulator \033[34mxkubpise\033[0m\n");
-    else appendToFAT32ReadingErrors("\tMirroring is ENABLED which is NOT expected by FAT32 emulator \033[34mxkubpise\033[0m\n");
+        appendToFAT32ReadingErrors(vol, "\tMirroring is DISABLED, so FAT32 emulator \033[34mxkubpise\033[0m expects the first FAT table to be active\n");
+    else appendToFAT32ReadingErrors(vol, "\tMirroring is ENABLED, so FAT32 emulator \033[34mxkubpise\033[0m expects the active FAT field to be zero\n");
 
     if (activeFAT == 0)
-        appendToFAT32ReadingErrors("\tActive FAT is 0, which is expected by FAT32 emulator \033[34mxkubpise\033[0m\n");
+        appendToFAT32ReadingErrors(vol, "\tActive FAT is 0, which is expected by FAT32 emulator \033[34mxkubpise\033[0m\n");
     else if (activeFAT > N_FATS)
-        appendToFAT32ReadingErrors("\tActive FAT #%u is greater than the number of FATs (%d) in volume for FAT32 emulator \033[34mxkubpise\033[0m\n", activeFAT, N_FATS);
-    else appendToFAT32ReadingErrors("\tActive FAT #%u and this is expected by FAT32 emulator \033[34mxkubpise\033[0m\n", activeFAT);
+        appendToFAT32ReadingErrors(vol, "\tActive FAT #%u is greater than the number of FATs (%d) in volume for FAT32 emulator \033[34mxkubpise\033[0m\n", activeFAT, N_FATS);
+    else appendToFAT32ReadingErrors(vol, "\tActive FAT #%u and this is expected by FAT32 emulator \033[34mxkubpise\033[0m\n", activeFAT);
 
     if (bpb_ExtFlags & 0xFF70)
-        appendToFAT32ReadingErrors("\tWarning: Reserved bits in Extended Flags are non-zero!\n");
+        appendToFAT32ReadingErrors(vol, "\tWarning: Reserved bits in Extended Flags are non-zero!\n");
 }
 
-IsFormatted isValidFAT32xkubpise(const char * filename) {
+IsFormatted isValidFAT32xkubpise(Volume * vol, const char * filename) {
     IsFormatted issues = notFormatted;
     boolean anyErrors = False;
-    volume = fopen(filename, "r+b");
-    if (!volume) {
-        appendToFAT32ReadingErrors("Error opening the volume\n");
+    vol->device = openBlockDevice(filename, vol->backend, vol->stats);
+    if (!vol->device) {
+        appendToFAT32ReadingErrors(vol, "Error opening the volume\n");
         return badSize;
     } else {
-        fseek(volume, 0, SEEK_END);
-        long size = ftell(volume);
-        fseek(volume, 0, SEEK_SET);
-        if (size != TOTAL_SIZE) {
-            appendToFAT32ReadingErrors("Volume doesn't have mandatory size of 20 MB\n\tIts size is %ld bytes\n", size);
+        uint64_t size = vol->device->size;
+        if (size % SECTOR_SIZE != 0 || size < (uint64_t)MIN_TOTAL_N_SECTORS * SECTOR_SIZE || size > (uint64_t)UINT32_MAX * SECTOR_SIZE) {
+            appendToFAT32ReadingErrors(vol, "Volume size must be a multiple of %d bytes between %d and %llu sectors\n\tIts size is %llu bytes\n",
+                SECTOR_SIZE, MIN_TOTAL_N_SECTORS, (unsigned long long)UINT32_MAX, (unsigned long long)size);
             issues = badSize;
         }
         if (size < SECTOR_SIZE) {
-            appendToFAT32ReadingErrors("Volume is even smaller than %d bytes to host its BIOS Parameter Block\n", SECTOR_SIZE);
-            fclose(volume);
+            appendToFAT32ReadingErrors(vol, "Volume is even smaller than %d bytes to host its BIOS Parameter Block\n", SECTOR_SIZE);
+            closeBlockDevice(vol->device);
+            vol->device = NULL;
             return badSize;
         }
     }
 
+    // Whatever a previous run left in the journal reaches its place before anything is read;
+    // a failure has been reported and the volume is then used as it is
+    replayJournal(vol);
+
     unsigned char buffer[SECTOR_SIZE];
-    size_t bootSectorRead = fread(buffer, 1, SECTOR_SIZE, volume);
-    if(bootSectorRead != SECTOR_SIZE) {
-        appendToFAT32ReadingErrors("Couldn't read full boot sector\nOnly %ld bytes have been read\n", bootSectorRead);
-        fclose(volume);
+    if (vol->device->read(vol->device, 0, buffer, 1) == Failure) {
+        appendToFAT32ReadingErrors(vol, "Couldn't read full boot sector\n");
+        closeBlockDevice(vol->device);
+        vol->device = NULL;
         return badSize;
     }
 
     if (!(buffer[0x52] == 'F' && buffer[0x53] == 'A' && buffer[0x54] == 'T' && buffer[0x55] == '3' && buffer[0x56] == '2')) {
-        appendToFAT32ReadingErrors("Unexpected FAT32 signature: %c%c%c%c%c%c%c%c\n\t\t(hex): %02X %02X %02X %02X %02X %02X %02X %02X\n", safeChar(buffer[0x52]), safeChar(buffer[0x53]), safeChar(buffer[0x54]), safeChar(buffer[0x55]), safeChar(buffer[0x56]), safeChar(buffer[0x57]), safeChar(buffer[0x58]), safeChar(buffer[0x59]), (unsigned char)buffer[0x52], (unsigned char)buffer[0x53], (unsigned char)buffer[0x54], (unsigned char)buffer[0x55], (unsigned char)buffer[0x56], (unsigned char)buffer[0x57], (unsigned char)buffer[0x58], (unsigned char)buffer[0x59]);
+        appendToFAT32ReadingErrors(vol, "Unexpected FAT32 signature: %c%c%c%c%c%c%c%c\n\t\t(hex): %02X %02X %02X %02X %02X %02X %02X %02X\n", safeChar(buffer[0x52]), safeChar(buffer[0x53]), safeChar(buffer[0x54]), safeChar(buffer[0x55]), safeChar(buffer[0x56]), safeChar(buffer[0x57]), safeChar(buffer[0x58]), safeChar(buffer[0x59]), (unsigned char)buffer[0x52], (unsigned char)buffer[0x53], (unsigned char)buffer[0x54], (unsigned char)buffer[0x55], (unsigned char)buffer[0x56], (unsigned char)buffer[0x57], (unsigned char)buffer[0x58], (unsigned char)buffer[0x59]);
         anyErrors = True;
     }
 
@@ -461,77 +710,86 @@ IsFormatted isValidFAT32xkubpise(const char * filename) {
     const char customVolumeLabel[11] = { 'F','A','T','x','k','u','b','p','i','s','e' };
 
     if (memcmp(&buffer[0x03], customOEM, 8) != 0) {
-        appendToFAT32ReadingErrors("Unexpected OEM Name: %c%c%c%c%c%c%c%c \n\t\t(hex): %02X %02X %02X %02X %02X %02X %02X %02X\n", safeChar(buffer[0x03]), safeChar(buffer[0x04]), safeChar(buffer[0x05]), safeChar(buffer[0x06]), safeChar(buffer[0x07]), safeChar(buffer[0x08]), safeChar(buffer[0x09]), safeChar(buffer[0x0a]), (unsigned char)buffer[0x03], (unsigned char)buffer[0x04], (unsigned char)buffer[0x05], (unsigned char)buffer[0x06], (unsigned char)buffer[0x07], (unsigned char)buffer[0x08], (unsigned char)buffer[0x09], (unsigned char)buffer[0x0a]);
+        appendToFAT32ReadingErrors(vol, "Unexpected OEM Name: %c%c%c%c%c%c%c%c \n\t\t(hex): %02X %02X %02X %02X %02X %02X %02X %02X\n", safeChar(buffer[0x03]), safeChar(buffer[0x04]), safeChar(buffer[0x05]), safeChar(buffer[0x06]), safeChar(buffer[0x07]), safeChar(buffer[0x08]), safeChar(buffer[0x09]), safeChar(buffer[0x0a]), (unsigned char)buffer[0x03], (unsigned char)buffer[0x04], (unsigned char)buffer[0x05], (unsigned char)buffer[0x06], (unsigned char)buffer[0x07], (unsigned char)buffer[0x08], (unsigned char)buffer[0x09], (unsigned char)buffer[0x0a]);
         anyErrors = True;
     }
     if (volumeID != customVolumeID) {
-        appendToFAT32ReadingErrors("Unexpected Volume ID: %08X\n", volumeID);
+        appendToFAT32ReadingErrors(vol, "Unexpected Volume ID: %08X\n", volumeID);
         anyErrors = True;
     }
     if (memcmp(&buffer[0x47], customVolumeLabel, 11) != 0) {
-        appendToFAT32ReadingErrors("Unexpected Volume Label: %c%c%c%c%c%c%c%c%c%c%c\n\t\t(hex): %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X\n", safeChar(buffer[0x47]), safeChar(buffer[0x48]), safeChar(buffer[0x49]), safeChar(buffer[0x4a]), safeChar(buffer[0x4b]), safeChar(buffer[0x4c]), safeChar(buffer[0x4d]), safeChar(buffer[0x4e]), safeChar(buffer[0x4f]), safeChar(buffer[0x50]), safeChar(buffer[0x51]), (unsigned char)buffer[0x47], (unsigned char)buffer[0x48], (unsigned char)buffer[0x49], (unsigned char)buffer[0x4a], (unsigned char)buffer[0x4b], (unsigned char)buffer[0x4c], (unsigned char)buffer[0x4d], (unsigned char)buffer[0x4e], (unsigned char)buffer[0x4f], (unsigned char)buffer[0x50], (unsigned char)buffer[0x51]);
+        appendToFAT32ReadingErrors(vol, "Unexpected Volume Label: %c%c%c%c%c%c%c%c%c%c%c\n\t\t(hex): %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X\n", safeChar(buffer[0x47]), safeChar(buffer[0x48]), safeChar(buffer[0x49]), safeChar(buffer[0x4a]), safeChar(buffer[0x4b]), safeChar(buffer[0x4c]), safeChar(buffer[0x4d]), safeChar(buffer[0x4e]), safeChar(buffer[0x4f]), safeChar(buffer[0x50]), safeChar(buffer[0x51]), (unsigned char)buffer[0x47], (unsigned char)buffer[0x48], (unsigned char)buffer[0x49], (unsigned char)buffer[0x4a], (unsigned char)buffer[0x4b], (unsigned char)buffer[0x4c], (unsigned char)buffer[0x4d], (unsigned char)buffer[0x4e], (unsigned char)buffer[0x4f], (unsigned char)buffer[0x50], (unsigned char)buffer[0x51]);
         anyErrors = True;
     }
 
     uint16_t bpb_BytsPerSec = buffer[0x0B] | (buffer[0x0C] << 8);
     if (bpb_BytsPerSec != SECTOR_SIZE) {
-        appendToFAT32ReadingErrors("Unexpected sector size: %u\n", bpb_BytsPerSec);
+        appendToFAT32ReadingErrors(vol, "Unexpected sector size: %u\n", bpb_BytsPerSec);
         anyErrors = True;
     }
     uint8_t bpb_SecPerClus = buffer[0x0D];
-    if (bpb_SecPerClus != SECTORS_PER_CLUSTER) {
-        appendToFAT32ReadingErrors("Unexpected sector per cluster: %u\n", bpb_SecPerClus);
+    if (bpb_SecPerClus == 0 || bpb_SecPerClus > MAX_SECTORS_PER_CLUSTER || (bpb_SecPerClus & (bpb_SecPerClus - 1))) {
+        appendToFAT32ReadingErrors(vol, "Unexpected sector per cluster: %u\n", bpb_SecPerClus);
         anyErrors = True;
     }
     uint16_t bpb_RsvdSecCnt = buffer[0x0E] | (buffer[0x0F] << 8);
     if (bpb_RsvdSecCnt != N_RESERVED_SECTORS) {
-        appendToFAT32ReadingErrors("Unexpected number of reserved sectors: %u\n", bpb_RsvdSecCnt);
+        appendToFAT32ReadingErrors(vol, "Unexpected number of reserved sectors: %u\n", bpb_RsvdSecCnt);
         anyErrors = True;
     }
     uint8_t bpb_NumFATs = buffer[0x10];
     if (bpb_NumFATs != N_FATS) {
-        appendToFAT32ReadingErrors("Unexpected number of FAT tables: %u\n", bpb_NumFATs);
+        appendToFAT32ReadingErrors(vol, "Unexpected number of FAT tables: %u\n", bpb_NumFATs);
         anyErrors = True;
     }
     uint16_t bpb_RootEntCnt = buffer[0x11] | (buffer[0x12] << 8);
     if (bpb_RootEntCnt != 0) { // FAT32 does not use root directory entries
-        appendToFAT32ReadingErrors("BIOS Parameter Block indicates root directory\n");
+        appendToFAT32ReadingErrors(vol, "BIOS Parameter Block indicates root directory\n");
         anyErrors = True;
     } 
     uint16_t bpb_TotSec16 = buffer[0x13] | (buffer[0x14] << 8);
     if (bpb_TotSec16 != 0) { // FAT32 does not use this field
-        appendToFAT32ReadingErrors("BIOS Parameter Block indicates total number of sectors in 16-bit field\n");
+        appendToFAT32ReadingErrors(vol, "BIOS Parameter Block indicates total number of sectors in 16-bit field\n");
         anyErrors = True;
     } 
     uint32_t bpb_TotSec32 = buffer[0x20] | (buffer[0x21] << 8) |
             (buffer[0x22] << 16) | (buffer[0x23] << 24);
-    if (bpb_TotSec32 != TOTAL_N_SECTORS) {
-        appendToFAT32ReadingErrors("Volume for FAT32 emulator \033[34mxkubpise\033[0m must have %d sectors in total, not %u sectors\n", TOTAL_N_SECTORS, bpb_TotSec32);
+    if ((uint64_t)bpb_TotSec32 * SECTOR_SIZE != vol->device->size) {
+        appendToFAT32ReadingErrors(vol, "Volume for FAT32 emulator \033[34mxkubpise\033[0m must have %llu sectors in total as its file, not %u sectors\n", (unsigned long long)(vol->device->size / SECTOR_SIZE), bpb_TotSec32);
         anyErrors = True;
     }
     uint16_t bpb_FATSz16 = buffer[0x16] | (buffer[0x17] << 8);
     if (bpb_FATSz16 != 0) {
         if (bpb_TotSec16 != 0) { // FAT32 does not use 16-bit FAT size
-            appendToFAT32ReadingErrors("BIOS Parameter Block indicates size of a FAT table in 16-bit field\n");
+            appendToFAT32ReadingErrors(vol, "BIOS Parameter Block indicates size of a FAT table in 16-bit field\n");
             anyErrors = True;
         } 
     }
     uint32_t bpb_FATSz32 = buffer[0x24] | (buffer[0x25] << 8) |
             (buffer[0x26] << 16) | (buffer[0x27] << 24);
-    if (bpb_FATSz32 != FAT_SIZE) {
-        appendToFAT32ReadingErrors("FAT table size in volume for FAT32 emulator \033[34mxkubpise\033[0m must be %d bytes, not %u bytes\n", FAT_SIZE, bpb_FATSz32);
+    if (!anyErrors && bpb_FATSz32 != fatSizeFor(bpb_TotSec32, bpb_SecPerClus)) {
+        appendToFAT32ReadingErrors(vol, "FAT table size in volume for FAT32 emulator \033[34mxkubpise\033[0m must be %u sectors, not %u sectors\n", fatSizeFor(bpb_TotSec32, bpb_SecPerClus), bpb_FATSz32);
         anyErrors = True;
     }
     uint16_t bpb_ExtFlags = buffer[0x28] | (buffer[0x29] << 8);
-    if (bpb_ExtFlags != 0x80) { // FAT32 emulator xkubpise has no mirroring and use the first FAT table
-        commentOnExtFlags(bpb_ExtFlags);
+    // FAT32 emulator xkubpise either mirrors every FAT table or only uses the first one
+    if (bpb_ExtFlags != EXT_FLAGS_MIRRORED && bpb_ExtFlags != EXT_FLAGS_SINGLE_FAT) {
+        commentOnExtFlags(vol, bpb_ExtFlags);
         anyErrors = True;
     } 
     uint16_t bpb_FSVer = buffer[0x2A] | (buffer[0x2B] << 8);
     if (bpb_FSVer != 0) {
-        appendToFAT32ReadingErrors("FAT32 File System Version (should be zero): %u\n", bpb_FSVer);
+        appendToFAT32ReadingErrors(vol, "FAT32 File System Version (should be zero): %u\n", bpb_FSVer);
+        anyErrors = True;
+    }
+    // The layout comes from the BPB when it can be trusted; otherwise the whole file, with the requested
+    // cluster size, is what a new pre-formatting would use
+    if (issues == notFormatted && !anyErrors && setGeometry(vol, bpb_TotSec32, bpb_SecPerClus) == Failure) {
+        appendToFAT32ReadingErrors(vol, "BIOS Parameter Block describes an unusable layout\n");
         anyErrors = True;
     }
+    if (issues == notFormatted && !anyErrors) vol->geometry.mirroredFATs = bpb_ExtFlags == EXT_FLAGS_MIRRORED;
+    if (issues == notFormatted && anyErrors && setGeometry(vol, (uint32_t)(vol->device->size / SECTOR_SIZE), SECTORS_PER_CLUSTER(vol)) == Failure) issues = badSize;
     if (issues == notFormatted && !anyErrors) return formatted;
     if (issues == notFormatted && anyErrors) return notFormatted;
     return badSize;
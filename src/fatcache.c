@@ -0,0 +1,517 @@
+#include "fatcache.h"
+#include "fat32.h"
+#include "allocator.h"
+#include "blockdev.h"
+#include "bufcache.h"
+#include "journal.h"
+#include "volume.h"
+
+// The FAT is split into pages of FAT_PAGE_SECTORS sectors. A page is read on first use and kept
+// in one of at most MAX_RESIDENT_FAT_PAGES frames; the least recently used frame is reused when
+// they are all taken, after its modified sectors have been written back. For every page I also
+// remember how many free clusters it describes once it has been seen, so that the allocator can
+// skip full pages without reading them again. Memory and mount time thus do not depend on the
+// size of the volume (apart from a few bytes per page). A resident page also keeps one bit per
+// entry that is set when the entry is free, built when the page is read and kept up to date by
+// setFATEntry(), so that a free cluster is found 64 entries at a time.
+// With the mmap backend the pages are the mapping itself: nothing is copied or evicted, and the
+// bits of a page are built the first time its free clusters are counted.
+// When the FATs are mirrored, the dirty sectors of a commit are gathered into runs of consecutive
+// sectors and each run reaches every copy with a single vectored write.
+// With the journal, the sectors changed since the last commit are also "unlogged": a commit copies
+// them into its record, and a checkpoint writes back the dirty ones that have not changed since.
+// Entries are read and changed under the storage lock of the volume, as the sector cache is.
+typedef struct FATFrame {
+    uint32_t page;
+    uint8_t dirtySectors; // one bit per sector of the page
+    uint8_t unloggedSectors;
+    struct FATFrame * lruPrev;
+    struct FATFrame * lruNext;
+    uint32_t * entries;
+    uint64_t freeBits[FAT_FREE_WORDS_PER_PAGE];
+} FATFrame;
+
+struct FATCache {
+    boolean loaded;
+    uint32_t nPages;
+    FATFrame * frames;
+    uint32_t nFramesUsed;
+    uint32_t * pageFrame;  // per page: index of its frame + 1, 0 when it is not resident
+    uint16_t * freeInPage; // per page: free clusters, or FAT_PAGE_FREE_UNKNOWN
+    FATFrame * lruHead;    // most recently used
+    FATFrame * lruTail;
+    uint32_t * mappedFAT;
+    uint64_t * mappedFreeBits; // FAT_FREE_WORDS_PER_PAGE words per page, valid once freeInPage is known
+    boolean anyDirty;
+    uint64_t pageLoads;
+};
+
+FATCache * createFATCache(void) {
+    return calloc(1, sizeof(FATCache));
+}
+
+static uint32_t sectorsInPage(Volume * vol, uint32_t page) {
+    uint32_t first = page * FAT_PAGE_SECTORS;
+    return FAT_SIZE(vol) - first < FAT_PAGE_SECTORS ? FAT_SIZE(vol) - first : FAT_PAGE_SECTORS;
+}
+
+// Entries 0 and 1 and the tail of the last page do not describe clusters: their bits stay clear
+static uint16_t buildFreeBits(Volume * vol, uint32_t page, const uint32_t * entries, uint64_t * bits) {
+    uint32_t first = page * FAT_ENTRIES_PER_PAGE;
+    uint32_t end = first + sectorsInPage(vol, page) * FAT_ENTRIES_PER_SECTOR;
+    if (end > N_CLUSTERS(vol)) end = N_CLUSTERS(vol);
+    memset(bits, 0, FAT_FREE_WORDS_PER_PAGE * sizeof(uint64_t));
+    uint16_t count = 0;
+    for (uint32_t cluster = first < ROOT_CLUSTER ? ROOT_CLUSTER : first; cluster < end; ++cluster) {
+        if (entries[cluster - first] & FAT_ENTRY_MASK) continue;
+        bits[(cluster - first) / 64] |= (uint64_t)1 << ((cluster - first) % 64);
+        ++count;
+    }
+    return count;
+}
+
+// The bits of a page, NULL when they are not known (a page of a mapped FAT not counted yet)
+static uint64_t * pageFreeBits(Volume * vol, uint32_t page) {
+    FATCache * cache = vol->fatCache;
+    if (!cache->mappedFAT) {
+        return cache->pageFrame[page] ? cache->frames[cache->pageFrame[page] - 1].freeBits : NULL;
+    }
+    if (cache->freeInPage[page] == FAT_PAGE_FREE_UNKNOWN) return NULL;
+    return cache->mappedFreeBits + (size_t)page * FAT_FREE_WORDS_PER_PAGE;
+}
+
+static void unlinkFromLRU(Volume * vol, FATFrame * frame) {
+    FATCache * cache = vol->fatCache;
+    if (frame->lruPrev) frame->lruPrev->lruNext = frame->lruNext;
+    else cache->lruHead = frame->lruNext;
+    if (frame->lruNext) frame->lruNext->lruPrev = frame->lruPrev;
+    else cache->lruTail = frame->lruPrev;
+    frame->lruPrev = frame->lruNext = NULL;
+}
+
+static void pushToLRUHead(Volume * vol, FATFrame * frame) {
+    FATCache * cache = vol->fatCache;
+    frame->lruPrev = NULL;
+    frame->lruNext = cache->lruHead;
+    if (cache->lruHead) cache->lruHead->lruPrev = frame;
+    cache->lruHead = frame;
+    if (!cache->lruTail) cache->lruTail = frame;
+}
+
+typedef struct {
+    uint32_t sector; // first sector of the run, relative to the start of a FAT
+    uint32_t count;
+    int firstPart;
+    int nParts;
+} FATWriteRun;
+
+static int compareFramesByPage(const void * a, const void * b) {
+    uint32_t pageA = (*(FATFrame * const *)a)->page, pageB = (*(FATFrame * const *)b)->page;
+    return (pageA > pageB) - (pageA < pageB);
+}
+
+// I sort the frames by page and turn their dirty sectors into runs that may span several pages,
+// then write every run to each active FAT copy in turn
+static success writeBackFrames(Volume * vol, FATFrame ** dirty, uint32_t n) {
+    qsort(dirty, n, sizeof(FATFrame *), compareFramesByPage);
+    uint32_t maxParts = n * ((FAT_PAGE_SECTORS + 1) / 2); // dirty and clean sectors alternating
+    struct iovec * parts = malloc(maxParts * sizeof(struct iovec));
+    FATWriteRun * runs = malloc(maxParts * sizeof(FATWriteRun));
+    if (!parts || !runs) {
+        reportMessage("Failed to allocate memory for FAT write-back\n");
+        free(parts);
+        free(runs);
+        return Failure;
+    }
+    int nParts = 0, nRuns = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        FATFrame * frame = dirty[i];
+        uint32_t sector = 0, count = sectorsInPage(vol, frame->page);
+        while (sector < count) {
+            if (!(frame->dirtySectors & (1u << sector))) {
+                ++sector;
+                continue;
+            }
+            uint32_t runStart = sector;
+            while (sector < count && (frame->dirtySectors & (1u << sector))) ++sector;
+            uint32_t first = frame->page * FAT_PAGE_SECTORS + runStart;
+            FATWriteRun * last = nRuns ? &runs[nRuns - 1] : NULL;
+            if (!last || last->sector + last->count != first) {
+                last = &runs[nRuns++];
+                last->sector = first;
+                last->count = 0;
+                last->firstPart = nParts;
+                last->nParts = 0;
+            }
+            parts[nParts].iov_base = frame->entries + runStart * FAT_ENTRIES_PER_SECTOR;
+            parts[nParts].iov_len = (size_t)(sector - runStart) * SECTOR_SIZE;
+            ++nParts;
+            ++last->nParts;
+            last->count += sector - runStart;
+        }
+    }
+    success ret = Success;
+    for (uint32_t copy = 0; copy < FAT_COPIES_WRITTEN(vol) && ret == Success; ++copy) {
+        for (int r = 0; r < nRuns && ret == Success; ++r) {
+            uint32_t lba = N_RESERVED_SECTORS + copy * FAT_SIZE(vol) + runs[r].sector;
+            ret = uncachedWriteVector(vol, lba, parts + runs[r].firstPart, runs[r].nParts);
+            if (ret == Failure) reportMessage("Failed to write FAT #%u sectors from %u\n", copy + 1, lba);
+        }
+    }
+    free(parts);
+    free(runs);
+    if (ret == Failure) return Failure;
+    for (uint32_t i = 0; i < n; ++i) dirty[i]->dirtySectors = dirty[i]->unloggedSectors = 0;
+    return Success;
+}
+
+static FATFrame * residentPage(Volume * vol, uint32_t page) {
+    FATCache * cache = vol->fatCache;
+    if (cache->pageFrame[page]) {
+        FATFrame * frame = &cache->frames[cache->pageFrame[page] - 1];
+        if (frame != cache->lruHead) {
+            unlinkFromLRU(vol, frame);
+            pushToLRUHead(vol, frame);
+        }
+        return frame;
+    }
+    FATFrame * frame;
+    if (cache->nFramesUsed < MAX_RESIDENT_FAT_PAGES) {
+        frame = &cache->frames[cache->nFramesUsed];
+        frame->entries = malloc((size_t)FAT_PAGE_SECTORS * SECTOR_SIZE);
+        if (!frame->entries) {
+            reportMessage("Failed to allocate memory for a FAT page\n");
+            return NULL;
+        }
+        ++cache->nFramesUsed;
+    } else {
+        frame = cache->lruTail;
+        // A page with changes that are not logged yet only goes when every other one has some
+        if (isJournalActive(vol)) {
+            FATFrame * candidate = frame;
+            while (candidate && candidate->unloggedSectors) candidate = candidate->lruPrev;
+            if (candidate) frame = candidate;
+            else if (journalForget(vol, N_RESERVED_SECTORS + frame->page * FAT_PAGE_SECTORS, sectorsInPage(vol, frame->page)) == Failure) return NULL;
+        }
+        if (frame->dirtySectors && (journalBeforeWriteBack(vol) == Failure || writeBackFrames(vol, &frame, 1) == Failure)) return NULL;
+        unlinkFromLRU(vol, frame);
+        cache->pageFrame[frame->page] = 0;
+    }
+    if (readSectors(vol, N_RESERVED_SECTORS + page * FAT_PAGE_SECTORS, frame->entries, sectorsInPage(vol, page)) == Failure) {
+        reportMessage("Failed to read FAT page %u\n", page);
+        pushToLRUHead(vol, frame); // the frame is kept, empty, for the next page
+        frame->page = page;
+        frame->dirtySectors = frame->unloggedSectors = 0;
+        return NULL;
+    }
+    ++cache->pageLoads;
+    frame->page = page;
+    frame->dirtySectors = frame->unloggedSectors = 0;
+    cache->pageFrame[page] = (uint32_t)(frame - cache->frames) + 1;
+    pushToLRUHead(vol, frame);
+    uint16_t nFree = buildFreeBits(vol, page, frame->entries, frame->freeBits);
+    if (cache->freeInPage[page] == FAT_PAGE_FREE_UNKNOWN) cache->freeInPage[page] = nFree;
+    return frame;
+}
+
+success loadFATCache(Volume * vol) {
+    FATCache * cache = vol->fatCache;
+    releaseFATCache(vol);
+    cache->nPages = (FAT_SIZE(vol) + FAT_PAGE_SECTORS - 1) / FAT_PAGE_SECTORS;
+    cache->pageFrame = calloc(cache->nPages, sizeof(uint32_t));
+    cache->freeInPage = malloc(cache->nPages * sizeof(uint16_t));
+    cache->frames = calloc(MAX_RESIDENT_FAT_PAGES, sizeof(FATFrame));
+    if (!cache->pageFrame || !cache->freeInPage || !cache->frames) {
+        reportMessage("Failed to allocate memory for FAT cache\n");
+        releaseFATCache(vol);
+        return Failure;
+    }
+    memset(cache->freeInPage, 0xFF, cache->nPages * sizeof(uint16_t));
+    cache->mappedFAT = (uint32_t *)mappedSectors(vol->device, N_RESERVED_SECTORS, FAT_SIZE(vol));
+    if (cache->mappedFAT) {
+        cache->mappedFreeBits = malloc((size_t)cache->nPages * FAT_FREE_WORDS_PER_PAGE * sizeof(uint64_t));
+        if (!cache->mappedFreeBits) {
+            reportMessage("Failed to allocate memory for FAT cache\n");
+            releaseFATCache(vol);
+            return Failure;
+        }
+    }
+    cache->loaded = True;
+    // Only the first page is read now, it holds the reserved entries and the root directory
+    if (!cache->mappedFAT && !residentPage(vol, 0)) {
+        reportMessage("Failed to read FAT sectors into cache\n");
+        releaseFATCache(vol);
+        return Failure;
+    }
+    return Success;
+}
+
+void releaseFATCache(Volume * vol) {
+    FATCache * cache = vol->fatCache;
+    for (uint32_t i = 0; i < cache->nFramesUsed; ++i) free(cache->frames[i].entries);
+    free(cache->frames);
+    free(cache->pageFrame);
+    free(cache->freeInPage);
+    free(cache->mappedFreeBits);
+    cache->frames = NULL;
+    cache->pageFrame = NULL;
+    cache->freeInPage = NULL;
+    cache->mappedFreeBits = NULL;
+    cache->nFramesUsed = 0;
+    cache->nPages = 0;
+    cache->lruHead = cache->lruTail = NULL;
+    cache->mappedFAT = NULL;
+    cache->loaded = False;
+    cache->anyDirty = False;
+}
+
+boolean isFATCacheLoaded(Volume * vol) {
+    FATCache * cache = vol->fatCache;
+    return cache->loaded;
+}
+
+static uint32_t readFATEntry(Volume * vol, uint32_t cluster) {
+    FATCache * cache = vol->fatCache;
+    if (!cache->loaded || cluster >= FAT_ENTRIES_COUNT(vol)) return FAT_EOC;
+    if (cache->mappedFAT) return cache->mappedFAT[cluster] & FAT_ENTRY_MASK;
+    FATFrame * frame = residentPage(vol, cluster / FAT_ENTRIES_PER_PAGE);
+    if (!frame) return FAT_EOC;
+    return frame->entries[cluster % FAT_ENTRIES_PER_PAGE] & FAT_ENTRY_MASK;
+}
+
+uint32_t getFATEntry(Volume * vol, uint32_t cluster) {
+    lockStorage(vol);
+    uint32_t ret = readFATEntry(vol, cluster);
+    unlockStorage(vol);
+    return ret;
+}
+
+static void writeFATEntry(Volume * vol, uint32_t cluster, uint32_t value) {
+    FATCache * cache = vol->fatCache;
+    if (!cache->loaded || cluster >= FAT_ENTRIES_COUNT(vol)) return;
+    uint32_t page = cluster / FAT_ENTRIES_PER_PAGE;
+    uint32_t * entry;
+    if (cache->mappedFAT) {
+        mappedSectorsForWrite(vol->device, N_RESERVED_SECTORS + cluster / FAT_ENTRIES_PER_SECTOR, 1);
+        entry = &cache->mappedFAT[cluster];
+        // The mirrors are plain stores into the mapping as well; msync() writes them with the rest
+        for (uint32_t copy = 1; copy < FAT_COPIES_WRITTEN(vol); ++copy) {
+            uint32_t * mirror = (uint32_t *)mappedSectorsForWrite(vol->device, N_RESERVED_SECTORS + copy * FAT_SIZE(vol) + cluster / FAT_ENTRIES_PER_SECTOR, 1);
+            if (mirror) mirror[cluster % FAT_ENTRIES_PER_SECTOR] = (*entry & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+        }
+    } else {
+        FATFrame * frame = residentPage(vol, page);
+        if (!frame) return;
+        entry = &frame->entries[cluster % FAT_ENTRIES_PER_PAGE];
+        frame->dirtySectors |= 1u << (cluster % FAT_ENTRIES_PER_PAGE / FAT_ENTRIES_PER_SECTOR);
+        frame->unloggedSectors |= 1u << (cluster % FAT_ENTRIES_PER_PAGE / FAT_ENTRIES_PER_SECTOR);
+    }
+    uint32_t old = *entry & FAT_ENTRY_MASK;
+    // The upper 4 bits of a FAT32 entry are reserved and must be preserved
+    *entry = (*entry & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+    boolean isFree = (value & FAT_ENTRY_MASK) == 0;
+    if ((old == 0) != isFree && cluster >= ROOT_CLUSTER && cluster < N_CLUSTERS(vol)) {
+        if (cache->freeInPage[page] != FAT_PAGE_FREE_UNKNOWN) cache->freeInPage[page] += isFree ? 1 : -1;
+        uint64_t * bits = pageFreeBits(vol, page);
+        uint32_t index = cluster % FAT_ENTRIES_PER_PAGE;
+        if (bits) bits[index / 64] ^= (uint64_t)1 << (index % 64);
+        noteClusterState(vol, cluster, isFree);
+    }
+    cache->anyDirty = True;
+}
+
+void setFATEntry(Volume * vol, uint32_t cluster, uint32_t value) {
+    lockStorage(vol);
+    writeFATEntry(vol, cluster, value);
+    unlockStorage(vol);
+}
+
+success flushFATCache(Volume * vol) {
+    FATCache * cache = vol->fatCache;
+    if (!cache->loaded || !cache->anyDirty) return Success;
+    // Logged versions older than what is written now must not reach the volume after it
+    if (isJournalActive(vol) && checkpointJournal(vol, NULL) == Failure) return Failure;
+    // The mapping already holds the new entries, flushVolume() schedules their write-back
+    if (!cache->mappedFAT) {
+        FATFrame ** dirty = malloc(cache->nFramesUsed * sizeof(FATFrame *));
+        if (!dirty) return Failure;
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < cache->nFramesUsed; ++i)
+            if (cache->frames[i].dirtySectors) dirty[n++] = &cache->frames[i];
+        success ret = n ? writeBackFrames(vol, dirty, n) : Success;
+        free(dirty);
+        if (ret == Failure) return Failure;
+    }
+    cache->anyDirty = False;
+    return Success;
+}
+
+// The sectors of the first FAT changed since the last commit; they are copied out only if they all fit
+uint32_t gatherUnloggedFATSectors(Volume * vol, uint32_t * lbas, uint8_t * data, uint32_t max) {
+    FATCache * cache = vol->fatCache;
+    uint32_t n = 0;
+    if (!cache->loaded || cache->mappedFAT) return 0;
+    for (uint32_t i = 0; i < cache->nFramesUsed; ++i)
+        for (uint32_t sector = 0; sector < FAT_PAGE_SECTORS; ++sector)
+            if (cache->frames[i].unloggedSectors & (1u << sector)) ++n;
+    if (!data || n > max) return n;
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < cache->nFramesUsed; ++i) {
+        for (uint32_t sector = 0; sector < FAT_PAGE_SECTORS; ++sector) {
+            if (!(cache->frames[i].unloggedSectors & (1u << sector))) continue;
+            lbas[k] = N_RESERVED_SECTORS + cache->frames[i].page * FAT_PAGE_SECTORS + sector;
+            memcpy(data + (size_t)k * SECTOR_SIZE, cache->frames[i].entries + sector * FAT_ENTRIES_PER_SECTOR, SECTOR_SIZE);
+            ++k;
+        }
+    }
+    return n;
+}
+
+void markFATSectorsLogged(Volume * vol) {
+    FATCache * cache = vol->fatCache;
+    for (uint32_t i = 0; i < cache->nFramesUsed; ++i) cache->frames[i].unloggedSectors = 0;
+}
+
+// After a checkpoint the logged sectors are in their place; those changed again stay dirty
+void markLoggedFATSectorsClean(Volume * vol) {
+    FATCache * cache = vol->fatCache;
+    for (uint32_t i = 0; i < cache->nFramesUsed; ++i) cache->frames[i].dirtySectors &= cache->frames[i].unloggedSectors;
+}
+
+uint32_t getFATPageCount(Volume * vol) {
+    FATCache * cache = vol->fatCache;
+    return cache->nPages;
+}
+
+// A page whose summary is not known yet is looked at once
+static uint32_t countFreeInPage(Volume * vol, uint32_t page) {
+    FATCache * cache = vol->fatCache;
+    if (!cache->loaded || page >= cache->nPages) return 0;
+    if (cache->freeInPage[page] == FAT_PAGE_FREE_UNKNOWN) {
+        if (cache->mappedFAT) cache->freeInPage[page] = buildFreeBits(vol, page, cache->mappedFAT + (size_t)page * FAT_ENTRIES_PER_PAGE, cache->mappedFreeBits + (size_t)page * FAT_FREE_WORDS_PER_PAGE);
+        else if (!residentPage(vol, page)) return 0;
+    }
+    return cache->freeInPage[page];
+}
+
+uint32_t getFATPageFreeCount(Volume * vol, uint32_t page) {
+    lockStorage(vol);
+    uint32_t ret = countFreeInPage(vol, page);
+    unlockStorage(vol);
+    return ret;
+}
+
+// The first free cluster of a page at or after "fromCluster", 0 if there is none; the bits of
+// the clusters before it are masked off the first word
+static uint32_t searchFreeBits(Volume * vol, uint32_t page, uint32_t fromCluster) {
+    FATCache * cache = vol->fatCache;
+    if (countFreeInPage(vol, page) == 0) return 0;
+    uint32_t first = page * FAT_ENTRIES_PER_PAGE;
+    if (fromCluster < first) fromCluster = first;
+    if (fromCluster - first >= FAT_ENTRIES_PER_PAGE) return 0;
+    if (!cache->mappedFAT && !residentPage(vol, page)) return 0;
+    const uint64_t * bits = pageFreeBits(vol, page);
+    uint32_t word = (fromCluster - first) / 64;
+    uint64_t candidates = bits[word] & (~(uint64_t)0 << ((fromCluster - first) % 64));
+    while (!candidates) {
+        if (++word == FAT_FREE_WORDS_PER_PAGE) return 0;
+        candidates = bits[word];
+    }
+    return first + word * 64 + (uint32_t)__builtin_ctzll(candidates);
+}
+
+uint32_t findFreeClusterInFATPage(Volume * vol, uint32_t page, uint32_t fromCluster) {
+    lockStorage(vol);
+    uint32_t ret = searchFreeBits(vol, page, fromCluster);
+    unlockStorage(vol);
+    return ret;
+}
+
+void getFATCacheStats(Volume * vol, uint32_t * residentPages, uint64_t * loads) {
+    FATCache * cache = vol->fatCache;
+    *residentPages = cache->mappedFAT ? 0 : cache->nFramesUsed;
+    *loads = cache->pageLoads;
+}
+
+static void reportDivergence(uint32_t copy, uint32_t start, uint32_t end) {
+    reportMessage("FAT #%u differs from FAT #1 in sectors %u-%u of the table (clusters %u-%u)\n", copy + 1, start, end - 1,
+        start * FAT_ENTRIES_PER_SECTOR, end * FAT_ENTRIES_PER_SECTOR - 1);
+}
+
+// I compare every other copy with the first one a chunk at a time; only chunks that differ are
+// looked at sector by sector to report the divergent ranges. Returns the number of such sectors.
+uint32_t compareFATCopies(Volume * vol) {
+    if (flushFATCache(vol) == Failure) return 0;
+    uint32_t chunk = FAT_SIZE(vol) < FAT_COMPARE_CHUNK_SECTORS ? FAT_SIZE(vol) : FAT_COMPARE_CHUNK_SECTORS;
+    uint8_t * first = NULL, * other = NULL;
+    boolean mapped = mappedSectors(vol->device, N_RESERVED_SECTORS, N_FATS * FAT_SIZE(vol)) != NULL;
+    if (!mapped) {
+        first = malloc((size_t)chunk * SECTOR_SIZE);
+        other = malloc((size_t)chunk * SECTOR_SIZE);
+        if (!first || !other) {
+            reportMessage("Failed to allocate memory to compare the FAT copies\n");
+            free(first);
+            free(other);
+            return 0;
+        }
+    }
+    uint32_t divergent = 0;
+    for (uint32_t copy = 1; copy < N_FATS; ++copy) {
+        uint32_t rangeStart = 0;
+        boolean inRange = False;
+        for (uint32_t done = 0; done < FAT_SIZE(vol); done += chunk) {
+            uint32_t count = FAT_SIZE(vol) - done < chunk ? FAT_SIZE(vol) - done : chunk;
+            const uint8_t * a, * b;
+            if (mapped) {
+                a = mappedSectors(vol->device, N_RESERVED_SECTORS + done, count);
+                b = mappedSectors(vol->device, N_RESERVED_SECTORS + copy * FAT_SIZE(vol) + done, count);
+            } else {
+                if (readSectors(vol, N_RESERVED_SECTORS + done, first, count) == Failure ||
+                    readSectors(vol, N_RESERVED_SECTORS + copy * FAT_SIZE(vol) + done, other, count) == Failure) {
+                    reportMessage("Failed to read the FAT copies\n");
+                    break;
+                }
+                a = first;
+                b = other;
+            }
+            if (!inRange && memcmp(a, b, (size_t)count * SECTOR_SIZE) == 0) continue;
+            for (uint32_t s = 0; s < count; ++s) {
+                boolean same = memcmp(a + (size_t)s * SECTOR_SIZE, b + (size_t)s * SECTOR_SIZE, SECTOR_SIZE) == 0;
+                if (!same && !inRange) {
+                    rangeStart = done + s;
+                    inRange = True;
+                } else if (same && inRange) {
+                    reportDivergence(copy, rangeStart, done + s);
+                    divergent += done + s - rangeStart;
+                    inRange = False;
+                }
+            }
+        }
+        if (inRange) {
+            reportDivergence(copy, rangeStart, FAT_SIZE(vol));
+            divergent += FAT_SIZE(vol) - rangeStart;
+        }
+    }
+    free(first);
+    free(other);
+    return divergent;
+}
+
+// Before mirroring is turned on, the first FAT is copied over the other ones
+success copyActiveFAT(Volume * vol) {
+    if (flushFATCache(vol) == Failure) return Failure;
+    uint32_t chunk = FAT_SIZE(vol) < FAT_COMPARE_CHUNK_SECTORS ? FAT_SIZE(vol) : FAT_COMPARE_CHUNK_SECTORS;
+    uint8_t * buffer = malloc((size_t)chunk * SECTOR_SIZE);
+    if (!buffer) return Failure;
+    success ret = Success;
+    for (uint32_t done = 0; done < FAT_SIZE(vol) && ret == Success; done += chunk) {
+        uint32_t count = FAT_SIZE(vol) - done < chunk ? FAT_SIZE(vol) - done : chunk;
+        ret = readSectors(vol, N_RESERVED_SECTORS + done, buffer, count);
+        struct iovec part = { buffer, (size_t)count * SECTOR_SIZE };
+        for (uint32_t copy = 1; copy < N_FATS && ret == Success; ++copy)
+            ret = uncachedWriteVector(vol, N_RESERVED_SECTORS + copy * FAT_SIZE(vol) + done, &part, 1);
+    }
+    free(buffer);
+    if (ret == Failure) reportMessage("Failed to copy the first FAT over the other copies\n");
+    return ret;
+}
@@ -0,0 +1,238 @@
+#include "file.h"
+#include "fat32.h"
+#include "fatcache.h"
+#include "allocator.h"
+#include "dirindex.h"
+#include "bufcache.h"
+#include "hostcopy.h"
+#include "stats.h"
+#include "volume.h"
+
+#define SECTORS_FOR(bytes) (((bytes) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define CLUSTERS_FOR(vol, bytes) (((bytes) + CLUSTER_SIZE(vol) - 1) / CLUSTER_SIZE(vol))
+
+// A run filler produces "bytes" bytes of the file, starting at "offset", into the run at "firstCluster";
+// a run consumer does the opposite
+typedef success (* RunFiller)(Volume * vol, uint32_t firstCluster, uint32_t bytes, uint64_t offset, void * source);
+typedef success (* RunConsumer)(Volume * vol, uint32_t firstCluster, uint32_t bytes, uint64_t offset, void * target);
+
+typedef struct {
+    uint8_t rawName[FILE_AND_EXT_RAW_LENGTH];
+    uint32_t slot;
+    uint32_t firstCluster;
+    uint32_t size;
+} FileEntry;
+
+// I find a regular file of the directory through its index and read its size from the entry
+static success locateFile(Volume * vol, uint32_t dirCluster, const char * name, FileEntry * file) {
+    formatShortName(name, file->rawName);
+    const DirIndexEntry * indexed = lookupDirIndex(getDirIndex(vol, dirCluster), file->rawName);
+    if (!indexed) {
+        reportMessage("File %s not found\n", name);
+        return Failure;
+    }
+    if (indexed->attributes & 0x10) {
+        reportMessage("%s is a folder\n", name);
+        return Failure;
+    }
+    file->slot = indexed->slot;
+    uint8_t entry[ENTRY_SIZE];
+    if (readDirectoryEntry(vol, dirCluster, file->slot, entry) == Failure) return Failure;
+    file->firstCluster = entryFirstCluster(entry);
+    file->size = entryFileSize(entry);
+    return Success;
+}
+
+// I walk a chain to its last cluster; 0 if the chain is broken
+static uint32_t lastClusterOf(Volume * vol, uint32_t firstCluster, uint32_t * nClusters) {
+    uint32_t cluster = firstCluster, count = 1;
+    while (count <= N_CLUSTERS(vol)) {
+        uint32_t next = getFATEntry(vol, cluster);
+        if (next >= FAT_EOC_MIN) break;
+        if (next < ROOT_CLUSTER || next >= N_CLUSTERS(vol)) return 0;
+        cluster = next;
+        ++count;
+    }
+    *nClusters = count;
+    return cluster;
+}
+
+// I patch bytes inside one cluster, reading back only the sectors being touched
+static success writeIntoCluster(Volume * vol, uint32_t cluster, uint32_t offset, const uint8_t * data, uint32_t length) {
+    uint8_t buffer[CLUSTER_SIZE(vol)];
+    uint32_t firstSector = offset / SECTOR_SIZE;
+    uint32_t nSectors = SECTORS_FOR(offset + length) - firstSector;
+    uint32_t sector = CLUSTER_FIRST_SECTOR(vol, cluster) + firstSector;
+    IOClass previous = setIOClass(ioData);
+    success ret = readSectors(vol, sector, buffer, nSectors);
+    if (ret == Success) {
+        memcpy(buffer + offset % SECTOR_SIZE, data, length);
+        ret = writeSectors(vol, sector, buffer, nSectors);
+    }
+    setIOClass(previous);
+    return ret;
+}
+
+// I write the bytes of a freshly allocated run with one request; the last sector is zero-padded
+static success writeRun(Volume * vol, uint32_t firstCluster, const uint8_t * data, uint32_t length) {
+    uint32_t fullSectors = length / SECTOR_SIZE;
+    uint32_t sector = CLUSTER_FIRST_SECTOR(vol, firstCluster);
+    IOClass previous = setIOClass(ioData);
+    success ret = fullSectors ? writeSectors(vol, sector, data, fullSectors) : Success;
+    if (ret == Success && length % SECTOR_SIZE) {
+        uint8_t tail[SECTOR_SIZE];
+        memset(tail, 0, SECTOR_SIZE);
+        memcpy(tail, data + (size_t)fullSectors * SECTOR_SIZE, length % SECTOR_SIZE);
+        ret = writeSector(vol, sector + fullSectors, tail);
+    }
+    setIOClass(previous);
+    return ret;
+}
+
+// I append "length" bytes: first into the free space of the tail cluster, then into runs
+// of adjacent clusters, each filled with a single request
+static success appendToFile(Volume * vol, uint32_t dirCluster, const char * name, FileEntry * file, uint64_t length, const uint8_t * bytes, RunFiller fill, void * source) {
+    if ((uint64_t)file->size + length > 0xFFFFFFFF) {
+        reportMessage("File %s would exceed the FAT32 limit of 4 GiB\n", name);
+        return Failure;
+    }
+    uint32_t tail = 0, nClusters = 0;
+    if (file->firstCluster) {
+        tail = lastClusterOf(vol, file->firstCluster, &nClusters);
+        if (tail == 0 || file->size < (nClusters - 1) * CLUSTER_SIZE(vol) || file->size > nClusters * CLUSTER_SIZE(vol)) {
+            reportMessage("The cluster chain of %s does not match its size\n", name);
+            return Failure;
+        }
+    }
+    uint32_t spaceInTail = tail ? nClusters * CLUSTER_SIZE(vol) - file->size : 0;
+    // Only memory sources top up the tail; imports always start from an empty file
+    uint32_t toTail = !bytes ? 0 : (length < spaceInTail ? (uint32_t)length : spaceInTail);
+    if (CLUSTERS_FOR(vol, length - toTail) > getFreeClusterCount(vol)) {
+        reportMessage("Not enough free space for %llu more byte(s) in %s\n", (unsigned long long)length, name);
+        return Failure;
+    }
+
+    success ret = Success;
+    uint64_t offset = 0;
+    if (toTail) {
+        ret = writeIntoCluster(vol, tail, CLUSTER_SIZE(vol) - spaceInTail, bytes, toTail);
+        if (ret == Success) {
+            offset = toTail;
+            file->size += toTail;
+        }
+    }
+    while (ret == Success && offset < length) {
+        uint32_t runStart;
+        uint32_t runLength = allocateClusterRun(vol, CLUSTERS_FOR(vol, length - offset), &runStart);
+        if (runLength == 0) {
+            ret = Failure;
+            break;
+        }
+        uint32_t runBytes = (uint64_t)runLength * CLUSTER_SIZE(vol) < length - offset ? runLength * CLUSTER_SIZE(vol) : (uint32_t)(length - offset);
+        if (fill(vol, runStart, runBytes, offset, source) == Failure) {
+            freeClusterChain(vol, runStart);
+            ret = Failure;
+            break;
+        }
+        if (tail) setFATEntry(vol, tail, runStart);
+        else file->firstCluster = runStart;
+        tail = runStart + runLength - 1;
+        offset += runBytes;
+        file->size += runBytes;
+    }
+    if (ret == Failure) reportMessage("Failed to write the data of %s, %u byte(s) kept\n", name, file->size);
+
+    // Whatever has been written is recorded, so the entry never points past valid data
+    if (updateDirectoryEntry(vol, dirCluster, file->slot, file->firstCluster, file->size) == Failure) return Failure;
+    updateDirIndexCluster(vol, dirCluster, file->rawName, file->firstCluster);
+    return ret;
+}
+
+// I hand the file to the consumer one run of adjacent clusters at a time
+static success forEachRun(Volume * vol, const char * name, const FileEntry * file, RunConsumer consume, void * target) {
+    uint64_t offset = 0;
+    uint32_t cluster = file->firstCluster;
+    while (offset < file->size) {
+        if (cluster < ROOT_CLUSTER || cluster >= N_CLUSTERS(vol)) {
+            reportMessage("The cluster chain of %s is shorter than its size\n", name);
+            return Failure;
+        }
+        uint32_t runStart = cluster, runLength = 1;
+        uint32_t next = getFATEntry(vol, cluster);
+        while (next == runStart + runLength && offset + (uint64_t)runLength * CLUSTER_SIZE(vol) < file->size) {
+            ++runLength;
+            next = getFATEntry(vol, next);
+        }
+        uint32_t runBytes = offset + (uint64_t)runLength * CLUSTER_SIZE(vol) < file->size ? runLength * CLUSTER_SIZE(vol) : (uint32_t)(file->size - offset);
+        if (consume(vol, runStart, runBytes, offset, target) == Failure) return Failure;
+        offset += runBytes;
+        cluster = next;
+    }
+    return Success;
+}
+
+static success fillFromMemory(Volume * vol, uint32_t firstCluster, uint32_t bytes, uint64_t offset, void * source) {
+    return writeRun(vol, firstCluster, (const uint8_t *)source + offset, bytes);
+}
+
+static success fillFromHostFile(Volume * vol, uint32_t firstCluster, uint32_t bytes, uint64_t offset, void * source) {
+    return copyFromHostFile(vol, *(int *)source, offset, CLUSTER_FIRST_SECTOR(vol, firstCluster), bytes);
+}
+
+// The buffer is rounded up to whole sectors, so every run is read straight into it
+static success readIntoMemory(Volume * vol, uint32_t firstCluster, uint32_t bytes, uint64_t offset, void * target) {
+    IOClass previous = setIOClass(ioData);
+    success ret = readSectors(vol, CLUSTER_FIRST_SECTOR(vol, firstCluster), (uint8_t *)target + offset, SECTORS_FOR(bytes));
+    setIOClass(previous);
+    return ret;
+}
+
+static success copyToHost(Volume * vol, uint32_t firstCluster, uint32_t bytes, uint64_t offset, void * target) {
+    return copyToHostFile(vol, CLUSTER_FIRST_SECTOR(vol, firstCluster), bytes, *(int *)target, offset);
+}
+
+success writeFile(Volume * vol, uint32_t dirCluster, const char * name, const void * data, uint32_t length, boolean append) {
+    FileEntry file;
+    if (locateFile(vol, dirCluster, name, &file) == Failure) return Failure;
+    if (!append) {
+        freeClusterChain(vol, file.firstCluster);
+        file.firstCluster = 0;
+        file.size = 0;
+    }
+    return appendToFile(vol, dirCluster, name, &file, length, data, fillFromMemory, (void *)data);
+}
+
+uint8_t * readFile(Volume * vol, uint32_t dirCluster, const char * name, uint32_t * length) {
+    FileEntry file;
+    if (locateFile(vol, dirCluster, name, &file) == Failure) return NULL;
+    uint8_t * data = malloc((size_t)SECTORS_FOR((uint64_t)file.size) * SECTOR_SIZE + 1);
+    if (!data) {
+        reportMessage("Failed to allocate memory for the content of %s\n", name);
+        return NULL;
+    }
+    if (forEachRun(vol, name, &file, readIntoMemory, data) == Failure) {
+        free(data);
+        return NULL;
+    }
+    *length = file.size;
+    return data;
+}
+
+success importFile(Volume * vol, uint32_t dirCluster, const char * name, int hostFd, uint64_t length) {
+    FileEntry file;
+    if (locateFile(vol, dirCluster, name, &file) == Failure) return Failure;
+    freeClusterChain(vol, file.firstCluster);
+    file.firstCluster = 0;
+    file.size = 0;
+    return appendToFile(vol, dirCluster, name, &file, length, NULL, fillFromHostFile, &hostFd);
+}
+
+success exportFile(Volume * vol, uint32_t dirCluster, const char * name, int hostFd, uint64_t * length) {
+    FileEntry file;
+    if (locateFile(vol, dirCluster, name, &file) == Failure) return Failure;
+    // The data are read behind the sector cache, so whatever it still holds must reach the image first
+    if (syncBufferCache(vol, NULL) == Failure) return Failure;
+    if (forEachRun(vol, name, &file, copyToHost, &hostFd) == Failure) return Failure;
+    *length = file.size;
+    return Success;
+}
@@ -1,76 +1,89 @@
 #include "format.h"
 #include "fat32.h"
-
-boolean checkFormatting(void) {
+#include "fatcache.h"
+#include "allocator.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "volume.h"
+#include "blockdev.h"
+#include "journal.h"
+
+boolean checkFormatting(Volume * vol) {
     success ret = Success;
 
     // Check FAT contents
-    uint32_t * fat = malloc(FAT_SIZE * SECTOR_SIZE);
-    if (!fat) {
-        printf("Failed to allocate memory for FAT\n");
-        return False;
-    }
-    ret = readSectors(N_RESERVED_SECTORS, fat, FAT_SIZE);
-    if (ret == Failure) {
-        free(fat);
-        printf("Failed to read FAT sectors\n");
+    if (!isFATCacheLoaded(vol) && loadFATCache(vol) == Failure) {
+        reportMessage("Failed to read FAT sectors\n");
         return False;
     }
 
-    if (((fat[0] & FAT_ENTRY_MASK) != (0xFFFFFFF8 & FAT_ENTRY_MASK)) ||
-    ((fat[1] & FAT_ENTRY_MASK) != (0x0FFFFFFF & FAT_ENTRY_MASK)) ||
-    ((fat[ROOT_CLUSTER] & FAT_ENTRY_MASK) != (0x0FFFFFFF & FAT_ENTRY_MASK))) {
-        printf("FAT entries are incorrect\n");
-        free(fat);
+    // The root directory may span several clusters, so its entry is either end-of-chain or a link
+    uint32_t rootEntry = getFATEntry(vol, ROOT_CLUSTER);
+    if ((getFATEntry(vol, 0) != (0xFFFFFFF8 & FAT_ENTRY_MASK)) ||
+    (getFATEntry(vol, 1) != (0x0FFFFFFF & FAT_ENTRY_MASK)) ||
+    (rootEntry != (0x0FFFFFFF & FAT_ENTRY_MASK) && (rootEntry < ROOT_CLUSTER + 1 || rootEntry >= N_CLUSTERS(vol)))) {
+        reportMessage("FAT entries are incorrect\n");
         return False;
     }
-    free(fat);
 
     // Check FSInfo sector
     uint8_t fsinfoSector[SECTOR_SIZE];
-    ret = readSector(1, fsinfoSector);
+    ret = readSector(vol, 1, fsinfoSector);
     if (ret == Failure) {
-        printf("Failed to read FSInfo sector\n");
+        reportMessage("Failed to read FSInfo sector\n");
         return False;
     }
 
     if (*(uint32_t *)(fsinfoSector + 0x00) != 0x41615252 ||
         *(uint32_t *)(fsinfoSector + 0x1E4) != 0x61417272) {
-        printf("FSInfo sector is incorrect\n");
+        reportMessage("FSInfo sector is incorrect\n");
         return False;
     }
     uint32_t nextFreeCluster = *(uint32_t *)(fsinfoSector + 0x1EC);
-    if ((nextFreeCluster < ROOT_CLUSTER || nextFreeCluster > N_CLUSTERS + ROOT_CLUSTER - 1) && (nextFreeCluster != 0)) {
-        printf("Next free cluster in FSInfo sector is out of bounds\n");
+    if ((nextFreeCluster < ROOT_CLUSTER || nextFreeCluster > N_CLUSTERS(vol) + ROOT_CLUSTER - 1) && (nextFreeCluster != 0)) {
+        reportMessage("Next free cluster in FSInfo sector is out of bounds\n");
         return False;
     }
     return True;
 }
 
-success format(void) {
-    puts("Formatting FAT32 volume...");
+// A different cluster size means a new BPB; the size of the volume stays what it is
+success format(Volume * vol, uint32_t sectorsPerCluster) {
     success ret = Success;
-    // I initialize FAT tables with zeros
-    uint32_t * fat = calloc(FAT_SIZE, SECTOR_SIZE); if (!fat) return Failure;
-
-    fat[0] = 0xFFFFFFF8; // FAT[0]: media descriptor in low byte + reserved bits set (0x0FFFFFF8)
-    fat[1] = 0x0FFFFFFF; // FAT[1]: end of clusterchain marker
-    fat[ROOT_CLUSTER] = 0x0FFFFFFF; // FAT[2]: root directory cluster (end of chain marker)
+    // Changes still cached or logged for the old tables must not land on the new ones
+    if (syncVolume(vol) == Failure) return Failure;
+    if (sectorsPerCluster && sectorsPerCluster != SECTORS_PER_CLUSTER(vol)) {
+        // The FAT cache and the allocator are sized for the old layout
+        releaseFATCache(vol);
+        releaseAllocator(vol);
+        ret = preformat(vol, TOTAL_N_SECTORS(vol), sectorsPerCluster);
+        if (ret == Failure) return ret;
+    }
+    reportMessage("Formatting FAT32 volume (%u sectors, %u byte(s) per cluster)...\n", TOTAL_N_SECTORS(vol), CLUSTER_SIZE(vol));
+    // I initialize FAT tables with zeros, a chunk at a time so that large FATs need little memory
+    uint32_t chunkSectors = FAT_SIZE(vol) < FORMAT_CHUNK_SECTORS ? FAT_SIZE(vol) : FORMAT_CHUNK_SECTORS;
+    uint32_t * fat = calloc(chunkSectors, SECTOR_SIZE); if (!fat) return Failure;
 
     // I write both FAT copies
     for (uint8_t i = 0; i < N_FATS; ++i) {
-        ret = writeSectors(N_RESERVED_SECTORS + i * FAT_SIZE, fat, FAT_SIZE);
-        if (ret == Failure) {
-            free(fat);
-            return ret;
+        for (uint32_t done = 0; done < FAT_SIZE(vol); done += chunkSectors) {
+            uint32_t count = FAT_SIZE(vol) - done < chunkSectors ? FAT_SIZE(vol) - done : chunkSectors;
+            fat[0] = done ? 0 : 0xFFFFFFF8; // FAT[0]: media descriptor in low byte + reserved bits set (0x0FFFFFF8)
+            fat[1] = done ? 0 : 0x0FFFFFFF; // FAT[1]: end of clusterchain marker
+            fat[ROOT_CLUSTER] = done ? 0 : 0x0FFFFFFF; // FAT[2]: root directory cluster (end of chain marker)
+            ret = writeSectors(vol, N_RESERVED_SECTORS + i * FAT_SIZE(vol) + done, fat, count);
+            if (ret == Failure) {
+                free(fat);
+                return ret;
+            }
         }
     }
     free(fat);
 
     // I initialize root directory cluster with zeros
-    uint8_t * emptyCluster = calloc(SECTORS_PER_CLUSTER, SECTOR_SIZE);
+    uint8_t * emptyCluster = calloc(SECTORS_PER_CLUSTER(vol), SECTOR_SIZE);
     if (!emptyCluster) return Failure;
-    ret = writeSectors(ROOT_DIR_SECTOR, emptyCluster, SECTORS_PER_CLUSTER);
+    ret = writeSectors(vol, ROOT_DIR_SECTOR(vol), emptyCluster, SECTORS_PER_CLUSTER(vol));
     free(emptyCluster);
     if (ret == Failure) return ret;
 
@@ -80,11 +93,20 @@ success format(void) {
     // FSInfo signature offsets
     *(uint32_t *)(fsinfoSector + 0x00) = 0x41615252;  // Lead signature
     *(uint32_t *)(fsinfoSector + 0x1E4) = 0x61417272; // Structure signature
-    *(uint32_t *)(fsinfoSector + 0x1E8) = TOTAL_N_SECTORS / SECTORS_PER_CLUSTER - 2; // Free cluster count (approximate)
-    *(uint32_t *)(fsinfoSector + 0x1EC) = ROOT_CLUSTER + 1; // Next free cluster (start after root cluster)
+    *(uint32_t *)(fsinfoSector + FSINFO_FREE_COUNT_OFFSET) = N_CLUSTERS(vol) - ROOT_CLUSTER - 1; // Free cluster count (all but root)
+    *(uint32_t *)(fsinfoSector + FSINFO_NEXT_FREE_OFFSET) = ROOT_CLUSTER + 1; // Next free cluster (start after root cluster)
     *(uint32_t *)(fsinfoSector + 0x1FC) = 0xAA550000; //  end-of-sector signature ("magic number")
 
-    ret = writeSector(1, fsinfoSector);
+    ret = writeSector(vol, FSINFO_SECTOR, fsinfoSector);
+    if (ret == Failure) return ret;
+    if (syncVolume(vol) == Failure) return Failure;
+
+    // The cached FAT, the allocator and the directory indexes must reflect the freshly written tables
+    invalidateAllDirIndexes(vol);
+    dcacheInvalidateAll(vol);
+    ret = loadFATCache(vol);
+    if (ret == Failure) return ret;
+    ret = initAllocator(vol);
     if (ret == Failure) return ret;
 
     //initializeDotEntries(ROOT_CLUSTER, ROOT_CLUSTER); unnecessary for root
@@ -92,7 +114,8 @@ success format(void) {
 }
 
 
-success preformat(void) {
+success preformat(Volume * vol, uint32_t totalSectors, uint32_t sectorsPerCluster) {
+    if (setGeometry(vol, totalSectors, sectorsPerCluster) == Failure) return Failure;
     // Allocate and zero the first 512 bytes (boot sector)
     unsigned char bootSector[SECTOR_SIZE] = {0};
 
@@ -106,7 +129,7 @@ success preformat(void) {
     // BIOS Parameter Block
     bootSector[0x0B] = SECTOR_SIZE & 0xFF;
     bootSector[0x0C] = (SECTOR_SIZE >> 8) & 0xFF;
-    bootSector[0x0D] = SECTORS_PER_CLUSTER;
+    bootSector[0x0D] = SECTORS_PER_CLUSTER(vol);
     bootSector[0x0E] = N_RESERVED_SECTORS & 0xFF;
     bootSector[0x0F] = (N_RESERVED_SECTORS >> 8) & 0xFF;
     bootSector[0x10] = N_FATS;
@@ -116,20 +139,19 @@ success preformat(void) {
     bootSector[0x1A] = 0xFF; // Number of heads (dummy)
 
     // Total sectors (32-bit)
-    uint32_t totalSectors = TOTAL_N_SECTORS;
     bootSector[0x20] = totalSectors & 0xFF;
     bootSector[0x21] = (totalSectors >> 8) & 0xFF;
     bootSector[0x22] = (totalSectors >> 16) & 0xFF;
     bootSector[0x23] = (totalSectors >> 24) & 0xFF;
 
     // FAT size (32-bit)
-    bootSector[0x24] = FAT_SIZE & 0xFF;
-    bootSector[0x25] = (FAT_SIZE >> 8) & 0xFF;
-    bootSector[0x26] = (FAT_SIZE >> 16) & 0xFF;
-    bootSector[0x27] = (FAT_SIZE >> 24) & 0xFF;
+    bootSector[0x24] = FAT_SIZE(vol) & 0xFF;
+    bootSector[0x25] = (FAT_SIZE(vol) >> 8) & 0xFF;
+    bootSector[0x26] = (FAT_SIZE(vol) >> 16) & 0xFF;
+    bootSector[0x27] = (FAT_SIZE(vol) >> 24) & 0xFF;
 
-    // Extended flags (bit 7 = 1, mirror disabled, active FAT = 0)
-    bootSector[0x28] = 0x80;
+    // Extended flags (bit 7 = 0: the FATs are mirrored; bit 7 = 1: mirror disabled, active FAT = 0)
+    bootSector[0x28] = vol->geometry.mirroredFATs ? EXT_FLAGS_MIRRORED : EXT_FLAGS_SINGLE_FAT;
     bootSector[0x29] = 0x00;
 
     // File system version = 0
@@ -176,29 +198,36 @@ success preformat(void) {
     bootSector[0x1FE] = 0x55;
     bootSector[0x1FF] = 0xAA;
 
+    if (clearJournal(vol) == Failure) return Failure;
+
     // Write main boot sector
-    if (fseek(volume, 0, SEEK_SET) != 0) {
-        perror("Error saving sector 0");
-        fclose(volume);
-        return Failure;
-    }
-    if (fwrite(bootSector, 1, SECTOR_SIZE, volume) != SECTOR_SIZE) {
-        perror("Error saving sector 0");
-        fclose(volume);
+    if (writeSector(vol, 0, bootSector) == Failure) {
+        reportLine("Error saving sector 0");
         return Failure;
     }
 
     // Write backup boot sector
-    if (fseek(volume, 6 * SECTOR_SIZE, SEEK_SET) != 0) {
-        perror("Error saving sector 6");
-        fclose(volume);
+    if (writeSector(vol, 6, bootSector) == Failure) {
+        reportLine("Error saving sector 6");
         return Failure;
     }
-    if (fwrite(bootSector, 1, SECTOR_SIZE, volume) != SECTOR_SIZE) {
-        perror("Error saving sector 6");
-        fclose(volume);
+    return syncVolume(vol);
+}
+// The copies are made identical (again) before the BPB says they are mirrored, so that a crash in
+// between leaves a volume whose first FAT is still the only active one
+success setFATMirroring(Volume * vol, boolean mirrored) {
+    if (mirrored && copyActiveFAT(vol) == Failure) return Failure;
+    if (commitMetadata(vol) == Failure) return Failure;
+    uint8_t bootSector[SECTOR_SIZE];
+    if (readSectors(vol, 0, bootSector, 1) == Failure) {
+        reportLine("Error reading sector 0");
         return Failure;
     }
-    fflush(volume);
-    return Success;
-}
\ No newline at end of file
+    bootSector[0x28] = mirrored ? EXT_FLAGS_MIRRORED : EXT_FLAGS_SINGLE_FAT;
+    if (writeSector(vol, 0, bootSector) == Failure || writeSector(vol, 6, bootSector) == Failure) {
+        reportLine("Error saving the boot sectors");
+        return Failure;
+    }
+    vol->geometry.mirroredFATs = mirrored;
+    return syncVolume(vol);
+}
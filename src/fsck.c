@@ -0,0 +1,489 @@
+#include "fsck.h"
+#include "fat32.h"
+#include "fatcache.h"
+#include "allocator.h"
+#include "blockdev.h"
+#include "bufcache.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "volume.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+// The check works on a snapshot of the FAT taken after everything cached has been written out.
+// Directories are read level by level (breadth-first): the directories of one level are shared
+// by a pool of worker threads that read their clusters with pread() (or straight from the mapping)
+// and collect the entries they hold. Claiming the clusters of every chain is then done by a single
+// thread in a fixed order, so that the outcome of a check does not depend on thread scheduling;
+// it only walks the in-memory snapshot and takes a small part of the time.
+#define FSCK_BROKEN_LINK 0xFFFFFFFF
+
+typedef struct {
+    uint32_t cluster;
+    uint32_t parent;
+    char * path;
+} FsckDirectory;
+
+typedef struct {
+    uint32_t dirCluster;
+    uint32_t slot;
+    uint32_t firstCluster;
+    uint32_t size;
+    boolean isDirectory;
+    const char * dirPath;
+    char name[FULL_FILE_STRING_SIZE];
+} FsckEntry;
+
+typedef struct {
+    uint32_t dirCluster;
+    uint32_t slot; // 0 for ".", 1 for ".."
+    uint32_t expected;
+    uint32_t found;
+    boolean missing;
+    const char * path;
+} FsckDotIssue;
+
+typedef struct {
+    void * items;
+    uint32_t count;
+    uint32_t capacity;
+    size_t itemSize;
+} FsckList;
+
+// What one check works on; the workers share it
+typedef struct {
+    Volume * vol;
+    uint32_t * fat;          // snapshot of the first FAT
+    uint64_t * visited;      // directories already queued, set by the workers
+    uint64_t * owned;        // clusters claimed by a chain
+    uint32_t nextDirectory;  // next directory of the current level, taken atomically
+    int imageFd;
+    MessageTarget * messages; // where the workers report, the same as the caller
+} FsckCheck;
+
+typedef struct {
+    FsckCheck * check;
+    const FsckDirectory * level;
+    uint32_t levelCount;
+    FsckList subdirectories;
+    FsckList entries;
+    FsckList dotIssues;
+    uint8_t * buffer;
+    boolean failed;
+} FsckWorker;
+
+static void initList(FsckList * list, size_t itemSize) {
+    list->items = NULL;
+    list->count = list->capacity = 0;
+    list->itemSize = itemSize;
+}
+
+static boolean pushItem(FsckList * list, const void * item) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+        void * grown = realloc(list->items, capacity * list->itemSize);
+        if (!grown) return False;
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    memcpy((uint8_t *)list->items + list->count * list->itemSize, item, list->itemSize);
+    ++list->count;
+    return True;
+}
+
+static boolean appendList(FsckList * list, const FsckList * other) {
+    for (uint32_t i = 0; i < other->count; ++i)
+        if (!pushItem(list, (const uint8_t *)other->items + i * other->itemSize)) return False;
+    return True;
+}
+
+static boolean testAndSet(uint64_t * bitmap, uint32_t bit) {
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    return (__atomic_fetch_or(&bitmap[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static boolean isValidCluster(const FsckCheck * check, uint32_t cluster) {
+    return cluster >= ROOT_CLUSTER && cluster < N_CLUSTERS(check->vol);
+}
+
+// The next cluster of a chain, 0 at its end and FSCK_BROKEN_LINK when the link leads nowhere valid
+static uint32_t nextInChain(const FsckCheck * check, uint32_t cluster) {
+    uint32_t next = check->fat[cluster];
+    if (next >= FAT_EOC_MIN) return 0;
+    return isValidCluster(check, next) ? next : FSCK_BROKEN_LINK;
+}
+
+static success readRaw(const FsckCheck * check, uint32_t lba, void * buffer, uint32_t count) {
+    const uint8_t * mapped = mappedSectors(check->vol->device, lba, count);
+    if (mapped) {
+        memcpy(buffer, mapped, (size_t)count * SECTOR_SIZE);
+        return Success;
+    }
+    size_t total = (size_t)count * SECTOR_SIZE, done = 0;
+    while (done < total) {
+        ssize_t n = pread(check->imageFd, (uint8_t *)buffer + done, total - done, (off_t)lba * SECTOR_SIZE + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return Failure;
+        done += (size_t)n;
+    }
+    return Success;
+}
+
+static boolean isDotName(const uint8_t * name, int dots) {
+    for (int i = 0; i < FILE_AND_EXT_RAW_LENGTH; ++i)
+        if (name[i] != (i < dots ? '.' : ' ')) return False;
+    return True;
+}
+
+static void checkDotEntry(FsckWorker * worker, const FsckDirectory * dir, const uint8_t * entry, uint32_t slot) {
+    // The emulator points ".." of the root's children at the root cluster, other tools use 0
+    uint32_t expected = slot == 0 ? dir->cluster : dir->parent;
+    FsckDotIssue issue = { dir->cluster, slot, expected, 0, False, dir->path };
+    if (!isDotName(entry, (int)slot + 1) || !(entry[11] & 0x10)) issue.missing = True;
+    else {
+        issue.found = entryFirstCluster(entry);
+        if (issue.found == expected || (slot == 1 && expected == ROOT_CLUSTER && issue.found == 0)) return;
+    }
+    if (!pushItem(&worker->dotIssues, &issue)) worker->failed = True;
+}
+
+// I read one directory cluster after the other and keep what its entries describe
+static void scanDirectory(FsckWorker * worker, const FsckDirectory * dir) {
+    FsckCheck * check = worker->check;
+    Volume * vol = check->vol;
+    uint32_t cluster = dir->cluster;
+    for (uint32_t index = 0; cluster && cluster != FSCK_BROKEN_LINK && index < MAX_DIR_CLUSTERS(vol); ++index) {
+        const uint8_t * data = mappedSectors(vol->device, CLUSTER_FIRST_SECTOR(vol, cluster), SECTORS_PER_CLUSTER(vol));
+        if (!data) {
+            if (readRaw(check, CLUSTER_FIRST_SECTOR(vol, cluster), worker->buffer, SECTORS_PER_CLUSTER(vol)) == Failure) {
+                reportMessage("Failed to read directory cluster %u\n", cluster);
+                worker->failed = True;
+                return;
+            }
+            data = worker->buffer;
+        }
+        for (uint32_t i = 0; i < ENTRIES_PER_CLUSTER(vol); ++i) {
+            const uint8_t * entry = data + i * ENTRY_SIZE;
+            uint32_t slot = index * ENTRIES_PER_CLUSTER(vol) + i;
+            if (entry[0] == 0x00) return; // end of directory
+            if (dir->cluster != ROOT_CLUSTER && slot < 2) {
+                checkDotEntry(worker, dir, entry, slot);
+                continue;
+            }
+            if (entry[0] == 0xE5 || (entry[11] & 0x0F) == 0x0F || (entry[11] & 0x08)) continue;
+            FsckEntry found = { dir->cluster, slot, entryFirstCluster(entry), entryFileSize(entry),
+                (entry[11] & 0x10) ? True : False, dir->path, { 0 } };
+            extractNameToBuffer(entry, found.name);
+            if (!pushItem(&worker->entries, &found)) {
+                worker->failed = True;
+                return;
+            }
+            if (!found.isDirectory || !isValidCluster(check, found.firstCluster) || testAndSet(check->visited, found.firstCluster)) continue;
+            FsckDirectory child = { found.firstCluster, dir->cluster, malloc(strlen(dir->path) + FULL_FILE_STRING_SIZE + 1) };
+            if (!child.path || !pushItem(&worker->subdirectories, &child)) {
+                free(child.path);
+                worker->failed = True;
+                return;
+            }
+            sprintf(child.path, "%s%s/", dir->path, found.name);
+        }
+        cluster = nextInChain(check, cluster);
+    }
+}
+
+static void * runWorker(void * argument) {
+    FsckWorker * worker = argument;
+    useMessageTarget(worker->check->messages);
+    while (!worker->failed) {
+        uint32_t i = __atomic_fetch_add(&worker->check->nextDirectory, 1, __ATOMIC_RELAXED);
+        if (i >= worker->levelCount) break;
+        scanDirectory(worker, &worker->level[i]);
+    }
+    return NULL;
+}
+
+static uint32_t threadCount(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1) return 1;
+    return online < FSCK_MAX_THREADS ? (uint32_t)online : FSCK_MAX_THREADS;
+}
+
+// Breadth-first walk of the tree; every directory ever queued stays in "directories" so that
+// the paths of the entries remain valid until the check is over
+static success walkTree(FsckCheck * check, uint32_t nThreads, FsckList * directories, FsckList * entries, FsckList * dotIssues) {
+    FsckWorker workers[FSCK_MAX_THREADS];
+    pthread_t threads[FSCK_MAX_THREADS];
+    for (uint32_t t = 0; t < nThreads; ++t) {
+        initList(&workers[t].subdirectories, sizeof(FsckDirectory));
+        initList(&workers[t].entries, sizeof(FsckEntry));
+        initList(&workers[t].dotIssues, sizeof(FsckDotIssue));
+        workers[t].check = check;
+        workers[t].buffer = malloc(CLUSTER_SIZE(check->vol));
+        workers[t].failed = workers[t].buffer == NULL;
+    }
+    success ret = Success;
+    uint32_t levelStart = 0;
+    while (ret == Success && levelStart < directories->count) {
+        uint32_t levelCount = directories->count - levelStart;
+        // The list grows once the level is done, so the workers can point into it
+        const FsckDirectory * level = (const FsckDirectory *)directories->items + levelStart;
+        uint32_t used = levelCount < nThreads ? levelCount : nThreads;
+        check->nextDirectory = 0;
+        for (uint32_t t = 0; t < used; ++t) {
+            workers[t].level = level;
+            workers[t].levelCount = levelCount;
+            workers[t].subdirectories.count = workers[t].entries.count = workers[t].dotIssues.count = 0;
+        }
+        uint32_t started = 1;
+        for (; started < used; ++started)
+            if (pthread_create(&threads[started], NULL, runWorker, &workers[started]) != 0) break;
+        runWorker(&workers[0]);
+        for (uint32_t t = 1; t < started; ++t) pthread_join(threads[t], NULL);
+        levelStart += levelCount;
+        for (uint32_t t = 0; t < used && ret == Success; ++t) {
+            if (workers[t].failed || !appendList(directories, &workers[t].subdirectories) ||
+                !appendList(entries, &workers[t].entries) || !appendList(dotIssues, &workers[t].dotIssues)) ret = Failure;
+        }
+    }
+    for (uint32_t t = 0; t < nThreads; ++t) {
+        free(workers[t].subdirectories.items);
+        free(workers[t].entries.items);
+        free(workers[t].dotIssues.items);
+        free(workers[t].buffer);
+    }
+    return ret;
+}
+
+static int compareEntries(const void * a, const void * b) {
+    const FsckEntry * x = a, * y = b;
+    if (x->dirCluster != y->dirCluster) return (x->dirCluster > y->dirCluster) - (x->dirCluster < y->dirCluster);
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+static int compareDotIssues(const void * a, const void * b) {
+    const FsckDotIssue * x = a, * y = b;
+    if (x->dirCluster != y->dirCluster) return (x->dirCluster > y->dirCluster) - (x->dirCluster < y->dirCluster);
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+static void noteRepair(FsckReport * report, success ret) {
+    if (ret == Success) ++report->repaired;
+    else ++report->unrepaired;
+}
+
+// A chain is cut after its last sound cluster; a file that loses its first cluster becomes empty
+static void cutChain(FsckCheck * check, const FsckEntry * entry, uint32_t last, FsckReport * report) {
+    if (last) {
+        setFATEntry(check->vol, last, FAT_EOC);
+        check->fat[last] = FAT_EOC;
+        noteRepair(report, Success);
+    } else if (entry && !entry->isDirectory) noteRepair(report, updateDirectoryEntry(check->vol, entry->dirCluster, entry->slot, 0, 0));
+    else ++report->unrepaired;
+}
+
+// I claim every cluster of the chain and stop at the first one that is invalid, free or already
+// claimed; the number of clusters claimed is returned
+static uint32_t claimChain(FsckCheck * check, const FsckEntry * entry, uint32_t first, boolean repair, FsckReport * report) {
+    const char * dirPath = entry ? entry->dirPath : "/";
+    const char * name = entry ? entry->name : "";
+    uint32_t cluster = first, last = 0, length = 0;
+    while (True) {
+        if (!isValidCluster(check, cluster) || check->fat[cluster] == 0) {
+            reportMessage("Broken chain: %s%s links to %s cluster %u after %u cluster(s)\n", dirPath, name,
+                isValidCluster(check, cluster) ? "free" : "invalid", cluster, length);
+            ++report->brokenChains;
+            if (repair) cutChain(check, entry, last, report);
+            return length;
+        }
+        if (testAndSet(check->owned, cluster)) {
+            reportMessage("Cross-link: %s%s shares cluster %u with another chain (or loops back to it)\n", dirPath, name, cluster);
+            ++report->crossLinks;
+            if (repair) cutChain(check, entry, last, report);
+            return length;
+        }
+        ++length;
+        uint32_t next = nextInChain(check, cluster);
+        if (next == 0) return length;
+        last = cluster;
+        cluster = next == FSCK_BROKEN_LINK ? check->fat[cluster] : next;
+    }
+}
+
+static void claimEntries(FsckCheck * check, FsckList * entries, boolean repair, FsckReport * report) {
+    Volume * vol = check->vol;
+    qsort(entries->items, entries->count, sizeof(FsckEntry), compareEntries);
+    for (uint32_t i = 0; i < entries->count; ++i) {
+        const FsckEntry * entry = (const FsckEntry *)entries->items + i;
+        if (entry->isDirectory) ++report->directories;
+        else ++report->files;
+        if (entry->firstCluster == 0) {
+            if (entry->isDirectory) {
+                reportMessage("Broken chain: directory %s%s has no cluster\n", entry->dirPath, entry->name);
+                ++report->brokenChains;
+                if (repair) ++report->unrepaired;
+            } else if (entry->size) {
+                reportMessage("Bad size: %s%s has %u byte(s) but no cluster\n", entry->dirPath, entry->name, entry->size);
+                ++report->badSizes;
+                if (repair) noteRepair(report, updateDirectoryEntry(vol, entry->dirCluster, entry->slot, 0, 0));
+            }
+            continue;
+        }
+        uint32_t length = claimChain(check, entry, entry->firstCluster, repair, report);
+        report->usedClusters += length;
+        uint64_t capacity = (uint64_t)length * CLUSTER_SIZE(vol);
+        // A file that lost its whole chain has been reported (and emptied) already
+        if (!entry->isDirectory && length && entry->size > capacity) {
+            reportMessage("Bad size: %s%s has %u byte(s) but only %llu byte(s) of clusters\n", entry->dirPath, entry->name,
+                entry->size, (unsigned long long)capacity);
+            ++report->badSizes;
+            if (repair) noteRepair(report, updateDirectoryEntry(vol, entry->dirCluster, entry->slot, entry->firstCluster, (uint32_t)capacity));
+        }
+    }
+}
+
+static void checkDotIssues(FsckCheck * check, FsckList * dotIssues, boolean repair, FsckReport * report) {
+    qsort(dotIssues->items, dotIssues->count, sizeof(FsckDotIssue), compareDotIssues);
+    for (uint32_t i = 0; i < dotIssues->count; ++i) {
+        const FsckDotIssue * issue = (const FsckDotIssue *)dotIssues->items + i;
+        ++report->badDotEntries;
+        if (issue->missing) {
+            reportMessage("Bad directory: %s has no \"%s\" entry\n", issue->path, issue->slot ? ".." : ".");
+            if (repair) ++report->unrepaired;
+            continue;
+        }
+        reportMessage("Bad directory: \"%s\" of %s points to cluster %u instead of %u\n", issue->slot ? ".." : ".", issue->path,
+            issue->found, issue->expected);
+        if (repair) noteRepair(report, updateDirectoryEntry(check->vol, issue->dirCluster, issue->slot, issue->expected, 0));
+    }
+}
+
+// Allocated clusters that no chain claims are lost; I print them as ranges
+static void checkOrphans(FsckCheck * check, boolean repair, FsckReport * report) {
+    Volume * vol = check->vol;
+    uint32_t rangeStart = 0, nRanges = 0;
+    for (uint32_t cluster = ROOT_CLUSTER; cluster <= N_CLUSTERS(vol); ++cluster) {
+        boolean orphan = cluster < N_CLUSTERS(vol) && check->fat[cluster] != 0 && !(check->owned[cluster / 64] & ((uint64_t)1 << (cluster % 64)));
+        if (orphan) {
+            if (!rangeStart) rangeStart = cluster;
+            ++report->orphanClusters;
+            if (repair) {
+                setFATEntry(vol, cluster, 0);
+                check->fat[cluster] = 0;
+            }
+            continue;
+        }
+        if (!rangeStart) continue;
+        if (nRanges++ < FSCK_MAX_REPORTED_RANGES) reportMessage("Lost clusters: %u-%u belong to no file or directory\n", rangeStart, cluster - 1);
+        rangeStart = 0;
+    }
+    if (nRanges > FSCK_MAX_REPORTED_RANGES) reportMessage("... and %u more range(s) of lost clusters\n", nRanges - FSCK_MAX_REPORTED_RANGES);
+    if (repair && report->orphanClusters) ++report->repaired;
+}
+
+static uint32_t countFreeClusters(const FsckCheck * check) {
+    uint32_t count = 0;
+    for (uint32_t cluster = ROOT_CLUSTER; cluster < N_CLUSTERS(check->vol); ++cluster) count += check->fat[cluster] == 0;
+    return count;
+}
+
+// Lost clusters are not free, so the count is compared before anything is repaired
+static void checkFreeCount(Volume * vol, uint32_t storedCount, uint32_t actual, FsckReport * report) {
+    if (storedCount == actual && getFreeClusterCount(vol) == actual) return;
+    report->freeCountDrift = True;
+    reportMessage("Free count: FSInfo says %u, the allocator %u, the FAT has %u free cluster(s)\n", storedCount,
+        getFreeClusterCount(vol), actual);
+}
+
+static void releaseSnapshot(FsckCheck * check) {
+    free(check->fat);
+    free(check->visited);
+    free(check->owned);
+    check->fat = NULL;
+    check->visited = check->owned = NULL;
+}
+
+success checkVolume(Volume * vol, boolean repair, FsckReport * report) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(report, 0, sizeof(FsckReport));
+    report->threads = threadCount();
+
+    // The FSInfo count is read as the last commit left it, then everything reaches the image
+    uint8_t fsinfoSector[SECTOR_SIZE];
+    if (readSector(vol, FSINFO_SECTOR, fsinfoSector) == Failure) return Failure;
+    uint32_t storedCount = *(uint32_t *)(fsinfoSector + FSINFO_FREE_COUNT_OFFSET);
+    if (flushFATCache(vol) == Failure || syncBufferCache(vol, NULL) == Failure || flushVolume(vol->device) == Failure) return Failure;
+    FsckCheck check = { vol, NULL, NULL, NULL, 0, -1, currentMessageTarget() };
+    check.imageFd = vol->device->kind == backendStdio ? fileno(vol->device->file) : vol->device->fd;
+
+    size_t bitmapWords = (N_CLUSTERS(vol) + 63) / 64;
+    check.fat = malloc((size_t)FAT_SIZE(vol) * SECTOR_SIZE);
+    check.visited = calloc(bitmapWords, sizeof(uint64_t));
+    check.owned = calloc(bitmapWords, sizeof(uint64_t));
+    if (!check.fat || !check.visited || !check.owned || readRaw(&check, N_RESERVED_SECTORS, check.fat, FAT_SIZE(vol)) == Failure) {
+        reportMessage("Failed to take a snapshot of the FAT\n");
+        releaseSnapshot(&check);
+        return Failure;
+    }
+    for (uint32_t cluster = 0; cluster < N_CLUSTERS(vol); ++cluster) check.fat[cluster] &= FAT_ENTRY_MASK;
+
+    FsckList directories, entries, dotIssues;
+    initList(&directories, sizeof(FsckDirectory));
+    initList(&entries, sizeof(FsckEntry));
+    initList(&dotIssues, sizeof(FsckDotIssue));
+    FsckDirectory root = { ROOT_CLUSTER, ROOT_CLUSTER, malloc(2) };
+    success ret = root.path && pushItem(&directories, &root) ? Success : Failure;
+    if (ret == Success) {
+        strcpy(root.path, "/");
+        testAndSet(check.visited, ROOT_CLUSTER);
+        ret = walkTree(&check, report->threads, &directories, &entries, &dotIssues);
+    } else free(root.path);
+
+    if (ret == Success) {
+        // Directory entries are repaired before any chain is cut, while every slot can still be reached
+        checkFreeCount(vol, storedCount, countFreeClusters(&check), report);
+        checkDotIssues(&check, &dotIssues, repair, report);
+        report->usedClusters = claimChain(&check, NULL, ROOT_CLUSTER, repair, report);
+        claimEntries(&check, &entries, repair, report);
+        checkOrphans(&check, repair, report);
+        if (repair && fsckProblemCount(report)) {
+            // Freed orphans have been counted by the allocator, but its starting point may have been wrong
+            setFreeClusterCount(vol, countFreeClusters(&check));
+            if (report->freeCountDrift) ++report->repaired;
+            // The repaired entries and chains are read again through fresh indexes
+            invalidateAllDirIndexes(vol);
+            dcacheInvalidateAll(vol);
+            ret = syncVolume(vol);
+        }
+    } else reportMessage("Failed to walk the directory tree\n");
+
+    for (uint32_t i = 0; i < directories.count; ++i) free(((FsckDirectory *)directories.items)[i].path);
+    free(directories.items);
+    free(entries.items);
+    free(dotIssues.items);
+    releaseSnapshot(&check);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return ret;
+}
+
+uint32_t fsckProblemCount(const FsckReport * report) {
+    return report->crossLinks + report->brokenChains + report->badDotEntries + report->badSizes +
+        (report->orphanClusters ? 1 : 0) + (report->freeCountDrift ? 1 : 0);
+}
+
+void printFsckReport(const FsckReport * report, boolean repair) {
+    reportMessage("fsck: %u director(ies), %u file(s), %u cluster(s) in use, checked in %.3f ms with %u thread(s)\n",
+        report->directories, report->files, report->usedClusters, report->seconds * 1e3, report->threads);
+    if (!fsckProblemCount(report)) {
+        reportLine("The volume is clean");
+        return;
+    }
+    reportMessage("%u cross-link(s), %u broken chain(s), %u bad dot entr(ies), %u bad size(s), %u lost cluster(s)%s\n",
+        report->crossLinks, report->brokenChains, report->badDotEntries, report->badSizes, report->orphanClusters,
+        report->freeCountDrift ? ", wrong free count" : "");
+    if (repair) reportMessage("%u repair(s) made, %u problem(s) left as they are\n", report->repaired, report->unrepaired);
+    else reportLine("Run \"fsck repair\" (or --fsck=repair) to fix them");
+}
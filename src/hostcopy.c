@@ -0,0 +1,161 @@
+#define _GNU_SOURCE // copy_file_range()
+#include "hostcopy.h"
+#include "blockdev.h"
+#include "bufcache.h"
+#include "stats.h"
+#include "volume.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// Streaming between a host file and the image file descriptor, so that bulk data never goes
+// through the sector path. I try copy_file_range() first (the kernel copies, possibly without
+// touching the data), then sendfile(), then plain pread/pwrite with a large aligned buffer.
+// With the mmap backend the host file is read or written straight from the mapping.
+
+// The method is what the thread reports right after its copy, so each thread keeps its own
+static __thread HostCopyMethod lastMethod = copyBuffered;
+static const char * methodNames[] = { "copy_file_range", "sendfile", "buffered", "mmap" };
+
+static int imageDescriptor(Volume * vol) {
+    if (vol->device->kind == backendStdio) {
+        fflush(vol->device->file); // pending stdio writes must reach the descriptor first
+        return fileno(vol->device->file);
+    }
+    return vol->device->fd;
+}
+
+static boolean worthFallingBack(int error) {
+    return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
+#ifdef __linux__
+static int64_t kernelCopy(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t bytes) {
+    loff_t in = (loff_t)inOffset, out = (loff_t)outOffset;
+    uint64_t done = 0;
+    while (done < bytes) {
+        ssize_t n = copy_file_range(inFd, &in, outFd, &out, (size_t)(bytes - done), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return done ? -1 : (worthFallingBack(errno) ? -2 : -1);
+        if (n == 0) return -1; // the source ended early
+        done += (uint64_t)n;
+    }
+    return (int64_t)done;
+}
+
+// sendfile() writes at the current offset of the output descriptor
+static int64_t sendfileCopy(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t bytes) {
+    if (lseek(outFd, (off_t)outOffset, SEEK_SET) < 0) return -2;
+    off_t in = (off_t)inOffset;
+    uint64_t done = 0;
+    while (done < bytes) {
+        ssize_t n = sendfile(outFd, inFd, &in, (size_t)(bytes - done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return done ? -1 : (worthFallingBack(errno) ? -2 : -1);
+        if (n == 0) return -1;
+        done += (uint64_t)n;
+    }
+    return (int64_t)done;
+}
+#endif
+
+static success bufferedCopy(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t bytes) {
+    void * buffer = NULL;
+    if (posix_memalign(&buffer, HOST_COPY_ALIGNMENT, HOST_COPY_BUFFER_SIZE) != 0) {
+        reportMessage("Failed to allocate the copy buffer\n");
+        return Failure;
+    }
+    uint64_t done = 0;
+    while (done < bytes) {
+        size_t chunk = bytes - done < HOST_COPY_BUFFER_SIZE ? (size_t)(bytes - done) : HOST_COPY_BUFFER_SIZE;
+        ssize_t n = pread(inFd, buffer, chunk, (off_t)(inOffset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        size_t written = 0;
+        while (written < (size_t)n) {
+            ssize_t w = pwrite(outFd, (uint8_t *)buffer + written, (size_t)n - written, (off_t)(outOffset + done + written));
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                free(buffer);
+                return Failure;
+            }
+            written += (size_t)w;
+        }
+        done += (uint64_t)n;
+    }
+    free(buffer);
+    return done == bytes ? Success : Failure;
+}
+
+static success copyBetweenDescriptors(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t bytes) {
+#ifdef __linux__
+    int64_t copied = kernelCopy(inFd, inOffset, outFd, outOffset, bytes);
+    if (copied >= 0) {
+        lastMethod = copyKernel;
+        return Success;
+    }
+    if (copied == -1) return Failure;
+    copied = sendfileCopy(inFd, inOffset, outFd, outOffset, bytes);
+    if (copied >= 0) {
+        lastMethod = copySendfile;
+        return Success;
+    }
+    if (copied == -1) return Failure;
+#endif
+    lastMethod = copyBuffered;
+    return bufferedCopy(inFd, inOffset, outFd, outOffset, bytes);
+}
+
+success copyFromHostFile(Volume * vol, int hostFd, uint64_t hostOffset, uint32_t lba, uint64_t bytes) {
+    if (!vol->device || (uint64_t)lba * SECTOR_SIZE + bytes > vol->device->size) {
+        reportMessage("Error importing %llu byte(s) at sector %u: beyond the end of the volume\n", (unsigned long long)bytes, lba);
+        return Failure;
+    }
+    discardCachedRange(vol, lba, (uint32_t)((bytes + SECTOR_SIZE - 1) / SECTOR_SIZE));
+    countDataTransfer(vol->stats, (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE, True);
+    if (vol->device->kind == backendMmap) {
+        uint8_t * target = mappedSectorsForWrite(vol->device, lba, (uint32_t)((bytes + SECTOR_SIZE - 1) / SECTOR_SIZE));
+        uint64_t done = 0;
+        while (done < bytes) {
+            ssize_t n = pread(hostFd, target + done, (size_t)(bytes - done), (off_t)(hostOffset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return Failure;
+            done += (uint64_t)n;
+        }
+        lastMethod = copyMapped;
+        return Success;
+    }
+    return copyBetweenDescriptors(hostFd, hostOffset, imageDescriptor(vol), (uint64_t)lba * SECTOR_SIZE, bytes);
+}
+
+success copyToHostFile(Volume * vol, uint32_t lba, uint64_t bytes, int hostFd, uint64_t hostOffset) {
+    if (!vol->device || (uint64_t)lba * SECTOR_SIZE + bytes > vol->device->size) {
+        reportMessage("Error exporting %llu byte(s) at sector %u: beyond the end of the volume\n", (unsigned long long)bytes, lba);
+        return Failure;
+    }
+    countDataTransfer(vol->stats, (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE, False);
+    if (vol->device->kind == backendMmap) {
+        const uint8_t * source = mappedSectors(vol->device, lba, (uint32_t)((bytes + SECTOR_SIZE - 1) / SECTOR_SIZE));
+        uint64_t done = 0;
+        while (done < bytes) {
+            ssize_t n = pwrite(hostFd, source + done, (size_t)(bytes - done), (off_t)(hostOffset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return Failure;
+            done += (uint64_t)n;
+        }
+        lastMethod = copyMapped;
+        return Success;
+    }
+    return copyBetweenDescriptors(imageDescriptor(vol), (uint64_t)lba * SECTOR_SIZE, hostFd, hostOffset, bytes);
+}
+
+HostCopyMethod lastHostCopyMethod(void) {
+    return lastMethod;
+}
+
+const char * hostCopyMethodName(HostCopyMethod method) {
+    return methodNames[method];
+}
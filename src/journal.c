@@ -0,0 +1,341 @@
+#include "journal.h"
+#include "fat32.h"
+#include "fatcache.h"
+#include "allocator.h"
+#include "bufcache.h"
+#include "blockdev.h"
+#include "durability.h"
+#include "volume.h"
+
+#include <stddef.h>
+
+// The metadata sectors a command modifies (FAT, directories, FSInfo) become one record: a descriptor
+// sector that lists their LBAs, followed by their contents. Records are appended one after another
+// and reach the volume together (group commit) only when something has to rely on them: before one
+// of their sectors is written back to its place, and at a checkpoint. Until then the logged sectors
+// stay dirty in the caches. A checkpoint writes the latest logged version of every sector to its
+// place and leaves the mark of an empty journal at its head; a mount replays whatever is still there.
+// A command that changes more sectors than a record holds is written in place, as without journal.
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count;    // logged sectors after the descriptor, 0 in the mark of an empty journal
+    uint32_t checksum; // of the whole record, computed with this field set to zero
+    uint32_t fatSize;  // logged sectors of the first FAT are written to fatCopies copies
+    uint32_t fatCopies;
+    uint32_t lbas[JOURNAL_MAX_RECORD_SECTORS];
+} JournalDescriptor;
+
+typedef struct {
+    uint32_t lba;
+    const uint8_t * data;
+    boolean inFAT;
+} LoggedSector;
+
+struct Journal {
+    boolean enabled;
+    uint8_t (* image)[SECTOR_SIZE]; // the journal region as written since the last checkpoint, read at mount
+    uint32_t tail;     // first free sector of the region
+    uint32_t sequence; // of the next record; records left behind by earlier runs have smaller ones
+    boolean unflushed;     // records appended since the last barrier
+    boolean markUnflushed; // the empty mark, which must not be lost once sectors are written in place again
+    uint64_t nRecords, nSectorsLogged, nCheckpoints, nInPlace;
+};
+
+Journal * createJournal(void) {
+    Journal * journal = calloc(1, sizeof(Journal));
+    if (!journal) return NULL;
+    journal->enabled = True;
+    journal->sequence = 1;
+    return journal;
+}
+
+void setJournalEnabled(Volume * vol, boolean on) {
+    Journal * journal = vol->journal;
+    journal->enabled = on;
+}
+
+boolean isJournalEnabled(Volume * vol) {
+    Journal * journal = vol->journal;
+    return journal->enabled;
+}
+
+// Records are built from the caches, so a mapped volume or a disabled sector cache goes without journal
+boolean isJournalActive(Volume * vol) {
+    Journal * journal = vol->journal;
+    return journal->enabled && journal->image && vol->device && vol->device->kind != backendMmap && getBufferCacheCapacity(vol) > 0;
+}
+
+// FNV-1a over the record, with the checksum field counted as zero
+static uint32_t recordChecksum(const uint8_t * record, uint32_t sectors) {
+    uint32_t hash = 2166136261u;
+    size_t field = offsetof(JournalDescriptor, checksum);
+    for (size_t i = 0; i < (size_t)sectors * SECTOR_SIZE; ++i) {
+        uint8_t byte = (i >= field && i < field + sizeof(uint32_t)) ? 0 : record[i];
+        hash = (hash ^ byte) * 16777619u;
+    }
+    return hash;
+}
+
+static void sealRecord(Volume * vol, uint32_t at, JournalDescriptor * descriptor) {
+    Journal * journal = vol->journal;
+    memset(journal->image[at], 0, SECTOR_SIZE);
+    memcpy(journal->image[at], descriptor, sizeof(JournalDescriptor));
+    descriptor->checksum = recordChecksum(journal->image[at], 1 + descriptor->count);
+    memcpy(journal->image[at], descriptor, sizeof(JournalDescriptor));
+}
+
+static boolean isLoggedFATSector(uint32_t lba, const JournalDescriptor * descriptor) {
+    return lba >= N_RESERVED_SECTORS && lba - N_RESERVED_SECTORS < descriptor->fatSize;
+}
+
+// A record is replayed only if it is whole, names sectors of the volume outside the journal, and its checksum matches
+static boolean isValidRecord(Volume * vol, uint32_t at, uint64_t totalSectors, JournalDescriptor * descriptor) {
+    Journal * journal = vol->journal;
+    memcpy(descriptor, journal->image[at], sizeof(JournalDescriptor));
+    if (descriptor->magic != JOURNAL_MAGIC || descriptor->count > JOURNAL_MAX_RECORD_SECTORS || at + 1 + descriptor->count > JOURNAL_SECTORS)
+        return False;
+    if (descriptor->fatCopies > N_FATS || N_RESERVED_SECTORS + (uint64_t)descriptor->fatSize * descriptor->fatCopies > totalSectors)
+        return False;
+    for (uint32_t i = 0; i < descriptor->count; ++i) {
+        uint32_t lba = descriptor->lbas[i];
+        if (lba >= totalSectors || (lba >= JOURNAL_FIRST_SECTOR && lba < N_RESERVED_SECTORS)) return False;
+    }
+    return recordChecksum(journal->image[at], 1 + descriptor->count) == descriptor->checksum;
+}
+
+static int compareByLBA(const void * a, const void * b) {
+    uint32_t lbaA = ((const LoggedSector *)a)->lba, lbaB = ((const LoggedSector *)b)->lba;
+    return (lbaA > lbaB) - (lbaA < lbaB);
+}
+
+// I write the latest logged version of every sector to its place (each FAT sector to every copy),
+// in LBA order and with one vectored write per run of consecutive sectors
+static success applyRecords(Volume * vol, uint32_t end, uint32_t * written) {
+    Journal * journal = vol->journal;
+    LoggedSector latest[JOURNAL_MAX_RECORD_SECTORS], targets[JOURNAL_MAX_RECORD_SECTORS * N_FATS];
+    struct iovec parts[JOURNAL_MAX_RECORD_SECTORS * N_FATS];
+    uint32_t nLatest = 0, nTargets = 0;
+    JournalDescriptor descriptor;
+    for (uint32_t at = 0; at < end; at += 1 + descriptor.count) {
+        memcpy(&descriptor, journal->image[at], sizeof(JournalDescriptor));
+        for (uint32_t i = 0; i < descriptor.count; ++i) {
+            uint32_t k = 0;
+            while (k < nLatest && latest[k].lba != descriptor.lbas[i]) ++k;
+            if (k == nLatest) ++nLatest;
+            latest[k].lba = descriptor.lbas[i];
+            latest[k].data = journal->image[at + 1 + i];
+            latest[k].inFAT = isLoggedFATSector(descriptor.lbas[i], &descriptor);
+        }
+    }
+    // Within a run of records the layout does not change: a format checkpoints the journal first
+    for (uint32_t k = 0; k < nLatest; ++k) {
+        uint32_t copies = latest[k].inFAT ? descriptor.fatCopies : 1;
+        for (uint32_t copy = 0; copy < copies; ++copy) {
+            targets[nTargets] = latest[k];
+            targets[nTargets++].lba += copy * descriptor.fatSize;
+        }
+    }
+    qsort(targets, nTargets, sizeof(LoggedSector), compareByLBA);
+    for (uint32_t i = 0; i < nTargets;) {
+        uint32_t run = 0;
+        while (i + run < nTargets && targets[i + run].lba == targets[i].lba + run) {
+            parts[run].iov_base = (void *)targets[i + run].data;
+            parts[run].iov_len = SECTOR_SIZE;
+            ++run;
+        }
+        if (vol->device->writeVector(vol->device, targets[i].lba, parts, (int)run) == Failure) {
+            reportMessage("Failed to write logged sectors %u-%u to their place\n", targets[i].lba, targets[i].lba + run - 1);
+            return Failure;
+        }
+        i += run;
+    }
+    // Clean copies of FAT sectors may sit in the sector cache since their page was read
+    for (uint32_t i = 0; i < nTargets; ++i)
+        if (targets[i].inFAT) discardCachedRange(vol, targets[i].lba, 1);
+    if (written) *written = nTargets;
+    return Success;
+}
+
+// The mark of an empty journal is a record without sectors: nothing after it is replayed
+static success writeEmptyMark(Volume * vol) {
+    Journal * journal = vol->journal;
+    JournalDescriptor descriptor;
+    memset(&descriptor, 0, sizeof(JournalDescriptor));
+    descriptor.magic = JOURNAL_MAGIC;
+    descriptor.sequence = journal->sequence;
+    sealRecord(vol, 0, &descriptor);
+    journal->tail = 0;
+    journal->unflushed = False;
+    if (vol->device->write(vol->device, JOURNAL_FIRST_SECTOR, journal->image[0], 1) == Failure) {
+        reportMessage("Failed to write the journal head\n");
+        return Failure;
+    }
+    // The next barrier takes it along: until something is written in place, replaying the
+    // records it replaces writes nothing but what their sectors already hold
+    journal->markUnflushed = True;
+    return Success;
+}
+
+static success allocateImage(Volume * vol) {
+    Journal * journal = vol->journal;
+    if (!journal->image) journal->image = malloc((size_t)JOURNAL_SECTORS * SECTOR_SIZE);
+    if (journal->image) return Success;
+    reportMessage("Failed to allocate the journal\n");
+    return Failure;
+}
+
+// Called at mount, before anything is read: records of a run that did not end with a checkpoint
+// are written to their place in order, as long as they follow one another without a gap
+success replayJournal(Volume * vol) {
+    Journal * journal = vol->journal;
+    uint64_t totalSectors = vol->device->size / SECTOR_SIZE;
+    journal->tail = 0;
+    journal->unflushed = journal->markUnflushed = False;
+    if (totalSectors < N_RESERVED_SECTORS) return Success;
+    if (allocateImage(vol) == Failure) return Failure;
+    if (vol->device->read(vol->device, JOURNAL_FIRST_SECTOR, journal->image, JOURNAL_SECTORS) == Failure) {
+        reportMessage("Failed to read the journal\n");
+        return Failure;
+    }
+    JournalDescriptor descriptor;
+    uint32_t highest = 0;
+    for (uint32_t at = 0; at < JOURNAL_SECTORS; ++at) {
+        memcpy(&descriptor, journal->image[at], sizeof(JournalDescriptor));
+        if (descriptor.magic == JOURNAL_MAGIC && descriptor.sequence > highest) highest = descriptor.sequence;
+    }
+    journal->sequence = highest + 1;
+    uint32_t end = 0, nReplayed = 0, expected = 0;
+    while (end < JOURNAL_SECTORS && isValidRecord(vol, end, totalSectors, &descriptor) && descriptor.count &&
+        (nReplayed == 0 || descriptor.sequence == expected)) {
+        expected = descriptor.sequence + 1;
+        ++nReplayed;
+        end += 1 + descriptor.count;
+    }
+    if (nReplayed == 0) return Success;
+    uint32_t written = 0;
+    if (applyRecords(vol, end, &written) == Failure || durableBarrier(vol) == Failure || writeEmptyMark(vol) == Failure) {
+        reportMessage("Failed to replay the journal\n");
+        return Failure;
+    }
+    reportMessage("Replayed %u journal record(s): %u sector(s) written to their place\n", nReplayed, written);
+    return Success;
+}
+
+// A new volume starts with an empty journal, whatever the file held before
+success clearJournal(Volume * vol) {
+    Journal * journal = vol->journal;
+    if (allocateImage(vol) == Failure) return Failure;
+    memset(journal->image, 0, (size_t)JOURNAL_SECTORS * SECTOR_SIZE);
+    if (vol->device->write(vol->device, JOURNAL_FIRST_SECTOR + 1, journal->image[1], JOURNAL_SECTORS - 1) == Failure) {
+        reportMessage("Failed to clear the journal\n");
+        return Failure;
+    }
+    return writeEmptyMark(vol);
+}
+
+uint32_t pendingJournalSectors(Volume * vol) {
+    return gatherUnloggedFATSectors(vol, NULL, NULL, 0) + gatherUnloggedSectors(vol, NULL, NULL, 0);
+}
+
+// The journal is emptied first; directories and data then reach the volume before the FAT that links them
+static success commitInPlace(Volume * vol) {
+    Journal * journal = vol->journal;
+    ++journal->nInPlace;
+    if (checkpointJournal(vol, NULL) == Failure || syncBufferCache(vol, NULL) == Failure || flushFATCache(vol) == Failure) return Failure;
+    return flushVolume(vol->device);
+}
+
+success commitTransaction(Volume * vol) {
+    Journal * journal = vol->journal;
+    if (flushFSInfo(vol) == Failure) return Failure;
+    uint32_t pending = pendingJournalSectors(vol);
+    if (pending == 0) return Success;
+    if (pending > JOURNAL_MAX_RECORD_SECTORS) return commitInPlace(vol);
+    if (journal->tail + 1 + pending > JOURNAL_SECTORS && checkpointJournal(vol, NULL) == Failure) return Failure;
+
+    JournalDescriptor descriptor;
+    memset(&descriptor, 0, sizeof(JournalDescriptor));
+    uint8_t * data = journal->image[journal->tail + 1];
+    uint32_t nFAT = gatherUnloggedFATSectors(vol, descriptor.lbas, data, pending);
+    gatherUnloggedSectors(vol, descriptor.lbas + nFAT, data + (size_t)nFAT * SECTOR_SIZE, pending - nFAT);
+    descriptor.magic = JOURNAL_MAGIC;
+    descriptor.sequence = journal->sequence;
+    descriptor.count = pending;
+    descriptor.fatSize = FAT_SIZE(vol);
+    descriptor.fatCopies = FAT_COPIES_WRITTEN(vol);
+    sealRecord(vol, journal->tail, &descriptor);
+    // The record is handed to the kernel at once: a command is committed once a crash of the
+    // process cannot lose it, whatever the backend buffers
+    if (vol->device->write(vol->device, JOURNAL_FIRST_SECTOR + journal->tail, journal->image[journal->tail], 1 + pending) == Failure ||
+        flushVolume(vol->device) == Failure) {
+        reportMessage("Failed to append a record to the journal\n");
+        return Failure;
+    }
+    markFATSectorsLogged(vol);
+    markSectorsLogged(vol);
+    journal->tail += 1 + pending;
+    ++journal->sequence;
+    journal->unflushed = True;
+    ++journal->nRecords;
+    journal->nSectorsLogged += pending;
+    return Success;
+}
+
+success checkpointJournal(Volume * vol, uint32_t * written) {
+    Journal * journal = vol->journal;
+    if (written) *written = 0;
+    if (journal->tail == 0) return journalBeforeWriteBack(vol);
+    if (journalBeforeWriteBack(vol) == Failure || applyRecords(vol, journal->tail, written) == Failure) return Failure;
+    // Sectors changed again since they were logged stay dirty for the next record
+    markLoggedFATSectorsClean(vol);
+    markLoggedSectorsClean(vol);
+    ++journal->nCheckpoints;
+    if (durableBarrier(vol) == Failure) return Failure;
+    return writeEmptyMark(vol);
+}
+
+// The records must be in the volume before any of their sectors is
+success journalBeforeWriteBack(Volume * vol) {
+    Journal * journal = vol->journal;
+    if (!journal->unflushed && !journal->markUnflushed) return Success;
+    journal->unflushed = journal->markUnflushed = False;
+    return durableBarrier(vol);
+}
+
+// Sectors about to be written in place must not be overwritten later by an older logged version
+success journalForget(Volume * vol, uint32_t lba, uint32_t count) {
+    Journal * journal = vol->journal;
+    if (journal->markUnflushed) {
+        journal->markUnflushed = False;
+        if (durableBarrier(vol) == Failure) return Failure;
+    }
+    JournalDescriptor descriptor;
+    for (uint32_t at = 0; at < journal->tail; at += 1 + descriptor.count) {
+        memcpy(&descriptor, journal->image[at], sizeof(JournalDescriptor));
+        for (uint32_t i = 0; i < descriptor.count; ++i) {
+            uint32_t copies = isLoggedFATSector(descriptor.lbas[i], &descriptor) ? descriptor.fatCopies : 1;
+            for (uint32_t copy = 0; copy < copies; ++copy) {
+                uint64_t target = (uint64_t)descriptor.lbas[i] + (uint64_t)copy * descriptor.fatSize;
+                if (target >= lba && target < (uint64_t)lba + count) return checkpointJournal(vol, NULL);
+            }
+        }
+    }
+    return Success;
+}
+
+void resetJournal(Volume * vol) {
+    Journal * journal = vol->journal;
+    free(journal->image);
+    journal->image = NULL;
+    journal->tail = 0;
+    journal->unflushed = journal->markUnflushed = False;
+}
+
+void getJournalStats(Volume * vol, uint64_t * records, uint64_t * sectors, uint64_t * checkpoints, uint64_t * inPlaceCommits) {
+    Journal * journal = vol->journal;
+    *records = journal->nRecords;
+    *sectors = journal->nSectorsLogged;
+    *checkpoints = journal->nCheckpoints;
+    *inPlaceCommits = journal->nInPlace;
+}
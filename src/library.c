@@ -0,0 +1,306 @@
+#include "xkubpise.h"
+#include "utils.h"
+#include "fat32.h"
+#include "format.h"
+#include "allocator.h"
+#include "blockdev.h"
+#include "bufcache.h"
+#include "journal.h"
+#include "durability.h"
+#include "volume.h"
+#include "file.h"
+#include "fsck.h"
+#include "mktree.h"
+#include "rmtree.h"
+#include "move.h"
+#include "fatcache.h"
+
+#include <sys/stat.h>
+
+// Every volume keeps the engine state of its own. A call takes the lock of its volume and collects
+// whatever the engine reports into the session; calls on different volumes run in parallel.
+struct XkVolume {
+    Volume * vol;
+    uint32_t nSessions; // counted under the lock of the volume
+};
+
+struct XkSession {
+    XkVolume * volume;
+    uint32_t cluster; // current folder
+    char error[XK_ERROR_SIZE];
+};
+
+void xkDefaultOptions(XkOptions * options) {
+    options->backend = xkBackendStdio;
+    options->cacheSectors = DEFAULT_CACHE_SECTORS;
+    options->journal = 1;
+    options->durable = 0;
+    options->create = 0;
+    options->sizeMB = DEFAULT_TOTAL_N_SECTORS / (2 * 1024);
+    options->sectorsPerCluster = DEFAULT_SECTORS_PER_CLUSTER;
+}
+
+static Volume * enterVolume(XkVolume * handle, char * messages, size_t size) {
+    lockEngine(handle->vol);
+    setMessageSink(messages, size);
+    return handle->vol;
+}
+
+static void leaveVolume(Volume * vol) {
+    setMessageSink(NULL, 0);
+    unlockEngine(vol);
+}
+
+// A session removed from its folder by another one is moved to the root by the removal
+static Volume * enter(XkSession * session) {
+    return enterVolume(session->volume, session->error, sizeof(session->error));
+}
+
+// As in the interactive emulator, the changes of a call are committed on their own, failed or not
+static int leave(Volume * vol, success result, boolean changed) {
+    if (changed && (commitMetadata(vol) == Failure || persistAfterCommand(vol) == Failure)) {
+        reportMessage("Failed to commit the changes\n");
+        result = Failure;
+    }
+    leaveVolume(vol);
+    return result == Success ? 0 : -1;
+}
+
+// The same steps as the emulator takes at startup, without asking anything
+static success mountImage(Volume * vol, const char * path, const XkOptions * options) {
+    if (options->backend < xkBackendStdio || options->backend > xkBackendMmap) {
+        reportMessage("Unknown I/O backend %d\n", (int)options->backend);
+        return Failure;
+    }
+    if (options->sizeMB == 0 || options->sizeMB > UINT32_MAX / (2 * 1024)) {
+        reportMessage("Invalid volume size of %u MB\n", options->sizeMB);
+        return Failure;
+    }
+    vol->enforceAbsolutePath = False; // sessions resolve relative paths from their own folder
+    vol->backend = (BackendKind)options->backend;
+    setBufferCacheCapacity(vol, options->cacheSectors);
+    setJournalEnabled(vol, options->journal ? True : False);
+    if (options->durable) parseSyncPolicy(vol, "command");
+    if (setGeometry(vol, options->sizeMB * 2 * 1024, options->sectorsPerCluster) == Failure) return Failure;
+
+    boolean created = False;
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        if (errno != ENOENT || !options->create) {
+            reportMessage("Cannot open %s: %s\n", path, strerror(errno));
+            return Failure;
+        }
+        if (checkFileStatus(vol, path) != FAT32_NOT_FOUND) return Failure;
+        vol->device = openBlockDevice(path, vol->backend, vol->stats);
+        if (!vol->device || preformat(vol, TOTAL_N_SECTORS(vol), SECTORS_PER_CLUSTER(vol)) == Failure) {
+            reportMessage("Failed to create the volume %s\n", path);
+            return Failure;
+        }
+        unmountVolume(vol);
+        created = True;
+    }
+    vol->isFormatted = isValidFAT32xkubpise(vol, path);
+    if (vol->isFormatted <= notFormatted) {
+        reportMessage("%s is not a valid volume:\n%s", path, vol->readingErrors);
+        return Failure;
+    }
+    if (!checkFormatting(vol)) {
+        if (!created) {
+            reportMessage("%s is pre-initialized but not formatted\n", path);
+            return Failure;
+        }
+        if (format(vol, 0) == Failure) return Failure;
+        vol->isFormatted = formatted;
+        return Success;
+    }
+    return initAllocator(vol);
+}
+
+XkVolume * xkOpen(const char * path, const XkOptions * options, char * error, size_t errorSize) {
+    XkOptions defaults;
+    char messages[XK_ERROR_SIZE] = "";
+    if (!options) {
+        xkDefaultOptions(&defaults);
+        options = &defaults;
+    }
+    XkVolume * handle = calloc(1, sizeof(XkVolume));
+    if (handle) handle->vol = createVolume();
+    if (!handle || !handle->vol) {
+        if (error && errorSize) snprintf(error, errorSize, "Out of memory\n");
+        free(handle);
+        return NULL;
+    }
+    Volume * vol = enterVolume(handle, messages, sizeof(messages));
+    success opened = mountImage(vol, path, options);
+    if (opened == Failure) unmountVolume(vol);
+    leaveVolume(vol);
+    if (error && errorSize) snprintf(error, errorSize, "%s", messages);
+    if (opened == Success) return handle;
+    destroyVolume(handle->vol);
+    free(handle);
+    return NULL;
+}
+
+int xkClose(XkVolume * handle) {
+    if (!handle) return 0;
+    char messages[XK_ERROR_SIZE];
+    Volume * vol = enterVolume(handle, messages, sizeof(messages));
+    if (handle->nSessions) {
+        leaveVolume(vol);
+        return -1;
+    }
+    success synced = syncVolume(vol);
+    unmountVolume(vol);
+    leaveVolume(vol);
+    destroyVolume(vol);
+    free(handle);
+    return synced == Success ? 0 : -1;
+}
+
+XkSession * xkOpenSession(XkVolume * handle) {
+    if (!handle) return NULL;
+    XkSession * session = calloc(1, sizeof(XkSession));
+    if (!session) return NULL;
+    session->volume = handle;
+    session->cluster = ROOT_CLUSTER;
+    if (trackCurrentFolder(handle->vol, &session->cluster) == Failure) {
+        free(session);
+        return NULL;
+    }
+    lockEngine(handle->vol);
+    ++handle->nSessions;
+    unlockEngine(handle->vol);
+    return session;
+}
+
+void xkCloseSession(XkSession * session) {
+    if (!session) return;
+    lockEngine(session->volume->vol);
+    --session->volume->nSessions;
+    unlockEngine(session->volume->vol);
+    untrackCurrentFolder(session->volume->vol, &session->cluster);
+    free(session);
+}
+
+const char * xkLastError(const XkSession * session) {
+    return session->error;
+}
+
+int xkChangeDirectory(XkSession * session, const char * path) {
+    Volume * vol = enter(session);
+    uint32_t cluster = findClusterByFullPath(vol, path, session->cluster);
+    if (cluster) session->cluster = cluster;
+    return leave(vol, cluster ? Success : Failure, False);
+}
+
+int xkCurrentDirectory(XkSession * session, char * path, size_t size) {
+    char location[MAX_PATH];
+    Volume * vol = enter(session);
+    buildPathToRoot(vol, session->cluster, location);
+    success result = Success;
+    if (strlen(location) >= size) {
+        reportMessage("The path of the current folder is longer than %zu bytes\n", size - 1);
+        result = Failure;
+    } else strcpy(path, location);
+    return leave(vol, result, False);
+}
+
+int xkList(XkSession * session, const char * path, void (* visit)(const char * name, void * data), void * data) {
+    char lowerCaseName[FULL_FILE_STRING_SIZE];
+    Volume * vol = enter(session);
+    uint32_t cluster = path ? findClusterByFullPath(vol, path, session->cluster) : session->cluster;
+    if (cluster == 0) return leave(vol, Failure, False);
+    char (* names)[FULL_FILE_STRING_SIZE];
+    int nInDir = collectNamesInCluster(vol, cluster, &names);
+    for (int i = 0; i < nInDir; ++i) {
+        toLowerRegister(names[i], lowerCaseName);
+        visit(lowerCaseName, data);
+    }
+    free(names);
+    return leave(vol, Success, False);
+}
+
+// The engine checks and uppercases names in place
+static success copyName(const char * name, char * copy, size_t size) {
+    if (!name || strlen(name) >= size) {
+        reportMessage("Invalid name: %s\n", name ? name : "(null)");
+        return Failure;
+    }
+    strcpy(copy, name);
+    return Success;
+}
+
+int xkMakeDirectory(XkSession * session, const char * path, int parents) {
+    char copy[MAX_PATH];
+    Volume * vol = enter(session);
+    if (copyName(path, copy, sizeof(copy)) == Failure) return leave(vol, Failure, False);
+    if (!parents) return leave(vol, createFolderIn(vol, session->cluster, copy), True);
+    char * paths[1] = { copy };
+    uint32_t nCreated;
+    return leave(vol, makeDirectories(vol, paths, 1, session->cluster, &nCreated), True);
+}
+
+int xkMakeTree(XkSession * session, const char * manifestPath) {
+    Volume * vol = enter(session);
+    uint32_t nCreated;
+    return leave(vol, makeTreeFromManifest(vol, manifestPath, session->cluster, &nCreated), True);
+}
+
+int xkCreateFile(XkSession * session, const char * name) {
+    char copy[MAX_PATH];
+    Volume * vol = enter(session);
+    if (copyName(name, copy, sizeof(copy)) == Failure) return leave(vol, Failure, False);
+    return leave(vol, createFileIn(vol, session->cluster, copy), True);
+}
+
+int xkRemove(XkSession * session, const char * name, int recursive) {
+    Volume * vol = enter(session);
+    uint32_t nRemoved;
+    return leave(vol, removeEntry(vol, session->cluster, name, recursive ? removeRecursively : removeFileOnly, &nRemoved), True);
+}
+
+int xkMove(XkSession * session, const char * source, const char * destination) {
+    char sourceCopy[MAX_PATH], destinationCopy[MAX_PATH];
+    Volume * vol = enter(session);
+    if (copyName(source, sourceCopy, sizeof(sourceCopy)) == Failure || copyName(destination, destinationCopy, sizeof(destinationCopy)) == Failure)
+        return leave(vol, Failure, False);
+    return leave(vol, moveEntry(vol, sourceCopy, destinationCopy, session->cluster), True);
+}
+
+int xkWriteFile(XkSession * session, const char * name, const void * data, uint32_t length, int append) {
+    char copy[MAX_PATH];
+    Volume * vol = enter(session);
+    if (copyName(name, copy, sizeof(copy)) == Failure) return leave(vol, Failure, False);
+    if (!append && !nameExistsInDirectory(vol, copy, session->cluster) && createFileIn(vol, session->cluster, copy) == Failure)
+        return leave(vol, Failure, True);
+    return leave(vol, writeFile(vol, session->cluster, copy, data, length, append ? True : False), True);
+}
+
+void * xkReadFile(XkSession * session, const char * name, uint32_t * length) {
+    Volume * vol = enter(session);
+    uint8_t * content = readFile(vol, session->cluster, name, length);
+    leave(vol, content ? Success : Failure, False);
+    return content;
+}
+
+int xkSync(XkSession * session) {
+    Volume * vol = enter(session);
+    success result = Success;
+    if (commitMetadata(vol) == Failure || (isJournalActive(vol) && checkpointJournal(vol, NULL) == Failure) ||
+        syncBufferCache(vol, NULL) == Failure || flushVolume(vol->device) == Failure) {
+        reportMessage("Failed to write cached changes to the volume\n");
+        result = Failure;
+    }
+    return leave(vol, result, False);
+}
+
+int xkCheck(XkSession * session, int repair, uint32_t * problems) {
+    FsckReport report;
+    Volume * vol = enter(session);
+    if (commitMetadata(vol) == Failure || checkVolume(vol, repair ? True : False, &report) == Failure) {
+        reportMessage("The check could not be completed\n");
+        return leave(vol, Failure, False);
+    }
+    if (problems) *problems = repair ? report.unrepaired : fsckProblemCount(&report);
+    return leave(vol, Success, repair ? True : False);
+}
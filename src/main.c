@@ -2,40 +2,131 @@
 #include "fat32.h"
 #include "format.h"
 #include "emulator.h"
+#include "allocator.h"
+#include "blockdev.h"
+#include "bufcache.h"
+#include "fatcache.h"
+#include "fsck.h"
+#include "stats.h"
+#include "journal.h"
+#include "durability.h"
+#include "server.h"
+#include "volume.h"
 
-IsFormatted isFormatted = notFormatted;
-boolean enforceAbsolutePath = True;
 const char * fat32 = NULL;
-char fat32ReadingErrors[FAT32ERRORS_SIZE];
-FILE * volume;
-char localFilesAndFolders[SECTOR_SIZE / FAT_ENTRY_SIZE][FULL_FILE_STRING_SIZE];
+static Volume * vol = NULL; // the one volume of the run, also seen by the exit handler
+
+// XKUBPISE_STATS names the file that receives the counters of the whole run, whichever way it ends
+static void dumpStatsAtExit(void) {
+    dumpStats(vol, getenv(STATS_ENV));
+}
 
 int main(int argc, char * argv[]) {
     success preFormatResult;
-    if (argc < 2) { 
-        puts("No path to (desired) FAT32 volume was provided. Exiting...");
-        return 1; 
+    vol = createVolume();
+    if (!vol) {
+        puts("Out of memory. Exiting...");
+        return 1;
     }
-    if (strcmp(argv[1], "-p") == 0) {
-        enforceAbsolutePath = False;
-        if (argc > 2) fat32 = argv[2];
-        else {
-            puts("No path to (desired) FAT32 volume was provided. Exiting...");
-            return 1; 
-        }
-    } else {
-        fat32 = argv[1];
-        if (argc > 2) {
-            if (strcmp(argv[2], "-p") == 0) {
-                enforceAbsolutePath = False;
+    if (getenv(STATS_ENV) && *getenv(STATS_ENV)) atexit(dumpStatsAtExit);
+    const char * scriptPath = NULL;
+    const char * socketPath = NULL;
+    uint32_t nWorkers = 0;
+    boolean keepGoing = False;
+    boolean fsckMode = False, fsckRepair = False;
+    uint32_t totalSectors = DEFAULT_TOTAL_N_SECTORS, sectorsPerCluster = DEFAULT_SECTORS_PER_CLUSTER;
+    // The order of arguments doesn't matter: options start with '-', the first other argument is the volume
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-p") == 0) {
+            vol->enforceAbsolutePath = False;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            if (i + 1 >= argc) {
+                puts("No script was provided after -b. Exiting...");
+                return 1;
+            }
+            scriptPath = argv[++i];
+        } else if (strcmp(argv[i], "-k") == 0) {
+            keepGoing = True;
+        } else if (strncmp(argv[i], "--io=", 5) == 0) {
+            if (!parseBackendName(argv[i] + 5, &vol->backend)) {
+                printf("Unknown I/O backend %s (expected stdio, pread or mmap). Exiting...\n", argv[i] + 5);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            char * end;
+            unsigned long sectors = strtoul(argv[i] + 8, &end, 10);
+            if (*end != '\0' || sectors > 1024 * 1024) {
+                printf("Invalid cache size %s (expected a number of sectors up to 1048576). Exiting...\n", argv[i] + 8);
+                return 1;
+            }
+            setBufferCacheCapacity(vol, (uint32_t)sectors);
+        } else if (strncmp(argv[i], "--size=", 7) == 0) {
+            char * end;
+            unsigned long megabytes = strtoul(argv[i] + 7, &end, 10);
+            if (*end != '\0' || megabytes == 0 || megabytes > (unsigned long)(UINT32_MAX / (2 * 1024))) {
+                printf("Invalid volume size %s (expected a number of MB). Exiting...\n", argv[i] + 7);
+                return 1;
+            }
+            totalSectors = (uint32_t)(megabytes * 2 * 1024);
+        } else if (strncmp(argv[i], "--spc=", 6) == 0) {
+            char * end;
+            sectorsPerCluster = (uint32_t)strtoul(argv[i] + 6, &end, 10);
+            if (*end != '\0') sectorsPerCluster = 0; // rejected by setGeometry() below
+        } else if (strcmp(argv[i], "--fsck") == 0 || strcmp(argv[i], "--fsck=repair") == 0) {
+            fsckMode = True;
+            fsckRepair = argv[i][6] == '=' ? True : False;
+        } else if (strncmp(argv[i], "--mirror=", 9) == 0) {
+            if (strcmp(argv[i] + 9, "on") == 0) vol->geometry.mirroredFATs = True;
+            else if (strcmp(argv[i] + 9, "off") == 0) vol->geometry.mirroredFATs = False;
+            else {
+                printf("Invalid FAT mirroring mode %s (expected on or off). Exiting...\n", argv[i] + 9);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--journal=", 10) == 0) {
+            if (strcmp(argv[i] + 10, "on") == 0) setJournalEnabled(vol, True);
+            else if (strcmp(argv[i] + 10, "off") == 0) setJournalEnabled(vol, False);
+            else {
+                printf("Invalid journal mode %s (expected on or off). Exiting...\n", argv[i] + 10);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--sync=", 7) == 0) {
+            if (!parseSyncPolicy(vol, argv[i] + 7)) {
+                printf("Invalid sync policy %s (expected none, command or interval:<ms>). Exiting...\n", argv[i] + 7);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--serve=", 8) == 0 && argv[i][8] != '\0') {
+            socketPath = argv[i] + 8;
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            char * end;
+            unsigned long workers = strtoul(argv[i] + 10, &end, 10);
+            if (*end != '\0' || workers == 0 || workers > SERVER_MAX_WORKERS) {
+                printf("Invalid number of workers %s (expected 1 to %d). Exiting...\n", argv[i] + 10, SERVER_MAX_WORKERS);
+                return 1;
             }
+            nWorkers = (uint32_t)workers;
+        } else if (!fat32) {
+            fat32 = argv[i];
         }
     }
-    fat32_status_t check = checkFileStatus(fat32);
+    if (!fat32) { 
+        puts("No path to (desired) FAT32 volume was provided. Exiting...");
+        return 1; 
+    }
+    // The requested layout applies to new volumes; an existing one brings its own in its BPB
+    if (setGeometry(vol, totalSectors, sectorsPerCluster) == Failure) {
+        puts("Invalid volume layout. Exiting...");
+        return 1;
+    }
+    fat32_status_t check = checkFileStatus(vol, fat32);
     switch (check)
     {
     case FAT32_NOT_FOUND:
-        preFormatResult = preformat();
+        vol->device = openBlockDevice(fat32, vol->backend, vol->stats);
+        if (!vol->device) {
+            printf("Failed to open %s with the %s backend. Exiting...\n", fat32, backendName(vol->backend));
+            return 1;
+        }
+        preFormatResult = preformat(vol, TOTAL_N_SECTORS(vol), SECTORS_PER_CLUSTER(vol));
         if (preFormatResult == Failure) {
             puts("\nFAT32 volume pre-formatting failed.\n");
             return 1;
@@ -46,24 +137,21 @@ int main(int argc, char * argv[]) {
     case FAT32_OK:
         break;
     }
-    if (volume) {
-        fclose(volume);
-        volume = NULL;
-    }
-    isFormatted = isValidFAT32xkubpise(fat32);
-    if(isFormatted <= notFormatted) {
-        printf("\nFAT32 volume is \033[31mnot valid\033[0m for FAT32 emulator \033[34mxkubpise\033[0m\nThe following \033[31minconsistencies\033[0m have been detected:\n%s", fat32ReadingErrors);
+    unmountVolume(vol);
+    vol->isFormatted = isValidFAT32xkubpise(vol, fat32);
+    if(vol->isFormatted <= notFormatted) {
+        printf("\nFAT32 volume is \033[31mnot valid\033[0m for FAT32 emulator \033[34mxkubpise\033[0m\nThe following \033[31minconsistencies\033[0m have been detected:\n%s", vol->readingErrors);
         puts("");
-        if (isFormatted == badSize) return 1;
+        if (vol->isFormatted == badSize) return 1;
         else {
-            printf("This file is 20 MB in size, which is suitable for a FAT32 emulator \033[34mxkubpise\033[0m volume.\nHowever, it does not appear to be a valid volume for this emulator, or it may be corrupted.\n\nAre you sure you want to convert this file into a FAT32 emulator volume?\n\n\tThis will \033[31mDESTROY\033[0m all data in it!\n\nIf yes, please type:\n\"I understand that the data in this file will be LOST\" (without quotes):\n ");
+            printf("This file is %.1f MB in size, which is suitable for a FAT32 emulator \033[34mxkubpise\033[0m volume.\nHowever, it does not appear to be a valid volume for this emulator, or it may be corrupted.\n\nAre you sure you want to convert this file into a FAT32 emulator volume?\n\n\tThis will \033[31mDESTROY\033[0m all data in it!\n\nIf yes, please type:\n\"I understand that the data in this file will be LOST\" (without quotes):\n ", TOTAL_SIZE(vol) / (1024.0 * 1024.0));
             char answer[53];
             fgets(answer, sizeof(answer), stdin);
             if (strcmp(answer, "I understand that the data in this file will be LOST") != 0) {
                 puts("\nThank you for your wise decision to preserve this file. Exiting...\n");
                 return 1;
             } else {
-                preFormatResult = preformat();
+                preFormatResult = preformat(vol, TOTAL_N_SECTORS(vol), SECTORS_PER_CLUSTER(vol));
                 if (preFormatResult == Failure) {
                     puts("\nFAT32 volume pre-formatting failed.\n");
                     return 1; 
@@ -72,12 +160,64 @@ int main(int argc, char * argv[]) {
             }
         }
     }
-    if (isFormatted == formatted) {
-        if (!checkFormatting()) {
-            isFormatted = notFormatted;
+    if (vol->isFormatted == formatted) {
+        if (!checkFormatting(vol)) {
+            vol->isFormatted = notFormatted;
             puts("\nThe volume is pre-initialized but not fully formatted.\nYou can use the emulator to format it now (command \"format\"), or you can format it using another tool.\n\n");
+        } else if (initAllocator(vol) == Failure) {
+            puts("\nFailed to build the free-cluster map of the volume. Exiting...\n");
+            return 1;
+        } else if (vol->geometry.mirroredFATs) {
+            // Mirrored copies are expected to be identical; a crash or another tool may have left them apart
+            uint32_t divergent = compareFATCopies(vol);
+            if (divergent) printf("%u FAT sector(s) differ between the copies; \"mirror on\" copies FAT #1 over the others\n", divergent);
+        }
+    }
+    // A volume can be checked (and repaired) without starting the emulator
+    if (fsckMode) {
+        FsckReport report;
+        if (vol->isFormatted != formatted) {
+            puts("Only a formatted volume can be checked. Exiting...");
+            unmountVolume(vol);
+            return 1;
+        }
+        success checked = checkVolume(vol, fsckRepair, &report);
+        if (checked == Success) printFsckReport(&report, fsckRepair);
+        else puts("The check could not be completed");
+        // A check alone leaves the volume untouched, even the FSInfo hints the mount would correct
+        if (!fsckRepair) releaseAllocator(vol);
+        unmountVolume(vol);
+        return checked == Success && !(fsckRepair ? report.unrepaired : fsckProblemCount(&report)) ? 0 : 1;
+    }
+    // The volume stays mounted while clients come and go, until SIGINT or SIGTERM
+    if (socketPath) {
+        if (startFlusher(vol) == Failure) {
+            unmountVolume(vol);
+            return 1;
         }
+        success served = serve(vol, socketPath, nWorkers);
+        stopFlusher(vol);
+        unmountVolume(vol);
+        return served == Success ? 0 : 1;
+    }
+    // Commands come from a script (-b) or from a pipe: no prompt, and one commit at the end
+    FILE * script = stdin;
+    if (scriptPath) {
+        script = fopen(scriptPath, "r");
+        if (!script) {
+            printf("Failed to open script %s. Exiting...\n", scriptPath);
+            unmountVolume(vol);
+            return 1;
+        }
+    }
+    if (startFlusher(vol) == Failure) {
+        if (script != stdin) fclose(script);
+        unmountVolume(vol);
+        return 1;
     }
-    emulate();
-    return 0;
+    success result = emulate(vol, script, scriptPath != NULL || !isatty(STDIN_FILENO), keepGoing);
+    stopFlusher(vol);
+    if (script != stdin) fclose(script);
+    unmountVolume(vol);
+    return result == Success ? 0 : 1;
 }
\ No newline at end of file
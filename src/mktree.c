@@ -0,0 +1,438 @@
+#include "mktree.h"
+#include "fat32.h"
+#include "fatcache.h"
+#include "allocator.h"
+#include "blockdev.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "volume.h"
+
+// The paths are first resolved into a plan with a node per directory they go through, existing or
+// not. Once the plan is complete, the clusters of every new directory (and those existing directories
+// need to grow by) are reserved with one allocator call; they come in ascending order, and each
+// directory takes a contiguous share of them. The new clusters are then built in memory and written
+// with one request per run, every sector of an existing directory that receives entries is read and
+// written once, and the FAT is only touched in its cache. Nothing is written when a path is invalid
+// or the volume is short of space.
+typedef struct {
+    uint8_t name[FILE_AND_EXT_RAW_LENGTH];
+    boolean isNew;
+    int32_t parent;          // node of the parent directory, -1 for existing directories
+    int32_t firstChild;      // new subdirectories only: existing ones are found through the directory index
+    int32_t nextSibling;
+    uint32_t cluster;        // first cluster, existing or reserved
+    uint32_t slot;           // of the entry of a new directory in its parent
+    uint32_t nNewChildren;
+    uint32_t nClusters;      // of a new directory, or those an existing one grows by
+    uint32_t firstReserved;  // position of its first cluster in the reserved list
+    uint32_t chainLength;    // of an existing directory before it grows
+    uint32_t lastCluster;
+} TreeNode;
+
+typedef struct {
+    TreeNode * nodes;
+    uint32_t count;
+    uint32_t capacity;
+} TreePlan;
+
+typedef struct {
+    uint32_t sector;
+    uint32_t offset;
+    int32_t node;
+} EntryUpdate;
+
+static const uint8_t dotName[FILE_AND_EXT_RAW_LENGTH] = { '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+static const uint8_t dotDotName[FILE_AND_EXT_RAW_LENGTH] = { '.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+
+static int32_t addNode(TreePlan * plan, const uint8_t * name, boolean isNew, int32_t parent, uint32_t cluster) {
+    if (plan->count == plan->capacity) {
+        uint32_t newCapacity = plan->capacity ? plan->capacity * 2 : 64;
+        TreeNode * grown = realloc(plan->nodes, newCapacity * sizeof(TreeNode));
+        if (!grown) {
+            reportMessage("Failed to allocate memory for the directory tree\n");
+            return -1;
+        }
+        plan->nodes = grown;
+        plan->capacity = newCapacity;
+    }
+    int32_t index = (int32_t)plan->count++;
+    TreeNode * node = &plan->nodes[index];
+    memset(node, 0, sizeof(TreeNode));
+    if (name) memcpy(node->name, name, FILE_AND_EXT_RAW_LENGTH);
+    node->isNew = isNew;
+    node->parent = parent;
+    node->firstChild = node->nextSibling = -1;
+    node->cluster = cluster;
+    if (isNew) {
+        TreeNode * up = &plan->nodes[parent];
+        node->nextSibling = up->firstChild;
+        up->firstChild = index;
+        // The entries of a new directory follow its dot entries in the order they are planned
+        if (up->isNew) node->slot = 2 + up->nNewChildren;
+        ++up->nNewChildren;
+    }
+    return index;
+}
+
+// An existing directory can be reached by several paths (absolute, relative, through ".."), but it
+// has a single node, so that the entries it receives get distinct slots
+static int32_t existingNode(TreePlan * plan, uint32_t cluster) {
+    for (uint32_t i = 0; i < plan->count; ++i)
+        if (!plan->nodes[i].isNew && plan->nodes[i].cluster == cluster) return (int32_t)i;
+    return addNode(plan, NULL, False, -1, cluster);
+}
+
+static int32_t findNewChild(const TreePlan * plan, int32_t node, const uint8_t * rawName) {
+    for (int32_t child = plan->nodes[node].firstChild; child >= 0; child = plan->nodes[child].nextSibling)
+        if (memcmp(plan->nodes[child].name, rawName, FILE_AND_EXT_RAW_LENGTH) == 0) return child;
+    return -1;
+}
+
+static success addPath(Volume * vol, TreePlan * plan, const char * inputPath, uint32_t startCluster) {
+    size_t length = strlen(inputPath);
+    if (length == 0 || length >= MAX_PATH) {
+        reportMessage("Invalid path: %s\n", inputPath);
+        return Failure;
+    }
+    boolean absPath = inputPath[0] == '/' ? True : False;
+    if (vol->enforceAbsolutePath && !absPath) {
+        reportLine("\tAbsolute path is required in this configuration of FAT32 emulator \x1b[34mxkubpise\x1b[0m\n\tUse -p option to allow relative paths when launching emulator");
+        return Failure;
+    }
+    for (size_t c = 0; c < length; ++c) {
+        if (!isValidShortChar(inputPath[c], True, True)) {
+            reportMessage("Invalid character(s) in path %s\n", inputPath);
+            return Failure;
+        }
+    }
+    char path[MAX_PATH];
+    strcpy(path, inputPath);
+    int32_t node = existingNode(plan, absPath ? ROOT_CLUSTER : startCluster);
+    if (node < 0) return Failure;
+    char * rest;
+    for (char * token = strtok_r(path, "/", &rest); token; token = strtok_r(NULL, "/", &rest)) {
+        if (strcmp(token, ".") == 0) continue;
+        if (strcmp(token, "..") == 0) {
+            if (plan->nodes[node].isNew) {
+                node = plan->nodes[node].parent;
+                continue;
+            }
+            uint32_t up = findSubdirectoryCluster(vol, "..", plan->nodes[node].cluster);
+            node = existingNode(plan, up >= ROOT_CLUSTER ? up : ROOT_CLUSTER); // ".." of the root is the root
+            if (node < 0) return Failure;
+            continue;
+        }
+        char name[FILE_NAME_MAX_LENGTH + 1];
+        if (strlen(token) > FILE_NAME_MAX_LENGTH || !isValidShortNameAndUppercaseFile(strcpy(name, token), itsFolder)) {
+            reportMessage("Invalid folder name %s in the path %s\n", token, inputPath);
+            return Failure;
+        }
+        uint8_t rawName[FILE_AND_EXT_RAW_LENGTH];
+        formatShortName(name, rawName);
+        if (!plan->nodes[node].isNew) {
+            DirIndex * index = getDirIndex(vol, plan->nodes[node].cluster);
+            if (!index) return Failure;
+            const DirIndexEntry * entry = lookupDirIndex(index, rawName);
+            if (entry && !(entry->attributes & 0x10)) {
+                reportMessage("%s in the path %s exists and is not a folder\n", token, inputPath);
+                return Failure;
+            }
+            if (entry) {
+                node = existingNode(plan, entry->firstCluster);
+                if (node < 0) return Failure;
+                continue;
+            }
+        }
+        int32_t child = findNewChild(plan, node, rawName);
+        if (child < 0) child = addNode(plan, rawName, True, node, 0);
+        if (child < 0) return Failure;
+        node = child;
+    }
+    return Success;
+}
+
+// I count the clusters every directory needs and give the existing ones the slots of their new entries:
+// reusable (deleted) slots first, then the never-used ones, which continue into the clusters they grow by
+static success layOutPlan(Volume * vol, TreePlan * plan, uint32_t * total) {
+    *total = 0;
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        TreeNode * node = &plan->nodes[i];
+        if (node->isNew) {
+            node->nClusters = (2 + node->nNewChildren + ENTRIES_PER_CLUSTER(vol) - 1) / ENTRIES_PER_CLUSTER(vol);
+            if (node->nClusters > MAX_DIR_CLUSTERS(vol)) {
+                reportMessage("A new folder would exceed the maximum of %d entries\n", MAX_DIR_ENTRIES);
+                return Failure;
+            }
+        } else if (node->nNewChildren) {
+            DirIndex * index = getDirIndex(vol, node->cluster);
+            if (!index) return Failure;
+            uint32_t capacity = index->nClusters * ENTRIES_PER_CLUSTER(vol);
+            uint32_t available = index->nDeleted + (capacity - index->endSlot);
+            uint32_t missing = node->nNewChildren > available ? node->nNewChildren - available : 0;
+            node->nClusters = (missing + ENTRIES_PER_CLUSTER(vol) - 1) / ENTRIES_PER_CLUSTER(vol);
+            node->chainLength = index->nClusters;
+            node->lastCluster = index->lastCluster;
+            if (index->nClusters + node->nClusters > MAX_DIR_CLUSTERS(vol)) {
+                reportMessage("Folder at cluster %u would exceed the maximum of %d entries\n", node->cluster, MAX_DIR_ENTRIES);
+                return Failure;
+            }
+            uint32_t k = 0;
+            for (int32_t child = node->firstChild; child >= 0; child = plan->nodes[child].nextSibling, ++k)
+                plan->nodes[child].slot = k < index->nDeleted ? index->deletedSlots[index->nDeleted - 1 - k] : index->endSlot + (k - index->nDeleted);
+        }
+        node->firstReserved = *total;
+        *total += node->nClusters;
+    }
+    return Success;
+}
+
+static void putDirectoryEntry(uint8_t * entry, const uint8_t * rawName, uint32_t cluster) {
+    memset(entry, 0, ENTRY_SIZE);
+    memcpy(entry, rawName, FILE_AND_EXT_RAW_LENGTH);
+    entry[11] = 0x10; // Directory attribute
+    entry[26] = cluster & 0xFF;
+    entry[27] = (cluster >> 8) & 0xFF;
+    entry[20] = (cluster >> 16) & 0xFF;
+    entry[21] = (cluster >> 24) & 0xFF;
+}
+
+// Position in the reserved list of the cluster that holds the entry of a new directory, or -1 when
+// the entry goes to a cluster its (existing) parent already had
+static int64_t reservedEntryCluster(Volume * vol, const TreePlan * plan, const TreeNode * child) {
+    const TreeNode * parent = &plan->nodes[child->parent];
+    uint32_t firstNewSlot = parent->isNew ? 0 : parent->chainLength * ENTRIES_PER_CLUSTER(vol);
+    if (child->slot < firstNewSlot) return -1;
+    return (int64_t)parent->firstReserved + (child->slot - firstNewSlot) / ENTRIES_PER_CLUSTER(vol);
+}
+
+// I build the reserved clusters a chunk at a time and write each run of adjacent ones with one request
+static success writeNewClusters(Volume * vol, const TreePlan * plan, const uint32_t * clusters, uint32_t total) {
+    uint32_t perChunk = MKTREE_CHUNK_BYTES / CLUSTER_SIZE(vol) ? MKTREE_CHUNK_BYTES / CLUSTER_SIZE(vol) : 1;
+    uint8_t * buffer = malloc((size_t)perChunk * CLUSTER_SIZE(vol));
+    if (!buffer) {
+        reportMessage("Failed to allocate memory for the new folders\n");
+        return Failure;
+    }
+    for (uint32_t start = 0; start < total; start += perChunk) {
+        uint32_t end = start + perChunk < total ? start + perChunk : total;
+        memset(buffer, 0, (size_t)(end - start) * CLUSTER_SIZE(vol));
+        for (uint32_t i = 0; i < plan->count; ++i) {
+            const TreeNode * node = &plan->nodes[i];
+            if (!node->isNew) continue;
+            if (node->firstReserved >= start && node->firstReserved < end) {
+                uint8_t * first = buffer + (size_t)(node->firstReserved - start) * CLUSTER_SIZE(vol);
+                putDirectoryEntry(first, dotName, node->cluster);
+                putDirectoryEntry(first + ENTRY_SIZE, dotDotName, plan->nodes[node->parent].cluster);
+            }
+            int64_t at = reservedEntryCluster(vol, plan, node);
+            if (at < start || at >= end) continue;
+            uint8_t * entry = buffer + (size_t)(at - start) * CLUSTER_SIZE(vol) + (node->slot % ENTRIES_PER_CLUSTER(vol)) * ENTRY_SIZE;
+            putDirectoryEntry(entry, node->name, node->cluster);
+        }
+        uint32_t i = start;
+        while (i < end) {
+            uint32_t runStart = i;
+            while (i + 1 < end && clusters[i + 1] == clusters[i] + 1) ++i;
+            ++i;
+            if (writeSectors(vol, CLUSTER_FIRST_SECTOR(vol, clusters[runStart]), buffer + (size_t)(runStart - start) * CLUSTER_SIZE(vol),
+                (i - runStart) * SECTORS_PER_CLUSTER(vol)) == Failure) {
+                reportMessage("Failed to write folder clusters %u-%u\n", clusters[runStart], clusters[i - 1]);
+                free(buffer);
+                return Failure;
+            }
+        }
+    }
+    free(buffer);
+    return Success;
+}
+
+static int compareUpdates(const void * a, const void * b) {
+    const EntryUpdate * x = a, * y = b;
+    if (x->sector != y->sector) return x->sector < y->sector ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Entries that go to clusters existing directories already have are grouped by sector
+static success writeExistingEntries(Volume * vol, const TreePlan * plan) {
+    uint32_t nUpdates = 0;
+    for (uint32_t i = 0; i < plan->count; ++i)
+        if (plan->nodes[i].isNew && reservedEntryCluster(vol, plan, &plan->nodes[i]) < 0) ++nUpdates;
+    if (nUpdates == 0) return Success;
+    EntryUpdate * updates = malloc(nUpdates * sizeof(EntryUpdate));
+    if (!updates) {
+        reportMessage("Failed to allocate memory for the new folder entries\n");
+        return Failure;
+    }
+    nUpdates = 0;
+    uint32_t * chain = NULL;
+    int32_t chainOwner = -1;
+    uint32_t chainLength = 0;
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        const TreeNode * node = &plan->nodes[i];
+        if (!node->isNew || reservedEntryCluster(vol, plan, node) >= 0) continue;
+        if (node->parent != chainOwner) {
+            free(chain);
+            chainOwner = node->parent;
+            chainLength = collectClusterChain(vol, plan->nodes[chainOwner].cluster, &chain);
+        }
+        uint32_t hop = node->slot / ENTRIES_PER_CLUSTER(vol), inCluster = node->slot % ENTRIES_PER_CLUSTER(vol);
+        if (hop >= chainLength) {
+            reportMessage("Failed to locate entry %u in the chain of cluster %u\n", node->slot, plan->nodes[chainOwner].cluster);
+            free(chain);
+            free(updates);
+            return Failure;
+        }
+        updates[nUpdates].sector = CLUSTER_FIRST_SECTOR(vol, chain[hop]) + inCluster / ENTRIES_PER_SECTOR;
+        updates[nUpdates].offset = (inCluster % ENTRIES_PER_SECTOR) * ENTRY_SIZE;
+        updates[nUpdates++].node = (int32_t)i;
+    }
+    free(chain);
+    qsort(updates, nUpdates, sizeof(EntryUpdate), compareUpdates);
+
+    success result = Success;
+    for (uint32_t i = 0; result == Success && i < nUpdates;) {
+        uint32_t sector = updates[i].sector;
+        // On a mapped volume I edit the entries in place, otherwise I read-modify-write the sector once
+        uint8_t copy[SECTOR_SIZE];
+        uint8_t * buffer = mappedSectorsForWrite(vol->device, sector, 1);
+        if (!buffer) {
+            buffer = copy;
+            if (readSector(vol, sector, buffer) == Failure) result = Failure;
+        }
+        for (; i < nUpdates && updates[i].sector == sector; ++i) {
+            const TreeNode * node = &plan->nodes[updates[i].node];
+            putDirectoryEntry(buffer + updates[i].offset, node->name, node->cluster);
+        }
+        if (result == Success && buffer == copy && writeSector(vol, sector, buffer) == Failure) result = Failure;
+        if (result == Failure) reportMessage("Failed to write the folder entries of sector %u\n", sector);
+    }
+    free(updates);
+    return result;
+}
+
+// The reserved clusters are marked end-of-chain; I link those of each directory, and the clusters an
+// existing directory grows by to the end of its chain
+static void linkClusters(Volume * vol, const TreePlan * plan, const uint32_t * clusters) {
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        const TreeNode * node = &plan->nodes[i];
+        if (node->nClusters == 0) continue;
+        const uint32_t * own = clusters + node->firstReserved;
+        if (!node->isNew) setFATEntry(vol, node->lastCluster, own[0]);
+        for (uint32_t j = 0; j + 1 < node->nClusters; ++j) setFATEntry(vol, own[j], own[j + 1]);
+    }
+}
+
+// Slots are handed to the indexes in the order they were taken from them
+static void updateIndexes(Volume * vol, const TreePlan * plan, const uint32_t * clusters) {
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        const TreeNode * node = &plan->nodes[i];
+        if (node->isNew || node->nNewChildren == 0) continue;
+        for (uint32_t j = 0; j < node->nClusters; ++j) noteDirectoryExtended(vol, node->cluster, clusters[node->firstReserved + j]);
+        for (int32_t child = node->firstChild; child >= 0; child = plan->nodes[child].nextSibling) {
+            const TreeNode * entry = &plan->nodes[child];
+            insertIntoDirIndex(vol, node->cluster, entry->name, 0x10, entry->slot, entry->cluster);
+        }
+    }
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        const TreeNode * node = &plan->nodes[i];
+        if (node->isNew) dcacheInvalidate(vol, plan->nodes[node->parent].cluster, node->name, node->cluster);
+    }
+}
+
+success makeDirectories(Volume * vol, char * const * paths, uint32_t nPaths, uint32_t startCluster, uint32_t * nCreated) {
+    *nCreated = 0;
+    TreePlan plan = { NULL, 0, 0 };
+    for (uint32_t p = 0; p < nPaths; ++p) {
+        if (addPath(vol, &plan, paths[p], startCluster) == Failure) {
+            free(plan.nodes);
+            return Failure;
+        }
+    }
+    uint32_t total;
+    if (layOutPlan(vol, &plan, &total) == Failure) {
+        free(plan.nodes);
+        return Failure;
+    }
+    if (total == 0) {
+        free(plan.nodes);
+        return Success; // every folder already exists
+    }
+    uint32_t * clusters = malloc(total * sizeof(uint32_t));
+    if (!clusters || allocateClusters(vol, total, clusters) == Failure) {
+        reportMessage("Not enough free clusters: %u needed, %u free\n", total, getFreeClusterCount(vol));
+        free(clusters);
+        free(plan.nodes);
+        return Failure;
+    }
+    uint32_t created = 0;
+    for (uint32_t i = 0; i < plan.count; ++i) {
+        if (!plan.nodes[i].isNew) continue;
+        plan.nodes[i].cluster = clusters[plan.nodes[i].firstReserved];
+        ++created;
+    }
+    // Until their entries are written, the new clusters are not reachable: a failure gives them back
+    if (writeNewClusters(vol, &plan, clusters, total) == Failure) {
+        for (uint32_t i = 0; i < total; ++i) freeCluster(vol, clusters[i]);
+        free(clusters);
+        free(plan.nodes);
+        return Failure;
+    }
+    linkClusters(vol, &plan, clusters);
+    success result = writeExistingEntries(vol, &plan);
+    if (result == Success) {
+        updateIndexes(vol, &plan, clusters);
+        *nCreated = created;
+    } else {
+        for (uint32_t i = 0; i < plan.count; ++i)
+            if (!plan.nodes[i].isNew) invalidateDirIndex(vol, plan.nodes[i].cluster);
+    }
+    free(clusters);
+    free(plan.nodes);
+    return result;
+}
+
+// A manifest lists one folder path per line; empty lines and lines starting with '#' are skipped
+success makeTreeFromManifest(Volume * vol, const char * manifestPath, uint32_t startCluster, uint32_t * nCreated) {
+    *nCreated = 0;
+    FILE * manifest = fopen(manifestPath, "r");
+    if (!manifest) {
+        reportMessage("Cannot open manifest %s: %s\n", manifestPath, strerror(errno));
+        return Failure;
+    }
+    char ** paths = NULL;
+    uint32_t nPaths = 0, capacity = 0, lineNumber = 0;
+    char line[MAX_PATH + 2];
+    success result = Success;
+    while (result == Success && fgets(line, sizeof(line), manifest)) {
+        ++lineNumber;
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            reportMessage("Line %u of %s is longer than %d characters\n", lineNumber, manifestPath, MAX_PATH);
+            result = Failure;
+            break;
+        }
+        while (length && isspace((unsigned char)line[length - 1])) line[--length] = '\0';
+        char * path = line;
+        while (*path == ' ' || *path == '\t') ++path;
+        if (*path == '\0' || *path == '#') continue;
+        if (nPaths == capacity) {
+            uint32_t newCapacity = capacity ? capacity * 2 : 64;
+            char ** grown = realloc(paths, newCapacity * sizeof(char *));
+            if (!grown) {
+                reportMessage("Failed to allocate memory for the manifest\n");
+                result = Failure;
+                break;
+            }
+            paths = grown;
+            capacity = newCapacity;
+        }
+        paths[nPaths] = strdup(path);
+        if (!paths[nPaths]) result = Failure;
+        else ++nPaths;
+    }
+    fclose(manifest);
+    if (result == Success) result = makeDirectories(vol, paths, nPaths, startCluster, nCreated);
+    for (uint32_t i = 0; i < nPaths; ++i) free(paths[i]);
+    free(paths);
+    return result;
+}
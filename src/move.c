@@ -0,0 +1,112 @@
+#include "move.h"
+#include "fat32.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "volume.h"
+
+// A move only rewrites directory entries: a moved folder first gets its ".." pointed at the new
+// parent, then the entry, with its new name if any, is stored in the destination folder, and the
+// old one is marked deleted last. Its clusters and everything below it stay where they are. The
+// changes are those of one command, so with the journal they are committed as one record. Without
+// it (or when the command is too large for a record) a crash between the writes leaves either a
+// folder whose ".." names the new parent, which fsck rewrites, or a folder found in both parents,
+// which fsck reports as a cross-link; the folder is never left in neither.
+
+// I split a path into the folder holding its last component and that component
+static uint32_t resolveParent(Volume * vol, char * path, uint32_t startCluster, char ** leaf) {
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') path[--length] = '\0';
+    char * slash = strrchr(path, '/');
+    if (!slash) {
+        *leaf = path;
+        return startCluster;
+    }
+    *leaf = slash + 1;
+    if (slash == path) return ROOT_CLUSTER;
+    *slash = '\0';
+    return findClusterByFullPath(vol, path, startCluster);
+}
+
+static boolean isDotName(const char * name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+// A folder can't go below itself: I walk up from the destination through the ".." entries
+static boolean isInSubtree(Volume * vol, uint32_t cluster, uint32_t folderCluster) {
+    for (uint32_t n = 0; n < N_CLUSTERS(vol); ++n) {
+        if (cluster == folderCluster) return True;
+        if (cluster <= ROOT_CLUSTER || cluster >= N_CLUSTERS(vol)) return False;
+        cluster = getDotDotCluster(vol, cluster);
+    }
+    return True; // the ".." entries loop, so I refuse rather than guess
+}
+
+success moveEntry(Volume * vol, char * sourcePath, char * destinationPath, uint32_t startCluster) {
+    char * sourceName;
+    uint32_t sourceDir = resolveParent(vol, sourcePath, startCluster, &sourceName);
+    if (sourceDir == 0) return Failure;
+    if (!*sourceName || isDotName(sourceName) || strlen(sourceName) >= FULL_FILE_STRING_SIZE) {
+        reportMessage("Invalid source: %s\n", *sourceName ? sourceName : "/");
+        return Failure;
+    }
+    uint8_t sourceRaw[FILE_AND_EXT_RAW_LENGTH];
+    formatShortName(sourceName, sourceRaw);
+    const DirIndexEntry * indexed = lookupDirIndex(getDirIndex(vol, sourceDir), sourceRaw);
+    if (!indexed) {
+        reportMessage("%s not found\n", sourceName);
+        return Failure;
+    }
+    uint32_t sourceSlot = indexed->slot, firstCluster = indexed->firstCluster;
+    IsFolder isFolder = (indexed->attributes & 0x10) ? itsFolder : itsFile;
+
+    // The destination is an existing folder to move into, or the new path of the entry
+    char * destinationName;
+    uint32_t destinationDir = resolveParent(vol, destinationPath, startCluster, &destinationName);
+    if (destinationDir == 0) return Failure;
+    char newName[FULL_FILE_STRING_SIZE];
+    strcpy(newName, sourceName);
+    if (isDotName(destinationName)) {
+        destinationDir = findSubdirectoryCluster(vol, destinationName, destinationDir);
+        if (destinationDir == 0) return Failure;
+    } else if (*destinationName) {
+        uint8_t destinationRaw[FILE_AND_EXT_RAW_LENGTH];
+        formatShortName(destinationName, destinationRaw);
+        const DirIndexEntry * existing = lookupDirIndex(getDirIndex(vol, destinationDir), destinationRaw);
+        if (existing && (existing->attributes & 0x10)) destinationDir = existing->firstCluster;
+        else if (existing) {
+            reportMessage("Name %s already exists in the folder\n", destinationName);
+            return Failure;
+        } else if (strlen(destinationName) >= sizeof(newName)) {
+            reportMessage("Invalid name: %s\n", destinationName);
+            return Failure;
+        } else strcpy(newName, destinationName);
+    }
+    if (!isValidShortNameAndUppercaseFile(newName, isFolder)) {
+        reportMessage("Invalid %s name: %s\n", isFolder ? "folder" : "file", newName);
+        return Failure;
+    }
+    uint8_t newRaw[FILE_AND_EXT_RAW_LENGTH];
+    formatShortName(newName, newRaw);
+    if (lookupDirIndex(getDirIndex(vol, destinationDir), newRaw)) {
+        reportMessage("Name %s already exists in the folder\n", newName);
+        return Failure;
+    }
+    if (isFolder && destinationDir != sourceDir && isInSubtree(vol, destinationDir, firstCluster)) {
+        reportMessage("Cannot move the folder %s into itself\n", sourceName);
+        return Failure;
+    }
+
+    uint8_t entry[ENTRY_SIZE];
+    if (readDirectoryEntry(vol, sourceDir, sourceSlot, entry) == Failure) return Failure;
+    memcpy(entry, newRaw, FILE_AND_EXT_RAW_LENGTH);
+    boolean reparented = isFolder && destinationDir != sourceDir ? True : False;
+    if (reparented && setDotDotCluster(vol, firstCluster, destinationDir) == Failure) return Failure;
+    if (placeDirectoryEntry(vol, destinationDir, entry) == Failure) {
+        if (reparented) setDotDotCluster(vol, firstCluster, sourceDir);
+        return Failure;
+    }
+    if (deleteDirectoryEntry(vol, sourceDir, sourceSlot) == Failure) return Failure;
+    removeFromDirIndex(vol, sourceDir, sourceRaw);
+    dcacheInvalidate(vol, sourceDir, sourceRaw, firstCluster);
+    return Success;
+}
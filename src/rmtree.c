@@ -0,0 +1,178 @@
+#include "rmtree.h"
+#include "fat32.h"
+#include "fatcache.h"
+#include "allocator.h"
+#include "bufcache.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "volume.h"
+#include "dirscan.h"
+
+// Everything a removal frees is collected before anything is changed, so that a read error leaves
+// the tree as it was: the directories below the removed one are read once each, breadth-first, and
+// the clusters of every chain found in them go into one batch. Only the entry of the removed object
+// is marked deleted, the directories below it go with their clusters. The batch is freed in
+// ascending order, each FAT sector is changed in the cache however many chains run through it, and
+// the FAT, FSInfo and the directory sector reach the volume once, at the commit.
+typedef struct {
+    uint32_t * clusters;
+    uint32_t count;
+    uint32_t capacity;
+} ClusterBatch;
+
+typedef struct {
+    uint32_t cluster;
+    uint32_t parentCluster;
+    uint8_t name[FILE_AND_EXT_RAW_LENGTH];
+} RemovedDirectory;
+
+typedef struct {
+    RemovedDirectory * items;
+    uint32_t count;
+    uint32_t capacity;
+} DirectoryList;
+
+static boolean reserveItems(void ** items, uint32_t * capacity, uint32_t needed, size_t itemSize) {
+    if (needed <= *capacity) return True;
+    uint32_t newCapacity = *capacity ? *capacity * 2 : 64;
+    while (newCapacity < needed) newCapacity *= 2;
+    void * grown = realloc(*items, (size_t)newCapacity * itemSize);
+    if (!grown) {
+        reportMessage("Failed to allocate memory for the removal\n");
+        return False;
+    }
+    *items = grown;
+    *capacity = newCapacity;
+    return True;
+}
+
+// A chain that runs into a free cluster ends there
+static success addChain(Volume * vol, ClusterBatch * batch, uint32_t firstCluster) {
+    uint32_t cluster = firstCluster;
+    for (uint32_t n = 0; cluster >= ROOT_CLUSTER && cluster < N_CLUSTERS(vol) && n < N_CLUSTERS(vol); ++n) {
+        uint32_t next = getFATEntry(vol, cluster);
+        if (next == 0) break;
+        if (!reserveItems((void **)&batch->clusters, &batch->capacity, batch->count + 1, sizeof(uint32_t))) return Failure;
+        batch->clusters[batch->count++] = cluster;
+        if (next >= FAT_EOC_MIN) break;
+        cluster = next;
+    }
+    return Success;
+}
+
+static success addDirectory(Volume * vol, DirectoryList * dirs, uint32_t cluster, uint32_t parentCluster, const uint8_t * name) {
+    // Every directory has a cluster of its own: more of them means the tree loops
+    if (dirs->count >= N_CLUSTERS(vol)) {
+        reportMessage("The folder tree loops back on itself, run fsck\n");
+        return Failure;
+    }
+    if (!reserveItems((void **)&dirs->items, &dirs->capacity, dirs->count + 1, sizeof(RemovedDirectory))) return Failure;
+    RemovedDirectory * dir = &dirs->items[dirs->count++];
+    dir->cluster = cluster;
+    dir->parentCluster = parentCluster;
+    memcpy(dir->name, name, FILE_AND_EXT_RAW_LENGTH);
+    return Success;
+}
+
+// The list starts with the removed directory and grows with the subdirectories found in it
+static success collectSubtree(Volume * vol, DirectoryList * dirs, ClusterBatch * batch, uint32_t * nEntries) {
+    for (uint32_t i = 0; i < dirs->count; ++i) {
+        uint32_t dirCluster = dirs->items[i].cluster;
+        DirectoryView view;
+        if (openDirectoryView(vol, dirCluster, &view) == Failure) return Failure;
+        success ret = Success;
+        for (uint32_t c = 0; c < view.nClusters && ret == Success; ++c) {
+            if (!reserveItems((void **)&batch->clusters, &batch->capacity, batch->count + 1, sizeof(uint32_t))) ret = Failure;
+            else batch->clusters[batch->count++] = view.chain[c];
+        }
+        EntryMasks masks;
+        for (uint32_t base = 0; ret == Success && scanDirectoryBlock(&view, base, &masks); base += SCAN_BLOCK_ENTRIES) {
+            for (uint64_t bits = masks.used & ~masks.longName; ret == Success && bits; bits &= bits - 1) {
+                uint32_t slot = base + lowestBit(bits);
+                const uint8_t * entry = directoryEntry(&view, slot);
+                if (entry[0] == '.') continue;
+                uint32_t firstCluster = entryFirstCluster(entry);
+                ++*nEntries;
+                if (!(masks.directory >> (slot - base) & 1)) ret = firstCluster ? addChain(vol, batch, firstCluster) : Success;
+                else if (firstCluster >= ROOT_CLUSTER && firstCluster < N_CLUSTERS(vol)) ret = addDirectory(vol, dirs, firstCluster, dirCluster, entry);
+            }
+            if (masks.end < masks.count) break;
+        }
+        closeDirectoryView(&view);
+        if (ret == Failure) return Failure;
+    }
+    return Success;
+}
+
+// Cached sectors of freed clusters would only be written back for nothing; the batch is sorted,
+// so I drop them run by run
+static void discardFreedSectors(Volume * vol, const ClusterBatch * batch) {
+    for (uint32_t i = 0; i < batch->count;) {
+        uint32_t end = i + 1;
+        while (end < batch->count && batch->clusters[end] == batch->clusters[end - 1] + 1) ++end;
+        discardCachedRange(vol, CLUSTER_FIRST_SECTOR(vol, batch->clusters[i]), (end - i) * SECTORS_PER_CLUSTER(vol));
+        i = end;
+    }
+}
+
+success removeEntry(Volume * vol, uint32_t dirCluster, const char * name, RemoveMode mode, uint32_t * nRemoved) {
+    *nRemoved = 0;
+    if (!name || !*name || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        reportMessage("Invalid name: %s\n", name ? name : "");
+        return Failure;
+    }
+    uint8_t rawName[FILE_AND_EXT_RAW_LENGTH];
+    formatShortName(name, rawName);
+    const DirIndexEntry * indexed = lookupDirIndex(getDirIndex(vol, dirCluster), rawName);
+    if (!indexed) {
+        reportMessage("%s not found\n", name);
+        return Failure;
+    }
+    uint32_t slot = indexed->slot, firstCluster = indexed->firstCluster;
+    boolean isFolder = (indexed->attributes & 0x10) ? True : False;
+    if (isFolder && mode == removeFileOnly) {
+        reportMessage("%s is a folder (use rmdir or rm -r)\n", name);
+        return Failure;
+    }
+    if (!isFolder && mode == removeEmptyFolder) {
+        reportMessage("%s is not a folder\n", name);
+        return Failure;
+    }
+    if (isFolder && (firstCluster < ROOT_CLUSTER || firstCluster >= N_CLUSTERS(vol))) {
+        reportMessage("Folder %s points to the invalid cluster %u, run fsck\n", name, firstCluster);
+        return Failure;
+    }
+    if (mode == removeEmptyFolder) {
+        DirIndex * index = getDirIndex(vol, firstCluster);
+        if (!index) return Failure;
+        if (index->count > 2) { // "." and ".."
+            reportMessage("Folder %s is not empty\n", name);
+            return Failure;
+        }
+    }
+
+    ClusterBatch batch = { NULL, 0, 0 };
+    DirectoryList dirs = { NULL, 0, 0 };
+    uint32_t nEntries = 1;
+    success ret;
+    if (!isFolder) ret = firstCluster ? addChain(vol, &batch, firstCluster) : Success;
+    else {
+        ret = addDirectory(vol, &dirs, firstCluster, dirCluster, rawName);
+        if (ret == Success) ret = collectSubtree(vol, &dirs, &batch, &nEntries);
+    }
+    if (ret == Success) ret = deleteDirectoryEntry(vol, dirCluster, slot);
+    if (ret == Success) {
+        removeFromDirIndex(vol, dirCluster, rawName);
+        for (uint32_t i = 0; i < dirs.count; ++i) {
+            invalidateDirIndex(vol, dirs.items[i].cluster);
+            leaveRemovedFolder(vol, dirs.items[i].cluster);
+            dcacheInvalidate(vol, dirs.items[i].parentCluster, dirs.items[i].name, dirs.items[i].cluster);
+        }
+        freeClusters(vol, batch.clusters, batch.count);
+        discardFreedSectors(vol, &batch);
+        *nRemoved = nEntries;
+    }
+    free(batch.clusters);
+    free(dirs.items);
+    return ret;
+}
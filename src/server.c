@@ -0,0 +1,272 @@
+#include "server.h"
+#include "emulator.h"
+#include "volume.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// The volume is mounted once and the commands of the emulator are served to local clients, each
+// with its own current folder. The thread that calls serve() polls the idle connections and hands
+// one with input to a worker; the worker runs the complete lines received so far, sends the replies
+// and gives the connection back through a pipe. Commands that work in one folder share the volume
+// and lock only that folder, readers together and writers alone, so clients in different folders
+// run in parallel; commands that span folders (rmdir, rm -r, mv, mkdir -p, import, ...) take the
+// volume alone. A slow client only holds its own worker.
+typedef struct {
+    int fd;
+    uint32_t cluster; // current folder
+    boolean busy;     // handed to a worker
+    boolean closing;
+    size_t length;
+    char input[INPUT_MAX_LENGTH];
+} Client;
+
+// Everything a call of serve() keeps, on its stack: any number of volumes can be served at once
+typedef struct {
+    Volume * vol;
+    int wakeReads, wakeWrites;          // clients given back by the workers, NULL when a signal stops the server
+    Client * ready[SERVER_MAX_CLIENTS]; // clients with input, waiting for a worker
+    uint32_t readyHead, nReady;
+    boolean stopping;
+    pthread_mutex_t queueLock;
+    pthread_cond_t queueNotEmpty;
+    Client * clients[SERVER_MAX_CLIENTS];
+    uint32_t nClients;
+    struct pollfd fds[2 + SERVER_MAX_CLIENTS];
+    Client * polled[2 + SERVER_MAX_CLIENTS];
+} Server;
+
+static int stopWrites = -1; // wake-up pipe of the server a signal stops; a signal handler reaches nothing else
+
+static void requestStop(int signal) {
+    (void)signal;
+    Client * none = NULL;
+    ssize_t ignored = write(stopWrites, &none, sizeof(none));
+    (void)ignored;
+}
+
+static success sendAll(int fd, const char * data, size_t length) {
+    while (length) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return Failure;
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return Success;
+}
+
+static void runLine(Volume * vol, Client * client, char * line) {
+    char * reply = NULL;
+    size_t size = 0;
+    FILE * output = open_memstream(&reply, &size);
+    if (!output) {
+        client->closing = True;
+        return;
+    }
+    CommandResult result = runClientCommand(vol, line, &client->cluster, output);
+    fputs(result == commandFailed ? SERVER_REPLY_FAILED : SERVER_REPLY_OK, output);
+    fclose(output);
+    if (sendAll(client->fd, reply, size) == Failure || result == commandExit) client->closing = True;
+    free(reply);
+}
+
+// A partial line stays in the buffer until the rest of it arrives
+static void handleInput(Volume * vol, Client * client) {
+    ssize_t got = read(client->fd, client->input + client->length, sizeof(client->input) - 1 - client->length);
+    if (got <= 0) {
+        if (got == 0 || errno != EINTR) client->closing = True;
+        return;
+    }
+    client->length += (size_t)got;
+    char * line = client->input;
+    char * newline;
+    while (!client->closing && (newline = memchr(line, '\n', client->input + client->length - line))) {
+        *newline = '\0';
+        runLine(vol, client, line);
+        line = newline + 1;
+    }
+    client->length -= (size_t)(line - client->input);
+    memmove(client->input, line, client->length);
+    if (!client->closing && client->length == sizeof(client->input) - 1) {
+        static const char tooLong[] = "Command too long\n" SERVER_REPLY_FAILED;
+        sendAll(client->fd, tooLong, sizeof(tooLong) - 1);
+        client->closing = True;
+    }
+}
+
+static void * serveClients(void * argument) {
+    Server * server = argument;
+    while (True) {
+        pthread_mutex_lock(&server->queueLock);
+        while (!server->nReady && !server->stopping) pthread_cond_wait(&server->queueNotEmpty, &server->queueLock);
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->queueLock);
+            return NULL;
+        }
+        Client * client = server->ready[server->readyHead];
+        server->readyHead = (server->readyHead + 1) % SERVER_MAX_CLIENTS;
+        --server->nReady;
+        pthread_mutex_unlock(&server->queueLock);
+        handleInput(server->vol, client);
+        ssize_t ignored = write(server->wakeWrites, &client, sizeof(client));
+        (void)ignored;
+    }
+}
+
+static void handOver(Server * server, Client * client) {
+    client->busy = True;
+    pthread_mutex_lock(&server->queueLock);
+    server->ready[(server->readyHead + server->nReady) % SERVER_MAX_CLIENTS] = client;
+    ++server->nReady;
+    pthread_cond_signal(&server->queueNotEmpty);
+    pthread_mutex_unlock(&server->queueLock);
+}
+
+static int openListener(const char * socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        reportMessage("Socket path %s is too long\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+    // A socket left by a server that did not stop cleanly is replaced; any other file is not
+    struct stat info;
+    if (lstat(socketPath, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(socketPath);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SERVER_BACKLOG) != 0) {
+        reportMessage("Cannot listen on %s: %s\n", socketPath, strerror(errno));
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+static uint32_t defaultWorkerCount(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1) return 1;
+    return online < SERVER_MAX_WORKERS ? (uint32_t)online : SERVER_MAX_WORKERS;
+}
+
+success serve(Volume * vol, const char * socketPath, uint32_t nWorkers) {
+    if (nWorkers == 0) nWorkers = defaultWorkerCount();
+    if (nWorkers > SERVER_MAX_WORKERS) nWorkers = SERVER_MAX_WORKERS;
+    int listener = openListener(socketPath);
+    if (listener < 0) return Failure;
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.vol = vol;
+    int wake[2];
+    if (pipe(wake) != 0) {
+        reportMessage("Cannot create the wake-up pipe: %s\n", strerror(errno));
+        close(listener);
+        unlink(socketPath);
+        return Failure;
+    }
+    server.wakeReads = wake[0];
+    server.wakeWrites = wake[1];
+    pthread_mutex_init(&server.queueLock, NULL);
+    pthread_cond_init(&server.queueNotEmpty, NULL);
+
+    int previousStopWrites = stopWrites;
+    stopWrites = server.wakeWrites;
+    struct sigaction stop, previousInterrupt, previousTerminate;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = requestStop;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, &previousInterrupt);
+    sigaction(SIGTERM, &stop, &previousTerminate);
+
+    pthread_t workers[SERVER_MAX_WORKERS];
+    uint32_t nStarted = 0;
+    while (nStarted < nWorkers && pthread_create(&workers[nStarted], NULL, serveClients, &server) == 0) ++nStarted;
+    success result = nStarted ? Success : Failure;
+    if (nStarted) reportMessage("Serving the volume on %s with %u worker(s)\n", socketPath, nStarted);
+    else reportLine("Failed to start the workers");
+    fflush(stdout);
+
+    struct pollfd * fds = server.fds;
+    Client ** clients = server.clients;
+    boolean running = nStarted ? True : False;
+    while (running) {
+        nfds_t nFds = 0;
+        fds[nFds++] = (struct pollfd){ .fd = server.wakeReads, .events = POLLIN };
+        // Connections beyond the limit wait in the backlog
+        fds[nFds++] = (struct pollfd){ .fd = server.nClients < SERVER_MAX_CLIENTS ? listener : -1, .events = POLLIN };
+        for (uint32_t i = 0; i < server.nClients; ++i) {
+            if (clients[i]->busy) continue;
+            server.polled[nFds] = clients[i];
+            fds[nFds++] = (struct pollfd){ .fd = clients[i]->fd, .events = POLLIN };
+        }
+        if (poll(fds, nFds, -1) < 0) {
+            if (errno == EINTR) continue;
+            reportMessage("Polling the connections failed: %s\n", strerror(errno));
+            result = Failure;
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            Client * returned[64];
+            ssize_t got = read(server.wakeReads, returned, sizeof(returned));
+            for (ssize_t i = 0; i < got / (ssize_t)sizeof(Client *); ++i) {
+                if (!returned[i]) {
+                    running = False;
+                    continue;
+                }
+                returned[i]->busy = False;
+                if (!returned[i]->closing) continue;
+                for (uint32_t c = 0; c < server.nClients; ++c) {
+                    if (clients[c] != returned[i]) continue;
+                    clients[c] = clients[--server.nClients];
+                    break;
+                }
+                untrackCurrentFolder(vol, &returned[i]->cluster);
+                close(returned[i]->fd);
+                free(returned[i]);
+            }
+        }
+        for (nfds_t i = 2; i < nFds; ++i)
+            if (fds[i].revents && !server.polled[i]->busy) handOver(&server, server.polled[i]);
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            Client * client = fd >= 0 ? calloc(1, sizeof(Client)) : NULL;
+            if (client) {
+                client->fd = fd;
+                client->cluster = ROOT_CLUSTER;
+            }
+            if (client && trackCurrentFolder(vol, &client->cluster) == Success) clients[server.nClients++] = client;
+            else {
+                free(client);
+                if (fd >= 0) close(fd);
+            }
+        }
+    }
+
+    // A worker finishes the lines it has taken before it stops
+    pthread_mutex_lock(&server.queueLock);
+    server.stopping = True;
+    pthread_cond_broadcast(&server.queueNotEmpty);
+    pthread_mutex_unlock(&server.queueLock);
+    for (uint32_t i = 0; i < nStarted; ++i) pthread_join(workers[i], NULL);
+    for (uint32_t i = 0; i < server.nClients; ++i) {
+        untrackCurrentFolder(vol, &clients[i]->cluster);
+        close(clients[i]->fd);
+        free(clients[i]);
+    }
+    sigaction(SIGINT, &previousInterrupt, NULL);
+    sigaction(SIGTERM, &previousTerminate, NULL);
+    stopWrites = previousStopWrites;
+    close(server.wakeReads);
+    close(server.wakeWrites);
+    pthread_cond_destroy(&server.queueNotEmpty);
+    pthread_mutex_destroy(&server.queueLock);
+    close(listener);
+    unlink(socketPath);
+    if (nStarted) reportLine("Server stopped");
+    return result;
+}
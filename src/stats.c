@@ -0,0 +1,285 @@
+#include "stats.h"
+#include "bufcache.h"
+#include "fatcache.h"
+#include "dcache.h"
+#include "journal.h"
+#include "volume.h"
+
+// Every volume counts its own traffic, under a lock of its own since commands may share the volume;
+// the counters are printed and reset by commands that hold the volume alone, and fsck workers use their own reads
+typedef struct {
+    uint64_t readRequests;
+    uint64_t sectorsRead;
+    uint64_t writeRequests;
+    uint64_t sectorsWritten;
+} IOCounters;
+
+typedef struct {
+    char verb[STATS_VERB_LENGTH];
+    uint64_t count;
+    double totalSeconds;
+    double maxSeconds;
+    uint64_t buckets[STATS_LATENCY_BUCKETS];
+} VerbLatency;
+
+static const char * ioClassNames[IO_CLASS_COUNT] = { "reserved", "fat", "directory", "data" };
+
+// The class is that of the command the thread is running, whatever volume it runs on
+static __thread IOClass currentClass = ioDirectory;
+
+struct VolumeStats {
+    pthread_mutex_t lock;
+    const VolumeGeometry * geometry; // of the volume, to tell its regions apart
+    IOCounters requested[IO_CLASS_COUNT]; // what the engine asked for
+    IOCounters device[IO_CLASS_COUNT];    // what reached the image, by region
+    uint64_t seeks;       // device requests that do not start where the previous one ended
+    uint64_t seekCalls;   // fseeko() calls of the stdio backend
+    uint64_t flushes;
+    uint64_t dataSyncs;
+    uint64_t nextLBA;
+    VerbLatency verbs[STATS_MAX_VERBS];
+    uint32_t nVerbs;
+    // The caches keep their own counters; a reset only moves the baselines
+    uint64_t baseCacheHits, baseCacheMisses, baseDentryHits, baseDentryMisses, baseFATPageLoads;
+    uint64_t baseRecords, baseLoggedSectors, baseCheckpoints, baseInPlaceCommits;
+};
+
+VolumeStats * createVolumeStats(const VolumeGeometry * geometry) {
+    VolumeStats * stats = calloc(1, sizeof(VolumeStats));
+    if (!stats) return NULL;
+    if (pthread_mutex_init(&stats->lock, NULL) != 0) {
+        free(stats);
+        return NULL;
+    }
+    stats->geometry = geometry;
+    return stats;
+}
+
+void destroyVolumeStats(VolumeStats * stats) {
+    if (!stats) return;
+    pthread_mutex_destroy(&stats->lock);
+    free(stats);
+}
+
+// Returns the previous class so that callers can restore it
+IOClass setIOClass(IOClass ioClass) {
+    IOClass previous = currentClass;
+    currentClass = ioClass;
+    return previous;
+}
+
+static IOClass classify(const VolumeStats * stats, uint32_t lba, IOClass dataRegionClass) {
+    if (lba < N_RESERVED_SECTORS) return ioReserved;
+    if (lba < stats->geometry->firstDataSector) return ioFAT;
+    return dataRegionClass;
+}
+
+static void add(IOCounters * counters, uint64_t sectors, boolean write) {
+    if (write) {
+        ++counters->writeRequests;
+        counters->sectorsWritten += sectors;
+    } else {
+        ++counters->readRequests;
+        counters->sectorsRead += sectors;
+    }
+}
+
+void countRequest(VolumeStats * stats, uint32_t lba, uint64_t sectors, boolean write) {
+    pthread_mutex_lock(&stats->lock);
+    add(&stats->requested[classify(stats, lba, currentClass)], sectors, write);
+    pthread_mutex_unlock(&stats->lock);
+}
+
+// Host copies bypass both the cache and the backends
+void countDataTransfer(VolumeStats * stats, uint64_t sectors, boolean write) {
+    pthread_mutex_lock(&stats->lock);
+    add(&stats->requested[ioData], sectors, write);
+    add(&stats->device[ioData], sectors, write);
+    pthread_mutex_unlock(&stats->lock);
+}
+
+void countDeviceIO(VolumeStats * stats, uint32_t lba, uint64_t sectors, boolean write) {
+    pthread_mutex_lock(&stats->lock);
+    add(&stats->device[classify(stats, lba, currentClass)], sectors, write);
+    if (lba != stats->nextLBA) ++stats->seeks;
+    stats->nextLBA = (uint64_t)lba + sectors;
+    pthread_mutex_unlock(&stats->lock);
+}
+
+void countSeekCall(VolumeStats * stats) {
+    pthread_mutex_lock(&stats->lock);
+    ++stats->seekCalls;
+    pthread_mutex_unlock(&stats->lock);
+}
+
+void countFlush(VolumeStats * stats) {
+    pthread_mutex_lock(&stats->lock);
+    ++stats->flushes;
+    pthread_mutex_unlock(&stats->lock);
+}
+
+void countDataSync(VolumeStats * stats) {
+    pthread_mutex_lock(&stats->lock);
+    ++stats->dataSyncs;
+    pthread_mutex_unlock(&stats->lock);
+}
+
+static uint32_t bucketOf(double seconds) {
+    double micros = seconds * 1e6;
+    uint32_t bucket = 0;
+    while (bucket + 1 < STATS_LATENCY_BUCKETS && micros >= (double)(1u << bucket)) ++bucket;
+    return bucket;
+}
+
+void recordCommandLatency(Volume * vol, const char * verb, double seconds) {
+    VolumeStats * stats = vol->stats;
+    VerbLatency * entry = NULL;
+    pthread_mutex_lock(&stats->lock);
+    for (uint32_t i = 0; i < stats->nVerbs && !entry; ++i)
+        if (strncmp(stats->verbs[i].verb, verb, STATS_VERB_LENGTH - 1) == 0) entry = &stats->verbs[i];
+    // Unknown words typed by the user should not push real verbs out
+    if (!entry && stats->nVerbs < STATS_MAX_VERBS) {
+        entry = &stats->verbs[stats->nVerbs++];
+        memset(entry, 0, sizeof(VerbLatency));
+        strncpy(entry->verb, verb, STATS_VERB_LENGTH - 1);
+    }
+    if (entry) {
+        ++entry->count;
+        entry->totalSeconds += seconds;
+        if (seconds > entry->maxSeconds) entry->maxSeconds = seconds;
+        ++entry->buckets[bucketOf(seconds)];
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+// The upper bound of the bucket that holds the requested fraction, capped by the slowest command
+static double percentileMicros(const VerbLatency * entry, double fraction) {
+    uint64_t wanted = (uint64_t)(fraction * entry->count + 0.999999), seen = 0;
+    for (uint32_t i = 0; i < STATS_LATENCY_BUCKETS; ++i) {
+        seen += entry->buckets[i];
+        if (seen >= wanted) {
+            double bound = (double)(1u << i);
+            return bound < entry->maxSeconds * 1e6 ? bound : entry->maxSeconds * 1e6;
+        }
+    }
+    return entry->maxSeconds * 1e6;
+}
+
+// The dentry cache can also be reset on its own, which leaves a baseline above its counters
+static uint64_t since(uint64_t value, uint64_t base) {
+    return value >= base ? value - base : value;
+}
+
+static void cacheCounters(Volume * vol, uint64_t * cacheHits, uint64_t * cacheMisses, uint64_t * dentryHits, uint64_t * dentryMisses, uint64_t * fatPageLoads) {
+    VolumeStats * stats = vol->stats;
+    uint32_t dirty, resident;
+    getBufferCacheStats(vol, cacheHits, cacheMisses, &dirty);
+    dcacheGetStats(vol, dentryHits, dentryMisses);
+    getFATCacheStats(vol, &resident, fatPageLoads);
+    *cacheHits = since(*cacheHits, stats->baseCacheHits);
+    *cacheMisses = since(*cacheMisses, stats->baseCacheMisses);
+    *dentryHits = since(*dentryHits, stats->baseDentryHits);
+    *dentryMisses = since(*dentryMisses, stats->baseDentryMisses);
+    *fatPageLoads = since(*fatPageLoads, stats->baseFATPageLoads);
+}
+
+static void journalCounters(Volume * vol, uint64_t * records, uint64_t * sectors, uint64_t * checkpoints, uint64_t * inPlaceCommits) {
+    VolumeStats * stats = vol->stats;
+    getJournalStats(vol, records, sectors, checkpoints, inPlaceCommits);
+    *records -= stats->baseRecords;
+    *sectors -= stats->baseLoggedSectors;
+    *checkpoints -= stats->baseCheckpoints;
+    *inPlaceCommits -= stats->baseInPlaceCommits;
+}
+
+void printStats(Volume * vol) {
+    VolumeStats * stats = vol->stats;
+    reportLine("Traffic      requested: reads (sectors)   writes (sectors)   device: reads (sectors)   writes (sectors)");
+    for (int c = 0; c < IO_CLASS_COUNT; ++c) {
+        reportMessage("%-10s %12llu (%8llu) %10llu (%8llu) %16llu (%8llu) %10llu (%8llu)\n", ioClassNames[c],
+            (unsigned long long)stats->requested[c].readRequests, (unsigned long long)stats->requested[c].sectorsRead,
+            (unsigned long long)stats->requested[c].writeRequests, (unsigned long long)stats->requested[c].sectorsWritten,
+            (unsigned long long)stats->device[c].readRequests, (unsigned long long)stats->device[c].sectorsRead,
+            (unsigned long long)stats->device[c].writeRequests, (unsigned long long)stats->device[c].sectorsWritten);
+    }
+    reportMessage("Device: %llu seek(s), %llu fseek call(s), %llu flush(es), %llu fdatasync(s)\n", (unsigned long long)stats->seeks,
+        (unsigned long long)stats->seekCalls, (unsigned long long)stats->flushes, (unsigned long long)stats->dataSyncs);
+    uint64_t cacheHits, cacheMisses, dentryHits, dentryMisses, fatPageLoads;
+    cacheCounters(vol, &cacheHits, &cacheMisses, &dentryHits, &dentryMisses, &fatPageLoads);
+    reportMessage("Caches: sectors %llu hit(s) / %llu miss(es), dentries %llu hit(s) / %llu miss(es), %llu FAT page load(s)\n",
+        (unsigned long long)cacheHits, (unsigned long long)cacheMisses, (unsigned long long)dentryHits,
+        (unsigned long long)dentryMisses, (unsigned long long)fatPageLoads);
+    uint64_t records, loggedSectors, checkpoints, inPlaceCommits;
+    journalCounters(vol, &records, &loggedSectors, &checkpoints, &inPlaceCommits);
+    reportMessage("Journal: %llu record(s) of %llu sector(s), %llu checkpoint(s), %llu commit(s) too large for it\n",
+        (unsigned long long)records, (unsigned long long)loggedSectors, (unsigned long long)checkpoints,
+        (unsigned long long)inPlaceCommits);
+    if (stats->nVerbs) reportLine("Command      count    mean us     p50 us     p99 us     max us");
+    for (uint32_t i = 0; i < stats->nVerbs; ++i) {
+        const VerbLatency * entry = &stats->verbs[i];
+        reportMessage("%-10s %7llu %10.1f %10.1f %10.1f %10.1f\n", entry->verb, (unsigned long long)entry->count,
+            entry->totalSeconds * 1e6 / (double)entry->count, percentileMicros(entry, 0.5), percentileMicros(entry, 0.99),
+            entry->maxSeconds * 1e6);
+    }
+}
+
+void resetStats(Volume * vol) {
+    VolumeStats * stats = vol->stats;
+    memset(stats->requested, 0, sizeof(stats->requested));
+    memset(stats->device, 0, sizeof(stats->device));
+    stats->seeks = stats->seekCalls = stats->flushes = stats->dataSyncs = 0;
+    stats->nVerbs = 0;
+    uint32_t dirty, resident;
+    getBufferCacheStats(vol, &stats->baseCacheHits, &stats->baseCacheMisses, &dirty);
+    dcacheGetStats(vol, &stats->baseDentryHits, &stats->baseDentryMisses);
+    getFATCacheStats(vol, &resident, &stats->baseFATPageLoads);
+    getJournalStats(vol, &stats->baseRecords, &stats->baseLoggedSectors, &stats->baseCheckpoints, &stats->baseInPlaceCommits);
+}
+
+static void dumpCounters(FILE * out, const IOCounters * counters) {
+    fputs("{", out);
+    for (int c = 0; c < IO_CLASS_COUNT; ++c) {
+        fprintf(out, "%s\"%s\": {\"read_requests\": %llu, \"sectors_read\": %llu, \"write_requests\": %llu, \"sectors_written\": %llu}",
+            c ? ", " : "", ioClassNames[c], (unsigned long long)counters[c].readRequests, (unsigned long long)counters[c].sectorsRead,
+            (unsigned long long)counters[c].writeRequests, (unsigned long long)counters[c].sectorsWritten);
+    }
+    fputs("}", out);
+}
+
+success dumpStats(Volume * vol, const char * path) {
+    VolumeStats * stats = vol->stats;
+    FILE * out = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (!out) {
+        printf("Failed to write statistics to %s\n", path);
+        return Failure;
+    }
+    uint64_t cacheHits, cacheMisses, dentryHits, dentryMisses, fatPageLoads;
+    cacheCounters(vol, &cacheHits, &cacheMisses, &dentryHits, &dentryMisses, &fatPageLoads);
+    fputs("{\"requested\": ", out);
+    dumpCounters(out, stats->requested);
+    fputs(", \"device\": ", out);
+    dumpCounters(out, stats->device);
+    fprintf(out, ", \"seeks\": %llu, \"seek_calls\": %llu, \"flushes\": %llu, \"datasyncs\": %llu", (unsigned long long)stats->seeks,
+        (unsigned long long)stats->seekCalls, (unsigned long long)stats->flushes, (unsigned long long)stats->dataSyncs);
+    fprintf(out, ", \"caches\": {\"sector_hits\": %llu, \"sector_misses\": %llu, \"dentry_hits\": %llu, \"dentry_misses\": %llu, \"fat_page_loads\": %llu}",
+        (unsigned long long)cacheHits, (unsigned long long)cacheMisses, (unsigned long long)dentryHits,
+        (unsigned long long)dentryMisses, (unsigned long long)fatPageLoads);
+    uint64_t records, loggedSectors, checkpoints, inPlaceCommits;
+    journalCounters(vol, &records, &loggedSectors, &checkpoints, &inPlaceCommits);
+    fprintf(out, ", \"journal\": {\"records\": %llu, \"logged_sectors\": %llu, \"checkpoints\": %llu, \"in_place_commits\": %llu}",
+        (unsigned long long)records, (unsigned long long)loggedSectors, (unsigned long long)checkpoints,
+        (unsigned long long)inPlaceCommits);
+    fputs(", \"commands\": {", out);
+    for (uint32_t i = 0; i < stats->nVerbs; ++i) {
+        const VerbLatency * entry = &stats->verbs[i];
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"total_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, \"histogram_us\": [",
+            i ? ", " : "", entry->verb, (unsigned long long)entry->count, entry->totalSeconds * 1e6, percentileMicros(entry, 0.5),
+            percentileMicros(entry, 0.99), entry->maxSeconds * 1e6);
+        // Bucket i counts the commands that took less than 2^i microseconds (and not less than 2^(i-1))
+        for (uint32_t b = 0; b < STATS_LATENCY_BUCKETS; ++b) fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)entry->buckets[b]);
+        fputs("]}", out);
+    }
+    fputs("}}\n", out);
+    if (out != stderr) fclose(out);
+    return Success;
+}
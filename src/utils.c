@@ -4,6 +4,82 @@
 #include <string.h>
 #include <stdbool.h>
 #include "fat32.h"
+#include "blockdev.h"
+#include "bufcache.h"
+#include "volume.h"
+
+#include <pthread.h>
+
+// Engine diagnostics are printed by the emulator; during a library call they are collected for
+// the caller instead, and the server sends them to the client whose command is running. Each
+// thread has its own target, and fsck workers borrow the one of the thread that started them
+// (useMessageTarget()), so they may report at the same time
+struct MessageTarget {
+    char * sink;
+    size_t sinkSize, sinkLength;
+    pthread_mutex_t sinkLock;
+    FILE * stream;
+};
+
+static __thread MessageTarget ownTarget = { .sinkLock = PTHREAD_MUTEX_INITIALIZER };
+static __thread MessageTarget * target = NULL;
+
+MessageTarget * currentMessageTarget(void) {
+    return target ? target : &ownTarget;
+}
+
+void useMessageTarget(MessageTarget * other) {
+    target = other;
+}
+
+void setMessageSink(char * buffer, size_t size) {
+    MessageTarget * t = currentMessageTarget();
+    t->sink = size ? buffer : NULL;
+    t->sinkSize = size;
+    t->sinkLength = 0;
+    if (t->sink) t->sink[0] = '\0';
+}
+
+void setMessageStream(FILE * output) {
+    currentMessageTarget()->stream = output;
+}
+
+void reportMessage(const char * format, ...) {
+    MessageTarget * t = currentMessageTarget();
+    va_list args;
+    va_start(args, format);
+    if (!t->sink) vfprintf(t->stream ? t->stream : stdout, format, args);
+    else {
+        pthread_mutex_lock(&t->sinkLock);
+        if (t->sinkLength + 1 < t->sinkSize) {
+            size_t room = t->sinkSize - t->sinkLength;
+            int written = vsnprintf(t->sink + t->sinkLength, room, format, args);
+            if (written > 0) t->sinkLength += (size_t)written < room ? (size_t)written : room - 1;
+        }
+        pthread_mutex_unlock(&t->sinkLock);
+    }
+    va_end(args);
+}
+
+void reportLine(const char * text) {
+    reportMessage("%s\n", text);
+}
+
+// Content that may hold any byte, such as the data of a file
+void reportBytes(const void * data, size_t length) {
+    MessageTarget * t = currentMessageTarget();
+    if (!t->sink) {
+        fwrite(data, 1, length, t->stream ? t->stream : stdout);
+        return;
+    }
+    pthread_mutex_lock(&t->sinkLock);
+    size_t copied = t->sinkLength + 1 < t->sinkSize ? t->sinkSize - t->sinkLength - 1 : 0;
+    if (copied > length) copied = length;
+    memcpy(t->sink + t->sinkLength, data, copied);
+    t->sinkLength += copied;
+    if (t->sinkSize) t->sink[t->sinkLength] = '\0';
+    pthread_mutex_unlock(&t->sinkLock);
+}
 
 void skipRest() {
     int ch;
@@ -117,56 +193,99 @@ boolean isValidShortNameAndUppercaseFolder(char * name) {
     return True;
 }
 
-success writeSector(uint32_t sector, const void * data) {
-    if (fseek(volume, sector * SECTOR_SIZE, SEEK_SET) != 0) return Failure;
-    if (fwrite(data, 1, SECTOR_SIZE, volume) != SECTOR_SIZE) return Failure;
-    return Success;
+// The strict xkubpise profile: 20 MB with one sector per cluster and only the first FAT active;
+// mirrored FATs (--mirror=on) are a choice made for a new volume
+void setDefaultGeometry(Volume * vol) {
+    VolumeGeometry * geometry = &vol->geometry;
+    geometry->totalSectors = DEFAULT_TOTAL_N_SECTORS;
+    geometry->sectorsPerCluster = DEFAULT_SECTORS_PER_CLUSTER;
+    geometry->fatSize = DEFAULT_TOTAL_N_SECTORS * FAT_ENTRY_SIZE / SECTOR_SIZE;
+    geometry->firstDataSector = N_RESERVED_SECTORS + N_FATS * geometry->fatSize;
+    geometry->nClusters = DEFAULT_TOTAL_N_SECTORS - geometry->firstDataSector;
+    geometry->mirroredFATs = False;
+}
+
+// One FAT entry for every cluster-sized piece of the volume, which gives 320 sectors for the default profile
+uint32_t fatSizeFor(uint32_t totalSectors, uint32_t sectorsPerCluster) {
+    uint64_t entries = totalSectors / sectorsPerCluster;
+    return (uint32_t)((entries * FAT_ENTRY_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE);
 }
 
-success writeSectors(uint32_t startSector, const void * data, size_t count) {
-    if (fseek(volume, startSector * SECTOR_SIZE, SEEK_SET) != 0) return Failure;
-    if (fwrite(data, SECTOR_SIZE, count, volume) != count) return Failure;
+success setGeometry(Volume * vol, uint32_t totalSectors, uint32_t sectorsPerCluster) {
+    if (sectorsPerCluster == 0 || sectorsPerCluster > MAX_SECTORS_PER_CLUSTER || (sectorsPerCluster & (sectorsPerCluster - 1))) {
+        reportMessage("Sectors per cluster must be a power of two between 1 and %d, not %u\n", MAX_SECTORS_PER_CLUSTER, sectorsPerCluster);
+        return Failure;
+    }
+    if (totalSectors < MIN_TOTAL_N_SECTORS) {
+        reportMessage("A volume needs at least %d sectors, not %u\n", MIN_TOTAL_N_SECTORS, totalSectors);
+        return Failure;
+    }
+    uint32_t fatSize = fatSizeFor(totalSectors, sectorsPerCluster);
+    uint64_t firstDataSector = N_RESERVED_SECTORS + (uint64_t)N_FATS * fatSize;
+    if (firstDataSector + 2 * sectorsPerCluster > totalSectors) {
+        reportMessage("A volume of %u sectors leaves no room for data with %u sector(s) per cluster\n", totalSectors, sectorsPerCluster);
+        return Failure;
+    }
+    uint32_t nClusters = (uint32_t)((totalSectors - firstDataSector) / sectorsPerCluster);
+    if (nClusters > MAX_CLUSTER_NUMBER) {
+        reportMessage("A volume of %u sectors has too many clusters, use more sectors per cluster\n", totalSectors);
+        return Failure;
+    }
+    vol->geometry.totalSectors = totalSectors;
+    vol->geometry.sectorsPerCluster = sectorsPerCluster;
+    vol->geometry.fatSize = fatSize;
+    vol->geometry.firstDataSector = (uint32_t)firstDataSector;
+    vol->geometry.nClusters = nClusters;
     return Success;
 }
 
+success writeSector(Volume * vol, uint32_t sector, const void * data) {
+    return cachedWrite(vol, sector, data, 1);
+}
+
+success writeSectors(Volume * vol, uint32_t startSector, const void * data, size_t count) {
+    return cachedWrite(vol, startSector, data, (uint32_t)count);
+}
+
 char safeChar(unsigned char c) {
     return (isprint(c) && c != '\0') ? c : '.';
 }
 
-fat32_status_t checkFileStatus(const char * filename) {
+fat32_status_t checkFileStatus(Volume * vol, const char * filename) {
     struct stat buffer;
     if (stat(filename, &buffer) != 0) {
         if (errno == ENOENT) {            
-            printf("File %s does not seem yet to exist\nCreating new FAT32 volume at %s...\n", filename, filename);
-            volume = fopen(filename, "wb");
-            if (!volume) {
+            reportMessage("File %s does not seem yet to exist\nCreating new FAT32 volume at %s...\n", filename, filename);
+            FILE * created = fopen(filename, "wb");
+            if (!created) {
                 perror("Failed to create new FAT32 volume");
                 return FAT32_ERROR;
             }
 
-            if (fseek(volume, TOTAL_SIZE - 1, SEEK_SET) != 0) {
-                perror("Failed to allocated 20 MB to new FAT32 volume. Closing ...");
-                fclose(volume);
+            if (fseeko(created, (off_t)TOTAL_SIZE(vol) - 1, SEEK_SET) != 0) {
+                perror("Failed to allocate the size of the new FAT32 volume. Closing ...");
+                fclose(created);
                 return FAT32_ERROR;
             }
         
-            if (fwrite("", 1, 1, volume) != 1) {
-                perror("Failed to allocated 20 MB to new FAT32 volume. Closing ...");
-                fclose(volume);
+            if (fwrite("", 1, 1, created) != 1) {
+                perror("Failed to allocate the size of the new FAT32 volume. Closing ...");
+                fclose(created);
                 return FAT32_ERROR;
             }
+            fclose(created);
             return FAT32_NOT_FOUND;
         } else {
-            printf("File with the path %s can't be accessed\n", filename);
+            reportMessage("File with the path %s can't be accessed\n", filename);
             return FAT32_ERROR;
         }
     }
     if (!S_ISREG(buffer.st_mode)) {
-        printf("%s is not a regular file\n", filename);
+        reportMessage("%s is not a regular file\n", filename);
         return FAT32_ERROR;
     }
     if (buffer.st_size == 0) {
-        printf("File %s is empty\nAre you certain that you want to use it as a new volume for FAT32 emulator \033[34mxkubpise\033[0m (Y/n):", filename);
+        reportMessage("File %s is empty\nAre you certain that you want to use it as a new volume for FAT32 emulator \033[34mxkubpise\033[0m (Y/n):", filename);
         // Add reading user input and formatting if requested
         return FAT32_ERROR;
     }
@@ -175,28 +294,28 @@ fat32_status_t checkFileStatus(const char * filename) {
     if (!f) {
         switch (errno) {
             case EACCES:
-                printf("No permission to read %s\n", filename);
+                reportMessage("No permission to read %s\n", filename);
                 return FAT32_ERROR;
             case ENFILE:
-                printf("System limit on open files reached\n");
+                reportMessage("System limit on open files reached\n");
                 return FAT32_ERROR;
             case ETXTBSY:
-                printf("File is currently busy/executed and cannot be opened\n");
+                reportMessage("File is currently busy/executed and cannot be opened\n");
                 return FAT32_ERROR;
             case EISDIR:
-                printf("%s is a directory, not a file\n", filename);
+                reportMessage("%s is a directory, not a file\n", filename);
                 return FAT32_ERROR;
             case ENAMETOOLONG:
-                printf("Filename too long: %s\n", filename);
+                reportMessage("Filename too long: %s\n", filename);
                 return FAT32_ERROR;
             case ENOSPC:
-                printf("No space left on device\n");
+                reportMessage("No space left on device\n");
                 return FAT32_ERROR;
             case EROFS:
-                printf("Read-only filesystem error\n");
+                reportMessage("Read-only filesystem error\n");
                 return FAT32_ERROR;
             default:
-                printf("Other error %d opening %s: %s\n", errno, filename, strerror(errno));
+                reportMessage("Other error %d opening %s: %s\n", errno, filename, strerror(errno));
                 return FAT32_ERROR;
         }
     }
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np()
+#include "volume.h"
+#include "fatcache.h"
+#include "allocator.h"
+#include "bufcache.h"
+#include "journal.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "durability.h"
+#include "stats.h"
+
+// The lock of the volume prefers writers: a stream of shared commands cannot keep an exclusive
+// one (or the flusher) waiting
+static success initLocks(Volume * vol) {
+    pthread_rwlockattr_t writersFirst;
+    pthread_mutexattr_t recursive;
+    if (pthread_rwlockattr_init(&writersFirst) != 0) return Failure;
+    pthread_rwlockattr_setkind_np(&writersFirst, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    success ret = pthread_rwlock_init(&vol->lock, &writersFirst) == 0 ? Success : Failure;
+    pthread_rwlockattr_destroy(&writersFirst);
+    if (ret == Failure) return Failure;
+    if (pthread_mutexattr_init(&recursive) != 0) {
+        pthread_rwlock_destroy(&vol->lock);
+        return Failure;
+    }
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    ret = pthread_mutex_init(&vol->storageLock, &recursive) == 0 ? Success : Failure;
+    pthread_mutexattr_destroy(&recursive);
+    if (ret == Failure) {
+        pthread_rwlock_destroy(&vol->lock);
+        return Failure;
+    }
+    if (pthread_mutex_init(&vol->foldersLock, NULL) != 0) {
+        pthread_mutex_destroy(&vol->storageLock);
+        pthread_rwlock_destroy(&vol->lock);
+        return Failure;
+    }
+    uint32_t stripe = 0;
+    while (stripe < DIRECTORY_LOCK_STRIPES && pthread_rwlock_init(&vol->directoryLocks[stripe], NULL) == 0) ++stripe;
+    if (stripe == DIRECTORY_LOCK_STRIPES) return Success;
+    while (stripe-- > 0) pthread_rwlock_destroy(&vol->directoryLocks[stripe]);
+    pthread_mutex_destroy(&vol->foldersLock);
+    pthread_mutex_destroy(&vol->storageLock);
+    pthread_rwlock_destroy(&vol->lock);
+    return Failure;
+}
+
+// A new volume has the default profile and nothing mounted; the options of a run are set on it
+// before the mount
+Volume * createVolume(void) {
+    Volume * vol = calloc(1, sizeof(Volume));
+    if (!vol) return NULL;
+    vol->backend = backendStdio;
+    vol->isFormatted = notFormatted;
+    vol->enforceAbsolutePath = True;
+    setDefaultGeometry(vol);
+    vol->fatCache = createFATCache();
+    vol->allocator = createAllocator();
+    vol->bufferCache = createBufferCache();
+    vol->journal = createJournal();
+    vol->dirIndexes = createDirIndexTable();
+    vol->dcache = createDentryCache();
+    vol->durability = createDurability();
+    vol->stats = createVolumeStats(&vol->geometry);
+    if (!vol->fatCache || !vol->allocator || !vol->bufferCache || !vol->journal || !vol->dirIndexes || !vol->dcache ||
+        !vol->durability || !vol->stats || initLocks(vol) == Failure) {
+        free(vol->fatCache);
+        free(vol->allocator);
+        free(vol->bufferCache);
+        free(vol->journal);
+        destroyDirIndexTable(vol->dirIndexes);
+        destroyDentryCache(vol->dcache);
+        destroyDurability(vol->durability);
+        destroyVolumeStats(vol->stats);
+        free(vol);
+        return NULL;
+    }
+    return vol;
+}
+
+// The volume must have been unmounted
+void destroyVolume(Volume * vol) {
+    if (!vol) return;
+    free(vol->fatCache);
+    free(vol->allocator);
+    free(vol->bufferCache);
+    free(vol->journal);
+    destroyDirIndexTable(vol->dirIndexes);
+    destroyDentryCache(vol->dcache);
+    destroyDurability(vol->durability);
+    destroyVolumeStats(vol->stats);
+    free(vol->currentFolders);
+    for (uint32_t stripe = 0; stripe < DIRECTORY_LOCK_STRIPES; ++stripe) pthread_rwlock_destroy(&vol->directoryLocks[stripe]);
+    pthread_mutex_destroy(&vol->foldersLock);
+    pthread_mutex_destroy(&vol->storageLock);
+    pthread_rwlock_destroy(&vol->lock);
+    free(vol);
+}
+
+// Readers of a directory share its lock, a writer holds it alone. A thread holds one directory
+// lock at a time: path resolution locks every folder along the path in turn.
+void lockDirectory(Volume * vol, uint32_t cluster, boolean exclusive) {
+    pthread_rwlock_t * lock = &vol->directoryLocks[cluster % DIRECTORY_LOCK_STRIPES];
+    if (exclusive) pthread_rwlock_wrlock(lock);
+    else pthread_rwlock_rdlock(lock);
+}
+
+// The index of a directory is only dropped when nobody works in it
+boolean tryLockDirectory(Volume * vol, uint32_t cluster) {
+    return pthread_rwlock_trywrlock(&vol->directoryLocks[cluster % DIRECTORY_LOCK_STRIPES]) == 0 ? True : False;
+}
+
+void unlockDirectory(Volume * vol, uint32_t cluster) {
+    pthread_rwlock_unlock(&vol->directoryLocks[cluster % DIRECTORY_LOCK_STRIPES]);
+}
+
+void lockStorage(Volume * vol) {
+    pthread_mutex_lock(&vol->storageLock);
+}
+
+void unlockStorage(Volume * vol) {
+    pthread_mutex_unlock(&vol->storageLock);
+}
+
+// A cluster freed with its folder can soon hold another folder, so that checking it again would not
+// tell that the folder is gone: whoever removes a folder moves those who were in it to the root.
+// A current folder only changes under the lock of the volume, and is only moved from outside
+// under that lock held alone.
+success trackCurrentFolder(Volume * vol, uint32_t * cluster) {
+    success ret = Success;
+    pthread_mutex_lock(&vol->foldersLock);
+    if (vol->nCurrentFolders == vol->currentFoldersCapacity) {
+        uint32_t newCapacity = vol->currentFoldersCapacity ? vol->currentFoldersCapacity * 2 : 16;
+        uint32_t ** grown = realloc(vol->currentFolders, newCapacity * sizeof(uint32_t *));
+        if (grown) {
+            vol->currentFolders = grown;
+            vol->currentFoldersCapacity = newCapacity;
+        } else ret = Failure;
+    }
+    if (ret == Success) vol->currentFolders[vol->nCurrentFolders++] = cluster;
+    pthread_mutex_unlock(&vol->foldersLock);
+    return ret;
+}
+
+void untrackCurrentFolder(Volume * vol, uint32_t * cluster) {
+    pthread_mutex_lock(&vol->foldersLock);
+    for (uint32_t i = 0; i < vol->nCurrentFolders; ++i) {
+        if (vol->currentFolders[i] != cluster) continue;
+        vol->currentFolders[i] = vol->currentFolders[--vol->nCurrentFolders];
+        break;
+    }
+    pthread_mutex_unlock(&vol->foldersLock);
+}
+
+void leaveRemovedFolder(Volume * vol, uint32_t cluster) {
+    pthread_mutex_lock(&vol->foldersLock);
+    for (uint32_t i = 0; i < vol->nCurrentFolders; ++i)
+        if (*vol->currentFolders[i] == cluster) *vol->currentFolders[i] = ROOT_CLUSTER;
+    pthread_mutex_unlock(&vol->foldersLock);
+}
+
+// After a format
+void leaveAllFolders(Volume * vol) {
+    pthread_mutex_lock(&vol->foldersLock);
+    for (uint32_t i = 0; i < vol->nCurrentFolders; ++i) *vol->currentFolders[i] = ROOT_CLUSTER;
+    pthread_mutex_unlock(&vol->foldersLock);
+}
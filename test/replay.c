@@ -0,0 +1,282 @@
+// Journal replay test of the FAT32 emulator xkubpise: the image is copied while the volume is still
+// open, as a crash right after a commit would leave it, and the copy must come back with the
+// committed changes complete once its journal is replayed. A torn record and a record left behind
+// by an earlier run must not be replayed.
+#include "xkubpise.h"
+#include "journal.h"
+
+#include <stddef.h>
+
+#define TEST_IMAGE "xkubpise_replay.img"
+#define TEST_CRASHED_IMAGE "xkubpise_replay_crashed.img"
+#define TEST_SIZE_MB 64
+#define TEST_TEXT "logged by the journal, written in place by the replay"
+
+// The first fields of a record descriptor, as src/journal.c lays them out
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count;
+    uint32_t checksum;
+} RecordHead;
+
+typedef int (* Change)(XkSession * session);
+
+static int nFailed = 0;
+
+static int expect(int condition, const char * backend, const char * what) {
+    if (!condition) {
+        printf("FAILED (%s): %s\n", backend, what);
+        ++nFailed;
+    }
+    return condition;
+}
+
+// The records of a commit are handed to the kernel, so the copy sees what a crash would leave
+static int copyImage(const char * from, const char * to) {
+    FILE * source = fopen(from, "rb");
+    FILE * target = source ? fopen(to, "wb") : NULL;
+    static char buffer[1 << 16];
+    size_t got;
+    int ret = source && target ? 0 : -1;
+    while (ret == 0 && (got = fread(buffer, 1, sizeof(buffer), source)) > 0)
+        if (fwrite(buffer, 1, got, target) != got) ret = -1;
+    if (source && ferror(source)) ret = -1;
+    if (target && fclose(target) != 0) ret = -1;
+    if (source) fclose(source);
+    return ret;
+}
+
+static int accessSectors(const char * path, uint32_t lba, void * data, uint32_t count, int write) {
+    FILE * image = fopen(path, "r+b");
+    if (!image) return -1;
+    int ret = fseek(image, (long)lba * SECTOR_SIZE, SEEK_SET) == 0 ? 0 : -1;
+    if (ret == 0 && write) ret = fwrite(data, SECTOR_SIZE, count, image) == count ? 0 : -1;
+    else if (ret == 0) ret = fread(data, SECTOR_SIZE, count, image) == count ? 0 : -1;
+    if (fclose(image) != 0) ret = -1;
+    return ret;
+}
+
+// The record at a sector of the journal, NULL when there is none
+static uint8_t * readRecord(const char * path, uint32_t at, RecordHead * head) {
+    static uint8_t record[JOURNAL_SECTORS][SECTOR_SIZE];
+    if (accessSectors(path, JOURNAL_FIRST_SECTOR + at, record[0], 1, 0) == -1) return NULL;
+    memcpy(head, record[0], sizeof(RecordHead));
+    if (head->magic != JOURNAL_MAGIC || head->count == 0 || at + 1 + head->count > JOURNAL_SECTORS) return NULL;
+    if (accessSectors(path, JOURNAL_FIRST_SECTOR + at + 1, record[1], head->count, 0) == -1) return NULL;
+    return record[0];
+}
+
+// FNV-1a over the record with the checksum counted as zero, as src/journal.c seals it
+static void sealRecord(uint8_t * record, RecordHead * head) {
+    uint32_t hash = 2166136261u;
+    size_t field = offsetof(RecordHead, checksum);
+    head->checksum = 0;
+    memcpy(record, head, sizeof(RecordHead));
+    for (size_t i = 0; i < (size_t)(1 + head->count) * SECTOR_SIZE; ++i) hash = (hash ^ record[i]) * 16777619u;
+    head->checksum = hash;
+    memcpy(record + field, &hash, sizeof(hash));
+}
+
+// Whatever prepare creates is in place before the change, whose records are then the only ones
+// in the journal
+static int crashAfter(XkOptions * options, const char * backend, Change prepare, Change change) {
+    char error[XK_ERROR_SIZE] = "";
+    options->create = 1;
+    remove(TEST_IMAGE);
+    XkVolume * volume = xkOpen(TEST_IMAGE, options, error, sizeof(error));
+    if (!expect(volume != NULL, backend, "the image is created")) return -1;
+    XkSession * session = xkOpenSession(volume);
+    int ready = expect(session && (!prepare || prepare(session) == 0) && xkSync(session) == 0, backend, "the volume is prepared");
+    int crashed = ready && expect(change(session) == 0, backend, "the change is committed") &&
+        expect(copyImage(TEST_IMAGE, TEST_CRASHED_IMAGE) == 0, backend, "the image is copied");
+    xkCloseSession(session);
+    xkClose(volume);
+    remove(TEST_IMAGE);
+    options->create = 0;
+    return crashed ? 0 : -1;
+}
+
+// error receives what the mount reported, the replay included
+static XkSession * openCrashed(XkOptions * options, const char * backend, char * error, XkVolume ** volume) {
+    *volume = xkOpen(TEST_CRASHED_IMAGE, options, error, XK_ERROR_SIZE);
+    if (!expect(*volume != NULL, backend, "the crashed image opens")) return NULL;
+    XkSession * session = xkOpenSession(*volume);
+    if (!expect(session != NULL, backend, "a session opens")) xkClose(*volume);
+    return session;
+}
+
+static void closeCrashed(XkVolume * volume, XkSession * session, const char * backend) {
+    uint32_t problems = 1;
+    expect(xkCheck(session, 0, &problems) == 0 && problems == 0, backend, "fsck finds the volume clean");
+    xkCloseSession(session);
+    xkClose(volume);
+    remove(TEST_CRASHED_IMAGE);
+}
+
+static void defaultOptions(XkOptions * options, XkBackend backendKind) {
+    xkDefaultOptions(options);
+    options->backend = backendKind;
+    options->sizeMB = TEST_SIZE_MB;
+}
+
+static int prepareMove(XkSession * session) {
+    return xkMakeDirectory(session, "/a/c/d", 1) == 0 && xkMakeDirectory(session, "b", 0) == 0 ? 0 : -1;
+}
+
+static int move(XkSession * session) {
+    return xkMove(session, "/a/c", "/b");
+}
+
+static int makeDirectory(XkSession * session) {
+    return xkMakeDirectory(session, "new", 0);
+}
+
+static int makeTwoDirectories(XkSession * session) {
+    return xkMakeDirectory(session, "first", 0) == 0 && xkMakeDirectory(session, "second", 0) == 0 ? 0 : -1;
+}
+
+static int prepareTree(XkSession * session) {
+    static const char text[] = TEST_TEXT;
+    return xkMakeDirectory(session, "/t/u/v", 1) == 0 && xkChangeDirectory(session, "/t/u") == 0 &&
+        xkWriteFile(session, "f", text, sizeof(text), 0) == 0 && xkChangeDirectory(session, "/") == 0 ? 0 : -1;
+}
+
+static int removeTree(XkSession * session) {
+    return xkRemove(session, "t", 1);
+}
+
+static int writeFile(XkSession * session) {
+    static const char text[] = TEST_TEXT;
+    return xkWriteFile(session, "f", text, sizeof(text), 0);
+}
+
+static void testMoveReplay(XkBackend backendKind, const char * backend) {
+    XkOptions options;
+    defaultOptions(&options, backendKind);
+    if (crashAfter(&options, backend, prepareMove, move) == -1) return;
+    char error[XK_ERROR_SIZE] = "", path[64] = "";
+    XkVolume * volume;
+    XkSession * session = openCrashed(&options, backend, error, &volume);
+    if (!session) return;
+    expect(strstr(error, "Replayed") != NULL, backend, "the move is replayed from the journal");
+    expect(xkChangeDirectory(session, "/b/c/d") == 0, backend, "the folder is in its new parent");
+    expect(xkChangeDirectory(session, "../..") == 0 && xkCurrentDirectory(session, path, sizeof(path)) == 0 &&
+        strcmp(path, "/b") == 0, backend, "\"..\" of the folder names its new parent");
+    expect(xkChangeDirectory(session, "/a/c") == -1, backend, "the folder is gone from its old parent");
+    closeCrashed(volume, session, backend);
+}
+
+static void testMakeDirectoryReplay(XkBackend backendKind, const char * backend) {
+    XkOptions options;
+    defaultOptions(&options, backendKind);
+    if (crashAfter(&options, backend, NULL, makeDirectory) == -1) return;
+    char error[XK_ERROR_SIZE] = "";
+    XkVolume * volume;
+    XkSession * session = openCrashed(&options, backend, error, &volume);
+    if (!session) return;
+    expect(strstr(error, "Replayed") != NULL, backend, "mkdir is replayed from the journal");
+    expect(xkChangeDirectory(session, "/new") == 0 && xkChangeDirectory(session, "..") == 0, backend, "the folder exists");
+    closeCrashed(volume, session, backend);
+}
+
+// The clusters of the removed tree must come back free, or fsck finds them lost
+static void testRemoveTreeReplay(XkBackend backendKind, const char * backend) {
+    XkOptions options;
+    defaultOptions(&options, backendKind);
+    if (crashAfter(&options, backend, prepareTree, removeTree) == -1) return;
+    char error[XK_ERROR_SIZE] = "";
+    XkVolume * volume;
+    XkSession * session = openCrashed(&options, backend, error, &volume);
+    if (!session) return;
+    expect(strstr(error, "Replayed") != NULL, backend, "rm -r is replayed from the journal");
+    expect(xkChangeDirectory(session, "/t") == -1, backend, "the tree is gone");
+    closeCrashed(volume, session, backend);
+}
+
+// The data is written in place before the record that links it
+static void testWriteReplay(XkBackend backendKind, const char * backend) {
+    static const char text[] = TEST_TEXT;
+    XkOptions options;
+    defaultOptions(&options, backendKind);
+    if (crashAfter(&options, backend, NULL, writeFile) == -1) return;
+    char error[XK_ERROR_SIZE] = "";
+    XkVolume * volume;
+    XkSession * session = openCrashed(&options, backend, error, &volume);
+    if (!session) return;
+    expect(strstr(error, "Replayed") != NULL, backend, "write is replayed from the journal");
+    uint32_t length = 0;
+    char * content = xkReadFile(session, "f", &length);
+    expect(content && length == sizeof(text) && memcmp(content, text, length) == 0, backend, "the file holds what was written");
+    free(content);
+    closeCrashed(volume, session, backend);
+}
+
+// A record whose last sector did not reach the disk fails its checksum: the volume stays as it
+// was before the command
+static void testTornRecord(XkBackend backendKind, const char * backend) {
+    XkOptions options;
+    defaultOptions(&options, backendKind);
+    if (crashAfter(&options, backend, NULL, makeDirectory) == -1) return;
+    RecordHead head;
+    uint8_t * record = readRecord(TEST_CRASHED_IMAGE, 0, &head);
+    if (!expect(record != NULL, backend, "mkdir leaves a record at the head of the journal")) {
+        remove(TEST_CRASHED_IMAGE);
+        return;
+    }
+    record[head.count * SECTOR_SIZE + SECTOR_SIZE / 2] ^= 0xFF;
+    expect(accessSectors(TEST_CRASHED_IMAGE, JOURNAL_FIRST_SECTOR + head.count, record + head.count * SECTOR_SIZE, 1, 1) == 0,
+        backend, "the record is torn");
+    char error[XK_ERROR_SIZE] = "";
+    XkVolume * volume;
+    XkSession * session = openCrashed(&options, backend, error, &volume);
+    if (!session) return;
+    expect(strstr(error, "Replayed") == NULL, backend, "the torn record is ignored");
+    expect(xkChangeDirectory(session, "/new") == -1, backend, "the folder of the torn record does not exist");
+    closeCrashed(volume, session, backend);
+}
+
+// A whole record that does not follow the one before it was left by an earlier run: the replay
+// stops before it
+static void testStaleSequence(XkBackend backendKind, const char * backend) {
+    XkOptions options;
+    defaultOptions(&options, backendKind);
+    if (crashAfter(&options, backend, NULL, makeTwoDirectories) == -1) return;
+    RecordHead first, second;
+    uint8_t * record = readRecord(TEST_CRASHED_IMAGE, 0, &first) ? readRecord(TEST_CRASHED_IMAGE, 1 + first.count, &second) : NULL;
+    if (!expect(record != NULL && second.sequence == first.sequence + 1, backend, "the two mkdirs leave two records")) {
+        remove(TEST_CRASHED_IMAGE);
+        return;
+    }
+    second.sequence = first.sequence - 1;
+    sealRecord(record, &second);
+    expect(accessSectors(TEST_CRASHED_IMAGE, JOURNAL_FIRST_SECTOR + 1 + first.count, record, 1, 1) == 0, backend,
+        "the second record gets a stale sequence number");
+    char error[XK_ERROR_SIZE] = "";
+    XkVolume * volume;
+    XkSession * session = openCrashed(&options, backend, error, &volume);
+    if (!session) return;
+    expect(strstr(error, "Replayed 1 journal record(s)") != NULL, backend, "only the first record is replayed");
+    expect(xkChangeDirectory(session, "/first") == 0, backend, "the folder of the first record exists");
+    expect(xkChangeDirectory(session, "/second") == -1, backend, "the folder of the stale record does not exist");
+    closeCrashed(volume, session, backend);
+}
+
+int main(void) {
+    // The journal is inactive with the mmap backend
+    static const struct {
+        XkBackend kind;
+        const char * name;
+    } backends[] = { { xkBackendStdio, "stdio" }, { xkBackendPread, "pread" } };
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+        testMoveReplay(backends[i].kind, backends[i].name);
+        testMakeDirectoryReplay(backends[i].kind, backends[i].name);
+        testRemoveTreeReplay(backends[i].kind, backends[i].name);
+        testWriteReplay(backends[i].kind, backends[i].name);
+        testTornRecord(backends[i].kind, backends[i].name);
+        testStaleSequence(backends[i].kind, backends[i].name);
+    }
+    if (nFailed) return EXIT_FAILURE;
+    puts("Journal replay: ok");
+    return EXIT_SUCCESS;
+}
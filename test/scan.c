@@ -0,0 +1,92 @@
+// Directory scan test of the FAT32 emulator xkubpise: every vector kernel must classify crafted
+// directories exactly as the scalar one does, block by block
+#include "dirscan.h"
+
+#define TEST_DIRECTORIES 200
+#define TEST_MAX_CLUSTERS 5
+#define TEST_MAX_ENTRIES_PER_CLUSTER 2048 // 64 sectors of 512 bytes
+
+static int nFailed = 0;
+static uint64_t seed = 0x9E3779B97F4A7C15u;
+
+static uint32_t nextRandom(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (uint32_t)(seed >> 32);
+}
+
+// The first byte and the attributes are drawn mostly from the values that classify an entry, the
+// other bytes are noise a kernel must not pick up
+static void craftEntry(uint8_t * entry) {
+    static const uint8_t firstBytes[] = { 0x00, 0xE5, '.', 'A', 'Z', 0x05, 0x80, 0xFF };
+    static const uint8_t attributes[] = { 0x0F, 0x10, 0x20, 0x00, 0x1F, 0x3F, 0x0E, 0x30, 0xFF };
+    for (uint32_t i = 0; i < ENTRY_SIZE; ++i) entry[i] = (uint8_t)nextRandom();
+    uint32_t pick = nextRandom();
+    if (pick % 4) entry[0] = firstBytes[pick / 4 % sizeof(firstBytes)];
+    // Never-used entries are rare, so that most blocks run to their end or to a late end mark
+    if (entry[0] == 0x00 && nextRandom() % 8) entry[0] = 'B';
+    pick = nextRandom();
+    if (pick % 4) entry[11] = attributes[pick / 4 % sizeof(attributes)];
+}
+
+static int sameMasks(const EntryMasks * a, const EntryMasks * b) {
+    return a->count == b->count && a->end == b->end && a->used == b->used && a->deleted == b->deleted &&
+        a->longName == b->longName && a->directory == b->directory;
+}
+
+// Blocks start on every 16th slot, not only on every 64th, so that a block also starts and ends
+// in the middle of a cluster
+static void compareKernels(const DirectoryView * view, const char ** kernels, uint32_t nKernels, uint32_t directory) {
+    for (uint32_t firstSlot = 0; firstSlot < view->nClusters * view->entriesPerCluster; firstSlot += 16) {
+        EntryMasks expected, got;
+        useScanKernel("scalar");
+        scanDirectoryBlock(view, firstSlot, &expected);
+        for (uint32_t k = 0; k < nKernels; ++k) {
+            useScanKernel(kernels[k]);
+            if (scanDirectoryBlock(view, firstSlot, &got) && sameMasks(&expected, &got)) continue;
+            printf("FAILED (%s): directory %u (%u x %u entries), block at slot %u\n", kernels[k], directory, view->nClusters,
+                view->entriesPerCluster, firstSlot);
+            ++nFailed;
+        }
+    }
+}
+
+int main(void) {
+    static const uint32_t entriesPerCluster[] = { 16, 32, 64, 128, TEST_MAX_ENTRIES_PER_CLUSTER };
+    static const char * candidates[] = { "sse2", "avx2" };
+    const char * kernels[2];
+    uint32_t nKernels = 0;
+    for (uint32_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i)
+        if (useScanKernel(candidates[i])) kernels[nKernels++] = candidates[i];
+        else printf("Scan kernel %s: not available, skipped\n", candidates[i]);
+    if (nKernels == 0) {
+        puts("No vector scan kernel to compare");
+        return EXIT_SUCCESS;
+    }
+
+    uint8_t * storage = malloc((size_t)TEST_MAX_CLUSTERS * TEST_MAX_ENTRIES_PER_CLUSTER * ENTRY_SIZE);
+    const uint8_t * clusters[TEST_MAX_CLUSTERS];
+    if (!storage) return EXIT_FAILURE;
+    for (uint32_t d = 0; d < TEST_DIRECTORIES; ++d) {
+        DirectoryView view;
+        memset(&view, 0, sizeof(view));
+        view.entriesPerCluster = entriesPerCluster[d % (sizeof(entriesPerCluster) / sizeof(entriesPerCluster[0]))];
+        view.nClusters = 1 + nextRandom() % TEST_MAX_CLUSTERS;
+        view.clusters = clusters;
+        // The clusters of a chain need not follow one another: they are laid out backwards
+        for (uint32_t c = 0; c < view.nClusters; ++c)
+            clusters[c] = storage + (size_t)(view.nClusters - 1 - c) * view.entriesPerCluster * ENTRY_SIZE;
+        uint32_t nSlots = view.nClusters * view.entriesPerCluster;
+        for (uint32_t slot = 0; slot < nSlots; ++slot) craftEntry((uint8_t *)directoryEntry(&view, slot));
+        // The end mark in the middle of a block, past a piece boundary of 1-sector clusters
+        if (d % 3 == 0 && nSlots > 40) ((uint8_t *)directoryEntry(&view, 40))[0] = 0x00;
+        compareKernels(&view, kernels, nKernels, d);
+    }
+    free(storage);
+    if (nFailed) return EXIT_FAILURE;
+    printf("Scan kernels against the scalar one:");
+    for (uint32_t k = 0; k < nKernels; ++k) printf(" %s", kernels[k]);
+    puts(": ok");
+    return EXIT_SUCCESS;
+}